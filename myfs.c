@@ -32,46 +32,763 @@
 #include <sys/dirent.h>
 #include <sys/malloc.h>
 #include <sys/queue.h>
+#include <sys/tree.h>
 #include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/rmlock.h>
+#include <sys/sx.h>
 #include <sys/condvar.h>
+#include <sys/pcpu.h>
+#include <sys/smp.h>
+#include <sys/uio.h>
+#include <sys/proc.h>
+#include <sys/priv.h>
+#include <sys/ucred.h>
+#include <sys/namei.h>
+#include <sys/taskqueue.h>
+#include <sys/bitstring.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/vmem.h>
+#include <sys/endian.h>
+#include <sys/eventhandler.h>
+#include <sys/fcntl.h>
+#include <sys/disk_zone.h>
+#include <crypto/sha2/sha512.h>
+#include <geom/geom.h>
+#include <geom/geom_vfs.h>
+#include <opencrypto/cryptodev.h>
+#include <vm/uma.h>
+#include <machine/atomic.h>
+#include <contrib/zlib/zlib.h>
+
+#include "myfs_ioctl.h"
+#include "myfs_image.h"
+#include "myfs_casefold.h"
 
 #define MYFS_MAGIC 0x4D594653  // "MYFS" in hex
 #define MYFS_NAME "myfs"
 #define MYFS_VERSION 1
 
+/*
+ * Per-CPU batch for space reservations, in blocks.  The global reserved
+ * count may lag by up to MYFS_RESV_BATCH * mp_ncpus blocks ("slack").
+ */
+#define MYFS_RESV_BATCH 64
+
+/*
+ * Batched per-CPU counter.  Each CPU accumulates a signed delta in its own
+ * slot and folds it into the shared count once it reaches the batch size,
+ * so the shared count is never off by more than batch * mp_ncpus.  Callers
+ * that need an exact value near a threshold use myfs_pcount_sum().
+ */
+struct myfs_pcount {
+    int64_t count;          /* folded value */
+    int64_t batch;
+    uint64_t *pcpu;         /* per-CPU deltas, from pcpu_zone_8 */
+};
+
+/*
+ * Quota accounting.  Usage is kept in per-CPU counters with a small batch
+ * so charging never bounces a shared cache line; a periodic task folds the
+ * deltas so reported usage stays fresh.
+ */
+#define MYFS_QUOTA_BATCH 32
+#define MYFS_DQHASHSIZE 64      /* power of 2 */
+
+struct myfs_dquot {
+    LIST_ENTRY(myfs_dquot) link;
+    uint32_t type;          /* MYFS_QTYPE_* */
+    uint32_t id;
+    uint64_t blk_limit;     /* 0 = unlimited */
+    uint64_t ino_limit;
+    struct mtx lock;        /* serializes exact checks near a limit */
+    struct myfs_pcount blocks;
+    struct myfs_pcount inodes;
+};
+
+LIST_HEAD(myfs_dqhead, myfs_dquot);
+
+/*
+ * Recursive directory statistics, CephFS rstats-style.  Each directory with
+ * activity below it has an entry keyed by inode number, independent of its
+ * vnode so totals survive reclaim.  A change is applied to the parent
+ * directory right away and queued as a pending delta; a periodic task
+ * pushes pending deltas one level up at a time, so bursts of changes in one
+ * directory reach the root as a single update per level.  A directory whose
+ * parent is not known yet holds its pending delta until an operation inside
+ * it supplies the parent.
+ */
+#define MYFS_RSHASHSIZE 256     /* power of 2 */
+
+struct myfs_rstat {
+    LIST_ENTRY(myfs_rstat) hash;
+    TAILQ_ENTRY(myfs_rstat) dirty;
+    ino_t ino;
+    ino_t parent;           /* 0 at the root */
+    int ondirty;
+    int64_t rbytes;         /* subtree totals */
+    int64_t rfiles;
+    int64_t rsubdirs;
+    int64_t dbytes;         /* not yet pushed to parent */
+    int64_t dfiles;
+    int64_t dsubdirs;
+};
+
+LIST_HEAD(myfs_rshead, myfs_rstat);
+TAILQ_HEAD(myfs_rsdirty, myfs_rstat);
+
+/*
+ * Read-write directories.  Entries sit in blocks of MYFS_DIRBLK slots,
+ * which readdir walks in slot order, and a chained hash index finds them
+ * by name.  Removing an entry frees its block as soon as the block is
+ * empty and halves the index once it has four buckets per entry; a
+ * directory left using less than 1/MYFS_DIR_SPARSE of its slots is queued
+ * for myfs_dir_task(), which packs the survivors into as few blocks as
+ * they need.  An emptied directory so ends up as cheap as a new one.
+ *
+ * Inserts and removes need only a shared vnode lock, see
+ * myfs_dir_share().  Each of the MYFS_DIR_NLOCKS stripes covers the
+ * buckets of one range of hash values, which the index never splits since
+ * it has at least as many buckets; blk_lock covers the blocks and counts,
+ * and is held just long enough to take or give back a slot.  Resizing the
+ * index and compaction take lock exclusively, everything else shares it.
+ */
+#define MYFS_DIRBLK 64          /* slots per block */
+#define MYFS_DIR_MINSHIFT 4     /* smallest index, in bits */
+#define MYFS_DIR_NLOCKS (1 << MYFS_DIR_MINSHIFT)
+#define MYFS_DIR_SPARSE 4
+
+struct myfs_dent {
+    LIST_ENTRY(myfs_dent) hash;
+    ino_t ino;
+    uint32_t h;             /* myfs_dir_hash() of name */
+    uint32_t slot;          /* block * MYFS_DIRBLK + index */
+    uint8_t type;           /* DT_* */
+    uint16_t namelen;
+    char name[];
+};
+
+LIST_HEAD(myfs_denthead, myfs_dent);
+
+struct myfs_dblk {
+    u_int used;
+    struct myfs_dent *ents[MYFS_DIRBLK];
+};
+
+struct myfs_dir {
+    ino_t ino;
+    TAILQ_ENTRY(myfs_dir) sparse;   /* on mmp->dir_sparse if queued */
+    int queued;
+    struct sx lock;         /* exclusive to resize or compact */
+    struct sx stripes[MYFS_DIR_NLOCKS];
+    struct myfs_denthead *index;    /* 1 << shift buckets, by top bits */
+    u_int shift;
+
+    /* Protected by blk_lock */
+    struct sx blk_lock;
+    u_int count;            /* live entries */
+    struct myfs_dblk **blks;    /* NULL where a block was freed */
+    u_int nblks;            /* up to the last block in use */
+    u_int cap;              /* length of blks */
+    u_int nalloc;           /* blocks not freed */
+    u_int hint;             /* blocks below this one are full */
+};
+
+TAILQ_HEAD(myfs_dirq, myfs_dir);
+
+/*
+ * Decoded inode metadata.  Read-only mounts of the same device share one
+ * cache of these, so hundreds of mounts of a golden image decode each
+ * inode once.
+ */
+#define MYFS_METAHASHSIZE 1024  /* power of 2 */
+
+struct myfs_meta {
+    LIST_ENTRY(myfs_meta) link;
+    ino_t ino;
+    uint32_t gen;           /* generation, for file handles */
+    mode_t mode;
+    nlink_t nlink;
+    off_t size;
+    uid_t uid;
+    gid_t gid;
+    uint32_t projid;
+    struct timespec atime;
+    struct timespec mtime;
+    struct timespec ctime;
+    daddr_t daddr;          /* sealed images: first data block */
+    uint32_t dflags;        /* sealed images: MYFS_IMG_I_* */
+    struct myfs_img_crypt crypt;    /* sealed images: MYFS_IMG_I_CRYPT */
+    u_int ref;              /* shared caches: used since the last trim */
+};
+
+LIST_HEAD(myfs_metahead, myfs_meta);
+
+struct myfs_rocache {
+    LIST_ENTRY(myfs_rocache) link;  /* on myfs_rocaches */
+    struct cdev *dev;       /* sharing key: device ... */
+    uint64_t img_ctime;     /* ... and the image on it */
+    uint64_t img_nblocks;
+    uint32_t img_gen;
+    u_int refs;             /* mounts using it, myfs_rocache_lock */
+    struct rmlock lock;
+    struct myfs_metahead hash[MYFS_METAHASHSIZE];
+    u_int count;            /* entries, under lock */
+    u_int hand;             /* next bucket myfs_rocache_trim() visits */
+};
+
+static LIST_HEAD(, myfs_rocache) myfs_rocaches =
+    LIST_HEAD_INITIALIZER(myfs_rocaches);
+static struct sx myfs_rocache_lock;
+SX_SYSINIT(myfs_rocache, &myfs_rocache_lock, "myfs rocache");
+
+SYSCTL_NODE(_vfs, OID_AUTO, myfs, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
+    "myfs filesystem");
+
+/* Event counters over all mounts, for tests and tuning. */
+static SYSCTL_NODE(_vfs_myfs, OID_AUTO, stats, CTLFLAG_RD | CTLFLAG_MPSAFE,
+    0, "myfs event counters");
+
+static COUNTER_U64_DEFINE_EARLY(myfs_st_bloom_builds);
+SYSCTL_COUNTER_U64(_vfs_myfs_stats, OID_AUTO, bloom_builds, CTLFLAG_RD,
+    &myfs_st_bloom_builds, "Absent-name filters built");
+
+static COUNTER_U64_DEFINE_EARLY(myfs_st_bloom_rejects);
+SYSCTL_COUNTER_U64(_vfs_myfs_stats, OID_AUTO, bloom_rejects, CTLFLAG_RD,
+    &myfs_st_bloom_rejects, "Lookups failed by an absent-name filter");
+
+static COUNTER_U64_DEFINE_EARLY(myfs_st_prefetch);
+SYSCTL_COUNTER_U64(_vfs_myfs_stats, OID_AUTO, prefetch, CTLFLAG_RD,
+    &myfs_st_prefetch, "Blocks queued by prefetch on open");
+
+static COUNTER_U64_DEFINE_EARLY(myfs_st_l2_hits);
+SYSCTL_COUNTER_U64(_vfs_myfs_stats, OID_AUTO, l2_hits, CTLFLAG_RD,
+    &myfs_st_l2_hits, "Blocks read from a cache device");
+
+static COUNTER_U64_DEFINE_EARLY(myfs_st_log_cleaned);
+SYSCTL_COUNTER_U64(_vfs_myfs_stats, OID_AUTO, log_cleaned, CTLFLAG_RD,
+    &myfs_st_log_cleaned, "Zones cleaned on log-structured volumes");
+
+static COUNTER_U64_DEFINE_EARLY(myfs_st_zone_resets);
+SYSCTL_COUNTER_U64(_vfs_myfs_stats, OID_AUTO, zone_resets, CTLFLAG_RD,
+    &myfs_st_zone_resets, "Write pointers of zoned drives reset");
+
+static COUNTER_U64_DEFINE_EARLY(myfs_st_zone_wperr);
+SYSCTL_COUNTER_U64(_vfs_myfs_stats, OID_AUTO, zone_wperr, CTLFLAG_RD,
+    &myfs_st_zone_wperr, "Writes off the write pointer of emulated zones");
+
+static COUNTER_U64_DEFINE_EARLY(myfs_st_lowmem_freed);
+SYSCTL_COUNTER_U64(_vfs_myfs_stats, OID_AUTO, lowmem_freed, CTLFLAG_RD,
+    &myfs_st_lowmem_freed,
+    "Filters and crypto sessions released on low memory");
+
+/*
+ * Reserved-but-unwritten blocks per mount before myfs_write kicks off
+ * writeback.  Keeping dirty data bounded is what keeps freeze latency
+ * bounded by in-flight I/O.
+ */
+static u_long myfs_dirty_max = 65536;
+SYSCTL_ULONG(_vfs_myfs, OID_AUTO, dirty_max, CTLFLAG_RW, &myfs_dirty_max, 0,
+    "Dirty blocks per mount that trigger background writeback");
+
+/*
+ * Access trace buffer, one per CPU.  Only the owning CPU produces, inside a
+ * critical section, and only a drainer holding trace_lock consumes, so
+ * head and tail need nothing beyond acquire/release ordering.
+ */
+#define MYFS_TRACE_DEFRECS 4096
+#define MYFS_TRACE_MAXRECS (1024 * 1024)
+
+struct myfs_tring {
+    uint64_t head;          /* next slot to fill, owner CPU only */
+    uint64_t tail;          /* next slot to drain */
+    uint64_t dropped;
+    struct myfs_trace_rec recs[];
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * Tiered volumes.  Data lives on fast and slow devices, each with its
+ * free space in a vmem arena of PAGE_SIZE blocks; block 0 holds a label.
+ * Files map to devices through per-node extent maps, and every extent
+ * carries an access heat that the migrator uses to move it.
+ *
+ * Each class may hold several devices, and a volume may also have a
+ * single class of plain data devices.  Every device is an allocation
+ * group of its own; a file's extents are striped across the devices of
+ * its class in MYFS_STRIPE-block units, starting from the one its inode
+ * number picks.
+ */
+#define MYFS_DEV_FAST 0         /* device classes */
+#define MYFS_DEV_SLOW 1
+#define MYFS_NCLASS 2
+#define MYFS_MAXDEVS MYFS_TIER_MAXDEVS
+#define MYFS_STRIPE 256         /* blocks, 1 MiB */
+#define MYFS_NODEV MYFS_MAXDEVS /* extent reserved, not placed yet */
+
+#define MYFS_TIER_SMALL (64 * 1024)     /* default tiersmall, bytes */
+#define MYFS_TIER_COLD 3600             /* default tiercold, seconds */
+
+/*
+ * Extent maps are not kept on disk, so whatever a tiered volume wrote is
+ * unreachable once it is unmounted.  The label marks a device as holding
+ * such a volume, and myfs_tier_label_check() refuses it, or any device
+ * that is not blank, unless the tierformat option says to discard it.
+ */
+#define MYFS_TLABEL_MAGIC 0x4D595444    /* "MYTD" */
+#define MYFS_TLABEL_VERSION 1
+
+struct myfs_tlabel {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t volid[16];      /* random, the same on every device */
+    uint32_t devid;         /* index in the volume */
+    uint32_t ndevs;
+    uint32_t class;         /* MYFS_DEV_FAST or MYFS_DEV_SLOW */
+    uint32_t reserved;
+};
+
+/*
+ * Log-structured devices (the logwrite mount option) are cut into
+ * segments instead.  Data is only ever appended at the head of the open
+ * segment; the last block of each segment holds a summary naming the
+ * owner of every block, written when the segment fills, which is what
+ * lets the cleaner find and move the live blocks of a victim segment.
+ */
+#define MYFS_SEGBLKS 256                /* 1 MiB at 4k blocks */
+#define MYFS_SEGDATA (MYFS_SEGBLKS - 1) /* blocks before the summary */
+#define MYFS_SEGBASE(d, s) ((d)->segbase + (daddr_t)(s) * MYFS_SEGBLKS)
+#define MYFS_ZONEBLKS(d) ((daddr_t)(d)->zsegs * MYFS_SEGBLKS)
+#define MYFS_SEGSUM_MAGIC 0x4D595347    /* "MYSG" */
+#define MYFS_LOG_RESERVE 2              /* free zones kept for cleaning */
+#define MYFS_LOG_WAIT 50                /* placement retries, 1/10 s apart */
+#define MYFS_ZONE_REPORT 128            /* zones per report command */
+
+#define MYFS_SEG_FREE 0
+#define MYFS_SEG_OPEN 1
+#define MYFS_SEG_SEALED 2
+
+struct myfs_seg {
+    uint16_t live;          /* blocks still mapped */
+    uint8_t state;          /* MYFS_SEG_* */
+    time_t mtime;           /* time_uptime of the last append */
+};
+
+/*
+ * Segments are handed out by zone.  On zoned (SMR or ZNS) devices a zone
+ * is the drive's, a run of segments that must be written in order and can
+ * only be reused once all of them are free; elsewhere it is one segment.
+ */
+struct myfs_zone {
+    u_int nfree;            /* free segments */
+    uint8_t flags;
+};
+
+#define MYFS_ZONE_SEQ 0x01      /* sequential write required */
+#define MYFS_ZONE_DIRTY 0x02    /* written and emptied by this mount */
+
+struct myfs_segsum {
+    uint32_t magic;
+    uint32_t nblocks;       /* blocks appended */
+    uint64_t seq;
+    struct {
+        uint64_t ino;
+        uint64_t lbn;
+    } ent[MYFS_SEGDATA];
+};
+
+CTASSERT(sizeof(struct myfs_segsum) <= PAGE_SIZE);
+
+struct myfs_dev {
+    struct vnode *devvp;
+    struct g_consumer *cp;
+    daddr_t nblocks;
+    vmem_t *arena;          /* free blocks, unless log-structured */
+
+    /* Log-structured devices, see myfs_log_alloc() */
+    struct sx log_lock;
+    struct myfs_seg *segs;
+    u_int nsegs;
+    struct myfs_zone *zones;
+    u_int nzones;
+    u_int zsegs;            /* segments per zone */
+    u_int nfree;            /* free zones */
+    bitstr_t *zfree;
+    daddr_t segbase;        /* first block of segment 0 */
+    daddr_t zblks;          /* drive zone size, 0 unless zoned */
+    daddr_t wp;             /* write pointer in the open zone */
+    daddr_t simzone;        /* emulated zone size, see myfs_zone_cmd() */
+    daddr_t *simwp;         /* and write pointers, per drive zone */
+    u_int cur;              /* open segment */
+    u_int cur_used;
+    uint64_t seq;
+    struct myfs_segsum *sum;    /* of the open segment */
+};
+
+struct myfs_extent {
+    RB_ENTRY(myfs_extent) link;
+    daddr_t lbn;            /* first file block */
+    daddr_t pbn;            /* first device block */
+    u_int len;              /* blocks */
+    u_int dev;              /* index in devs, or MYFS_NODEV */
+    u_int heat;             /* accesses, halved every migrator pass */
+    u_int epoch;            /* migrator pass heat was last decayed in */
+    time_t atime;           /* time_uptime of the last access */
+};
+
+RB_HEAD(myfs_extmap, myfs_extent);
+
+static int myfs_tier_interval = 30;
+SYSCTL_INT(_vfs_myfs, OID_AUTO, tier_interval, CTLFLAG_RW,
+    &myfs_tier_interval, 0, "Seconds between tier migrator passes");
+
+static u_int myfs_tier_hot = 8;
+SYSCTL_UINT(_vfs_myfs, OID_AUTO, tier_hot, CTLFLAG_RW, &myfs_tier_hot, 0,
+    "Extent heat that promotes slow-tier data to the fast tier");
+
+static u_long myfs_tier_batch = 16384;
+SYSCTL_ULONG(_vfs_myfs, OID_AUTO, tier_batch, CTLFLAG_RW, &myfs_tier_batch,
+    0, "Blocks the tier migrator may move per pass");
+
+static u_int myfs_tier_reserve = 10;
+SYSCTL_UINT(_vfs_myfs, OID_AUTO, tier_reserve, CTLFLAG_RW,
+    &myfs_tier_reserve, 0,
+    "Percent of the fast tier kept free for new and promoted data");
+
+static u_int myfs_log_clean_low = 10;
+SYSCTL_UINT(_vfs_myfs, OID_AUTO, log_clean_low, CTLFLAG_RW,
+    &myfs_log_clean_low, 0,
+    "Percent of free segments below which the cleaner starts");
+
+static u_int myfs_log_clean_high = 20;
+SYSCTL_UINT(_vfs_myfs, OID_AUTO, log_clean_high, CTLFLAG_RW,
+    &myfs_log_clean_high, 0,
+    "Percent of free segments at which the cleaner stops");
+
+/*
+ * Zoned placement has only been exercised against the emulated drives of
+ * the zonesim mount option, never a real one, so it stays off for real
+ * drives until asked for.  Without it host-managed drives are refused and
+ * host-aware ones are used like any other disk.
+ */
+static int myfs_zoned = 0;
+SYSCTL_INT(_vfs_myfs, OID_AUTO, zoned, CTLFLAG_RWTUN, &myfs_zoned, 0,
+    "Use zoned allocation on host-managed and host-aware drives");
+
+/*
+ * Absent-name filters for sealed directories.  A large directory that
+ * keeps failing lookups gets a Bloom filter over its index keys, built
+ * once from the index, and names the filter rules out fail with ENOENT
+ * without reading a directory block.  Ten bits per entry, rounded up to a
+ * power of 2, and six probes keep false positives near 1%.
+ */
+#define MYFS_BLOOM_BITS 10          /* per entry, before rounding */
+#define MYFS_BLOOM_PROBES 6
+#define MYFS_BLOOM_MAXBITS (1U << 27)   /* 16 MiB */
+
+struct myfs_bloom {
+    uint32_t mask;          /* bits - 1 */
+    uint64_t bits[];
+};
+
+static u_int myfs_bloom_min = 128;
+SYSCTL_UINT(_vfs_myfs, OID_AUTO, bloom_min, CTLFLAG_RW, &myfs_bloom_min, 0,
+    "Entries a sealed directory needs before it gets an absent-name filter");
+
+static u_int myfs_bloom_misses = 4;
+SYSCTL_UINT(_vfs_myfs, OID_AUTO, bloom_misses, CTLFLAG_RW,
+    &myfs_bloom_misses, 0,
+    "Failed lookups in a sealed directory before its filter is built");
+
+/*
+ * Read cache device.  Image blocks read from the primary device are staged
+ * and written to the cache device a batch at a time at a rotating hand,
+ * replacing the oldest, and found again by primary block number.  Slot
+ * keys are kept on the cache device as well, so a remount starts warm.
+ *
+ * Layout, in MYFS_IMG_BSIZE blocks: the header, then the index of one
+ * little-endian key per slot (primary block + 1, 0 if empty), then the
+ * slots.  A slot's key is cleared on disk before the slot is rewritten
+ * and set only after its data is down, so any index on disk is safe.  The
+ * header names the cached image by its ctime, size and the random
+ * generation mkfs.myfs gives every image; a cache of any other image is
+ * started over.
+ */
+#define MYFS_L2_MAGIC 0x4D594C32    /* "MYL2" */
+#define MYFS_L2_VERSION 2
+#define MYFS_L2_IPB (MYFS_IMG_BSIZE / sizeof(uint64_t))  /* keys per block */
+#define MYFS_L2_BATCH 64            /* slots per write, divides MYFS_L2_IPB */
+#define MYFS_L2_FLUSH 5             /* seconds between index writes */
+#define MYFS_L2_IOBLKS 32           /* index blocks per I/O */
+
+struct myfs_l2_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nslots;
+    uint64_t hand;
+    uint64_t img_ctime;     /* the image being cached */
+    uint64_t img_nblocks;
+    uint32_t img_gen;
+    uint32_t reserved;
+};
+
+struct myfs_l2slot {
+    LIST_ENTRY(myfs_l2slot) hash;
+    uint64_t key;           /* primary block + 1, 0 if empty */
+    u_int gen;              /* bumped whenever the slot is emptied */
+};
+
+LIST_HEAD(myfs_l2head, myfs_l2slot);
+
+struct myfs_l2batch {
+    int n;
+    uint64_t keys[MYFS_L2_BATCH];
+    char *data;             /* MYFS_L2_BATCH blocks */
+};
+
+struct myfs_l2 {
+    struct myfs_dev dev;
+    struct rmlock lock;     /* hash, slot keys and gens */
+    struct myfs_l2head *hash;
+    u_long hashmask;
+    struct myfs_l2slot *slots;
+    uint64_t nslots;
+    daddr_t data0;          /* block of slot 0 */
+    uint64_t img_ctime;     /* identity written to the header */
+    uint64_t img_nblocks;
+    uint32_t img_gen;
+
+    /* Writer state, under wlock */
+    struct sx wlock;
+    uint64_t hand;          /* next slot to write, a multiple of the batch */
+    uint64_t *ibuf;         /* MYFS_L2_IOBLKS blocks of index or header */
+    bitstr_t *idirty;       /* index blocks to write back */
+    int hdr_valid;          /* header on disk describes this index */
+    struct task write_task;
+    struct timeout_task flush_task;
+    int dying;
+    int failed;             /* write error, stop feeding */
+
+    /* Blocks waiting to be written */
+    struct mtx stage_lock;
+    struct myfs_l2batch *stage, *spare;
+
+    uint64_t hits, misses, drops;
+};
+
+/* One superblock entry per data device, in mount option order. */
+struct myfs_sb_dev {
+    uint32_t devid;
+    uint32_t class;         /* MYFS_DEV_FAST or MYFS_DEV_SLOW */
+    uint64_t total_blocks;
+    uint64_t free_blocks;
+};
+
 /* Filesystem superblock information */
 struct myfs_sb {
     uint32_t magic;
     uint64_t total_blocks;
     uint64_t free_blocks;
-    // Add your superblock data here
+    uint32_t ndevs;
+    struct myfs_sb_dev devs[MYFS_MAXDEVS];
+};
+
+/* The data devices of one class, see myfs_stripe_dev(). */
+struct myfs_devset {
+    u_int ndevs;
+    u_int devs[MYFS_MAXDEVS];
+};
+
+/* A master key, kept as its HKDF pseudorandom key. */
+struct myfs_mkey {
+    LIST_ENTRY(myfs_mkey) link;
+    uint8_t id[MYFS_KEY_IDSIZE];
+    uint8_t prk[SHA512_DIGEST_LENGTH];
 };
 
 /* Filesystem mount structure */
 struct myfs_mount {
     struct mount *mp;
     struct myfs_sb sb;
+
+    /*
+     * Delayed allocation reservations.  Blocks in resv are promised to
+     * dirty data but not yet allocated, so the space callers may still
+     * claim is sb.free_blocks - resv.  resv_lock serializes the slow path
+     * and any change to sb.free_blocks.
+     */
+    struct mtx resv_lock;
+    struct myfs_pcount resv;
+    u_int resv_nearfull;    /* bypass per-CPU slots, see myfs_resv_reserve() */
+
+    /*
+     * Quotas.  dquots are created on first charge and live until unmount,
+     * so pointers cached in nodes stay valid without references.
+     */
+    struct rmlock dq_lock;
+    struct myfs_dqhead dq_hash[MYFS_DQHASHSIZE];
+    struct timeout_task dq_fold_task;
+    int dq_dying;
+
+    /* Recursive statistics, all protected by rs_lock */
+    uint64_t mnt_flags;     /* MYFS_MNT_* */
+    struct mtx rs_lock;
+    struct myfs_rshead rs_hash[MYFS_RSHASHSIZE];
+    struct myfs_rsdirty rs_dirty;
+    struct timeout_task rs_task;
+    int rs_dying;
+
+    /* Read-write directories awaiting compaction, see myfs_dir_task() */
+    uint8_t dir_key[MYFS_IMG_HASHKEY_SIZE];  /* see myfs_dir_hash() */
+    struct mtx dir_lock;    /* covers dir_sparse and each queued flag */
+    struct myfs_dirq dir_sparse;
+    struct timeout_task dir_task;
+    int dir_dying;
+
+    /* In-memory namespace of volumes without a sealed image */
+    uint64_t ino_next;      /* next inode number, see myfs_node_alloc() */
+
+    /* Background writeback and freeze state */
+    struct task wb_task;
+    struct sx freeze_lock;  /* serializes freeze and thaw */
+    int frozen;
+
+    /* Vnode operations for new vnodes, and the shared cache if read-only */
+    struct vop_ops *vops;
+    struct myfs_rocache *rocache;
+
+    /* Backing device, only opened for sealed images so far */
+    struct vnode *devvp;
+    struct g_consumer *cp;
+    struct bufobj *bo;
+    struct myfs_img_sb img;     /* decoded sealed superblock */
+    uint8_t bloom_key[MYFS_IMG_HASHKEY_SIZE];   /* see myfs_bloom_hash() */
+
+    /* Metadata copies of MYFS_IMG_F_DUP images, see myfs_img_bread() */
+    uint32_t *img_csums;    /* per metadata block */
+    u_long img_head;        /* last block read */
+    u_int img_busy[2];      /* reads in flight, per copy */
+    uint64_t img_bad;       /* copies that failed */
+    uint64_t img_fixed;     /* and were rewritten */
+
+    /* Access tracing, see myfs_trace() */
+    struct sx trace_lock;
+    struct myfs_tring **trace;  /* indexed by CPU id */
+    u_int trace_nrecs;      /* per ring, power of 2 */
+    u_int trace_gen;        /* bumped on every start */
+    u_int tracing;
+
+    /* Tiered data devices, see myfs_tier_pick(); sb.ndevs are open */
+    struct myfs_dev devs[MYFS_MAXDEVS];
+    struct myfs_devset sets[MYFS_NCLASS];
+    off_t tier_small;       /* files up to this size stay on the fast tier */
+    time_t tier_cold;       /* idle seconds before an extent is demoted */
+    struct timeout_task tier_task;
+    u_int tier_epoch;       /* migrator passes, for heat decay */
+    int tier_dying;
+    struct timeout_task log_task;   /* segment cleaner */
+    struct sx zone_lock;    /* placement and writes, if zoned */
+
+    /* Read cache device, see myfs_l2_read() */
+    struct myfs_l2 *l2;
+
+    /* Master keys for encrypted images, see myfs_crypt_session() */
+    struct mtx key_lock;
+    LIST_HEAD(, myfs_mkey) keys;
+    u_int key_gen;          /* bumped on every removal */
     // Add mount-specific data here
 };
 
+/* Sessions for the keys of an encrypted inode, see myfs_crypt_session(). */
+struct myfs_ckeys {
+    crypto_session_t data;      /* AES-256-XTS, file blocks */
+    crypto_session_t names;     /* AES-256-CBC, names and symlink targets */
+    uint8_t iv[AES_BLOCK_LEN];  /* for names */
+};
+
 /* Vnode data */
 struct myfs_node {
+    struct vnode *vp;
     ino_t ino;
+    uint32_t gen;           /* generation, for file handles */
     mode_t mode;
     nlink_t nlink;
     off_t size;
     struct timespec atime;
     struct timespec mtime;
     struct timespec ctime;
+    uid_t uid;
+    gid_t gid;
+    uint32_t projid;
+    uint32_t flags;         /* MYFS_NODE_* */
+    ino_t parent;           /* primary parent directory */
+    daddr_t daddr;          /* sealed images: first data block */
+    uint32_t dflags;        /* sealed images: MYFS_IMG_I_* */
+    struct myfs_img_crypt crypt;    /* sealed images: MYFS_IMG_I_CRYPT */
+    struct myfs_ckeys *crypt_keys;  /* per-file keys, set up on first use */
+    struct myfs_bloom *bloom;   /* sealed directories: absent names */
+    u_int bloom_misses;     /* failed lookups, until bloom is built */
+    struct myfs_dir *dir;   /* read-write directories: entries */
+    int64_t blocks;         /* read-write files: blocks placed or reserved */
+    u_int trace_gen;        /* trace generation this node was seen in */
+    off_t trace_hiwat;      /* furthest offset traced in that generation */
+    struct myfs_dquot *dquot[MYFS_MAXQTYPES];   /* attached lazily */
+
+    /*
+     * Tiered volumes: extents by file block.  The map changes only under
+     * the exclusive vnode lock; ext_lock covers it against heat updates
+     * from shared-locked readers.
+     */
+    struct mtx ext_lock;
+    struct myfs_extmap extents;
     // Add node-specific data here
 };
 
+/*
+ * File handle contents, for NFS export: the inode number and generation.
+ * myfs_fhtovp() resolves one through the vnode hash, never by path.
+ */
+struct myfs_fid {
+    uint64_t ino;
+    uint32_t gen;
+    uint32_t pad;
+};
+CTASSERT(sizeof(struct myfs_fid) <= MAXFIDSZ);
+
+/* Root of a volume without a sealed image; lower numbers are never used. */
+#define MYFS_ROOTINO 2
+
+/* Mount flags */
+#define MYFS_MNT_RSTATS 0x0001  /* maintain recursive statistics */
+#define MYFS_MNT_RDONLY 0x0002  /* read-only fast path, see myfs_ro_vops */
+#define MYFS_MNT_SEALED 0x0004  /* sealed image, see myfs_image.h */
+#define MYFS_MNT_TRACE 0x0008   /* trace from mount time */
+#define MYFS_MNT_TIERED 0x0010  /* fast and slow data devices */
+#define MYFS_MNT_LOG 0x0020     /* log-structured data devices */
+#define MYFS_MNT_REPAIR 0x0040  /* rewrite bad metadata copies */
+#define MYFS_MNT_ZONED 0x0080   /* zoned data devices, see myfs_strategy() */
+
+#define MYFS_DEVCLASS(mmp, dev) ((mmp)->sb.devs[(dev)].class)
+
+/* Node flags */
+#define MYFS_NODE_PROJINHERIT 0x0001    /* children take projid */
+#define MYFS_NODE_TIER_FAST 0x0002      /* pin data to the fast tier */
+#define MYFS_NODE_TIER_SLOW 0x0004      /* pin data to the slow tier */
+#define MYFS_NODE_TIER_MASK (MYFS_NODE_TIER_FAST | MYFS_NODE_TIER_SLOW)
+#define MYFS_NODE_DONTNEED 0x0008       /* drop cached data when inactive */
+#define MYFS_NODE_HELD 0x0010           /* linked, see myfs_node_alloc() */
+
 /* Function declarations */
 static int myfs_mount(struct mount *mp);
-static int myfs_unmount(struct mount *mp);
-static int myfs_root(struct mount *mp, struct vnode **vpp);
+static int myfs_unmount(struct mount *mp, int mntflags);
+static int myfs_root(struct mount *mp, int flags, struct vnode **vpp);
 static int myfs_statfs(struct mount *mp, struct statfs *sbp);
-static int myfs_vget(struct mount *mp, ino_t ino, struct vnode **vpp);
+static int myfs_vget(struct mount *mp, ino_t ino, int flags,
+    struct vnode **vpp);
+static int myfs_fhtovp(struct mount *mp, struct fid *fhp, int flags,
+    struct vnode **vpp);
+static int myfs_node_alloc(struct mount *mp, struct vnode *dvp,
+    struct ucred *cred, enum vtype type, mode_t mode, struct vnode **vpp);
 
 /* VFS operations vector */
 static struct vfsops myfs_vfsops = {
@@ -80,13 +797,14 @@ static struct vfsops myfs_vfsops = {
     .vfs_root = myfs_root,
     .vfs_statfs = myfs_statfs,
     .vfs_vget = myfs_vget,
+    .vfs_fhtovp = myfs_fhtovp,
     .vfs_sync = vfs_stdsync,
     .vfs_init = NULL,
     .vfs_uninit = NULL,
 };
 
 /* Vnode operations */
-static int myfs_lookup(struct vop_lookup_args *ap);
+static int myfs_lookup(struct vop_cachedlookup_args *ap);
 static int myfs_create(struct vop_create_args *ap);
 static int myfs_mknod(struct vop_mknod_args *ap);
 static int myfs_open(struct vop_open_args *ap);
@@ -109,13 +827,17 @@ static int myfs_rmdir(struct vop_rmdir_args *ap);
 static int myfs_inactive(struct vop_inactive_args *ap);
 static int myfs_truncate(struct vop_truncate_args *ap);
 static int myfs_fsync(struct vop_fsync_args *ap);
+static int myfs_vptofh(struct vop_vptofh_args *ap);
+static int myfs_strategy(struct vop_strategy_args *ap);
+static int myfs_bmap(struct vop_bmap_args *ap);
 
 /* Vnode operations vector */
 static struct vop_ops myfs_vops = {
     .vop_default = &default_vnodeops,
 
     /* Directory operations */
-    .vop_lookup = myfs_lookup,
+    .vop_lookup = vfs_cache_lookup,
+    .vop_cachedlookup = myfs_lookup,
     .vop_create = myfs_create,
     .vop_mknod = myfs_mknod,
     .vop_open = myfs_open,
@@ -138,303 +860,7237 @@ static struct vop_ops myfs_vops = {
     .vop_inactive = myfs_inactive,
     .vop_truncate = myfs_truncate,
     .vop_fsync = myfs_fsync,
+    .vop_vptofh = myfs_vptofh,
+    .vop_strategy = myfs_strategy,
+    .vop_bmap = myfs_bmap,
 };
 
-/* Mount function */
+/*
+ * Read-only mounts use this vector.  Anything that would modify the volume
+ * fails up front, and nothing takes write-side locks, touches timestamps or
+ * tracks dirty state; everything else falls through to myfs_vops.
+ */
+static int myfs_vop_erofs(struct vop_generic_args *ap);
+static int myfs_ro_fsync(struct vop_fsync_args *ap);
+static int myfs_ro_inactive(struct vop_inactive_args *ap);
+
+#define MYFS_VOP_EROFS ((void *)(uintptr_t)myfs_vop_erofs)
+
+static struct vop_ops myfs_ro_vops = {
+    .vop_default = &myfs_vops,
+
+    .vop_create = MYFS_VOP_EROFS,
+    .vop_mknod = MYFS_VOP_EROFS,
+    .vop_setattr = MYFS_VOP_EROFS,
+    .vop_write = MYFS_VOP_EROFS,
+    .vop_symlink = MYFS_VOP_EROFS,
+    .vop_remove = MYFS_VOP_EROFS,
+    .vop_rename = MYFS_VOP_EROFS,
+    .vop_mkdir = MYFS_VOP_EROFS,
+    .vop_rmdir = MYFS_VOP_EROFS,
+    .vop_truncate = MYFS_VOP_EROFS,
+    .vop_fsync = myfs_ro_fsync,
+    .vop_inactive = myfs_ro_inactive,
+};
+
+/*
+ * Sealed images are read-only by construction and served through this
+ * vector on top of myfs_ro_vops.
+ */
+static int myfs_img_open(struct vop_open_args *ap);
+static int myfs_img_access(struct vop_access_args *ap);
+static int myfs_img_getattr(struct vop_getattr_args *ap);
+static int myfs_img_lookup(struct vop_cachedlookup_args *ap);
+static int myfs_img_readdir(struct vop_readdir_args *ap);
+static int myfs_img_read(struct vop_read_args *ap);
+static int myfs_img_readlink(struct vop_readlink_args *ap);
+static int myfs_img_bmap(struct vop_bmap_args *ap);
+static int myfs_img_getpages(struct vop_getpages_args *ap);
+static int myfs_img_advise(struct vop_advise_args *ap);
+static int myfs_img_inactive(struct vop_inactive_args *ap);
+
+static struct vop_ops myfs_img_vops = {
+    .vop_default = &myfs_ro_vops,
+
+    .vop_lookup = vfs_cache_lookup,
+    .vop_cachedlookup = myfs_img_lookup,
+    .vop_open = myfs_img_open,
+    .vop_access = myfs_img_access,
+    .vop_getattr = myfs_img_getattr,
+    .vop_readdir = myfs_img_readdir,
+    .vop_read = myfs_img_read,
+    .vop_readlink = myfs_img_readlink,
+    .vop_bmap = myfs_img_bmap,
+    .vop_getpages = myfs_img_getpages,
+    .vop_advise = myfs_img_advise,
+    .vop_inactive = myfs_img_inactive,
+};
+
+/* Per-CPU counter helpers */
+
+static void
+myfs_pcount_init(struct myfs_pcount *pc, int64_t batch)
+{
+    pc->count = 0;
+    pc->batch = batch;
+    pc->pcpu = uma_zalloc_pcpu(pcpu_zone_8, M_WAITOK | M_ZERO);
+}
+
+static void
+myfs_pcount_destroy(struct myfs_pcount *pc)
+{
+    uma_zfree_pcpu(pcpu_zone_8, pc->pcpu);
+    pc->pcpu = NULL;
+}
+
+/* Add to the calling CPU's slot, folding into the shared count at batch. */
+static void
+myfs_pcount_add(struct myfs_pcount *pc, int64_t delta)
+{
+    uint64_t *slot;
+    int64_t local;
+
+    critical_enter();
+    slot = zpcpu_get(pc->pcpu);
+    local = (int64_t)atomic_fetchadd_64(slot, (uint64_t)delta) + delta;
+    critical_exit();
+
+    if (local >= pc->batch || local <= -pc->batch) {
+        local = (int64_t)atomic_swap_64(slot, 0);
+        atomic_add_64((uint64_t *)&pc->count, (uint64_t)local);
+    }
+}
+
+/* Add straight to the shared count; used when exactness beats scaling. */
+static void
+myfs_pcount_add_global(struct myfs_pcount *pc, int64_t delta)
+{
+    atomic_add_64((uint64_t *)&pc->count, (uint64_t)delta);
+}
+
+/* Approximate value, off by at most batch * mp_ncpus. */
+static int64_t
+myfs_pcount_read(struct myfs_pcount *pc)
+{
+    return ((int64_t)atomic_load_64((uint64_t *)&pc->count));
+}
+
+/* Exact value: fold every CPU's slot into the shared count. */
+static int64_t
+myfs_pcount_sum(struct myfs_pcount *pc)
+{
+    int64_t local;
+    int cpu;
+
+    CPU_FOREACH(cpu) {
+        local = (int64_t)atomic_swap_64(zpcpu_get_cpu(pc->pcpu, cpu), 0);
+        if (local != 0)
+            atomic_add_64((uint64_t *)&pc->count, (uint64_t)local);
+    }
+    return (myfs_pcount_read(pc));
+}
+
+static int64_t
+myfs_pcount_slack(struct myfs_pcount *pc)
+{
+    return (pc->batch * mp_ncpus);
+}
+
+/* Space reservation for delayed allocation */
+
+static int64_t
+myfs_resv_avail(struct myfs_mount *mmp, int64_t resv)
+{
+    int64_t avail;
+
+    avail = (int64_t)atomic_load_64(&mmp->sb.free_blocks) - resv;
+    return (avail > 0 ? avail : 0);
+}
+
+/*
+ * Promise nblocks to dirty data without allocating them.  myfs_data_dirty()
+ * takes a block for every block a write dirties that has no space yet, and
+ * myfs_place() turns it into an allocation when the buffer goes out.
+ *
+ * While the volume has plenty of room, small reservations only touch the
+ * local CPU's slot: the 2 * slack margin covers both the lag of the shared
+ * count and concurrent fast-path callers.  Once that margin is gone the
+ * mount switches to "nearfull" mode, where every reservation and release
+ * goes straight to the shared count under resv_lock.  That keeps the cost
+ * O(1) per call instead of summing all CPUs each time; the exact sum is
+ * only taken in the last slack blocks before returning ENOSPC.
+ */
 static int
-myfs_mount(struct mount *mp)
+myfs_resv_reserve(struct myfs_mount *mmp, int64_t nblocks)
 {
-    struct myfs_mount *mmp;
-    int error = 0;
+    struct myfs_pcount *pc = &mmp->resv;
+    int64_t slack, avail;
 
-    printf("MYFS: Mounting filesystem\n");
+    slack = myfs_pcount_slack(pc);
+    if (!atomic_load_int(&mmp->resv_nearfull) && nblocks <= pc->batch &&
+        myfs_resv_avail(mmp, myfs_pcount_read(pc)) >= nblocks + 2 * slack) {
+        myfs_pcount_add(pc, nblocks);
+        return (0);
+    }
 
-    /* Allocate mount structure */
-    mmp = malloc(sizeof(struct myfs_mount), M_TEMP, M_WAITOK | M_ZERO);
-    if (!mmp)
-        return (ENOMEM);
+    mtx_lock(&mmp->resv_lock);
+    if (!mmp->resv_nearfull) {
+        avail = myfs_resv_avail(mmp, myfs_pcount_sum(pc));
+        if (avail < nblocks + 2 * slack)
+            atomic_store_int(&mmp->resv_nearfull, 1);
+    } else {
+        avail = myfs_resv_avail(mmp, myfs_pcount_read(pc));
+        if (avail - nblocks < slack)
+            avail = myfs_resv_avail(mmp, myfs_pcount_sum(pc));
+        else if (avail >= nblocks + 4 * slack)
+            atomic_store_int(&mmp->resv_nearfull, 0);
+    }
+    if (avail < nblocks) {
+        mtx_unlock(&mmp->resv_lock);
+        return (ENOSPC);
+    }
+    myfs_pcount_add_global(pc, nblocks);
+    mtx_unlock(&mmp->resv_lock);
 
-    mp->mnt_data = mmp;
-    mmp->mp = mp;
+    return (0);
+}
 
-    /* Initialize superblock */
-    mmp->sb.magic = MYFS_MAGIC;
-    mmp->sb.total_blocks = 0;  // Initialize with actual values
-    mmp->sb.free_blocks = 0;
+/* Give back a reservation that will not be allocated. */
+static void
+myfs_resv_release(struct myfs_mount *mmp, int64_t nblocks)
+{
+    if (atomic_load_int(&mmp->resv_nearfull))
+        myfs_pcount_add_global(&mmp->resv, -nblocks);
+    else
+        myfs_pcount_add(&mmp->resv, -nblocks);
+}
 
-    /* Set filesystem statistics */
-    mp->mnt_stat.f_iosize = PAGE_SIZE;
-    mp->mnt_stat.f_blocks = mmp->sb.total_blocks;
-    mp->mnt_stat.f_bfree = mmp->sb.free_blocks;
-    mp->mnt_stat.f_bavail = mmp->sb.free_blocks;
-    mp->mnt_stat.f_namemax = NAME_MAX;
+/* Quotas */
 
-    /* Set VFS flags */
-    vfs_getnewfsid(mp);
-    mp->mnt_flag |= MNT_LOCAL;
+#define MYFS_DQHASH(mmp, type, id) \
+    (&(mmp)->dq_hash[((id) + (type) * 0x9e3779b1u) & (MYFS_DQHASHSIZE - 1)])
 
-    return (error);
+static struct myfs_dquot *
+myfs_dqfind(struct myfs_mount *mmp, uint32_t type, uint32_t id)
+{
+    struct rm_priotracker tracker;
+    struct myfs_dquot *dq;
+
+    rm_rlock(&mmp->dq_lock, &tracker);
+    LIST_FOREACH(dq, MYFS_DQHASH(mmp, type, id), link) {
+        if (dq->type == type && dq->id == id)
+            break;
+    }
+    rm_runlock(&mmp->dq_lock, &tracker);
+
+    return (dq);
+}
+
+/* Find or create the dquot for (type, id). */
+static struct myfs_dquot *
+myfs_dqget(struct myfs_mount *mmp, uint32_t type, uint32_t id)
+{
+    struct myfs_dquot *dq, *ndq;
+
+    dq = myfs_dqfind(mmp, type, id);
+    if (dq != NULL)
+        return (dq);
+
+    ndq = malloc(sizeof(struct myfs_dquot), M_TEMP, M_WAITOK | M_ZERO);
+    ndq->type = type;
+    ndq->id = id;
+    mtx_init(&ndq->lock, "myfs dquot", NULL, MTX_DEF);
+    myfs_pcount_init(&ndq->blocks, MYFS_QUOTA_BATCH);
+    myfs_pcount_init(&ndq->inodes, MYFS_QUOTA_BATCH);
+
+    rm_wlock(&mmp->dq_lock);
+    LIST_FOREACH(dq, MYFS_DQHASH(mmp, type, id), link) {
+        if (dq->type == type && dq->id == id)
+            break;
+    }
+    if (dq == NULL) {
+        LIST_INSERT_HEAD(MYFS_DQHASH(mmp, type, id), ndq, link);
+        dq = ndq;
+        ndq = NULL;
+    }
+    rm_wunlock(&mmp->dq_lock);
+
+    if (ndq != NULL) {
+        myfs_pcount_destroy(&ndq->inodes);
+        myfs_pcount_destroy(&ndq->blocks);
+        mtx_destroy(&ndq->lock);
+        free(ndq, M_TEMP);
+    }
+    return (dq);
+}
+
+static void
+myfs_quota_attach(struct myfs_mount *mmp, struct myfs_node *np)
+{
+    if (np->dquot[MYFS_QTYPE_USR] == NULL)
+        np->dquot[MYFS_QTYPE_USR] = myfs_dqget(mmp, MYFS_QTYPE_USR, np->uid);
+    if (np->dquot[MYFS_QTYPE_GRP] == NULL)
+        np->dquot[MYFS_QTYPE_GRP] = myfs_dqget(mmp, MYFS_QTYPE_GRP, np->gid);
+    if (np->dquot[MYFS_QTYPE_PRJ] == NULL)
+        np->dquot[MYFS_QTYPE_PRJ] = myfs_dqget(mmp, MYFS_QTYPE_PRJ,
+            np->projid);
+}
+
+/*
+ * Would adding delta to pc exceed limit?  Far from the limit the folded
+ * count alone decides; within 2 * slack of it we sum every CPU.  The fast
+ * path margin covers both the folded count's lag and concurrent callers
+ * that each add at most one batch.
+ */
+static int
+myfs_dq_over(struct myfs_pcount *pc, uint64_t limit, int64_t delta)
+{
+    if (limit == 0 || delta <= 0)
+        return (0);
+    if (myfs_pcount_read(pc) + delta + 2 * myfs_pcount_slack(pc) <=
+        (int64_t)limit)
+        return (0);
+    return (myfs_pcount_sum(pc) + delta > (int64_t)limit);
+}
+
+/*
+ * Charge dblocks and dinodes against every dquot in dqs (NULL entries are
+ * untracked) or fail with EDQUOT without charging anything.  A node is
+ * charged an inode by myfs_node_alloc() and a block for every hole it
+ * fills by myfs_data_reserve(); myfs_quota_chown() moves both.
+ */
+static int
+myfs_quota_alloc(struct myfs_dquot **dqs, int64_t dblocks, int64_t dinodes)
+{
+    struct myfs_dquot *dq;
+    int i, j;
+
+    for (i = 0; i < MYFS_MAXQTYPES; i++) {
+        dq = dqs[i];
+        if (dq == NULL)
+            continue;
+        if (myfs_dq_over(&dq->blocks, atomic_load_64(&dq->blk_limit),
+            dblocks) == 0 &&
+            myfs_dq_over(&dq->inodes, atomic_load_64(&dq->ino_limit),
+            dinodes) == 0) {
+            myfs_pcount_add(&dq->blocks, dblocks);
+            myfs_pcount_add(&dq->inodes, dinodes);
+            continue;
+        }
+
+        /* Near a limit: decide and charge exactly, one caller at a time. */
+        mtx_lock(&dq->lock);
+        if ((dq->blk_limit != 0 && dblocks > 0 &&
+            myfs_pcount_sum(&dq->blocks) + dblocks > (int64_t)dq->blk_limit) ||
+            (dq->ino_limit != 0 && dinodes > 0 &&
+            myfs_pcount_sum(&dq->inodes) + dinodes > (int64_t)dq->ino_limit)) {
+            mtx_unlock(&dq->lock);
+            for (j = 0; j < i; j++) {
+                if (dqs[j] == NULL)
+                    continue;
+                myfs_pcount_add(&dqs[j]->blocks, -dblocks);
+                myfs_pcount_add(&dqs[j]->inodes, -dinodes);
+            }
+            return (EDQUOT);
+        }
+        myfs_pcount_add_global(&dq->blocks, dblocks);
+        myfs_pcount_add_global(&dq->inodes, dinodes);
+        mtx_unlock(&dq->lock);
+    }
+
+    return (0);
+}
+
+static void
+myfs_quota_free(struct myfs_dquot **dqs, int64_t dblocks, int64_t dinodes)
+{
+    int i;
+
+    for (i = 0; i < MYFS_MAXQTYPES; i++) {
+        if (dqs[i] == NULL)
+            continue;
+        myfs_pcount_add(&dqs[i]->blocks, -dblocks);
+        myfs_pcount_add(&dqs[i]->inodes, -dinodes);
+    }
+}
+
+/*
+ * Give np a new owner, group and project, moving what it is charged, its
+ * blocks and its inode, to their dquots; or fail with EDQUOT and change
+ * nothing.  The caller holds the vnode lock exclusively.
+ */
+static int
+myfs_quota_chown(struct myfs_mount *mmp, struct myfs_node *np, uid_t uid,
+    gid_t gid, uint32_t projid)
+{
+    struct myfs_dquot *odq[MYFS_MAXQTYPES] = { NULL };
+    struct myfs_dquot *ndq[MYFS_MAXQTYPES] = { NULL };
+    uint32_t ids[MYFS_MAXQTYPES];
+    int error, i;
+
+    myfs_quota_attach(mmp, np);
+    ids[MYFS_QTYPE_USR] = uid;
+    ids[MYFS_QTYPE_GRP] = gid;
+    ids[MYFS_QTYPE_PRJ] = projid;
+    for (i = 0; i < MYFS_MAXQTYPES; i++) {
+        ndq[i] = myfs_dqget(mmp, i, ids[i]);
+        if (ndq[i] == np->dquot[i])
+            ndq[i] = NULL;
+        else
+            odq[i] = np->dquot[i];
+    }
+
+    error = myfs_quota_alloc(ndq, np->blocks, 1);
+    if (error)
+        return (error);
+    myfs_quota_free(odq, np->blocks, 1);
+    for (i = 0; i < MYFS_MAXQTYPES; i++) {
+        if (ndq[i] != NULL)
+            np->dquot[i] = ndq[i];
+    }
+    np->uid = uid;
+    np->gid = gid;
+    np->projid = projid;
+    return (0);
+}
+
+/* Periodically fold per-CPU deltas so reported usage is fresh. */
+static void
+myfs_dq_fold(void *arg, int pending __unused)
+{
+    struct myfs_mount *mmp = arg;
+    struct rm_priotracker tracker;
+    struct myfs_dquot *dq;
+    int i;
+
+    rm_rlock(&mmp->dq_lock, &tracker);
+    for (i = 0; i < MYFS_DQHASHSIZE; i++) {
+        LIST_FOREACH(dq, &mmp->dq_hash[i], link) {
+            myfs_pcount_sum(&dq->blocks);
+            myfs_pcount_sum(&dq->inodes);
+        }
+    }
+    rm_runlock(&mmp->dq_lock, &tracker);
+
+    if (!mmp->dq_dying)
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->dq_fold_task, hz);
+}
+
+static void
+myfs_quota_init(struct myfs_mount *mmp)
+{
+    int i;
+
+    rm_init(&mmp->dq_lock, "myfs dquots");
+    for (i = 0; i < MYFS_DQHASHSIZE; i++)
+        LIST_INIT(&mmp->dq_hash[i]);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &mmp->dq_fold_task, 0,
+        myfs_dq_fold, mmp);
+}
+
+static void
+myfs_quota_uninit(struct myfs_mount *mmp)
+{
+    struct myfs_dquot *dq;
+    int i;
+
+    mmp->dq_dying = 1;
+    while (taskqueue_cancel_timeout(taskqueue_thread, &mmp->dq_fold_task,
+        NULL) != 0)
+        taskqueue_drain_timeout(taskqueue_thread, &mmp->dq_fold_task);
+
+    for (i = 0; i < MYFS_DQHASHSIZE; i++) {
+        while ((dq = LIST_FIRST(&mmp->dq_hash[i])) != NULL) {
+            LIST_REMOVE(dq, link);
+            myfs_pcount_destroy(&dq->inodes);
+            myfs_pcount_destroy(&dq->blocks);
+            mtx_destroy(&dq->lock);
+            free(dq, M_TEMP);
+        }
+    }
+    rm_destroy(&mmp->dq_lock);
+}
+
+/*
+ * Ownership and project of a node cred creates in dnp.  New files take the
+ * directory's group, as on UFS.  Only directories tagged with
+ * MYFS_NODE_PROJINHERIT pass their project on, and new subdirectories
+ * inherit the tag, as with XFS.  Tier hints are always inherited.
+ */
+static void
+myfs_node_init(struct myfs_node *np, struct myfs_node *dnp,
+    struct ucred *cred, int type)
+{
+    np->parent = dnp->ino;
+    np->uid = cred->cr_uid;
+    np->gid = dnp->gid;
+    if (dnp->flags & MYFS_NODE_PROJINHERIT) {
+        np->projid = dnp->projid;
+        if (type == VDIR)
+            np->flags |= MYFS_NODE_PROJINHERIT;
+    }
+    np->flags |= dnp->flags & MYFS_NODE_TIER_MASK;
+}
+
+static int
+myfs_ioc_setquota(struct myfs_mount *mmp, struct thread *td,
+    struct myfs_quota_args *qa)
+{
+    struct myfs_dquot *dq;
+    int error;
+
+    error = priv_check(td, PRIV_VFS_SETQUOTA);
+    if (error)
+        return (error);
+    if (qa->type >= MYFS_MAXQTYPES)
+        return (EINVAL);
+
+    dq = myfs_dqget(mmp, qa->type, qa->id);
+    atomic_store_64(&dq->blk_limit, qa->blk_limit);
+    atomic_store_64(&dq->ino_limit, qa->ino_limit);
+
+    return (0);
+}
+
+static int
+myfs_ioc_getquota(struct myfs_mount *mmp, struct ucred *cred,
+    struct myfs_quota_args *qa)
+{
+    struct myfs_dquot *dq;
+    int error;
+
+    if (qa->type >= MYFS_MAXQTYPES)
+        return (EINVAL);
+    if (!(qa->type == MYFS_QTYPE_USR && qa->id == cred->cr_uid) &&
+        !(qa->type == MYFS_QTYPE_GRP && groupmember(qa->id, cred))) {
+        error = priv_check_cred(cred, PRIV_VFS_GETQUOTA);
+        if (error)
+            return (error);
+    }
+
+    dq = myfs_dqfind(mmp, qa->type, qa->id);
+    if (dq == NULL) {
+        qa->blk_limit = qa->ino_limit = 0;
+        qa->blk_used = qa->ino_used = 0;
+        return (0);
+    }
+    qa->blk_limit = atomic_load_64(&dq->blk_limit);
+    qa->ino_limit = atomic_load_64(&dq->ino_limit);
+    qa->blk_used = MAX(myfs_pcount_sum(&dq->blocks), 0);
+    qa->ino_used = MAX(myfs_pcount_sum(&dq->inodes), 0);
+
+    return (0);
+}
+
+/*
+ * Tag a directory with a project.  What the directory itself is charged
+ * moves to the new project; its existing children keep theirs.
+ */
+static int
+myfs_ioc_setprojid(struct myfs_mount *mmp, struct vnode *vp,
+    struct thread *td, struct myfs_projid_args *pa)
+{
+    struct myfs_node *np;
+    int error;
+
+    error = priv_check(td, PRIV_VFS_SETQUOTA);
+    if (error)
+        return (error);
+    if (vp->v_type != VDIR)
+        return (ENOTDIR);
+    if ((pa->flags & ~MYFS_PROJ_INHERIT) != 0)
+        return (EINVAL);
+
+    vn_lock(vp, LK_EXCLUSIVE | LK_RETRY);
+    np = (struct myfs_node *)vp->v_data;
+    error = myfs_quota_chown(mmp, np, np->uid, np->gid, pa->projid);
+    if (error) {
+        VOP_UNLOCK(vp);
+        return (error);
+    }
+    if (pa->flags & MYFS_PROJ_INHERIT)
+        np->flags |= MYFS_NODE_PROJINHERIT;
+    else
+        np->flags &= ~MYFS_NODE_PROJINHERIT;
+    VOP_UNLOCK(vp);
+
+    return (0);
+}
+
+/*
+ * Usage of vp's project.  Per-project counters are maintained on every
+ * charge, so this costs one per-CPU fold regardless of tree size.
+ */
+static int
+myfs_ioc_getprojusage(struct myfs_mount *mmp, struct vnode *vp,
+    struct myfs_projusage_args *pu)
+{
+    struct myfs_node *np;
+    struct myfs_dquot *dq;
+
+    vn_lock(vp, LK_SHARED | LK_RETRY);
+    np = (struct myfs_node *)vp->v_data;
+    myfs_quota_attach(mmp, np);
+    dq = np->dquot[MYFS_QTYPE_PRJ];
+    pu->projid = np->projid;
+    pu->flags = (np->flags & MYFS_NODE_PROJINHERIT) ? MYFS_PROJ_INHERIT : 0;
+    VOP_UNLOCK(vp);
+
+    pu->blk_used = MAX(myfs_pcount_sum(&dq->blocks), 0);
+    pu->ino_used = MAX(myfs_pcount_sum(&dq->inodes), 0);
+    pu->blk_limit = atomic_load_64(&dq->blk_limit);
+    pu->ino_limit = atomic_load_64(&dq->ino_limit);
+
+    return (0);
+}
+
+/* Recursive statistics */
+
+#define MYFS_RSHASH(mmp, ino) \
+    (&(mmp)->rs_hash[(ino) & (MYFS_RSHASHSIZE - 1)])
+
+static struct myfs_rstat *
+myfs_rstat_find(struct myfs_mount *mmp, ino_t ino)
+{
+    struct myfs_rstat *rs;
+
+    mtx_assert(&mmp->rs_lock, MA_OWNED);
+    LIST_FOREACH(rs, MYFS_RSHASH(mmp, ino), hash) {
+        if (rs->ino == ino)
+            break;
+    }
+    return (rs);
+}
+
+/* Look up ino's entry, creating it if needed.  May drop rs_lock. */
+static struct myfs_rstat *
+myfs_rstat_get(struct myfs_mount *mmp, ino_t ino)
+{
+    struct myfs_rstat *rs, *nrs;
+
+    mtx_assert(&mmp->rs_lock, MA_OWNED);
+    rs = myfs_rstat_find(mmp, ino);
+    if (rs != NULL)
+        return (rs);
+
+    mtx_unlock(&mmp->rs_lock);
+    nrs = malloc(sizeof(struct myfs_rstat), M_TEMP, M_WAITOK | M_ZERO);
+    nrs->ino = ino;
+    mtx_lock(&mmp->rs_lock);
+
+    rs = myfs_rstat_find(mmp, ino);
+    if (rs != NULL) {
+        free(nrs, M_TEMP);
+        return (rs);
+    }
+    LIST_INSERT_HEAD(MYFS_RSHASH(mmp, ino), nrs, hash);
+    return (nrs);
+}
+
+/*
+ * Apply a delta to rs's totals and queue it for rs's parent.  Entries whose
+ * parent is not known yet keep the delta pending until it is.
+ */
+static void
+myfs_rstat_apply(struct myfs_mount *mmp, struct myfs_rstat *rs,
+    int64_t dbytes, int64_t dfiles, int64_t dsubdirs)
+{
+    rs->rbytes += dbytes;
+    rs->rfiles += dfiles;
+    rs->rsubdirs += dsubdirs;
+    rs->dbytes += dbytes;
+    rs->dfiles += dfiles;
+    rs->dsubdirs += dsubdirs;
+    if (!rs->ondirty && rs->parent != 0 && rs->parent != rs->ino) {
+        TAILQ_INSERT_TAIL(&mmp->rs_dirty, rs, dirty);
+        rs->ondirty = 1;
+    }
+}
+
+/*
+ * Account a change directly below directory ino, whose parent is parent
+ * (0 if the caller does not know it).  Called with the directory locked,
+ * or for a change of size with the file locked: its directory's entry was
+ * made when the file was linked into it.
+ */
+static void
+myfs_rstat_add(struct myfs_mount *mmp, ino_t ino, ino_t parent,
+    int64_t dbytes, int64_t dfiles, int64_t dsubdirs)
+{
+    struct myfs_rstat *rs;
+
+    if ((mmp->mnt_flags & MYFS_MNT_RSTATS) == 0)
+        return;
+    if (dbytes == 0 && dfiles == 0 && dsubdirs == 0)
+        return;
+
+    mtx_lock(&mmp->rs_lock);
+    rs = myfs_rstat_get(mmp, ino);
+    if (rs->parent == 0)
+        rs->parent = parent;
+    myfs_rstat_apply(mmp, rs, dbytes, dfiles, dsubdirs);
+    mtx_unlock(&mmp->rs_lock);
+}
+
+/*
+ * Push every pending delta up toward the root.  Each pass moves a delta
+ * one level; deltas arriving at an already dirty parent merge into its
+ * pending delta, so the work is bounded by the number of dirty directories,
+ * not the number of changes.
+ */
+static void
+myfs_rstat_flush(struct myfs_mount *mmp)
+{
+    struct myfs_rstat *rs, *prs;
+    int64_t dbytes, dfiles, dsubdirs;
+
+    mtx_lock(&mmp->rs_lock);
+    while ((rs = TAILQ_FIRST(&mmp->rs_dirty)) != NULL) {
+        TAILQ_REMOVE(&mmp->rs_dirty, rs, dirty);
+        rs->ondirty = 0;
+        dbytes = rs->dbytes;
+        dfiles = rs->dfiles;
+        dsubdirs = rs->dsubdirs;
+        rs->dbytes = rs->dfiles = rs->dsubdirs = 0;
+
+        /* Entries are only freed at unmount, so rs survives a drop. */
+        prs = myfs_rstat_get(mmp, rs->parent);
+        myfs_rstat_apply(mmp, prs, dbytes, dfiles, dsubdirs);
+    }
+    mtx_unlock(&mmp->rs_lock);
+}
+
+static void
+myfs_rstat_task(void *arg, int pending __unused)
+{
+    struct myfs_mount *mmp = arg;
+
+    myfs_rstat_flush(mmp);
+    if (!mmp->rs_dying)
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->rs_task, hz);
+}
+
+static void
+myfs_rstat_init(struct myfs_mount *mmp)
+{
+    int i;
+
+    mtx_init(&mmp->rs_lock, "myfs rstats", NULL, MTX_DEF);
+    for (i = 0; i < MYFS_RSHASHSIZE; i++)
+        LIST_INIT(&mmp->rs_hash[i]);
+    TAILQ_INIT(&mmp->rs_dirty);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &mmp->rs_task, 0,
+        myfs_rstat_task, mmp);
+}
+
+static void
+myfs_rstat_uninit(struct myfs_mount *mmp)
+{
+    struct myfs_rstat *rs;
+    int i;
+
+    mmp->rs_dying = 1;
+    while (taskqueue_cancel_timeout(taskqueue_thread, &mmp->rs_task,
+        NULL) != 0)
+        taskqueue_drain_timeout(taskqueue_thread, &mmp->rs_task);
+
+    for (i = 0; i < MYFS_RSHASHSIZE; i++) {
+        while ((rs = LIST_FIRST(&mmp->rs_hash[i])) != NULL) {
+            LIST_REMOVE(rs, hash);
+            free(rs, M_TEMP);
+        }
+    }
+    mtx_destroy(&mmp->rs_lock);
+}
+
+static int
+myfs_ioc_getrstat(struct myfs_mount *mmp, struct vnode *vp,
+    struct myfs_rstat_args *ra)
+{
+    struct myfs_rstat *rs;
+    ino_t ino;
+
+    if ((mmp->mnt_flags & MYFS_MNT_RSTATS) == 0)
+        return (EOPNOTSUPP);
+    if (vp->v_type != VDIR)
+        return (ENOTDIR);
+
+    ino = ((struct myfs_node *)vp->v_data)->ino;
+    myfs_rstat_flush(mmp);
+
+    mtx_lock(&mmp->rs_lock);
+    rs = myfs_rstat_find(mmp, ino);
+    if (rs != NULL) {
+        ra->rbytes = MAX(rs->rbytes, 0);
+        ra->rfiles = MAX(rs->rfiles, 0);
+        ra->rsubdirs = MAX(rs->rsubdirs, 0);
+    } else
+        ra->rbytes = ra->rfiles = ra->rsubdirs = 0;
+    mtx_unlock(&mmp->rs_lock);
+
+    return (0);
+}
+
+/* Read-write directories */
+
+#define MYFS_DIR_MAXSHIFT 24
+#define MYFS_DIR_BUCKET(dir, h) \
+    (&(dir)->index[(h) >> (32 - (dir)->shift)])
+#define MYFS_DIR_STRIPE(dir, h) \
+    (&(dir)->stripes[(h) >> (32 - MYFS_DIR_MINSHIFT)])
+#define MYFS_DIR_ISSPARSE(dir) ((dir)->nalloc > 1 && \
+    (dir)->count * MYFS_DIR_SPARSE < (dir)->nalloc * MYFS_DIRBLK)
+
+/* Hash of a name for the index, keyed per mount like myfs_bloom_hash(). */
+static uint32_t
+myfs_dir_hash(struct myfs_mount *mmp, const char *name, size_t len)
+{
+    return ((uint32_t)myfs_siphash13(mmp->dir_key, name, len));
+}
+
+/* Give directory dnp an empty entry table. */
+static void
+myfs_dir_alloc(struct myfs_node *dnp)
+{
+    struct myfs_dir *dir;
+    u_int i;
+
+    dir = malloc(sizeof(struct myfs_dir), M_TEMP, M_WAITOK | M_ZERO);
+    dir->ino = dnp->ino;
+    sx_init(&dir->lock, "myfs dir");
+    for (i = 0; i < MYFS_DIR_NLOCKS; i++)
+        sx_init(&dir->stripes[i], "myfs dir stripe");
+    sx_init(&dir->blk_lock, "myfs dir blocks");
+    dir->shift = MYFS_DIR_MINSHIFT;
+    dir->index = malloc(sizeof(*dir->index) << dir->shift, M_TEMP,
+        M_WAITOK);
+    for (i = 0; i < 1u << dir->shift; i++)
+        LIST_INIT(&dir->index[i]);
+    dnp->dir = dir;
+}
+
+static void
+myfs_dir_free(struct myfs_mount *mmp, struct myfs_dir *dir)
+{
+    u_int b, i;
+
+    mtx_lock(&mmp->dir_lock);
+    if (dir->queued)
+        TAILQ_REMOVE(&mmp->dir_sparse, dir, sparse);
+    mtx_unlock(&mmp->dir_lock);
+
+    for (b = 0; b < dir->nblks; b++) {
+        if (dir->blks[b] == NULL)
+            continue;
+        for (i = 0; i < MYFS_DIRBLK; i++)
+            free(dir->blks[b]->ents[i], M_TEMP);
+        free(dir->blks[b], M_TEMP);
+    }
+    free(dir->blks, M_TEMP);
+    free(dir->index, M_TEMP);
+    sx_destroy(&dir->blk_lock);
+    for (i = 0; i < MYFS_DIR_NLOCKS; i++)
+        sx_destroy(&dir->stripes[i]);
+    sx_destroy(&dir->lock);
+    free(dir, M_TEMP);
+}
+
+static struct myfs_dent *
+myfs_dir_find(struct myfs_dir *dir, uint32_t h, const char *name,
+    size_t len)
+{
+    struct myfs_dent *de;
+
+    LIST_FOREACH(de, MYFS_DIR_BUCKET(dir, h), hash) {
+        if (de->h == h && de->namelen == len &&
+            memcmp(de->name, name, len) == 0)
+            break;
+    }
+    return (de);
+}
+
+/* Move dir's entries to an index of 1 << shift buckets. */
+static void
+myfs_dir_rehash(struct myfs_dir *dir, u_int shift)
+{
+    struct myfs_denthead *index;
+    struct myfs_dent *de;
+    u_int i;
+
+    sx_assert(&dir->lock, SA_XLOCKED);
+    index = malloc(sizeof(*index) << shift, M_TEMP, M_WAITOK);
+    for (i = 0; i < 1u << shift; i++)
+        LIST_INIT(&index[i]);
+    for (i = 0; i < 1u << dir->shift; i++) {
+        while ((de = LIST_FIRST(&dir->index[i])) != NULL) {
+            LIST_REMOVE(de, hash);
+            LIST_INSERT_HEAD(&index[de->h >> (32 - shift)], de, hash);
+        }
+    }
+    free(dir->index, M_TEMP);
+    dir->index = index;
+    dir->shift = shift;
+}
+
+/* Queue dir for myfs_dir_task(). */
+static void
+myfs_dir_queue(struct myfs_mount *mmp, struct myfs_dir *dir)
+{
+    mtx_lock(&mmp->dir_lock);
+    if (!dir->queued && !mmp->dir_dying) {
+        TAILQ_INSERT_TAIL(&mmp->dir_sparse, dir, sparse);
+        dir->queued = 1;
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->dir_task, hz);
+    }
+    mtx_unlock(&mmp->dir_lock);
+}
+
+/* Give de the first free slot of dir. */
+static void
+myfs_dir_slot(struct myfs_dir *dir, struct myfs_dent *de)
+{
+    struct myfs_dblk **blks, *bp;
+    u_int b, i, cap;
+
+    sx_assert(&dir->blk_lock, SA_XLOCKED);
+    for (b = dir->hint; b < dir->nblks; b++) {
+        if (dir->blks[b] == NULL || dir->blks[b]->used < MYFS_DIRBLK)
+            break;
+    }
+    if (b == dir->cap) {
+        cap = MAX(dir->cap * 2, 1);
+        blks = malloc(cap * sizeof(*blks), M_TEMP, M_WAITOK | M_ZERO);
+        if (dir->nblks != 0)
+            memcpy(blks, dir->blks, dir->nblks * sizeof(*blks));
+        free(dir->blks, M_TEMP);
+        dir->blks = blks;
+        dir->cap = cap;
+    }
+    if (dir->blks[b] == NULL) {
+        dir->blks[b] = malloc(sizeof(struct myfs_dblk), M_TEMP,
+            M_WAITOK | M_ZERO);
+        dir->nalloc++;
+    }
+    if (b == dir->nblks)
+        dir->nblks++;
+    dir->hint = b;
+    bp = dir->blks[b];
+    for (i = 0; bp->ents[i] != NULL; i++)
+        ;
+    de->slot = b * MYFS_DIRBLK + i;
+    bp->ents[i] = de;
+    bp->used++;
+    dir->count++;
+}
+
+/* Look name up in directory dnp, locked shared or exclusive. */
+static int
+myfs_dir_lookup(struct myfs_mount *mmp, struct myfs_node *dnp,
+    const char *name, size_t len, ino_t *inop)
+{
+    struct myfs_dir *dir = dnp->dir;
+    struct myfs_dent *de;
+    uint32_t h;
+    int error;
+
+    h = myfs_dir_hash(mmp, name, len);
+    sx_slock(&dir->lock);
+    sx_slock(MYFS_DIR_STRIPE(dir, h));
+    de = myfs_dir_find(dir, h, name, len);
+    error = ENOENT;
+    if (de != NULL) {
+        *inop = de->ino;
+        error = 0;
+    }
+    sx_sunlock(MYFS_DIR_STRIPE(dir, h));
+    sx_sunlock(&dir->lock);
+    return (error);
+}
+
+/*
+ * Add name to directory dnp, locked shared or exclusive, in the first
+ * free slot.  Inserts of names in different stripes only meet on
+ * blk_lock.
+ */
+static int
+myfs_dir_insert(struct myfs_mount *mmp, struct myfs_node *dnp,
+    const char *name, size_t len, ino_t ino, uint8_t type)
+{
+    struct myfs_dir *dir = dnp->dir;
+    struct myfs_dent *de;
+    uint32_t h;
+    int grow;
+
+    h = myfs_dir_hash(mmp, name, len);
+    de = malloc(sizeof(struct myfs_dent) + len, M_TEMP, M_WAITOK);
+    de->ino = ino;
+    de->h = h;
+    de->type = type;
+    de->namelen = len;
+    memcpy(de->name, name, len);
+
+    sx_slock(&dir->lock);
+    sx_xlock(MYFS_DIR_STRIPE(dir, h));
+    if (myfs_dir_find(dir, h, name, len) != NULL) {
+        sx_xunlock(MYFS_DIR_STRIPE(dir, h));
+        sx_sunlock(&dir->lock);
+        free(de, M_TEMP);
+        return (EEXIST);
+    }
+    sx_xlock(&dir->blk_lock);
+    myfs_dir_slot(dir, de);
+    grow = dir->count > 2u << dir->shift;
+    sx_xunlock(&dir->blk_lock);
+    LIST_INSERT_HEAD(MYFS_DIR_BUCKET(dir, h), de, hash);
+    sx_xunlock(MYFS_DIR_STRIPE(dir, h));
+    sx_sunlock(&dir->lock);
+
+    if (grow) {
+        sx_xlock(&dir->lock);
+        if (dir->count > 2u << dir->shift &&
+            dir->shift < MYFS_DIR_MAXSHIFT)
+            myfs_dir_rehash(dir, dir->shift + 1);
+        sx_xunlock(&dir->lock);
+    }
+    return (0);
+}
+
+/*
+ * Remove name from directory dnp, locked shared or exclusive, returning
+ * its inode in *inop.  The entry's block is freed once empty and the
+ * index halved once it has four buckets per entry; a directory left
+ * sparse is queued for compaction.
+ */
+static int
+myfs_dir_remove(struct myfs_mount *mmp, struct myfs_node *dnp,
+    const char *name, size_t len, ino_t *inop)
+{
+    struct myfs_dir *dir = dnp->dir;
+    struct myfs_dblk *bp;
+    struct myfs_dent *de;
+    uint32_t h;
+    u_int b;
+    int shrink, sparse;
+
+    h = myfs_dir_hash(mmp, name, len);
+    sx_slock(&dir->lock);
+    sx_xlock(MYFS_DIR_STRIPE(dir, h));
+    de = myfs_dir_find(dir, h, name, len);
+    if (de == NULL) {
+        sx_xunlock(MYFS_DIR_STRIPE(dir, h));
+        sx_sunlock(&dir->lock);
+        return (ENOENT);
+    }
+    *inop = de->ino;
+    LIST_REMOVE(de, hash);
+
+    sx_xlock(&dir->blk_lock);
+    b = de->slot / MYFS_DIRBLK;
+    bp = dir->blks[b];
+    bp->ents[de->slot % MYFS_DIRBLK] = NULL;
+    dir->count--;
+    if (b < dir->hint)
+        dir->hint = b;
+    if (--bp->used == 0) {
+        free(bp, M_TEMP);
+        dir->blks[b] = NULL;
+        dir->nalloc--;
+        while (dir->nblks > 0 && dir->blks[dir->nblks - 1] == NULL)
+            dir->nblks--;
+    }
+    shrink = dir->shift > MYFS_DIR_MINSHIFT &&
+        dir->count < (1u << dir->shift) / 4;
+    sparse = MYFS_DIR_ISSPARSE(dir);
+    sx_xunlock(&dir->blk_lock);
+    sx_xunlock(MYFS_DIR_STRIPE(dir, h));
+    sx_sunlock(&dir->lock);
+    free(de, M_TEMP);
+
+    if (shrink) {
+        sx_xlock(&dir->lock);
+        if (dir->shift > MYFS_DIR_MINSHIFT &&
+            dir->count < (1u << dir->shift) / 4)
+            myfs_dir_rehash(dir, dir->shift - 1);
+        sx_xunlock(&dir->lock);
+    }
+    if (sparse)
+        myfs_dir_queue(mmp, dir);
+    return (0);
+}
+
+/* Pack dir's entries, in slot order, into as few blocks as they fill. */
+static void
+myfs_dir_compact(struct myfs_dir *dir)
+{
+    struct myfs_dblk **blks, *bp;
+    struct myfs_dent *de;
+    u_int b, i, n, slot;
+
+    sx_assert(&dir->lock, SA_XLOCKED);
+    n = howmany(dir->count, MYFS_DIRBLK);
+    blks = NULL;
+    if (n != 0) {
+        blks = malloc(n * sizeof(*blks), M_TEMP, M_WAITOK);
+        for (b = 0; b < n; b++)
+            blks[b] = malloc(sizeof(struct myfs_dblk), M_TEMP,
+                M_WAITOK | M_ZERO);
+    }
+
+    slot = 0;
+    for (b = 0; b < dir->nblks; b++) {
+        if ((bp = dir->blks[b]) == NULL)
+            continue;
+        for (i = 0; i < MYFS_DIRBLK; i++) {
+            if ((de = bp->ents[i]) == NULL)
+                continue;
+            de->slot = slot;
+            blks[slot / MYFS_DIRBLK]->ents[slot % MYFS_DIRBLK] = de;
+            blks[slot / MYFS_DIRBLK]->used++;
+            slot++;
+        }
+        free(bp, M_TEMP);
+    }
+    free(dir->blks, M_TEMP);
+
+    dir->blks = blks;
+    dir->nblks = dir->cap = dir->nalloc = n;
+    dir->hint = n > 0 ? n - 1 : 0;
+}
+
+/*
+ * Compact the queued directories.  Packing moves entries and so changes
+ * their readdir offsets; a directory someone else holds, maybe open part
+ * way through a readdir, is left for a later pass.
+ */
+static void
+myfs_dir_task(void *arg, int pending __unused)
+{
+    struct myfs_mount *mmp = arg;
+    struct myfs_node *np;
+    struct myfs_dir *dir;
+    struct vnode *vp;
+    ino_t ino;
+    u_int n;
+
+    mtx_lock(&mmp->dir_lock);
+    n = 0;
+    TAILQ_FOREACH(dir, &mmp->dir_sparse, sparse)
+        n++;
+    for (; n > 0 && !mmp->dir_dying; n--) {
+        dir = TAILQ_FIRST(&mmp->dir_sparse);
+        if (dir == NULL)
+            break;
+        TAILQ_REMOVE(&mmp->dir_sparse, dir, sparse);
+        dir->queued = 0;
+        ino = dir->ino;
+        mtx_unlock(&mmp->dir_lock);
+
+        /* dir may be gone now; only the node's pointer is trusted. */
+        if (vfs_hash_get(mmp->mp, ino, LK_SHARED, curthread, &vp,
+            NULL, NULL) == 0 && vp != NULL) {
+            np = (struct myfs_node *)vp->v_data;
+            dir = np->dir;
+            if (dir != NULL) {
+                sx_xlock(&dir->lock);
+                if (MYFS_DIR_ISSPARSE(dir)) {
+                    if (vrefcnt(vp) > 1)
+                        myfs_dir_queue(mmp, dir);
+                    else
+                        myfs_dir_compact(dir);
+                }
+                sx_xunlock(&dir->lock);
+            }
+            vput(vp);
+        }
+        mtx_lock(&mmp->dir_lock);
+    }
+    mtx_unlock(&mmp->dir_lock);
+}
+
+/*
+ * Readdir cookies, for the NFS server: room for as many entries as fit in
+ * the caller's buffer, each given the offset just past it.  Freed again if
+ * the readdir fails.
+ */
+static void
+myfs_cookies_alloc(struct vop_readdir_args *ap)
+{
+    if (ap->a_ncookies == NULL)
+        return;
+    *ap->a_ncookies = 0;
+    *ap->a_cookies = malloc(ap->a_uio->uio_resid / GENERIC_MINDIRSIZ *
+        sizeof(uint64_t), M_TEMP, M_WAITOK);
+}
+
+static void
+myfs_cookies_add(struct vop_readdir_args *ap, off_t off)
+{
+    if (ap->a_ncookies != NULL)
+        (*ap->a_cookies)[(*ap->a_ncookies)++] = off;
+}
+
+static void
+myfs_cookies_done(struct vop_readdir_args *ap, int error)
+{
+    if (error == 0 || ap->a_ncookies == NULL)
+        return;
+    free(*ap->a_cookies, M_TEMP);
+    *ap->a_cookies = NULL;
+    *ap->a_ncookies = 0;
+}
+
+/*
+ * Readdir of a read-write directory: "." and ".." at offsets 0 and 1, then
+ * each entry at its slot + 2.  Freed blocks are skipped whole.  Each entry
+ * is copied under the locks, which are dropped for uiomove().
+ */
+static int
+myfs_dir_readdir(struct vop_readdir_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct uio *uio = ap->a_uio;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct myfs_dir *dir = np->dir;
+    struct myfs_dblk *bp;
+    struct myfs_dent *de;
+    struct dirent d;
+    off_t idx, end;
+    int error = 0;
+
+    if (uio->uio_offset < 0)
+        return (EINVAL);
+    myfs_cookies_alloc(ap);
+
+    for (idx = uio->uio_offset;; idx++) {
+        sx_slock(&dir->lock);
+        sx_slock(&dir->blk_lock);
+        end = (off_t)dir->nblks * MYFS_DIRBLK + 2;
+        if (idx >= end) {
+            sx_sunlock(&dir->blk_lock);
+            sx_sunlock(&dir->lock);
+            break;
+        }
+        memset(&d, 0, sizeof(d));
+        if (idx == 0) {
+            d.d_fileno = np->ino;
+            d.d_type = DT_DIR;
+            d.d_namlen = 1;
+            d.d_name[0] = '.';
+        } else if (idx == 1) {
+            d.d_fileno = np->parent;
+            d.d_type = DT_DIR;
+            d.d_namlen = 2;
+            d.d_name[0] = d.d_name[1] = '.';
+        } else {
+            bp = dir->blks[(idx - 2) / MYFS_DIRBLK];
+            de = bp != NULL ? bp->ents[(idx - 2) % MYFS_DIRBLK] : NULL;
+            if (de == NULL) {
+                if (bp == NULL)
+                    idx = rounddown(idx - 2, MYFS_DIRBLK) +
+                        MYFS_DIRBLK + 1;
+                sx_sunlock(&dir->blk_lock);
+                sx_sunlock(&dir->lock);
+                continue;
+            }
+            d.d_fileno = de->ino;
+            d.d_type = de->type;
+            d.d_namlen = de->namelen;
+            memcpy(d.d_name, de->name, de->namelen);
+        }
+        sx_sunlock(&dir->blk_lock);
+        sx_sunlock(&dir->lock);
+        d.d_reclen = GENERIC_DIRSIZ(&d);
+        d.d_off = idx + 1;
+        dirent_terminate(&d);
+        if (d.d_reclen > uio->uio_resid)
+            break;
+        error = uiomove(&d, d.d_reclen, uio);
+        if (error)
+            break;
+        myfs_cookies_add(ap, d.d_off);
+        uio->uio_offset = idx + 1;
+    }
+
+    myfs_cookies_done(ap, error);
+    if (ap->a_eofflag != NULL)
+        *ap->a_eofflag = (idx >= end);
+    return (error);
+}
+
+static void
+myfs_dir_init(struct myfs_mount *mmp)
+{
+    arc4random_buf(mmp->dir_key, sizeof(mmp->dir_key));
+    mtx_init(&mmp->dir_lock, "myfs dirs", NULL, MTX_DEF);
+    TAILQ_INIT(&mmp->dir_sparse);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &mmp->dir_task, 0,
+        myfs_dir_task, mmp);
+}
+
+/* Stop compaction ahead of vflush(), or restart it if that failed. */
+static void
+myfs_dir_stop(struct myfs_mount *mmp, int stop)
+{
+    mtx_lock(&mmp->dir_lock);
+    mmp->dir_dying = stop;
+    if (!stop && !TAILQ_EMPTY(&mmp->dir_sparse))
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->dir_task, hz);
+    mtx_unlock(&mmp->dir_lock);
+    if (!stop)
+        return;
+    while (taskqueue_cancel_timeout(taskqueue_thread, &mmp->dir_task,
+        NULL) != 0)
+        taskqueue_drain_timeout(taskqueue_thread, &mmp->dir_task);
+}
+
+/* Writeback and freeze */
+
+static void
+myfs_wb_task(void *arg, int pending __unused)
+{
+    struct myfs_mount *mmp = arg;
+
+    /* Leave a mount being torn down to its own vflush. */
+    if (vfs_busy(mmp->mp, MBF_NOWAIT) != 0)
+        return;
+    VFS_SYNC(mmp->mp, MNT_NOWAIT);
+    vfs_unbusy(mmp->mp);
+}
+
+/* Start background writeback once dirty data passes myfs_dirty_max. */
+static void
+myfs_wb_check(struct myfs_mount *mmp)
+{
+    if (myfs_pcount_read(&mmp->resv) > (int64_t)myfs_dirty_max)
+        taskqueue_enqueue(taskqueue_thread, &mmp->wb_task);
+}
+
+/*
+ * Freeze the volume.  Dirty data is pushed once before suspending so that
+ * the suspended window only has to cover what was written meanwhile;
+ * vfs_write_suspend() then waits for in-flight writers and blocks new ones
+ * in vn_start_write().
+ */
+static int
+myfs_freeze(struct myfs_mount *mmp, struct thread *td)
+{
+    struct mount *mp = mmp->mp;
+    int error;
+
+    error = priv_check(td, PRIV_VFS_MOUNT);
+    if (error)
+        return (error);
+
+    sx_xlock(&mmp->freeze_lock);
+    if (mmp->frozen) {
+        sx_xunlock(&mmp->freeze_lock);
+        return (EBUSY);
+    }
+
+    VFS_SYNC(mp, MNT_NOWAIT);
+    error = vfs_write_suspend(mp, VS_SKIP_UNMOUNT);
+    if (error) {
+        sx_xunlock(&mmp->freeze_lock);
+        return (error);
+    }
+
+    /* No journal yet: a full sync is the commit point. */
+    myfs_rstat_flush(mmp);
+    error = VFS_SYNC(mp, MNT_WAIT);
+    if (error) {
+        vfs_write_resume(mp, 0);
+        sx_xunlock(&mmp->freeze_lock);
+        return (error);
+    }
+    mmp->frozen = 1;
+    sx_xunlock(&mmp->freeze_lock);
+
+    return (0);
+}
+
+static void
+myfs_thaw_locked(struct myfs_mount *mmp)
+{
+    struct mount *mp = mmp->mp;
+
+    sx_assert(&mmp->freeze_lock, SA_XLOCKED);
+
+    /*
+     * vfs_write_resume() insists on the suspending thread, but thaw is
+     * usually issued by a different process than freeze.  Take over
+     * ownership, as ffs_susp_unsuspend() does.
+     */
+    mp->mnt_susp_owner = curthread;
+    vfs_write_resume(mp, 0);
+    mmp->frozen = 0;
+}
+
+static int
+myfs_thaw(struct myfs_mount *mmp, struct thread *td)
+{
+    int error;
+
+    error = priv_check(td, PRIV_VFS_MOUNT);
+    if (error)
+        return (error);
+
+    sx_xlock(&mmp->freeze_lock);
+    if (!mmp->frozen) {
+        sx_xunlock(&mmp->freeze_lock);
+        return (EINVAL);
+    }
+    myfs_thaw_locked(mmp);
+    sx_xunlock(&mmp->freeze_lock);
+
+    return (0);
+}
+
+/* Devices */
+
+/* Does path name a disk device? */
+static int
+myfs_dev_isdisk(const char *path)
+{
+    struct nameidata nd;
+    int error, isdisk;
+
+    NDINIT(&nd, LOOKUP, FOLLOW | LOCKLEAF, UIO_SYSSPACE, path);
+    if (namei(&nd) != 0)
+        return (0);
+    NDFREE_PNBUF(&nd);
+    isdisk = vn_isdisk_error(nd.ni_vp, &error);
+    vput(nd.ni_vp);
+
+    return (isdisk);
+}
+
+/* Open the disk device at path through GEOM, for writing if wr. */
+static int
+myfs_dev_open(const char *path, int wr, struct myfs_dev *dev)
+{
+    struct nameidata nd;
+    struct vnode *devvp;
+    struct g_consumer *cp;
+    int error;
+
+    NDINIT(&nd, LOOKUP, FOLLOW | LOCKLEAF, UIO_SYSSPACE, path);
+    error = namei(&nd);
+    if (error)
+        return (error);
+    NDFREE_PNBUF(&nd);
+    devvp = nd.ni_vp;
+    if (!vn_isdisk_error(devvp, &error)) {
+        vput(devvp);
+        return (error);
+    }
+
+    g_topology_lock();
+    error = g_vfs_open(devvp, &cp, MYFS_NAME, wr);
+    g_topology_unlock();
+    VOP_UNLOCK(devvp);
+    if (error) {
+        vrele(devvp);
+        return (error);
+    }
+    dev->devvp = devvp;
+    dev->cp = cp;
+    dev->nblocks = cp->provider->mediasize / PAGE_SIZE;
+
+    return (0);
+}
+
+static void
+myfs_dev_close(struct myfs_dev *dev)
+{
+    g_topology_lock();
+    g_vfs_close(dev->cp);
+    g_topology_unlock();
+    vrele(dev->devvp);
+    dev->devvp = NULL;
+    dev->cp = NULL;
+    free(dev->simwp, M_TEMP);
+    dev->simwp = NULL;
+    dev->simzone = 0;
+}
+
+/* Sealed images */
+
+#define B_MYFS_VERIFIED B_FS_FLAG1  /* checksum already matched */
+
+static uint32_t
+myfs_crc32c(const void *buf, size_t len)
+{
+    return (calculate_crc32c(~0U, buf, len) ^ ~0U);
+}
+
+/* Whether block blk of the image is checked against the checksum table. */
+static int
+myfs_img_dup(struct myfs_mount *mmp, daddr_t blk)
+{
+    return (mmp->img_csums != NULL && blk > 0 && blk < mmp->img.csum &&
+        blk != MYFS_IMG_SB_COPY);
+}
+
+/*
+ * Which copy of metadata block blk to read first: one already cached,
+ * else the one with fewer reads in flight, else the one nearer the last
+ * block read.
+ */
+static int
+myfs_img_pick(struct myfs_mount *mmp, daddr_t blk)
+{
+    daddr_t where[2], d[2], head;
+    u_int busy[2];
+    int i;
+
+    where[0] = blk;
+    where[1] = mmp->img.mirror + blk;
+    head = atomic_load_long(&mmp->img_head);
+    for (i = 0; i < 2; i++) {
+        if (incore(mmp->bo, where[i] * btodb(MYFS_IMG_BSIZE)) != NULL)
+            return (i);
+        busy[i] = atomic_load_int(&mmp->img_busy[i]);
+        d[i] = where[i] > head ? where[i] - head : head - where[i];
+    }
+    if (busy[0] != busy[1])
+        return (busy[1] < busy[0]);
+    return (d[1] < d[0]);
+}
+
+/* Overwrite the bad copy at block dst with bp's good data. */
+static void
+myfs_img_fix(struct myfs_mount *mmp, daddr_t dst, struct buf *bp)
+{
+    struct buf *nbp;
+
+    if ((mmp->mnt_flags & MYFS_MNT_REPAIR) == 0)
+        return;
+    nbp = getblk(mmp->devvp, dst * btodb(MYFS_IMG_BSIZE), MYFS_IMG_BSIZE,
+        0, 0, 0);
+    bcopy(bp->b_data, nbp->b_data, MYFS_IMG_BSIZE);
+    nbp->b_flags |= B_MYFS_VERIFIED;
+    if (bwrite(nbp) == 0) {
+        atomic_add_64(&mmp->img_fixed, 1);
+        printf("MYFS: rewrote metadata block %jd\n", (intmax_t)dst);
+    }
+}
+
+/*
+ * Read block blk of the image.  Metadata of MYFS_IMG_F_DUP images comes
+ * from the copy myfs_img_pick() prefers and is checked against the
+ * checksum table; on a read error or mismatch the other copy is tried,
+ * and replaces the bad one if the mount allows repairs.
+ */
+static int
+myfs_img_bread(struct myfs_mount *mmp, daddr_t blk, struct buf **bpp)
+{
+    daddr_t where[2];
+    int copy, error, i;
+
+    if (!myfs_img_dup(mmp, blk))
+        return (bread(mmp->devvp, blk * btodb(MYFS_IMG_BSIZE),
+            MYFS_IMG_BSIZE, NOCRED, bpp));
+
+    where[0] = blk;
+    where[1] = mmp->img.mirror + blk;
+    copy = myfs_img_pick(mmp, blk);
+    for (i = 0; i < 2; i++, copy ^= 1) {
+        atomic_add_int(&mmp->img_busy[copy], 1);
+        error = bread(mmp->devvp, where[copy] * btodb(MYFS_IMG_BSIZE),
+            MYFS_IMG_BSIZE, NOCRED, bpp);
+        atomic_subtract_int(&mmp->img_busy[copy], 1);
+        atomic_store_long(&mmp->img_head, where[copy]);
+        if (error == 0) {
+            if (((*bpp)->b_flags & B_MYFS_VERIFIED) == 0 &&
+                myfs_crc32c((*bpp)->b_data, MYFS_IMG_BSIZE) !=
+                mmp->img_csums[blk]) {
+                (*bpp)->b_flags |= B_INVAL;
+                brelse(*bpp);
+                *bpp = NULL;
+                error = EINTEGRITY;
+            } else {
+                (*bpp)->b_flags |= B_MYFS_VERIFIED;
+                if (i != 0)
+                    myfs_img_fix(mmp, where[copy ^ 1], *bpp);
+                return (0);
+            }
+        }
+        atomic_add_64(&mmp->img_bad, 1);
+        printf("MYFS: metadata block %jd copy %d bad (error %d)\n",
+            (intmax_t)blk, copy, error);
+    }
+    return (error);
+}
+
+/* Read and check the checksum table of a DUP image, from either copy. */
+static int
+myfs_img_csum_load(struct myfs_mount *mmp)
+{
+    struct buf *bp;
+    uint32_t *csums;
+    size_t len;
+    daddr_t base, i, n;
+    int copy, error;
+
+    len = mmp->img.nmeta * sizeof(uint32_t);
+    n = howmany(len, MYFS_IMG_BSIZE);
+    csums = malloc(n * MYFS_IMG_BSIZE, M_TEMP, M_WAITOK);
+    for (copy = 0; copy < 2; copy++) {
+        base = (copy ? mmp->img.mirror : 0) + mmp->img.csum;
+        error = 0;
+        for (i = 0; i < n && error == 0; i++) {
+            error = bread(mmp->devvp, (base + i) * btodb(MYFS_IMG_BSIZE),
+                MYFS_IMG_BSIZE, NOCRED, &bp);
+            if (error == 0) {
+                memcpy((char *)csums + i * MYFS_IMG_BSIZE, bp->b_data,
+                    MYFS_IMG_BSIZE);
+                brelse(bp);
+            }
+        }
+        if (error == 0 && myfs_crc32c(csums, len) == mmp->img.csum_crc) {
+            for (i = 0; i < mmp->img.nmeta; i++)
+                csums[i] = le32toh(csums[i]);
+            mmp->img_csums = csums;
+            return (0);
+        }
+        printf("MYFS: checksum table copy %d bad\n", copy);
+    }
+    free(csums, M_TEMP);
+    return (EINTEGRITY);
+}
+
+/* Copy len bytes at byte offset off of the image into buf. */
+static int
+myfs_img_pread(struct myfs_mount *mmp, off_t off, void *buf, size_t len)
+{
+    struct buf *bp;
+    size_t boff, n;
+    int error;
+
+    while (len > 0) {
+        boff = off % MYFS_IMG_BSIZE;
+        n = MIN(len, MYFS_IMG_BSIZE - boff);
+        error = myfs_img_bread(mmp, off / MYFS_IMG_BSIZE, &bp);
+        if (error)
+            return (error);
+        memcpy(buf, (char *)bp->b_data + boff, n);
+        brelse(bp);
+        buf = (char *)buf + n;
+        off += n;
+        len -= n;
+    }
+    return (0);
+}
+
+static int
+myfs_img_read_dinode(struct myfs_mount *mmp, ino_t ino, struct myfs_meta *m)
+{
+    struct myfs_img_inode di;
+    int error;
+
+    if (ino < 1 || ino > mmp->img.ninodes)
+        return (ESTALE);
+    error = myfs_img_pread(mmp, mmp->img.itable * MYFS_IMG_BSIZE +
+        (ino - 1) * sizeof(di), &di, sizeof(di));
+    if (error)
+        return (error);
+
+    memset(m, 0, sizeof(*m));
+    m->ino = ino;
+    m->gen = mmp->img.gen;
+    m->mode = le16toh(di.mode);
+    m->nlink = le32toh(di.nlink);
+    m->uid = le32toh(di.uid);
+    m->gid = le32toh(di.gid);
+    m->size = le64toh(di.size);
+    m->mtime.tv_sec = le64toh(di.mtime);
+    m->mtime.tv_nsec = le32toh(di.mtime_nsec);
+    m->ctime.tv_sec = le64toh(di.ctime);
+    m->ctime.tv_nsec = le32toh(di.ctime_nsec);
+    m->atime = m->mtime;
+    m->daddr = le64toh(di.daddr);
+    m->dflags = le16toh(di.flags);
+    if (m->daddr >= mmp->img.nblocks)
+        return (EINTEGRITY);
+
+    if (m->dflags & MYFS_IMG_I_CRYPT) {
+        if ((mmp->img.flags & MYFS_IMG_F_CRYPT) == 0 ||
+            (m->dflags & MYFS_IMG_I_ZLIB) ||
+            le64toh(di.crypt) >= mmp->img.ncrypt)
+            return (EINTEGRITY);
+        error = myfs_img_pread(mmp, mmp->img.crypt * MYFS_IMG_BSIZE +
+            le64toh(di.crypt) * sizeof(m->crypt), &m->crypt,
+            sizeof(m->crypt));
+        if (error)
+            return (error);
+    }
+
+    return (0);
+}
+
+static int
+myfs_img_dirent(struct myfs_mount *mmp, struct myfs_node *dnp, uint32_t i,
+    struct myfs_img_dirent *de, char *name)
+{
+    off_t base = dnp->daddr * MYFS_IMG_BSIZE;
+    int error;
+
+    error = myfs_img_pread(mmp, base + sizeof(struct myfs_img_dirhdr) +
+        i * sizeof(*de), de, sizeof(*de));
+    if (error)
+        return (error);
+    if (le16toh(de->namelen) > NAME_MAX ||
+        le32toh(de->name_off) + le16toh(de->namelen) > (uint64_t)dnp->size)
+        return (EINTEGRITY);
+    return (myfs_img_pread(mmp, base + le32toh(de->name_off), name,
+        le16toh(de->namelen)));
+}
+
+static void
+myfs_bloom_hash(struct myfs_mount *mmp, const char *name, size_t len,
+    uint32_t *h1, uint32_t *h2)
+{
+    uint64_t h;
+
+    h = myfs_siphash13(mmp->bloom_key, name, len);
+    *h1 = (uint32_t)h;
+    *h2 = (uint32_t)(h >> 32) | 1;
+}
+
+static void
+myfs_bloom_add(struct myfs_mount *mmp, struct myfs_bloom *bf,
+    const char *name, size_t len)
+{
+    uint32_t h1, h2, bit;
+    int i;
+
+    myfs_bloom_hash(mmp, name, len, &h1, &h2);
+    for (i = 0; i < MYFS_BLOOM_PROBES; i++) {
+        bit = (h1 + i * h2) & bf->mask;
+        bf->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+/* Returns ENOENT if name is certainly not in dnp. */
+static int
+myfs_bloom_test(struct myfs_mount *mmp, struct myfs_node *dnp,
+    const char *name, size_t len)
+{
+    struct myfs_bloom *bf;
+    uint32_t h1, h2, bit;
+    int i;
+
+    bf = (struct myfs_bloom *)atomic_load_acq_ptr(
+        (volatile uintptr_t *)&dnp->bloom);
+    if (bf == NULL)
+        return (0);
+    myfs_bloom_hash(mmp, name, len, &h1, &h2);
+    for (i = 0; i < MYFS_BLOOM_PROBES; i++) {
+        bit = (h1 + i * h2) & bf->mask;
+        if ((bf->bits[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
+            counter_u64_add(myfs_st_bloom_rejects, 1);
+            return (ENOENT);
+        }
+    }
+    return (0);
+}
+
+/*
+ * Count a failed lookup in dnp, which has count entries.  The miss that
+ * reaches vfs.myfs.bloom_misses builds the filter from the index keys,
+ * folded in case-insensitive directories; the builder is the only
+ * writer, and readers under the shared vnode lock see either no filter
+ * or a complete one.
+ */
+static void
+myfs_bloom_miss(struct myfs_mount *mmp, struct myfs_node *dnp,
+    uint32_t count)
+{
+    struct myfs_img_dirent de;
+    struct myfs_bloom *bf;
+    char name[NAME_MAX];
+    uint32_t i, nbits;
+    size_t len;
+
+    if (dnp->bloom != NULL || count < myfs_bloom_min ||
+        atomic_fetchadd_int(&dnp->bloom_misses, 1) + 1 != myfs_bloom_misses)
+        return;
+
+    for (nbits = 64; nbits < (uint64_t)count * MYFS_BLOOM_BITS &&
+        nbits < MYFS_BLOOM_MAXBITS; nbits <<= 1)
+        continue;
+    bf = malloc(sizeof(*bf) + nbits / 8, M_TEMP, M_WAITOK | M_ZERO);
+    bf->mask = nbits - 1;
+    for (i = 0; i < count; i++) {
+        if (myfs_img_dirent(mmp, dnp, i, &de, name) != 0) {
+            free(bf, M_TEMP);
+            atomic_store_int(&dnp->bloom_misses, 0);
+            return;
+        }
+        len = le16toh(de.namelen);
+        if (dnp->dflags & MYFS_IMG_I_CASEFOLD)
+            len = myfs_fold(name, len, name);
+        myfs_bloom_add(mmp, bf, name, len);
+    }
+
+    /* Lookups read the filter without a lock: publish it filled in. */
+    atomic_store_rel_ptr((volatile uintptr_t *)&dnp->bloom, (uintptr_t)bf);
+    counter_u64_add(myfs_st_bloom_builds, 1);
+}
+
+/* Binary search dnp's sorted entries for name. */
+static int
+myfs_img_dirlookup(struct myfs_mount *mmp, struct myfs_node *dnp,
+    const char *name, size_t namelen, ino_t *inop)
+{
+    struct myfs_img_dirhdr hdr;
+    struct myfs_img_dirent de;
+    char ename[NAME_MAX];
+    uint32_t lo, hi, mid;
+    size_t elen;
+    int cmp, error;
+
+    if (myfs_bloom_test(mmp, dnp, name, namelen) != 0)
+        return (ENOENT);
+    error = myfs_img_pread(mmp, dnp->daddr * MYFS_IMG_BSIZE, &hdr,
+        sizeof(hdr));
+    if (error)
+        return (error);
+
+    lo = 0;
+    hi = le32toh(hdr.count);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        error = myfs_img_dirent(mmp, dnp, mid, &de, ename);
+        if (error)
+            return (error);
+        elen = le16toh(de.namelen);
+        cmp = memcmp(name, ename, MIN(namelen, elen));
+        if (cmp == 0)
+            cmp = (namelen > elen) - (namelen < elen);
+        if (cmp == 0) {
+            *inop = le64toh(de.ino);
+            return (0);
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    myfs_bloom_miss(mmp, dnp, le32toh(hdr.count));
+    return (ENOENT);
+}
+
+/*
+ * Case-insensitive directories: binary search the hash index for the
+ * first entry with the folded name's hash, then compare folded names
+ * along the run of equal hashes.
+ */
+static int
+myfs_img_foldlookup(struct myfs_mount *mmp, struct myfs_node *dnp,
+    const char *name, size_t namelen, ino_t *inop)
+{
+    struct myfs_img_dirhdr hdr;
+    struct myfs_img_dirhash dh;
+    struct myfs_img_dirent de;
+    char fname[NAME_MAX], ename[NAME_MAX];
+    uint32_t lo, hi, mid, count, hash;
+    size_t flen, elen;
+    off_t base;
+    int error;
+
+    flen = myfs_fold(name, namelen, fname);
+    if (myfs_bloom_test(mmp, dnp, fname, flen) != 0)
+        return (ENOENT);
+    error = myfs_img_pread(mmp, dnp->daddr * MYFS_IMG_BSIZE, &hdr,
+        sizeof(hdr));
+    if (error)
+        return (error);
+    count = le32toh(hdr.count);
+    if (sizeof(hdr) + (off_t)count * (sizeof(de) + sizeof(dh)) > dnp->size)
+        return (EINTEGRITY);
+    base = dnp->daddr * MYFS_IMG_BSIZE + sizeof(hdr) + count * sizeof(de);
+
+    hash = myfs_fold_hash((mmp->img.flags & MYFS_IMG_F_HASHKEY) ?
+        mmp->img.hash_key : NULL, fname, flen);
+    lo = 0;
+    hi = count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        error = myfs_img_pread(mmp, base + mid * sizeof(dh), &dh,
+            sizeof(dh));
+        if (error)
+            return (error);
+        if (le32toh(dh.hash) < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < count; lo++) {
+        error = myfs_img_pread(mmp, base + lo * sizeof(dh), &dh, sizeof(dh));
+        if (error)
+            return (error);
+        if (le32toh(dh.hash) != hash)
+            break;
+        if (le32toh(dh.idx) >= count)
+            return (EINTEGRITY);
+        error = myfs_img_dirent(mmp, dnp, le32toh(dh.idx), &de, ename);
+        if (error)
+            return (error);
+        elen = myfs_fold(ename, le16toh(de.namelen), ename);
+        if (elen == flen && memcmp(ename, fname, flen) == 0) {
+            *inop = le64toh(de.ino);
+            return (0);
+        }
+    }
+    myfs_bloom_miss(mmp, dnp, count);
+    return (ENOENT);
+}
+
+static void *
+myfs_zalloc(void *opaque, u_int items, u_int size)
+{
+    return (malloc((size_t)items * size, M_TEMP, M_NOWAIT));
+}
+
+static void
+myfs_zfree(void *opaque, void *ptr)
+{
+    free(ptr, M_TEMP);
+}
+
+/* Inflate one compressed block of exactly dstlen bytes. */
+static int
+myfs_img_inflate(void *src, size_t srclen, void *dst, size_t dstlen)
+{
+    z_stream zs;
+    int zerr;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = myfs_zalloc;
+    zs.zfree = myfs_zfree;
+    if (inflateInit(&zs) != Z_OK)
+        return (ENOMEM);
+    zs.next_in = src;
+    zs.avail_in = srclen;
+    zs.next_out = dst;
+    zs.avail_out = dstlen;
+    zerr = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    return (zerr == Z_STREAM_END && zs.total_out == dstlen ? 0 : EINTEGRITY);
+}
+
+/* Read logical block lbn of a compressed file into buf. */
+static int
+myfs_img_zblock(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn,
+    char *buf, size_t blen)
+{
+    uint32_t offs[2];
+    off_t base, nblocks;
+    size_t clen;
+    char *cbuf;
+    int error;
+
+    nblocks = howmany(np->size, MYFS_IMG_BSIZE);
+    base = np->daddr * MYFS_IMG_BSIZE;
+    error = myfs_img_pread(mmp, base + lbn * sizeof(uint32_t), offs,
+        sizeof(offs));
+    if (error)
+        return (error);
+    offs[0] = le32toh(offs[0]);
+    offs[1] = le32toh(offs[1]);
+    if (offs[1] < offs[0] || offs[1] - offs[0] > blen)
+        return (EINTEGRITY);
+
+    base += (nblocks + 1) * sizeof(uint32_t) + offs[0];
+    clen = offs[1] - offs[0];
+    if (clen == blen)
+        return (myfs_img_pread(mmp, base, buf, blen));
+
+    cbuf = malloc(clen, M_TEMP, M_WAITOK);
+    error = myfs_img_pread(mmp, base, cbuf, clen);
+    if (error == 0)
+        error = myfs_img_inflate(cbuf, clen, buf, blen);
+    free(cbuf, M_TEMP);
+
+    return (error);
+}
+
+/*
+ * Decode the superblock at block blk into mmp->img.  Returns ENOENT if
+ * there is none, and EINTEGRITY if a DUP superblock fails its checksum.
+ */
+static int
+myfs_img_sb_load(struct myfs_mount *mmp, daddr_t blk)
+{
+    struct myfs_img_sb *sb, copy;
+    struct buf *bp;
+    int error;
+
+    error = myfs_img_bread(mmp, blk, &bp);
+    if (error)
+        return (error);
+    sb = (struct myfs_img_sb *)bp->b_data;
+    mmp->img.magic = le32toh(sb->magic);
+    mmp->img.version = le32toh(sb->version);
+    mmp->img.bsize = le32toh(sb->bsize);
+    mmp->img.flags = le32toh(sb->flags);
+    mmp->img.nblocks = le64toh(sb->nblocks);
+    mmp->img.ninodes = le64toh(sb->ninodes);
+    mmp->img.itable = le64toh(sb->itable);
+    mmp->img.root = le64toh(sb->root);
+    mmp->img.ctime = le64toh(sb->ctime);
+    mmp->img.nmeta = le64toh(sb->nmeta);
+    mmp->img.mirror = le64toh(sb->mirror);
+    mmp->img.csum = le64toh(sb->csum);
+    mmp->img.csum_crc = le32toh(sb->csum_crc);
+    mmp->img.sb_crc = le32toh(sb->sb_crc);
+    mmp->img.crypt = le64toh(sb->crypt);
+    mmp->img.ncrypt = le64toh(sb->ncrypt);
+    memcpy(mmp->img.hash_key, sb->hash_key, sizeof(mmp->img.hash_key));
+    mmp->img.gen = le32toh(sb->gen);
+    copy = *sb;
+    brelse(bp);
+
+    if (mmp->img.magic != MYFS_IMG_MAGIC)
+        return (ENOENT);
+    if (mmp->img.flags & MYFS_IMG_F_DUP) {
+        copy.sb_crc = 0;
+        if (myfs_crc32c(&copy, sizeof(copy)) != mmp->img.sb_crc)
+            return (EINTEGRITY);
+    }
+    return (0);
+}
+
+/*
+ * Look for a sealed image on the device named by from.  Returns 0 with
+ * mmp->devvp left NULL if the device holds something else.
+ */
+static int
+myfs_img_mount(struct mount *mp, struct myfs_mount *mmp, const char *from)
+{
+    struct myfs_dev dev;
+    int error;
+
+    /*
+     * mount(8) always passes "from", and tiered mounts name their devices
+     * in options, so "from" is often "none" or some other non-disk.  Only
+     * a disk can hold an image, and failing to open one only means there
+     * is no image to serve: fall back to the normal mount.
+     */
+    if (!myfs_dev_isdisk(from))
+        return (0);
+
+    /* Repairs need write access to the device, not to the filesystem. */
+    vfs_flagopt(mp->mnt_optnew, "repair", &mmp->mnt_flags, MYFS_MNT_REPAIR);
+    error = myfs_dev_open(from, (mmp->mnt_flags & MYFS_MNT_REPAIR) != 0,
+        &dev);
+    if (error) {
+        printf("MYFS: %s: cannot probe for a sealed image, error %d\n",
+            from, error);
+        return (0);
+    }
+    mmp->devvp = dev.devvp;
+    mmp->cp = dev.cp;
+    mmp->bo = &dev.devvp->v_bufobj;
+
+    /* A DUP image whose first superblock is unreadable has a second. */
+    error = myfs_img_sb_load(mmp, 0);
+    if (error != 0 && myfs_img_sb_load(mmp, MYFS_IMG_SB_COPY) == 0 &&
+        (mmp->img.flags & MYFS_IMG_F_DUP)) {
+        printf("MYFS: %s: using the second superblock\n", from);
+        error = 0;
+    }
+    if (error != 0 && error != EINTEGRITY) {
+        /* No magic, or no readable superblock: not a sealed image. */
+        if (error != ENOENT)
+            printf("MYFS: %s: cannot read superblock, error %d\n",
+                from, error);
+        error = 0;
+        goto out;
+    }
+    if (error)
+        goto out;
+
+    if (mmp->img.version != MYFS_IMG_VERSION ||
+        mmp->img.bsize != MYFS_IMG_BSIZE ||
+        mmp->img.itable >= mmp->img.nblocks ||
+        mmp->img.root < 1 || mmp->img.root > mmp->img.ninodes ||
+        ((mmp->img.flags & MYFS_IMG_F_DUP) &&
+        (mmp->img.itable <= MYFS_IMG_SB_COPY ||
+        mmp->img.csum <= mmp->img.itable ||
+        mmp->img.csum >= mmp->img.nmeta ||
+        mmp->img.mirror < mmp->img.nmeta ||
+        mmp->img.mirror + mmp->img.nmeta > mmp->img.nblocks)) ||
+        ((mmp->img.flags & MYFS_IMG_F_CRYPT) &&
+        (mmp->img.crypt <= mmp->img.itable ||
+        mmp->img.ncrypt > mmp->img.ninodes ||
+        mmp->img.crypt + howmany(mmp->img.ncrypt *
+        sizeof(struct myfs_img_crypt), MYFS_IMG_BSIZE) > mmp->img.nblocks))) {
+        printf("MYFS: %s: bad sealed image superblock\n", from);
+        error = EINVAL;
+        goto out;
+    }
+    if ((mmp->mnt_flags & MYFS_MNT_RDONLY) == 0) {
+        error = EROFS;
+        goto out;
+    }
+    if (mmp->img.flags & MYFS_IMG_F_DUP) {
+        error = myfs_img_csum_load(mmp);
+        if (error)
+            goto out;
+    }
+
+    mmp->mnt_flags |= MYFS_MNT_SEALED;
+    mmp->vops = &myfs_img_vops;
+    arc4random_buf(mmp->bloom_key, sizeof(mmp->bloom_key));
+    mmp->sb.total_blocks = mmp->img.nblocks;
+    mmp->sb.free_blocks = 0;
+    return (0);
+
+out:
+    myfs_dev_close(&dev);
+    mmp->devvp = NULL;
+    mmp->cp = NULL;
+    mmp->bo = NULL;
+    return (error);
+}
+
+static void
+myfs_img_unmount(struct myfs_mount *mmp)
+{
+    struct myfs_dev dev = { .devvp = mmp->devvp, .cp = mmp->cp };
+
+    if (mmp->img_bad != 0)
+        printf("MYFS: %ju bad metadata copies, %ju rewritten\n",
+            (uintmax_t)mmp->img_bad, (uintmax_t)mmp->img_fixed);
+    free(mmp->img_csums, M_TEMP);
+    mmp->img_csums = NULL;
+
+    myfs_dev_close(&dev);
+    mmp->devvp = NULL;
+}
+
+/*
+ * Encrypted images.  Master keys are added per mount; each encrypted inode
+ * gets its own AES-256-XTS key for data and AES-256-CBC key for names,
+ * derived from the master key and the inode's nonce, and opencrypto
+ * sessions for them, so accelerated drivers such as aesni(4) are picked
+ * up wherever present.  Data is decrypted into private
+ * buffers after it is read, so the device's buffers and the read cache
+ * device only ever hold ciphertext.
+ */
+
+static struct mtx myfs_crypt_mtx;
+MTX_SYSINIT(myfs_crypt, &myfs_crypt_mtx, "myfs crypto", MTX_DEF);
+
+/* HMAC-SHA512 with a key of at most one block. */
+static void
+myfs_hmac_sha512(const uint8_t *key, size_t keylen, const void *msg,
+    size_t len, uint8_t *out)
+{
+    uint8_t pad[SHA512_BLOCK_LENGTH];
+    SHA512_CTX ctx;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, keylen);
+    for (i = 0; i < SHA512_BLOCK_LENGTH; i++)
+        pad[i] ^= 0x36;
+    SHA512_Init(&ctx);
+    SHA512_Update(&ctx, pad, sizeof(pad));
+    SHA512_Update(&ctx, msg, len);
+    SHA512_Final(out, &ctx);
+
+    for (i = 0; i < SHA512_BLOCK_LENGTH; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    SHA512_Init(&ctx);
+    SHA512_Update(&ctx, pad, sizeof(pad));
+    SHA512_Update(&ctx, out, SHA512_DIGEST_LENGTH);
+    SHA512_Final(out, &ctx);
+
+    explicit_bzero(pad, sizeof(pad));
+    explicit_bzero(&ctx, sizeof(ctx));
+}
+
+/* First output block of HKDF-Expand, see myfs_image.h for the info. */
+static void
+myfs_hkdf_expand(const uint8_t *prk, uint8_t what, const uint8_t *nonce,
+    uint8_t *out)
+{
+    uint8_t info[4 + 1 + MYFS_IMG_NONCE_SIZE + 1];
+    size_t len;
+
+    memcpy(info, "myfs", 4);
+    len = 4;
+    info[len++] = what;
+    if (nonce != NULL) {
+        memcpy(info + len, nonce, MYFS_IMG_NONCE_SIZE);
+        len += MYFS_IMG_NONCE_SIZE;
+    }
+    info[len++] = 1;
+    myfs_hmac_sha512(prk, SHA512_DIGEST_LENGTH, info, len, out);
+}
+
+static void
+myfs_mkey_free(struct myfs_mkey *mk)
+{
+    explicit_bzero(mk, sizeof(*mk));
+    free(mk, M_TEMP);
+}
+
+static void
+myfs_ckeys_free(struct myfs_ckeys *ck)
+{
+    if (ck->data != NULL)
+        crypto_freesession(ck->data);
+    if (ck->names != NULL)
+        crypto_freesession(ck->names);
+    explicit_bzero(ck, sizeof(*ck));
+    free(ck, M_TEMP);
+}
+
+static int
+myfs_ioc_addkey(struct myfs_mount *mmp, struct thread *td,
+    struct myfs_key_args *ka)
+{
+    uint8_t salt[SHA512_DIGEST_LENGTH], okm[SHA512_DIGEST_LENGTH];
+    struct myfs_mkey *mk, *old;
+    int error;
+
+    error = priv_check(td, PRIV_VFS_MOUNT);
+    if (error)
+        return (error);
+
+    /* HKDF-Extract without a salt, then the identifier. */
+    mk = malloc(sizeof(*mk), M_TEMP, M_WAITOK | M_ZERO);
+    memset(salt, 0, sizeof(salt));
+    myfs_hmac_sha512(salt, sizeof(salt), ka->key, sizeof(ka->key), mk->prk);
+    explicit_bzero(ka->key, sizeof(ka->key));
+    myfs_hkdf_expand(mk->prk, MYFS_IMG_HKDF_KEYID, NULL, okm);
+    memcpy(mk->id, okm, sizeof(mk->id));
+    memcpy(ka->id, mk->id, sizeof(ka->id));
+    explicit_bzero(okm, sizeof(okm));
+
+    mtx_lock(&mmp->key_lock);
+    LIST_FOREACH(old, &mmp->keys, link) {
+        if (memcmp(old->id, mk->id, sizeof(mk->id)) == 0)
+            break;
+    }
+    if (old == NULL) {
+        LIST_INSERT_HEAD(&mmp->keys, mk, link);
+        mk = NULL;
+    }
+    mtx_unlock(&mmp->key_lock);
+
+    if (mk != NULL)
+        myfs_mkey_free(mk);
+    return (0);
+}
+
+/*
+ * Forget a master key, then every per-file key derived from it.  Readers
+ * hold the vnode lock while they use a session, so taking it exclusively
+ * is enough to free one; plaintext pages and names go with it.
+ */
+static int
+myfs_ioc_rmkey(struct myfs_mount *mmp, struct thread *td,
+    struct myfs_key_args *ka)
+{
+    struct mount *mp = mmp->mp;
+    struct myfs_mkey *mk;
+    struct myfs_node *np;
+    struct vnode *vp, *mvp;
+    int error;
+
+    error = priv_check(td, PRIV_VFS_MOUNT);
+    if (error)
+        return (error);
+
+    mtx_lock(&mmp->key_lock);
+    LIST_FOREACH(mk, &mmp->keys, link) {
+        if (memcmp(mk->id, ka->id, sizeof(mk->id)) == 0)
+            break;
+    }
+    if (mk != NULL) {
+        LIST_REMOVE(mk, link);
+        mmp->key_gen++;
+    }
+    mtx_unlock(&mmp->key_lock);
+    if (mk == NULL)
+        return (ENOENT);
+    myfs_mkey_free(mk);
+
+    MNT_VNODE_FOREACH_ALL(vp, mp, mvp) {
+        np = (struct myfs_node *)vp->v_data;
+        if (np == NULL || np->crypt_keys == NULL ||
+            memcmp(np->crypt.key_id, ka->id, sizeof(ka->id)) != 0) {
+            VI_UNLOCK(vp);
+            continue;
+        }
+        if (vget(vp, LK_EXCLUSIVE | LK_INTERLOCK) != 0)
+            continue;
+        if (np->crypt_keys != NULL) {
+            myfs_ckeys_free(np->crypt_keys);
+            np->crypt_keys = NULL;
+        }
+        if (vp->v_type == VREG)
+            vn_pages_remove(vp, 0, 0);
+        vput(vp);
+    }
+    cache_purgevfs(mp);
+
+    return (0);
+}
+
+static int
+myfs_ioc_getpolicy(struct vnode *vp, struct myfs_policy_args *pa)
+{
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+
+    if ((np->dflags & MYFS_IMG_I_CRYPT) == 0)
+        return (ENOATTR);
+    memset(pa, 0, sizeof(*pa));
+    pa->version = np->crypt.version;
+    pa->contents_mode = np->crypt.contents_mode;
+    pa->names_mode = np->crypt.names_mode;
+    pa->flags = np->crypt.flags;
+    memcpy(pa->key_id, np->crypt.key_id, sizeof(pa->key_id));
+    return (0);
+}
+
+/*
+ * The sessions for np's per-file keys, set up on first use.  Fails with
+ * EACCES while the master key is missing.  Sessions derived from a key
+ * that is removed meanwhile are thrown away rather than installed.
+ */
+static int
+myfs_crypt_session(struct myfs_mount *mmp, struct myfs_node *np,
+    struct myfs_ckeys **ckp)
+{
+    struct crypto_session_params csp;
+    uint8_t prk[SHA512_DIGEST_LENGTH], key[SHA512_DIGEST_LENGTH];
+    uint8_t nkey[SHA512_DIGEST_LENGTH];
+    struct myfs_mkey *mk;
+    struct myfs_ckeys *ck;
+    u_int gen;
+    int error;
+
+    if (np->crypt.version != MYFS_IMG_CRYPT_V1 ||
+        np->crypt.contents_mode != MYFS_IMG_CRYPT_AES_256_XTS ||
+        np->crypt.names_mode != MYFS_IMG_CRYPT_AES_256_CBC)
+        return (EOPNOTSUPP);
+
+    for (;;) {
+        ck = atomic_load_ptr(&np->crypt_keys);
+        if (ck != NULL) {
+            *ckp = ck;
+            return (0);
+        }
+
+        mtx_lock(&mmp->key_lock);
+        LIST_FOREACH(mk, &mmp->keys, link) {
+            if (memcmp(mk->id, np->crypt.key_id, sizeof(mk->id)) == 0)
+                break;
+        }
+        if (mk != NULL)
+            memcpy(prk, mk->prk, sizeof(prk));
+        gen = mmp->key_gen;
+        mtx_unlock(&mmp->key_lock);
+        if (mk == NULL)
+            return (EACCES);
+
+        myfs_hkdf_expand(prk, MYFS_IMG_HKDF_FILEKEY, np->crypt.nonce, key);
+        myfs_hkdf_expand(prk, MYFS_IMG_HKDF_NAMEKEY, np->crypt.nonce, nkey);
+        ck = malloc(sizeof(*ck), M_TEMP, M_WAITOK | M_ZERO);
+        memset(&csp, 0, sizeof(csp));
+        csp.csp_mode = CSP_MODE_CIPHER;
+        csp.csp_cipher_alg = CRYPTO_AES_XTS;
+        csp.csp_cipher_klen = MYFS_IMG_KEY_SIZE;
+        csp.csp_cipher_key = key;
+        csp.csp_ivlen = AES_XTS_IV_LEN;
+        error = crypto_newsession(&ck->data, &csp,
+            CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE);
+        if (error == 0) {
+            csp.csp_cipher_alg = CRYPTO_AES_CBC;
+            csp.csp_cipher_klen = MYFS_IMG_NAMEKEY_SIZE;
+            csp.csp_cipher_key = nkey;
+            csp.csp_ivlen = AES_BLOCK_LEN;
+            error = crypto_newsession(&ck->names, &csp,
+                CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE);
+        }
+        memcpy(ck->iv, nkey + MYFS_IMG_NAMEKEY_SIZE, sizeof(ck->iv));
+        explicit_bzero(prk, sizeof(prk));
+        explicit_bzero(key, sizeof(key));
+        explicit_bzero(nkey, sizeof(nkey));
+        if (error) {
+            myfs_ckeys_free(ck);
+            return (error);
+        }
+
+        mtx_lock(&np->ext_lock);
+        mtx_lock(&mmp->key_lock);
+        if (gen == mmp->key_gen && np->crypt_keys == NULL) {
+            np->crypt_keys = ck;
+            ck = NULL;
+        }
+        mtx_unlock(&mmp->key_lock);
+        mtx_unlock(&np->ext_lock);
+        if (ck != NULL)
+            myfs_ckeys_free(ck);
+    }
+}
+
+static int
+myfs_crypt_done(struct cryptop *crp)
+{
+    mtx_lock(&myfs_crypt_mtx);
+    *(int *)crp->crp_opaque = 1;
+    wakeup(crp);
+    mtx_unlock(&myfs_crypt_mtx);
+    return (0);
+}
+
+/*
+ * Decrypt (or encrypt) len bytes in place with iv, as one data unit for
+ * XTS.  aesni(4) and the software driver complete inside
+ * crypto_dispatch(); anything else is waited for.
+ */
+static int
+myfs_crypt_run(crypto_session_t sid, int op, void *buf, size_t len,
+    const uint8_t *iv, size_t ivlen)
+{
+    struct cryptop *crp;
+    int done, error;
+
+    crp = crypto_getreq(sid, M_WAITOK);
+    crp->crp_op = op;
+    crp->crp_flags = CRYPTO_F_CBIFSYNC | CRYPTO_F_IV_SEPARATE;
+    crypto_use_buf(crp, buf, len);
+    crp->crp_payload_length = len;
+    memcpy(crp->crp_iv, iv, ivlen);
+    crp->crp_callback = myfs_crypt_done;
+    crp->crp_opaque = &done;
+
+    for (;;) {
+        done = 0;
+        error = crypto_dispatch(crp);
+        if (error)
+            break;
+        mtx_lock(&myfs_crypt_mtx);
+        while (!done)
+            mtx_sleep(crp, &myfs_crypt_mtx, 0, "myfscr", 0);
+        mtx_unlock(&myfs_crypt_mtx);
+        error = crp->crp_etype;
+        if (error != EAGAIN)
+            break;
+        /* The session moved to another driver; resubmit. */
+        crp->crp_etype = 0;
+        crp->crp_flags &= ~CRYPTO_F_DONE;
+    }
+    crypto_freereq(crp);
+
+    return (error);
+}
+
+/* Decrypt block lbn of an encrypted file in place. */
+static int
+myfs_crypt_block(struct myfs_ckeys *ck, void *buf, daddr_t lbn)
+{
+    uint8_t tweak[AES_XTS_IV_LEN];
+
+    le64enc(tweak, lbn);
+    return (myfs_crypt_run(ck->data, CRYPTO_OP_DECRYPT, buf, MYFS_IMG_BSIZE,
+        tweak, sizeof(tweak)));
+}
+
+/* Encrypt a name for lookup in an encrypted directory. */
+static int
+myfs_crypt_name(struct myfs_ckeys *ck, const char *name, size_t len,
+    char *out, size_t *outlen)
+{
+    if (len > MYFS_IMG_CRYPT_NAMEMAX)
+        return (ENOENT);
+    *outlen = roundup(MAX(len, 1), MYFS_IMG_CRYPT_PAD);
+    memset(out, 0, *outlen);
+    memcpy(out, name, len);
+    return (myfs_crypt_run(ck->names, CRYPTO_OP_ENCRYPT, out, *outlen,
+        ck->iv, sizeof(ck->iv)));
+}
+
+/* Decrypt a padded name or symlink target in place; returns its length. */
+static int
+myfs_crypt_unpad(struct myfs_ckeys *ck, char *buf, size_t len,
+    size_t *outlen)
+{
+    int error;
+
+    if (len == 0 || len % MYFS_IMG_CRYPT_PAD != 0)
+        return (EINTEGRITY);
+    error = myfs_crypt_run(ck->names, CRYPTO_OP_DECRYPT, buf, len, ck->iv,
+        sizeof(ck->iv));
+    if (error)
+        return (error);
+    *outlen = strnlen(buf, len);
+    return (0);
+}
+
+/* Tiered storage */
+
+static int
+myfs_ext_cmp(struct myfs_extent *a, struct myfs_extent *b)
+{
+    if (a->lbn != b->lbn)
+        return (a->lbn < b->lbn ? -1 : 1);
+    return (0);
+}
+
+RB_GENERATE_STATIC(myfs_extmap, myfs_extent, link, myfs_ext_cmp);
+
+/* The first extent of np that ends after lbn, if any. */
+static struct myfs_extent *
+myfs_ext_first(struct myfs_node *np, daddr_t lbn)
+{
+    struct myfs_extent key, *ep, *prev;
+
+    key.lbn = lbn;
+    ep = RB_NFIND(myfs_extmap, &np->extents, &key);
+    if (ep != NULL)
+        prev = RB_PREV(myfs_extmap, &np->extents, ep);
+    else
+        prev = RB_MAX(myfs_extmap, &np->extents);
+    if (prev != NULL && prev->lbn + prev->len > lbn)
+        return (prev);
+    return (ep);
+}
+
+/*
+ * Zone commands for d.  A device mounted with zonesim is emulated as a
+ * host-managed drive instead, zone 0 conventional and the rest sequential,
+ * all empty at mount.  Its write pointers are kept in simwp and enforced
+ * by myfs_zone_sim(), so zoned placement and the cleaner can be run over
+ * md(4) devices.
+ */
+static int
+myfs_zone_cmd(struct myfs_dev *d, struct disk_zone_args *za)
+{
+    struct disk_zone_rep_entry *ep;
+    u_int ssize, i;
+    daddr_t z, nz;
+
+    if (d->simwp == NULL)
+        return (g_io_zonecmd(za, d->cp));
+
+    ssize = d->cp->provider->sectorsize;
+    nz = d->nblocks / d->simzone;
+    switch (za->zone_cmd) {
+    case DISK_ZONE_GET_PARAMS:
+        za->zone_params.disk_params.zone_mode = DISK_ZONE_MODE_HOST_MANAGED;
+        return (0);
+    case DISK_ZONE_REPORT_ZONES:
+        z = za->zone_params.report.starting_id * ssize / PAGE_SIZE /
+            d->simzone;
+        for (i = 0; i < za->zone_params.report.entries_allocated &&
+            z < nz; i++, z++) {
+            ep = &za->zone_params.report.entries[i];
+            bzero(ep, sizeof(*ep));
+            ep->zone_start_lba = z * d->simzone * PAGE_SIZE / ssize;
+            ep->zone_length = d->simzone * PAGE_SIZE / ssize;
+            if (z == 0) {
+                ep->zone_type = DISK_ZONE_TYPE_CONVENTIONAL;
+                ep->zone_condition = DISK_ZONE_COND_NOWP;
+                continue;
+            }
+            ep->zone_type = DISK_ZONE_TYPE_SEQ_REQUIRED;
+            ep->write_pointer_lba = d->simwp[z] * PAGE_SIZE / ssize;
+            if (d->simwp[z] == z * d->simzone)
+                ep->zone_condition = DISK_ZONE_COND_EMPTY;
+            else if (d->simwp[z] == (z + 1) * d->simzone)
+                ep->zone_condition = DISK_ZONE_COND_FULL;
+            else
+                ep->zone_condition = DISK_ZONE_COND_IMPLICIT_OPEN;
+        }
+        za->zone_params.report.entries_filled = i;
+        return (0);
+    case DISK_ZONE_RWP:
+        z = za->zone_params.rwp.id * ssize / PAGE_SIZE / d->simzone;
+        if (z == 0 || z >= nz)
+            return (EINVAL);
+        d->simwp[z] = z * d->simzone;
+        return (0);
+    default:
+        return (EOPNOTSUPP);
+    }
+}
+
+/*
+ * The emulated drive's side of a write of len blocks at pbn: it must
+ * start at the zone's write pointer and stay within the zone.
+ */
+static int
+myfs_zone_sim(struct myfs_dev *d, daddr_t pbn, daddr_t len)
+{
+    daddr_t z;
+
+    if (d->simwp == NULL)
+        return (0);
+    z = pbn / d->simzone;
+    if (z == 0)
+        return (0);
+    if (pbn != d->simwp[z] || pbn + len > (z + 1) * d->simzone) {
+        counter_u64_add(myfs_st_zone_wperr, 1);
+        return (EIO);
+    }
+    d->simwp[z] += len;
+    return (0);
+}
+
+/* Whether block pbn of d lies in a zone that takes sequential writes only. */
+static int
+myfs_zone_seq(struct myfs_dev *d, daddr_t pbn)
+{
+    return (d->segs != NULL &&
+        (d->zones[(pbn - d->segbase) / MYFS_ZONEBLKS(d)].flags &
+        MYFS_ZONE_SEQ) != 0);
+}
+
+/*
+ * Bring the write pointer of d's open zone to pbn, for a write of len
+ * blocks there.  Blocks allocated but never written, such as the tail of
+ * a segment sealed early, are zero-filled first.  The fill bypasses the
+ * buffer cache, which would need a synchronous write per block, and goes
+ * out in maxphys runs.
+ */
+static int
+myfs_zone_seek(struct myfs_dev *d, daddr_t pbn, daddr_t len)
+{
+    void *zbuf;
+    daddr_t n;
+    int error;
+
+    sx_assert(&d->log_lock, SA_XLOCKED);
+    if (pbn < d->wp)
+        return (EIO);
+    if (d->wp < pbn) {
+        n = MIN(pbn - d->wp, maxphys / PAGE_SIZE);
+        zbuf = malloc(n * PAGE_SIZE, M_TEMP, M_WAITOK | M_ZERO);
+        for (error = 0; d->wp < pbn && error == 0; d->wp += n) {
+            n = MIN(pbn - d->wp, maxphys / PAGE_SIZE);
+            error = myfs_zone_sim(d, d->wp, n);
+            if (error == 0)
+                error = g_write_data(d->cp, d->wp * PAGE_SIZE, zbuf,
+                    n * PAGE_SIZE);
+        }
+        free(zbuf, M_TEMP);
+        if (error)
+            return (error);
+    }
+    return (myfs_zone_sim(d, pbn, len));
+}
+
+/*
+ * Write bp, which getblk() returned for block pbn of d.  Sequential zones
+ * only take writes at their write pointer, see myfs_zone_seek(), and the
+ * write is synchronous so that the next one, issued under the same log
+ * lock, lands behind it.  FreeBSD has no zone append to leave the
+ * ordering to the drive.
+ */
+static int
+myfs_dev_write(struct myfs_dev *d, struct buf *bp, daddr_t pbn)
+{
+    int error;
+
+    if (!myfs_zone_seq(d, pbn)) {
+        bawrite(bp);
+        return (0);
+    }
+
+    error = myfs_zone_seek(d, pbn, 1);
+    if (error) {
+        brelse(bp);
+        return (error);
+    }
+    error = bwrite(bp);
+    if (error == 0)
+        d->wp++;
+    return (error);
+}
+
+/*
+ * Write file buffer bp to block pbn of d, in a sequential zone, and
+ * complete it.  The caller holds the mount's zone lock from placement on,
+ * so no other block of the zone can be allocated, or written, before it.
+ */
+static void
+myfs_zone_strategy(struct myfs_dev *d, struct buf *bp, daddr_t pbn)
+{
+    daddr_t len;
+    int error;
+
+    len = howmany(bp->b_bcount, PAGE_SIZE);
+    sx_xlock(&d->log_lock);
+    error = myfs_zone_seek(d, pbn, len);
+    if (error == 0)
+        error = g_write_data(d->cp, pbn * PAGE_SIZE, bp->b_data,
+            bp->b_bcount);
+    if (error == 0)
+        d->wp = pbn + len;
+    sx_xunlock(&d->log_lock);
+    if (error) {
+        bp->b_error = error;
+        bp->b_ioflags |= BIO_ERROR;
+    }
+    bufdone(bp);
+}
+
+/*
+ * Copy len blocks between data devices one block buffer at a time, the
+ * size every other user of the device vnodes reads them with.
+ */
+static int
+myfs_dev_copy(struct myfs_dev *src, daddr_t spbn, struct myfs_dev *dst,
+    daddr_t dpbn, u_int len)
+{
+    struct buf *bp, *nbp;
+    u_int i;
+    int error;
+
+    for (i = 0; i < len; i++) {
+        error = bread(src->devvp, (spbn + i) * btodb(PAGE_SIZE), PAGE_SIZE,
+            NOCRED, &bp);
+        if (error)
+            return (error);
+        nbp = getblk(dst->devvp, (dpbn + i) * btodb(PAGE_SIZE), PAGE_SIZE,
+            0, 0, 0);
+        /* File buffers write these blocks later, bypassing devvp. */
+        nbp->b_flags |= B_NOCACHE;
+        bcopy(bp->b_data, nbp->b_data, PAGE_SIZE);
+        bp->b_flags |= B_INVAL;
+        brelse(bp);
+        error = myfs_dev_write(dst, nbp, dpbn + i);
+        if (error)
+            return (error);
+    }
+    return (0);
+}
+
+/*
+ * Make zone z the open one.  Only zones this mount wrote and then freed
+ * segment by segment are rewound: myfs_zone_report() keeps every zone the
+ * drive did not report empty out of the free set, so data from earlier
+ * mounts or other users of the drive is never reset.
+ */
+static int
+myfs_zone_open(struct myfs_dev *d, u_int z)
+{
+    struct disk_zone_args za;
+    struct myfs_zone *zp = &d->zones[z];
+    int error;
+
+    if (zp->flags & MYFS_ZONE_DIRTY) {
+        bzero(&za, sizeof(za));
+        za.zone_cmd = DISK_ZONE_RWP;
+        za.zone_params.rwp.id = (d->segbase +
+            (daddr_t)z * MYFS_ZONEBLKS(d)) * PAGE_SIZE /
+            d->cp->provider->sectorsize;
+        error = myfs_zone_cmd(d, &za);
+        if (error)
+            return (error);
+        zp->flags &= ~MYFS_ZONE_DIRTY;
+        counter_u64_add(myfs_st_zone_resets, 1);
+    }
+    if (zp->flags & MYFS_ZONE_SEQ)
+        zp->flags |= MYFS_ZONE_DIRTY;
+
+    bit_clear(d->zfree, z);
+    d->nfree--;
+    d->cur = z * d->zsegs;
+    d->wp = MYFS_SEGBASE(d, d->cur);
+    return (0);
+}
+
+/* Segment seg holds nothing live any more. */
+static void
+myfs_log_segfree(struct myfs_dev *d, u_int seg)
+{
+    u_int z = seg / d->zsegs;
+
+    d->segs[seg].state = MYFS_SEG_FREE;
+    if (++d->zones[z].nfree == d->zsegs && z != d->cur / d->zsegs) {
+        bit_set(d->zfree, z);
+        d->nfree++;
+    }
+}
+
+/*
+ * Close the open segment and open the next one: the next segment of the
+ * open zone, or else the first free zone after it.  The summary goes out
+ * through the buffer cache, so the cleaner sees it even before it
+ * reaches the disk.
+ */
+static int
+myfs_log_seal(struct myfs_dev *d, int clean)
+{
+    struct buf *bp;
+    ssize_t z;
+    u_int old;
+    int error;
+
+    sx_assert(&d->log_lock, SA_XLOCKED);
+    old = d->cur;
+    if ((old + 1) % d->zsegs == 0 &&
+        d->nfree <= (clean ? 0 : MYFS_LOG_RESERVE))
+        return (ENOSPC);
+
+    d->sum->magic = htole32(MYFS_SEGSUM_MAGIC);
+    d->sum->nblocks = htole32(d->cur_used);
+    d->sum->seq = htole64(d->seq++);
+    bp = getblk(d->devvp, (MYFS_SEGBASE(d, old) + MYFS_SEGDATA) *
+        btodb(PAGE_SIZE), PAGE_SIZE, 0, 0, 0);
+    memset(bp->b_data, 0, PAGE_SIZE);
+    memcpy(bp->b_data, d->sum, sizeof(*d->sum));
+    error = myfs_dev_write(d, bp, MYFS_SEGBASE(d, old) + MYFS_SEGDATA);
+    if (error)
+        return (error);
+
+    if ((old + 1) % d->zsegs != 0) {
+        d->cur = old + 1;
+    } else {
+        bit_ffs_at(d->zfree, old / d->zsegs + 1, d->nzones, &z);
+        if (z == -1)
+            bit_ffs(d->zfree, d->nzones, &z);
+        error = myfs_zone_open(d, z);
+        if (error)
+            return (error);
+    }
+    d->cur_used = 0;
+    d->segs[d->cur].state = MYFS_SEG_OPEN;
+    d->zones[d->cur / d->zsegs].nfree--;
+    memset(d->sum, 0, sizeof(*d->sum));
+
+    d->segs[old].state = MYFS_SEG_SEALED;
+    if (d->segs[old].live == 0)
+        myfs_log_segfree(d, old);
+
+    return (0);
+}
+
+/*
+ * Append len blocks owned by ino at lbn to the log.  Runs never straddle
+ * segments, so len is at most MYFS_SEGDATA and a run that does not fit
+ * the open segment's tail starts the next one.  Only the cleaner may use
+ * the last MYFS_LOG_RESERVE free zones.
+ */
+static int
+myfs_log_alloc(struct myfs_dev *d, ino_t ino, daddr_t lbn, u_int len,
+    int clean, daddr_t *pbnp)
+{
+    struct myfs_seg *sp;
+    u_int i;
+    int error;
+
+    if (len > MYFS_SEGDATA)
+        return (EINVAL);
+
+    sx_xlock(&d->log_lock);
+    if (d->cur_used + len > MYFS_SEGDATA) {
+        error = myfs_log_seal(d, clean);
+        if (error) {
+            sx_xunlock(&d->log_lock);
+            return (error);
+        }
+    }
+    sp = &d->segs[d->cur];
+    *pbnp = MYFS_SEGBASE(d, d->cur) + d->cur_used;
+    for (i = 0; i < len; i++) {
+        d->sum->ent[d->cur_used + i].ino = htole64(ino);
+        d->sum->ent[d->cur_used + i].lbn = htole64(lbn + i);
+    }
+    d->cur_used += len;
+    sp->live += len;
+    sp->mtime = time_uptime;
+    sx_xunlock(&d->log_lock);
+
+    return (0);
+}
+
+static void
+myfs_log_free(struct myfs_dev *d, daddr_t pbn, u_int len)
+{
+    struct myfs_seg *sp;
+    u_int seg;
+
+    seg = (pbn - d->segbase) / MYFS_SEGBLKS;
+    sx_xlock(&d->log_lock);
+    sp = &d->segs[seg];
+    sp->live -= len;
+    if (sp->live == 0 && sp->state == MYFS_SEG_SEALED)
+        myfs_log_segfree(d, seg);
+    sx_xunlock(&d->log_lock);
+}
+
+/* Free blocks on d that new data can go to. */
+static daddr_t
+myfs_dev_avail(struct myfs_dev *d)
+{
+    if (d->segs != NULL)
+        return (((daddr_t)d->nfree * d->zsegs + d->zsegs - 1 -
+            d->cur % d->zsegs) * MYFS_SEGDATA + MYFS_SEGDATA - d->cur_used);
+    return (vmem_size(d->arena, VMEM_FREE));
+}
+
+static int
+myfs_blk_alloc(struct myfs_mount *mmp, u_int dev, ino_t ino, daddr_t lbn,
+    u_int len, int clean, daddr_t *pbnp)
+{
+    struct myfs_dev *d = &mmp->devs[dev];
+    vmem_addr_t addr;
+    int error;
+
+    if (d->segs != NULL) {
+        error = myfs_log_alloc(d, ino, lbn, len, clean, pbnp);
+        if (error == ENOSPC)
+            taskqueue_enqueue_timeout(taskqueue_thread, &mmp->log_task, 0);
+        if (error)
+            return (error);
+    } else {
+        if (vmem_alloc(d->arena, len, M_BESTFIT | M_NOWAIT, &addr) != 0)
+            return (ENOSPC);
+        *pbnp = addr;
+    }
+
+    mtx_lock(&mmp->resv_lock);
+    mmp->sb.free_blocks -= len;
+    mmp->sb.devs[dev].free_blocks -= len;
+    mtx_unlock(&mmp->resv_lock);
+    return (0);
+}
+
+static void
+myfs_blk_free(struct myfs_mount *mmp, u_int dev, daddr_t pbn, u_int len)
+{
+    struct myfs_dev *d = &mmp->devs[dev];
+
+    if (d->segs != NULL)
+        myfs_log_free(d, pbn, len);
+    else
+        vmem_free(d->arena, pbn, len);
+
+    mtx_lock(&mmp->resv_lock);
+    mmp->sb.free_blocks += len;
+    mmp->sb.devs[dev].free_blocks += len;
+    mtx_unlock(&mmp->resv_lock);
+}
+
+/* Give back what an extent no longer maps: blocks, or a reservation. */
+static void
+myfs_ext_release(struct myfs_mount *mmp, u_int dev, daddr_t pbn, u_int len)
+{
+    if (dev == MYFS_NODEV)
+        myfs_resv_release(mmp, len);
+    else
+        myfs_blk_free(mmp, dev, pbn, len);
+}
+
+/*
+ * Allocate len blocks for ino at lbn on dev and fill them from sdev/spbn.
+ * On zoned devices the zone and log locks are held throughout, so that no
+ * other allocation can get ahead of this one's writes.
+ */
+static int
+myfs_blk_copy(struct myfs_mount *mmp, u_int sdev, daddr_t spbn, u_int dev,
+    ino_t ino, daddr_t lbn, u_int len, int clean, daddr_t *pbnp)
+{
+    struct myfs_dev *d = &mmp->devs[dev];
+    int error;
+
+    if (mmp->mnt_flags & MYFS_MNT_ZONED)
+        sx_xlock(&mmp->zone_lock);
+    if (d->zblks != 0)
+        sx_xlock(&d->log_lock);
+    error = myfs_blk_alloc(mmp, dev, ino, lbn, len, clean, pbnp);
+    if (error == 0) {
+        error = myfs_dev_copy(&mmp->devs[sdev], spbn, d, *pbnp, len);
+        if (error)
+            myfs_blk_free(mmp, dev, *pbnp, len);
+    }
+    if (d->zblks != 0)
+        sx_xunlock(&d->log_lock);
+    if (mmp->mnt_flags & MYFS_MNT_ZONED)
+        sx_xunlock(&mmp->zone_lock);
+
+    return (error);
+}
+
+/*
+ * Length of the extent the allocator hands out for [lbn, lbn + len): runs
+ * stop at stripe boundaries when a class has several devices, or when
+ * there is a slow tier, so that the migrator moves a stripe at a time
+ * rather than a whole file; and at segment size on log-structured
+ * volumes.  Zoned volumes place a block at a time, as each is written,
+ * since the rest of a run would be written later behind other blocks.
+ */
+static u_int
+myfs_ext_chunk(struct myfs_mount *mmp, daddr_t lbn, daddr_t len)
+{
+    if (mmp->mnt_flags & MYFS_MNT_ZONED)
+        return (MIN(len, 1));
+    if (mmp->sets[MYFS_DEV_FAST].ndevs > 1 ||
+        mmp->sets[MYFS_DEV_SLOW].ndevs > 0)
+        len = MIN(len, MYFS_STRIPE - lbn % MYFS_STRIPE);
+    if (mmp->mnt_flags & MYFS_MNT_LOG)
+        len = MIN(len, MYFS_SEGDATA);
+    return (MIN(len, UINT_MAX));
+}
+
+/*
+ * Point [lbn, lbn + len) of np at dev/pbn, or at a reservation if dev is
+ * MYFS_NODEV.  Whatever mapped the range before is cut out of its extents
+ * and its blocks or reservation given back, which is how an overwrite on
+ * a log-structured volume retires the old copy and how placing reserved
+ * blocks uses up their reservation.  A range that continues the extent
+ * before it on the same device extends that extent instead, so reserved
+ * runs written a block at a time stay one extent; placed extents only
+ * grow within a stripe, which is what the migrator moves at most.  The
+ * caller holds the vnode lock exclusively, so only heat updates can race.
+ *
+ * A vnode whose node maps any blocks is held, so that vnlru cannot
+ * recycle it and take the only copy of its extent map with it.
+ */
+static struct myfs_extent *
+myfs_ext_map(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn,
+    u_int len, u_int dev, daddr_t pbn)
+{
+    struct myfs_extent *ep, *next, *nep, *right, *left;
+    daddr_t end, epend, cut;
+    u_int odev;
+    int held;
+
+    held = !RB_EMPTY(&np->extents);
+    end = lbn + len;
+    for (ep = myfs_ext_first(np, lbn); ep != NULL && ep->lbn < end;
+        ep = next) {
+        next = RB_NEXT(myfs_extmap, &np->extents, ep);
+        epend = ep->lbn + ep->len;
+        odev = ep->dev;
+        if (ep->lbn >= lbn && epend <= end) {
+            /* Inside the range: drop it. */
+            mtx_lock(&np->ext_lock);
+            RB_REMOVE(myfs_extmap, &np->extents, ep);
+            mtx_unlock(&np->ext_lock);
+            myfs_ext_release(mmp, odev, ep->pbn, ep->len);
+            free(ep, M_TEMP);
+        } else if (ep->lbn < lbn && epend > end) {
+            /* Around the range: split off the part after it. */
+            right = malloc(sizeof(*right), M_TEMP, M_WAITOK);
+            *right = *ep;
+            right->lbn = end;
+            right->pbn = ep->pbn + (end - ep->lbn);
+            right->len = epend - end;
+            mtx_lock(&np->ext_lock);
+            ep->len = lbn - ep->lbn;
+            RB_INSERT(myfs_extmap, &np->extents, right);
+            mtx_unlock(&np->ext_lock);
+            myfs_ext_release(mmp, odev, ep->pbn + ep->len, len);
+        } else if (ep->lbn < lbn) {
+            /* Overlaps the start: keep the head. */
+            cut = epend - lbn;
+            mtx_lock(&np->ext_lock);
+            ep->len -= cut;
+            mtx_unlock(&np->ext_lock);
+            myfs_ext_release(mmp, odev, ep->pbn + ep->len, cut);
+        } else {
+            /*
+             * Overlaps the end: keep the tail.  Moving the key up to end
+             * keeps the tree ordered, as nothing else starts in between.
+             */
+            cut = end - ep->lbn;
+            mtx_lock(&np->ext_lock);
+            ep->lbn = end;
+            ep->pbn += cut;
+            ep->len -= cut;
+            mtx_unlock(&np->ext_lock);
+            myfs_ext_release(mmp, odev, ep->pbn - cut, cut);
+        }
+    }
+
+    left = lbn > 0 ? myfs_ext_first(np, lbn - 1) : NULL;
+    if (left != NULL && left->lbn + left->len == lbn && left->dev == dev &&
+        (uint64_t)left->len + len <= UINT_MAX &&
+        (dev == MYFS_NODEV || (left->pbn + left->len == pbn &&
+        left->lbn / MYFS_STRIPE == (lbn + len - 1) / MYFS_STRIPE))) {
+        mtx_lock(&np->ext_lock);
+        left->len += len;
+        mtx_unlock(&np->ext_lock);
+        return (left);
+    }
+
+    nep = malloc(sizeof(*nep), M_TEMP, M_WAITOK | M_ZERO);
+    nep->lbn = lbn;
+    nep->pbn = pbn;
+    nep->len = len;
+    nep->dev = dev;
+    nep->epoch = atomic_load_int(&mmp->tier_epoch);
+    nep->atime = time_uptime;
+    mtx_lock(&np->ext_lock);
+    RB_INSERT(myfs_extmap, &np->extents, nep);
+    mtx_unlock(&np->ext_lock);
+    if (!held)
+        vhold(np->vp);
+
+    return (nep);
+}
+
+/* Decay ep's heat by one half per migrator pass since it was last seen. */
+static u_int
+myfs_ext_heat(struct myfs_mount *mmp, struct myfs_extent *ep)
+{
+    u_int epoch, age;
+
+    epoch = atomic_load_int(&mmp->tier_epoch);
+    age = epoch - ep->epoch;
+    ep->heat = age >= 32 ? 0 : ep->heat >> age;
+    ep->epoch = epoch;
+    return (ep->heat);
+}
+
+/*
+ * The i'th device of class cls to try for block lbn of ino: the one the
+ * stripe holding lbn falls on, then the others in turn.
+ */
+static u_int
+myfs_stripe_dev(struct myfs_mount *mmp, u_int cls, ino_t ino, daddr_t lbn,
+    u_int i)
+{
+    struct myfs_devset *set = &mmp->sets[cls];
+
+    return (set->devs[(ino + lbn / MYFS_STRIPE + i) % set->ndevs]);
+}
+
+static int
+myfs_tier_roomy(struct myfs_mount *mmp)
+{
+    struct myfs_devset *set = &mmp->sets[MYFS_DEV_FAST];
+    daddr_t avail, total;
+    u_int i;
+
+    avail = total = 0;
+    for (i = 0; i < set->ndevs; i++) {
+        avail += myfs_dev_avail(&mmp->devs[set->devs[i]]);
+        total += mmp->devs[set->devs[i]].nblocks;
+    }
+    return (avail * 100 > total * (daddr_t)myfs_tier_reserve);
+}
+
+/*
+ * The class new data of np goes to once the file is size bytes long.
+ * Hints win; otherwise metadata and small files stay fast, and larger
+ * files go fast while the fast tier has room, so hot data starts out on
+ * SSD and the migrator only ever has to demote it.
+ */
+static u_int
+myfs_tier_pick(struct myfs_mount *mmp, struct myfs_node *np, off_t size)
+{
+    if (mmp->sets[MYFS_DEV_SLOW].ndevs == 0)
+        return (MYFS_DEV_FAST);
+    if (np->flags & MYFS_NODE_TIER_FAST)
+        return (MYFS_DEV_FAST);
+    if (np->flags & MYFS_NODE_TIER_SLOW)
+        return (MYFS_DEV_SLOW);
+    if (!S_ISREG(np->mode) || size <= mmp->tier_small)
+        return (MYFS_DEV_FAST);
+    return (myfs_tier_roomy(mmp) ? MYFS_DEV_FAST : MYFS_DEV_SLOW);
+}
+
+/*
+ * Place len reserved blocks of np at lbn, as myfs_ext_chunk() cut them, in
+ * the class myfs_tier_pick() chooses or else in the other one, on the
+ * stripe's device or else on the next with room.  On log-structured
+ * volumes overwrites are reserved afresh, so this is also how they get
+ * their new location; elsewhere placed blocks are written in place and
+ * must not be placed again.  The caller holds the vnode lock exclusively.
+ */
+static int
+myfs_tier_alloc(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn,
+    u_int len, off_t size, struct myfs_extent **epp)
+{
+    struct myfs_extent *ep;
+    daddr_t pbn;
+    u_int cls, dev, i, n;
+
+    if ((mmp->mnt_flags & MYFS_MNT_LOG) == 0) {
+        for (ep = myfs_ext_first(np, lbn); ep != NULL && ep->lbn < lbn + len;
+            ep = RB_NEXT(myfs_extmap, &np->extents, ep)) {
+            if (ep->dev != MYFS_NODEV)
+                return (EEXIST);
+        }
+    }
+
+    cls = myfs_tier_pick(mmp, np, size);
+    for (n = 0; n < MYFS_NCLASS; n++, cls ^= 1) {
+        for (i = 0; i < mmp->sets[cls].ndevs; i++) {
+            dev = myfs_stripe_dev(mmp, cls, np->ino, lbn, i);
+            if (myfs_blk_alloc(mmp, dev, np->ino, lbn, len, 0, &pbn) == 0) {
+                *epp = myfs_ext_map(mmp, np, lbn, len, dev, pbn);
+                return (0);
+            }
+        }
+    }
+
+    return (ENOSPC);
+}
+
+static void
+myfs_tier_free(struct myfs_mount *mmp, struct myfs_node *np,
+    struct myfs_extent *ep)
+{
+    mtx_lock(&np->ext_lock);
+    RB_REMOVE(myfs_extmap, &np->extents, ep);
+    mtx_unlock(&np->ext_lock);
+
+    myfs_ext_release(mmp, ep->dev, ep->pbn, ep->len);
+    free(ep, M_TEMP);
+    if (RB_EMPTY(&np->extents))
+        vdrop(np->vp);
+}
+
+/* Charge an access to every extent overlapping [lbn, lbn + len). */
+static void
+myfs_tier_touch(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn,
+    daddr_t len)
+{
+    struct myfs_extent *ep;
+
+    mtx_lock(&np->ext_lock);
+    for (ep = myfs_ext_first(np, lbn); ep != NULL && ep->lbn < lbn + len;
+        ep = RB_NEXT(myfs_extmap, &np->extents, ep)) {
+        if (myfs_ext_heat(mmp, ep) < UINT_MAX)
+            ep->heat++;
+        ep->atime = time_uptime;
+    }
+    mtx_unlock(&np->ext_lock);
+}
+
+/* The class ep belongs in now. */
+static u_int
+myfs_tier_want(struct myfs_mount *mmp, struct myfs_node *np,
+    struct myfs_extent *ep)
+{
+    u_int cls = MYFS_DEVCLASS(mmp, ep->dev);
+    u_int heat;
+    time_t idle;
+
+    if (np->flags & MYFS_NODE_TIER_FAST)
+        return (MYFS_DEV_FAST);
+    if (np->flags & MYFS_NODE_TIER_SLOW)
+        return (MYFS_DEV_SLOW);
+    if (np->size <= mmp->tier_small)
+        return (MYFS_DEV_FAST);
+
+    mtx_lock(&np->ext_lock);
+    heat = myfs_ext_heat(mmp, ep);
+    idle = time_uptime - ep->atime;
+    mtx_unlock(&np->ext_lock);
+
+    if (cls == MYFS_DEV_FAST && heat == 0 && idle >= mmp->tier_cold)
+        return (MYFS_DEV_SLOW);
+    if (cls == MYFS_DEV_SLOW && heat >= myfs_tier_hot &&
+        myfs_tier_roomy(mmp))
+        return (MYFS_DEV_FAST);
+    return (cls);
+}
+
+/*
+ * Copy ep into class cls and repoint it.  The caller holds the vnode lock
+ * exclusively and has checked that the file has no dirty buffers, so the
+ * device copy is current.
+ */
+static int
+myfs_tier_move(struct myfs_mount *mmp, struct myfs_node *np,
+    struct myfs_extent *ep, u_int cls)
+{
+    daddr_t pbn, opbn;
+    u_int dev, odev, i;
+    int error;
+
+    error = ENOSPC;
+    for (i = 0; i < mmp->sets[cls].ndevs && error == ENOSPC; i++) {
+        dev = myfs_stripe_dev(mmp, cls, np->ino, ep->lbn, i);
+        error = myfs_blk_copy(mmp, ep->dev, ep->pbn, dev, np->ino,
+            ep->lbn, ep->len, 0, &pbn);
+    }
+    if (error)
+        return (error);
+
+    mtx_lock(&np->ext_lock);
+    opbn = ep->pbn;
+    odev = ep->dev;
+    ep->pbn = pbn;
+    ep->dev = dev;
+    mtx_unlock(&np->ext_lock);
+    myfs_blk_free(mmp, odev, opbn, ep->len);
+    return (0);
+}
+
+/*
+ * Periodic migrator pass: age every extent by one epoch, then move extents
+ * whose tier no longer fits until the per-pass budget is spent.  Busy and
+ * dirty vnodes, and those with writes in flight, are skipped; they are hot
+ * and will be seen next pass.
+ */
+static void
+myfs_tier_task(void *arg, int pending __unused)
+{
+    struct myfs_mount *mmp = arg;
+    struct mount *mp = mmp->mp;
+    struct vnode *vp, *mvp;
+    struct myfs_node *np;
+    struct myfs_extent *ep;
+    u_long budget;
+    u_int cls;
+
+    atomic_add_int(&mmp->tier_epoch, 1);
+    if (mmp->mnt_flags & MYFS_MNT_RDONLY)
+        goto out;
+    if (vn_start_write(NULL, &mp, V_NOWAIT) != 0)
+        goto out;
+
+    budget = myfs_tier_batch;
+    MNT_VNODE_FOREACH_ALL(vp, mp, mvp) {
+        np = (struct myfs_node *)vp->v_data;
+        if (vp->v_type != VREG || np == NULL || RB_EMPTY(&np->extents)) {
+            VI_UNLOCK(vp);
+            continue;
+        }
+        if (budget == 0) {
+            VI_UNLOCK(vp);
+            MNT_VNODE_FOREACH_ALL_ABORT(mp, mvp);
+            break;
+        }
+        if (vget(vp, LK_EXCLUSIVE | LK_INTERLOCK | LK_NOWAIT) != 0)
+            continue;
+        if (vp->v_bufobj.bo_dirty.bv_cnt == 0 &&
+            vp->v_bufobj.bo_numoutput == 0) {
+            RB_FOREACH(ep, myfs_extmap, &np->extents) {
+                if (ep->len > budget)
+                    break;
+                if (ep->dev == MYFS_NODEV)
+                    continue;
+                cls = myfs_tier_want(mmp, np, ep);
+                if (cls != MYFS_DEVCLASS(mmp, ep->dev) &&
+                    myfs_tier_move(mmp, np, ep, cls) == 0)
+                    budget -= ep->len;
+            }
+        }
+        vput(vp);
+    }
+    vn_finished_write(mp);
+
+out:
+    if (!mmp->tier_dying)
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->tier_task,
+            MAX(myfs_tier_interval, 1) * hz);
+}
+
+/*
+ * Move the live blocks among [pbn, pbn + len) on dev, owned by ino at
+ * [lbn, lbn + len) according to a segment summary, to the log head.
+ * Blocks whose owner no longer maps them there are dead and skipped; a
+ * node that is not in memory has no blocks at all, see myfs_tier_reclaim().
+ *
+ * Writes of the owner still in flight land before its blocks are copied.
+ * self is the node of a writer cleaning from myfs_place(), which holds
+ * it locked with its own write counted in flight.  Other owners' locks
+ * are only tried, so that two such writers cannot wait on each other;
+ * a busy owner fails with EBUSY.
+ */
+static int
+myfs_log_relocate(struct myfs_mount *mmp, u_int dev, ino_t ino,
+    daddr_t lbn, daddr_t pbn, u_int len, struct myfs_node *self)
+{
+    struct myfs_node *np;
+    struct myfs_extent *ep;
+    struct vnode *vp;
+    struct bufobj *bo;
+    daddr_t npbn;
+    u_int off, n;
+    int error;
+
+    if (self != NULL && self->ino == ino) {
+        vp = NULL;
+        np = self;
+        bo = &np->vp->v_bufobj;
+        BO_LOCK(bo);
+        while (bo->bo_numoutput > 1) {
+            bo->bo_flag |= BO_WWAIT;
+            msleep(&bo->bo_numoutput, BO_LOCKPTR(bo), PRIBIO + 1,
+                "myfsrl", 0);
+        }
+        BO_UNLOCK(bo);
+    } else {
+        error = vfs_hash_get(mmp->mp, ino, LK_EXCLUSIVE | LK_NOWAIT,
+            curthread, &vp, NULL, NULL);
+        if (error || vp == NULL)
+            return (error);
+        np = (struct myfs_node *)vp->v_data;
+        bo = &vp->v_bufobj;
+        BO_LOCK(bo);
+        bufobj_wwait(bo, 0, 0);
+        BO_UNLOCK(bo);
+    }
+
+    for (off = 0; off < len; off += n) {
+        ep = myfs_ext_first(np, lbn + off);
+        if (ep == NULL || ep->lbn > lbn + off) {
+            n = 1;
+            continue;
+        }
+        n = MIN(len - off, ep->lbn + ep->len - (lbn + off));
+        if (ep->dev != dev || ep->pbn + (lbn + off - ep->lbn) != pbn + off)
+            continue;
+
+        error = myfs_blk_copy(mmp, dev, pbn + off, dev, ino, lbn + off, n,
+            1, &npbn);
+        if (error)
+            break;
+        myfs_ext_map(mmp, np, lbn + off, n, dev, npbn);
+    }
+    if (vp != NULL)
+        vput(vp);
+
+    return (error);
+}
+
+/* Relocate the live blocks of sealed segment seg of dev. */
+static int
+myfs_log_clean_seg(struct myfs_mount *mmp, u_int dev, u_int seg,
+    struct myfs_node *self)
+{
+    struct myfs_dev *d = &mmp->devs[dev];
+    struct myfs_segsum *sum;
+    struct buf *bp;
+    daddr_t base;
+    u_int i, run, n;
+    int error;
+
+    base = MYFS_SEGBASE(d, seg);
+    error = bread(d->devvp, (base + MYFS_SEGDATA) * btodb(PAGE_SIZE),
+        PAGE_SIZE, NOCRED, &bp);
+    if (error)
+        return (error);
+    sum = malloc(sizeof(*sum), M_TEMP, M_WAITOK);
+    memcpy(sum, bp->b_data, sizeof(*sum));
+    brelse(bp);
+    n = le32toh(sum->nblocks);
+    if (le32toh(sum->magic) != MYFS_SEGSUM_MAGIC || n > MYFS_SEGDATA) {
+        free(sum, M_TEMP);
+        return (EINTEGRITY);
+    }
+
+    /* Relocate owner runs: same inode, consecutive file blocks. */
+    for (i = 0; i < n; i += run) {
+        for (run = 1; i + run < n &&
+            sum->ent[i + run].ino == sum->ent[i].ino &&
+            le64toh(sum->ent[i + run].lbn) ==
+            le64toh(sum->ent[i].lbn) + run; run++)
+            ;
+        error = myfs_log_relocate(mmp, dev, le64toh(sum->ent[i].ino),
+            le64toh(sum->ent[i].lbn), base + i, run, self);
+        if (error)
+            break;
+    }
+    free(sum, M_TEMP);
+
+    return (error);
+}
+
+/*
+ * The zone of dev with the best benefit to cost ratio for cleaning, free
+ * space gained times age over the cost of reading and rewriting the live
+ * part, as in Sprite LFS, leaving out those in tried.  -1 if none is
+ * worth cleaning.
+ */
+static ssize_t
+myfs_log_victim(struct myfs_dev *d, bitstr_t *tried)
+{
+    struct myfs_seg *sp;
+    uint64_t score, best, cap, live;
+    time_t mtime;
+    u_int z, seg, nsealed;
+    ssize_t victim;
+
+    best = 0;
+    victim = -1;
+    cap = (uint64_t)d->zsegs * MYFS_SEGDATA;
+    sx_slock(&d->log_lock);
+    for (z = 0; z < d->nzones; z++) {
+        if (z == d->cur / d->zsegs || bit_test(tried, z))
+            continue;
+        live = 0;
+        mtime = 0;
+        nsealed = 0;
+        for (seg = z * d->zsegs; seg < (z + 1) * d->zsegs; seg++) {
+            sp = &d->segs[seg];
+            if (sp->state != MYFS_SEG_SEALED)
+                continue;
+            nsealed++;
+            live += sp->live;
+            mtime = MAX(mtime, sp->mtime);
+        }
+        if (nsealed == 0 || live >= cap)
+            continue;
+        score = (cap - live) * (time_uptime - mtime + 1) * 1024 /
+            (cap + live);
+        if (score > best) {
+            best = score;
+            victim = z;
+        }
+    }
+    sx_sunlock(&d->log_lock);
+
+    return (victim);
+}
+
+/*
+ * Clean one zone of dev, the best victim whose owners are not busy; see
+ * myfs_log_relocate() for self.  Returns ENOENT if there is nothing worth
+ * cleaning.
+ */
+static int
+myfs_log_clean(struct myfs_mount *mmp, u_int dev, struct myfs_node *self)
+{
+    struct myfs_dev *d = &mmp->devs[dev];
+    bitstr_t *tried;
+    ssize_t victim;
+    u_int seg;
+    int error;
+
+    tried = bit_alloc(d->nzones, M_TEMP, M_WAITOK);
+    for (;;) {
+        victim = myfs_log_victim(d, tried);
+        if (victim == -1) {
+            error = ENOENT;
+            break;
+        }
+        error = 0;
+        for (seg = victim * d->zsegs; seg < (victim + 1) * d->zsegs;
+            seg++) {
+            if (d->segs[seg].state != MYFS_SEG_SEALED)
+                continue;
+            error = myfs_log_clean_seg(mmp, dev, seg, self);
+            if (error)
+                break;
+        }
+        if (error != EBUSY)
+            break;
+        bit_set(tried, victim);
+    }
+    free(tried, M_TEMP);
+    if (error == 0)
+        counter_u64_add(myfs_st_log_cleaned, 1);
+
+    return (error);
+}
+
+/*
+ * Whether d is below pct percent free zones, or down to the reserve that
+ * only the cleaner may use.
+ */
+static int
+myfs_log_low(struct myfs_dev *d, u_int pct)
+{
+    return (d->nfree <= MYFS_LOG_RESERVE ||
+        (uint64_t)d->nfree * 100 < (uint64_t)d->nzones * pct);
+}
+
+/*
+ * Clean each device whose free zones ran low until they recover, or
+ * every zone has been tried once.
+ */
+static void
+myfs_log_task(void *arg, int pending __unused)
+{
+    struct myfs_mount *mmp = arg;
+    struct mount *mp = mmp->mp;
+    struct myfs_dev *d;
+    u_int n;
+    int i;
+
+    if (mmp->mnt_flags & MYFS_MNT_RDONLY)
+        goto out;
+    if (vn_start_write(NULL, &mp, V_NOWAIT) != 0)
+        goto out;
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        d = &mmp->devs[i];
+        if (d->segs == NULL || !myfs_log_low(d, myfs_log_clean_low))
+            continue;
+        for (n = 0; n < d->nzones && !mmp->tier_dying &&
+            myfs_log_low(d, myfs_log_clean_high); n++) {
+            if (myfs_log_clean(mmp, i, NULL) != 0)
+                break;
+        }
+    }
+    vn_finished_write(mp);
+
+out:
+    if (!mmp->tier_dying)
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->log_task, hz);
+}
+
+/*
+ * Clean a zone of each log-structured device down to its reserve, for a
+ * writer in myfs_place() that holds np locked.  Returns ENOENT if none
+ * could be cleaned.
+ */
+static int
+myfs_log_reclaim(struct myfs_mount *mmp, struct myfs_node *np)
+{
+    struct myfs_dev *d;
+    int error, i;
+
+    error = ENOENT;
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        d = &mmp->devs[i];
+        if (d->segs != NULL && myfs_log_low(d, 0) &&
+            myfs_log_clean(mmp, i, np) == 0)
+            error = 0;
+    }
+    return (error);
+}
+
+static void
+myfs_log_uninit(struct myfs_dev *d)
+{
+    sx_destroy(&d->log_lock);
+    free(d->sum, M_TEMP);
+    free(d->zfree, M_TEMP);
+    free(d->zones, M_TEMP);
+    free(d->segs, M_TEMP);
+    d->segs = NULL;
+}
+
+/*
+ * Find out whether d is a zoned drive and how big its zones are.  Only
+ * host-managed and host-aware drives are treated as zoned; drive-managed
+ * ones hide their zones and take random writes.
+ */
+static int
+myfs_zone_probe(struct myfs_dev *d)
+{
+    struct disk_zone_args za;
+    struct disk_zone_rep_entry ent;
+    int error;
+
+    d->zblks = 0;
+    bzero(&za, sizeof(za));
+    za.zone_cmd = DISK_ZONE_GET_PARAMS;
+    if (myfs_zone_cmd(d, &za) != 0)
+        return (0);
+    if ((za.zone_params.disk_params.zone_mode &
+        (DISK_ZONE_MODE_HOST_MANAGED | DISK_ZONE_MODE_HOST_AWARE)) == 0)
+        return (0);
+    if (!myfs_zoned && d->simwp == NULL) {
+        if ((za.zone_params.disk_params.zone_mode &
+            DISK_ZONE_MODE_HOST_MANAGED) == 0)
+            return (0);
+        printf("MYFS: %s: host-managed zoned drive, needs vfs.myfs.zoned\n",
+            d->cp->provider->name);
+        return (EOPNOTSUPP);
+    }
+
+    bzero(&za, sizeof(za));
+    za.zone_cmd = DISK_ZONE_REPORT_ZONES;
+    za.zone_params.report.entries_allocated = 1;
+    za.zone_params.report.entries = &ent;
+    error = myfs_zone_cmd(d, &za);
+    if (error)
+        return (error);
+    if (za.zone_params.report.entries_filled != 1)
+        return (ENXIO);
+    d->zblks = ent.zone_length * d->cp->provider->sectorsize / PAGE_SIZE;
+    if (d->zblks == 0 || d->zblks % MYFS_SEGBLKS != 0)
+        return (EINVAL);
+    return (0);
+}
+
+/*
+ * Record the type and state of every zone of d.  Zones the drive has
+ * taken offline or made read-only are left out of the free set, as is a
+ * short last zone.
+ */
+static int
+myfs_zone_report(struct myfs_dev *d)
+{
+    struct disk_zone_args za;
+    struct disk_zone_rep_entry *ents, *ep;
+    struct myfs_zone *zp;
+    u_int ssize = d->cp->provider->sectorsize;
+    uint64_t lba;
+    daddr_t z;
+    u_int i;
+    int error;
+
+    ents = malloc(MYFS_ZONE_REPORT * sizeof(*ents), M_TEMP, M_WAITOK);
+    lba = 0;
+    for (;;) {
+        bzero(&za, sizeof(za));
+        za.zone_cmd = DISK_ZONE_REPORT_ZONES;
+        za.zone_params.report.starting_id = lba;
+        za.zone_params.report.entries_allocated = MYFS_ZONE_REPORT;
+        za.zone_params.report.entries = ents;
+        error = myfs_zone_cmd(d, &za);
+        if (error || za.zone_params.report.entries_filled == 0)
+            break;
+        for (i = 0; i < za.zone_params.report.entries_filled; i++) {
+            ep = &ents[i];
+            lba = ep->zone_start_lba + ep->zone_length;
+            /* Zone 0 holds block 0 and is never used. */
+            z = ep->zone_start_lba * ssize / PAGE_SIZE / d->zblks - 1;
+            if (z < 0 || z >= d->nzones)
+                continue;
+            zp = &d->zones[z];
+            if (ep->zone_type == DISK_ZONE_TYPE_SEQ_REQUIRED)
+                zp->flags |= MYFS_ZONE_SEQ;
+            /*
+             * A zone with a write pointer is only known to be free when
+             * the drive says it is empty and the pointer is at its start.
+             */
+            if (((ep->zone_type != DISK_ZONE_TYPE_CONVENTIONAL &&
+                (ep->zone_condition != DISK_ZONE_COND_EMPTY ||
+                ep->write_pointer_lba != ep->zone_start_lba)) ||
+                ep->zone_condition == DISK_ZONE_COND_READONLY ||
+                ep->zone_condition == DISK_ZONE_COND_OFFLINE ||
+                ep->zone_length * ssize / PAGE_SIZE != d->zblks) &&
+                bit_test(d->zfree, z)) {
+                bit_clear(d->zfree, z);
+                d->nfree--;
+            }
+        }
+        if (lba * ssize >= d->cp->provider->mediasize)
+            break;
+    }
+    free(ents, M_TEMP);
+
+    return (error);
+}
+
+/*
+ * Cut d into segments.  On zoned devices segments start at zone 1 and are
+ * grouped by zone; the caller has probed d and checked it holds at least
+ * MYFS_LOG_RESERVE + 2 zones.
+ */
+static int
+myfs_log_init(struct myfs_dev *d)
+{
+    ssize_t z;
+    u_int i;
+    int error;
+
+    if (d->zblks != 0) {
+        d->segbase = d->zblks;
+        d->zsegs = d->zblks / MYFS_SEGBLKS;
+        d->nzones = d->nblocks / d->zblks - 1;
+    } else {
+        d->segbase = 1;
+        d->zsegs = 1;
+        d->nzones = (d->nblocks - 1) / MYFS_SEGBLKS;
+    }
+    d->nsegs = d->nzones * d->zsegs;
+    d->segs = malloc(d->nsegs * sizeof(*d->segs), M_TEMP,
+        M_WAITOK | M_ZERO);
+    d->zones = malloc(d->nzones * sizeof(*d->zones), M_TEMP,
+        M_WAITOK | M_ZERO);
+    for (i = 0; i < d->nzones; i++)
+        d->zones[i].nfree = d->zsegs;
+    d->zfree = bit_alloc(d->nzones, M_TEMP, M_WAITOK);
+    bit_nset(d->zfree, 0, d->nzones - 1);
+    d->nfree = d->nzones;
+    d->sum = malloc(sizeof(*d->sum), M_TEMP, M_WAITOK | M_ZERO);
+    sx_init_flags(&d->log_lock, "myfs log", SX_RECURSE);
+
+    error = 0;
+    if (d->zblks != 0)
+        error = myfs_zone_report(d);
+    if (error == 0) {
+        bit_ffs(d->zfree, d->nzones, &z);
+        if (z == -1)
+            error = ENOSPC;
+        else
+            error = myfs_zone_open(d, z);
+    }
+    if (error) {
+        myfs_log_uninit(d);
+        return (error);
+    }
+    d->cur_used = 0;
+    d->segs[d->cur].state = MYFS_SEG_OPEN;
+    d->zones[z].nfree--;
+
+    return (0);
+}
+
+/*
+ * Open the colon-separated device list for class cls, appending to the
+ * superblock's device table.
+ */
+static int
+myfs_devs_open(struct myfs_mount *mmp, const char *list, u_int cls, int wr)
+{
+    struct myfs_devset *set = &mmp->sets[cls];
+    struct myfs_sb_dev *sd;
+    char *buf, *p, *path;
+    int error;
+
+    buf = p = strdup(list, M_TEMP);
+    error = 0;
+    while ((path = strsep(&p, ":")) != NULL) {
+        if (*path == '\0')
+            continue;
+        if (mmp->sb.ndevs == MYFS_MAXDEVS) {
+            error = E2BIG;
+            break;
+        }
+        error = myfs_dev_open(path, wr, &mmp->devs[mmp->sb.ndevs]);
+        if (error)
+            break;
+        sd = &mmp->sb.devs[mmp->sb.ndevs];
+        sd->devid = mmp->sb.ndevs;
+        sd->class = cls;
+        set->devs[set->ndevs++] = mmp->sb.ndevs++;
+    }
+    free(buf, M_TEMP);
+    if (error == 0 && set->ndevs == 0)
+        error = EINVAL;
+
+    return (error);
+}
+
+/*
+ * Refuse devices that hold anything, unless format is set.  Every device
+ * is checked before any label is written, so a refused mount leaves them
+ * all as they were.
+ */
+static int
+myfs_tier_label_check(struct myfs_mount *mmp, int format)
+{
+    struct myfs_tlabel *lp;
+    char *buf;
+    u_int i, j;
+    int error;
+
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        buf = g_read_data(mmp->devs[i].cp, 0, PAGE_SIZE, &error);
+        if (buf == NULL)
+            return (error);
+        for (j = 0; j < PAGE_SIZE && buf[j] == 0; j++)
+            ;
+        lp = (struct myfs_tlabel *)buf;
+        if (j < PAGE_SIZE && !format) {
+            if (le32toh(lp->magic) == MYFS_TLABEL_MAGIC)
+                printf("MYFS: %s: holds an earlier tiered volume whose "
+                    "extent maps are gone; use tierformat to discard it\n",
+                    mmp->devs[i].cp->provider->name);
+            else
+                printf("MYFS: %s: not blank; use tierformat to "
+                    "overwrite it\n", mmp->devs[i].cp->provider->name);
+            g_free(buf);
+            return (EEXIST);
+        }
+        g_free(buf);
+    }
+
+    return (0);
+}
+
+/* Claim every device for this volume. */
+static int
+myfs_tier_label_write(struct myfs_mount *mmp)
+{
+    struct myfs_tlabel *lp;
+    char *buf;
+    u_int i;
+    int error;
+
+    buf = malloc(PAGE_SIZE, M_TEMP, M_WAITOK | M_ZERO);
+    lp = (struct myfs_tlabel *)buf;
+    lp->magic = htole32(MYFS_TLABEL_MAGIC);
+    lp->version = htole32(MYFS_TLABEL_VERSION);
+    arc4random_buf(lp->volid, sizeof(lp->volid));
+    lp->ndevs = htole32(mmp->sb.ndevs);
+    error = 0;
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        lp->devid = htole32(i);
+        lp->class = htole32(mmp->sb.devs[i].class);
+        error = g_write_data(mmp->devs[i].cp, 0, buf, PAGE_SIZE);
+        if (error)
+            break;
+    }
+    free(buf, M_TEMP);
+
+    return (error);
+}
+
+/*
+ * Open the data devices named by the mount options: fastdev and slowdev,
+ * both or neither, for a tiered volume, or datadev alone for one with a
+ * single class.  Each takes a colon-separated list to stripe across.
+ * tiersmall and tiercold tune the policy, logwrite makes every device
+ * log-structured, zonesim emulates zoned drives with zones of that many
+ * MiB, and tierformat allows devices that are not blank.
+ */
+static int
+myfs_tier_mount(struct mount *mp, struct myfs_mount *mmp)
+{
+    struct myfs_dev *dev;
+    struct myfs_sb_dev *sd;
+    char *fast, *slow, *data;
+    intmax_t val;
+    daddr_t simzone, z;
+    int error, i, wr;
+
+    fast = vfs_getopts(mp->mnt_optnew, "fastdev", &error);
+    slow = vfs_getopts(mp->mnt_optnew, "slowdev", &error);
+    data = vfs_getopts(mp->mnt_optnew, "datadev", &error);
+    if (fast == NULL && slow == NULL && data == NULL)
+        return (0);
+    if ((fast == NULL) != (slow == NULL) ||
+        (data != NULL && fast != NULL) || mmp->devvp != NULL)
+        return (EINVAL);
+
+    mmp->tier_small = MYFS_TIER_SMALL;
+    if (vfs_scanopt(mp->mnt_optnew, "tiersmall", "%jd", &val) == 1)
+        mmp->tier_small = MAX(val, 0);
+    mmp->tier_cold = MYFS_TIER_COLD;
+    if (vfs_scanopt(mp->mnt_optnew, "tiercold", "%jd", &val) == 1)
+        mmp->tier_cold = MAX(val, 0);
+    simzone = 0;
+    if (vfs_scanopt(mp->mnt_optnew, "zonesim", "%jd", &val) == 1) {
+        if (val <= 0 || val > 1024)
+            return (EINVAL);
+        simzone = val * (1024 * 1024 / PAGE_SIZE);
+    }
+
+    wr = (mmp->mnt_flags & MYFS_MNT_RDONLY) == 0;
+    if (data != NULL)
+        error = myfs_devs_open(mmp, data, MYFS_DEV_FAST, wr);
+    else {
+        error = myfs_devs_open(mmp, fast, MYFS_DEV_FAST, wr);
+        if (error == 0)
+            error = myfs_devs_open(mmp, slow, MYFS_DEV_SLOW, wr);
+    }
+    if (error)
+        goto fail;
+    error = myfs_tier_label_check(mmp,
+        vfs_flagopt(mp->mnt_optnew, "tierformat", NULL, 0));
+    if (error)
+        goto fail;
+
+    /* Zoned drives only take sequential writes: they imply logwrite. */
+    vfs_flagopt(mp->mnt_optnew, "logwrite", &mmp->mnt_flags, MYFS_MNT_LOG);
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        dev = &mmp->devs[i];
+        if (simzone != 0) {
+            dev->simzone = simzone;
+            dev->simwp = malloc(howmany(dev->nblocks, simzone) *
+                sizeof(*dev->simwp), M_TEMP, M_WAITOK);
+            for (z = 0; z < howmany(dev->nblocks, simzone); z++)
+                dev->simwp[z] = z * simzone;
+        }
+        error = myfs_zone_probe(dev);
+        if (error)
+            goto fail;
+        if (dev->zblks != 0)
+            mmp->mnt_flags |= MYFS_MNT_LOG | MYFS_MNT_ZONED;
+    }
+    error = EINVAL;
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        dev = &mmp->devs[i];
+        if (dev->nblocks < 2)
+            goto fail;
+        if ((mmp->mnt_flags & MYFS_MNT_LOG) == 0)
+            continue;
+        if (dev->zblks != 0 ?
+            dev->nblocks / dev->zblks < MYFS_LOG_RESERVE + 3 :
+            (dev->nblocks - 1) / MYFS_SEGBLKS < MYFS_LOG_RESERVE + 2)
+            goto fail;
+    }
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        dev = &mmp->devs[i];
+        sd = &mmp->sb.devs[i];
+        if (mmp->mnt_flags & MYFS_MNT_LOG) {
+            error = myfs_log_init(dev);
+            if (error) {
+                while (--i >= 0)
+                    myfs_log_uninit(&mmp->devs[i]);
+                goto fail;
+            }
+            /* The cleaner's reserve zones never hold new data. */
+            sd->total_blocks = (daddr_t)(dev->nsegs -
+                MYFS_LOG_RESERVE * dev->zsegs) * MYFS_SEGDATA;
+        } else {
+            dev->arena = vmem_create("myfs tier", 1, dev->nblocks - 1, 1,
+                0, M_WAITOK);
+            sd->total_blocks = dev->nblocks - 1;
+        }
+    }
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        sd = &mmp->sb.devs[i];
+        sd->free_blocks = sd->total_blocks;
+        mmp->sb.total_blocks += sd->total_blocks;
+        mmp->sb.free_blocks += sd->free_blocks;
+    }
+    if (wr) {
+        error = myfs_tier_label_write(mmp);
+        if (error) {
+            for (i = 0; i < mmp->sb.ndevs; i++) {
+                if (mmp->devs[i].segs != NULL)
+                    myfs_log_uninit(&mmp->devs[i]);
+                else
+                    vmem_destroy(mmp->devs[i].arena);
+            }
+            goto fail;
+        }
+    }
+    mmp->mnt_flags |= MYFS_MNT_TIERED;
+    if (mmp->mnt_flags & MYFS_MNT_ZONED)
+        sx_init_flags(&mmp->zone_lock, "myfs zone", SX_RECURSE);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &mmp->tier_task, 0,
+        myfs_tier_task, mmp);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &mmp->log_task, 0,
+        myfs_log_task, mmp);
+
+    return (0);
+
+fail:
+    for (i = 0; i < mmp->sb.ndevs; i++)
+        myfs_dev_close(&mmp->devs[i]);
+    mmp->sb.ndevs = 0;
+    bzero(mmp->sets, sizeof(mmp->sets));
+    mmp->mnt_flags &= ~(MYFS_MNT_LOG | MYFS_MNT_ZONED);
+    return (error);
+}
+
+/* Stop the migrator; it must not run while vnodes are flushed. */
+static void
+myfs_tier_stop(struct myfs_mount *mmp)
+{
+    if ((mmp->mnt_flags & MYFS_MNT_TIERED) == 0)
+        return;
+    mmp->tier_dying = 1;
+    while (taskqueue_cancel_timeout(taskqueue_thread, &mmp->tier_task,
+        NULL) != 0)
+        taskqueue_drain_timeout(taskqueue_thread, &mmp->tier_task);
+    while (taskqueue_cancel_timeout(taskqueue_thread, &mmp->log_task,
+        NULL) != 0)
+        taskqueue_drain_timeout(taskqueue_thread, &mmp->log_task);
+}
+
+static void
+myfs_tier_unmount(struct myfs_mount *mmp)
+{
+    int i;
+
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        if (mmp->devs[i].segs != NULL)
+            myfs_log_uninit(&mmp->devs[i]);
+        else
+            vmem_destroy(mmp->devs[i].arena);
+        myfs_dev_close(&mmp->devs[i]);
+    }
+    mmp->sb.ndevs = 0;
+    bzero(mmp->sets, sizeof(mmp->sets));
+    if (mmp->mnt_flags & MYFS_MNT_ZONED)
+        sx_destroy(&mmp->zone_lock);
+    mmp->mnt_flags &= ~MYFS_MNT_ZONED;
+}
+
+/* Follow a read-only update of a tiered mount with the device opens. */
+static int
+myfs_tier_setrw(struct myfs_mount *mmp, int wr)
+{
+    int error, i;
+
+    error = 0;
+    g_topology_lock();
+    for (i = 0; i < mmp->sb.ndevs; i++) {
+        error = g_access(mmp->devs[i].cp, 0, wr ? 1 : -1, 0);
+        if (error) {
+            while (--i >= 0)
+                g_access(mmp->devs[i].cp, 0, wr ? -1 : 1, 0);
+            break;
+        }
+    }
+    g_topology_unlock();
+
+    return (error);
+}
+
+/*
+ * Extent maps are not written out until the read-write format exists, so
+ * a reclaimed node's blocks go back to the arenas.  The hold taken in
+ * myfs_ext_map() keeps vnlru away, so this only runs when the vnode is
+ * destroyed by unmount or revoke; vgone() holds the vnode across reclaim,
+ * so dropping ours here cannot free it.
+ */
+static void
+myfs_tier_reclaim(struct myfs_mount *mmp, struct myfs_node *np)
+{
+    struct myfs_extent *ep;
+
+    while ((ep = RB_MIN(myfs_extmap, &np->extents)) != NULL)
+        myfs_tier_free(mmp, np, ep);
+}
+
+static int
+myfs_ioc_settier(struct myfs_mount *mmp, struct vnode *vp,
+    struct ucred *cred, struct myfs_tier_args *ta)
+{
+    struct myfs_node *np;
+    int error;
+
+    if ((mmp->mnt_flags & MYFS_MNT_TIERED) == 0 ||
+        mmp->sets[MYFS_DEV_SLOW].ndevs == 0)
+        return (EOPNOTSUPP);
+    if (ta->hint > MYFS_TIER_SLOW)
+        return (EINVAL);
+
+    vn_lock(vp, LK_EXCLUSIVE | LK_RETRY);
+    np = (struct myfs_node *)vp->v_data;
+    if (cred->cr_uid != np->uid) {
+        error = priv_check_cred(cred, PRIV_VFS_ADMIN);
+        if (error) {
+            VOP_UNLOCK(vp);
+            return (error);
+        }
+    }
+    np->flags &= ~MYFS_NODE_TIER_MASK;
+    if (ta->hint == MYFS_TIER_FAST)
+        np->flags |= MYFS_NODE_TIER_FAST;
+    else if (ta->hint == MYFS_TIER_SLOW)
+        np->flags |= MYFS_NODE_TIER_SLOW;
+    VOP_UNLOCK(vp);
+
+    /* Pinning takes effect on the next pass; run it now. */
+    if (ta->hint != MYFS_TIER_AUTO)
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->tier_task, 0);
+
+    return (0);
+}
+
+static int
+myfs_ioc_gettier(struct myfs_mount *mmp, struct vnode *vp,
+    struct myfs_tier_args *ta)
+{
+    struct myfs_node *np;
+    struct myfs_extent *ep;
+
+    if ((mmp->mnt_flags & MYFS_MNT_TIERED) == 0)
+        return (EOPNOTSUPP);
+
+    ta->fast_blocks = ta->slow_blocks = 0;
+    ta->ndevs = mmp->sb.ndevs;
+    memset(ta->dev_blocks, 0, sizeof(ta->dev_blocks));
+    vn_lock(vp, LK_SHARED | LK_RETRY);
+    np = (struct myfs_node *)vp->v_data;
+    if (np->flags & MYFS_NODE_TIER_FAST)
+        ta->hint = MYFS_TIER_FAST;
+    else if (np->flags & MYFS_NODE_TIER_SLOW)
+        ta->hint = MYFS_TIER_SLOW;
+    else
+        ta->hint = MYFS_TIER_AUTO;
+    mtx_lock(&np->ext_lock);
+    RB_FOREACH(ep, myfs_extmap, &np->extents) {
+        if (ep->dev == MYFS_NODEV)
+            continue;
+        ta->dev_blocks[ep->dev] += ep->len;
+        if (MYFS_DEVCLASS(mmp, ep->dev) == MYFS_DEV_FAST)
+            ta->fast_blocks += ep->len;
+        else
+            ta->slow_blocks += ep->len;
+    }
+    mtx_unlock(&np->ext_lock);
+    VOP_UNLOCK(vp);
+
+    return (0);
+}
+
+/* File data */
+
+static int
+myfs_data_hole(struct myfs_node *np, daddr_t lbn)
+{
+    struct myfs_extent *ep;
+
+    ep = myfs_ext_first(np, lbn);
+    return (ep == NULL || ep->lbn > lbn);
+}
+
+/*
+ * Whether block lbn of np needs space to take new data: a hole does, and
+ * on log-structured volumes so does a placed block, which moves on every
+ * write.  The caller reserves it with myfs_data_reserve() before it
+ * changes the buffer, and hands it to myfs_data_dirty() once it has, or
+ * back with myfs_data_unreserve().
+ */
+static int
+myfs_data_needs(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn)
+{
+    struct myfs_extent *ep;
+
+    ep = myfs_ext_first(np, lbn);
+    if (ep == NULL || ep->lbn > lbn)
+        return (1);
+    return (ep->dev != MYFS_NODEV && (mmp->mnt_flags & MYFS_MNT_LOG) != 0);
+}
+
+/* A block of space for lbn, and of quota if it is a hole. */
+static int
+myfs_data_reserve(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn)
+{
+    int error;
+
+    error = myfs_resv_reserve(mmp, 1);
+    if (error == 0 && myfs_data_hole(np, lbn)) {
+        error = myfs_quota_alloc(np->dquot, 1, 0);
+        if (error)
+            myfs_resv_release(mmp, 1);
+    }
+    return (error);
+}
+
+static void
+myfs_data_unreserve(struct myfs_mount *mmp, struct myfs_node *np,
+    daddr_t lbn)
+{
+    myfs_resv_release(mmp, 1);
+    if (myfs_data_hole(np, lbn))
+        myfs_quota_free(np->dquot, 1, 0);
+}
+
+/*
+ * Map block lbn of np, which myfs_data_reserve() reserved, to that
+ * reservation.  myfs_place() turns it into an allocation when the buffer
+ * is written, so that blocks written together are allocated together.
+ * The caller holds the vnode lock exclusively.
+ */
+static void
+myfs_data_dirty(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn)
+{
+    if (myfs_data_hole(np, lbn))
+        np->blocks++;
+    myfs_ext_map(mmp, np, lbn, 1, MYFS_NODEV, 0);
+}
+
+/*
+ * Where block lbn of np is to be written: its placed block, or else a new
+ * one for the reserved run starting at lbn, cut by myfs_ext_chunk().  A
+ * run that finds no room in one piece is placed in smaller ones, since
+ * the reservation only promised that many blocks, not contiguous ones.
+ * On log-structured volumes the promised blocks may still be dead ones
+ * in sealed segments, so placement cleans, or waits for the cleaner, up
+ * to MYFS_LOG_WAIT times.
+ */
+static int
+myfs_place(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn,
+    u_int *devp, daddr_t *pbnp)
+{
+    struct myfs_extent *ep;
+    u_int len, tries;
+    int error;
+
+    ep = myfs_ext_first(np, lbn);
+    if (ep == NULL || ep->lbn > lbn)
+        return (EIO);
+    for (tries = 0; ep->dev == MYFS_NODEV; tries++) {
+        len = myfs_ext_chunk(mmp, lbn, ep->lbn + ep->len - lbn);
+        while ((error = myfs_tier_alloc(mmp, np, lbn, len, np->size,
+            &ep)) == ENOSPC && len > 1)
+            len = howmany(len, 2);
+        if (error == 0)
+            break;
+        if (error != ENOSPC || (mmp->mnt_flags & MYFS_MNT_LOG) == 0 ||
+            tries == MYFS_LOG_WAIT)
+            return (error);
+        if (myfs_log_reclaim(mmp, np) != 0)
+            pause("myfscln", hz / 10);
+        ep = myfs_ext_first(np, lbn);
+    }
+    *devp = ep->dev;
+    *pbnp = ep->pbn + (lbn - ep->lbn);
+    return (0);
+}
+
+/*
+ * The device block holding block lbn of np, with the blocks of the same
+ * extent after and before it.  Holes and reserved blocks have none, and
+ * fail with ENOENT.  Readers may hold the vnode lock shared.
+ */
+static int
+myfs_data_map(struct myfs_node *np, daddr_t lbn, u_int *devp, daddr_t *pbnp,
+    int *runp, int *runbp)
+{
+    struct myfs_extent *ep;
+    int error;
+
+    error = ENOENT;
+    mtx_lock(&np->ext_lock);
+    ep = myfs_ext_first(np, lbn);
+    if (ep != NULL && ep->lbn <= lbn && ep->dev != MYFS_NODEV) {
+        *devp = ep->dev;
+        *pbnp = ep->pbn + (lbn - ep->lbn);
+        if (runp != NULL)
+            *runp = MIN(ep->lbn + ep->len - lbn - 1, INT_MAX);
+        if (runbp != NULL)
+            *runbp = MIN(lbn - ep->lbn, INT_MAX);
+        error = 0;
+    }
+    mtx_unlock(&np->ext_lock);
+    return (error);
+}
+
+/* Drop every block of np from lbn on, placed or reserved, and its quota. */
+static void
+myfs_data_trunc(struct myfs_mount *mmp, struct myfs_node *np, daddr_t lbn)
+{
+    struct myfs_extent *ep;
+    int64_t oblocks;
+    u_int cut;
+
+    oblocks = np->blocks;
+    while ((ep = myfs_ext_first(np, lbn)) != NULL) {
+        if (ep->lbn >= lbn) {
+            np->blocks -= ep->len;
+            myfs_tier_free(mmp, np, ep);
+            continue;
+        }
+        cut = ep->lbn + ep->len - lbn;
+        mtx_lock(&np->ext_lock);
+        ep->len -= cut;
+        mtx_unlock(&np->ext_lock);
+        myfs_ext_release(mmp, ep->dev, ep->pbn + ep->len, cut);
+        np->blocks -= cut;
+    }
+    myfs_quota_free(np->dquot, oblocks - np->blocks, 0);
+}
+
+/*
+ * Set the size of regular file vp.  Growing leaves a hole.  Shrinking
+ * zeroes the rest of the new last block, unless it is a hole, which makes
+ * that block dirty and so may need space; then every buffer and block
+ * past it goes.
+ */
+static int
+myfs_resize(struct vnode *vp, off_t length)
+{
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct myfs_extent *ep;
+    struct buf *bp;
+    daddr_t lbn;
+    off_t osize;
+    int error, need, off;
+
+    ASSERT_VOP_ELOCKED(vp, "myfs_resize");
+    if (length < 0)
+        return (EINVAL);
+    osize = np->size;
+    if (length == osize)
+        return (0);
+
+    lbn = length / PAGE_SIZE;
+    off = length % PAGE_SIZE;
+    ep = myfs_ext_first(np, lbn);
+    if (length < osize && off != 0 && ep != NULL && ep->lbn <= lbn) {
+        error = bread(vp, lbn, PAGE_SIZE, NOCRED, &bp);
+        if (error)
+            return (error);
+        need = myfs_data_needs(mmp, np, lbn);
+        if (need && (error = myfs_data_reserve(mmp, np, lbn)) != 0) {
+            brelse(bp);
+            return (error);
+        }
+        bzero((char *)bp->b_data + off, PAGE_SIZE - off);
+        if (need)
+            myfs_data_dirty(mmp, np, lbn);
+        bdwrite(bp);
+    }
+
+    np->size = length;
+    vnode_pager_setsize(vp, length);
+    if (np->nlink > 0)
+        myfs_rstat_add(mmp, np->parent, 0, length - osize, 0, 0);
+    if (length < osize) {
+        error = vtruncbuf(vp, length, PAGE_SIZE);
+        if (error)
+            return (error);
+        myfs_data_trunc(mmp, np, howmany(length, PAGE_SIZE));
+    }
+    return (0);
+}
+
+/* Read cache device */
+
+#define MYFS_L2HASH(l2, key) \
+    (&(l2)->hash[((key) * 0x9E3779B97F4A7C15ULL >> 32) & (l2)->hashmask])
+
+static struct myfs_l2slot *
+myfs_l2_find(struct myfs_l2 *l2, uint64_t key)
+{
+    struct myfs_l2slot *sp;
+
+    LIST_FOREACH(sp, MYFS_L2HASH(l2, key), hash) {
+        if (sp->key == key)
+            return (sp);
+    }
+    return (NULL);
+}
+
+/* Forget every slot, as after losing the index. */
+static void
+myfs_l2_reset(struct myfs_l2 *l2)
+{
+    struct myfs_l2slot *sp;
+    uint64_t i;
+
+    rm_wlock(&l2->lock);
+    for (i = 0; i < l2->nslots; i++) {
+        sp = &l2->slots[i];
+        if (sp->key != 0) {
+            LIST_REMOVE(sp, hash);
+            sp->key = 0;
+        }
+        sp->gen++;
+    }
+    rm_wunlock(&l2->lock);
+}
+
+/*
+ * Copy primary block blk into buf from the cache device.  The slot can be
+ * reused while the read is in flight, so its generation is checked again
+ * once the data is in.
+ */
+static int
+myfs_l2_read(struct myfs_l2 *l2, daddr_t blk, char *buf)
+{
+    struct rm_priotracker tracker;
+    struct myfs_l2slot *sp;
+    uint64_t key = blk + 1;
+    u_int gen = 0;
+    void *data;
+    int error;
+
+    rm_rlock(&l2->lock, &tracker);
+    sp = myfs_l2_find(l2, key);
+    if (sp != NULL)
+        gen = sp->gen;
+    rm_runlock(&l2->lock, &tracker);
+    if (sp == NULL) {
+        atomic_add_64(&l2->misses, 1);
+        return (ENOENT);
+    }
+
+    data = g_read_data(l2->dev.cp,
+        (l2->data0 + (sp - l2->slots)) * MYFS_IMG_BSIZE, MYFS_IMG_BSIZE,
+        &error);
+    if (data == NULL)
+        return (error);
+    rm_rlock(&l2->lock, &tracker);
+    if (sp->key != key || sp->gen != gen)
+        error = ESTALE;
+    rm_runlock(&l2->lock, &tracker);
+    if (error == 0) {
+        memcpy(buf, data, MYFS_IMG_BSIZE);
+        atomic_add_64(&l2->hits, 1);
+        counter_u64_add(myfs_st_l2_hits, 1);
+    }
+    g_free(data);
+
+    return (error);
+}
+
+/*
+ * Stage primary block blk, just read from the primary device, for the
+ * cache device.  Blocks arriving while a full batch waits for the writer
+ * are dropped rather than holding up the read.
+ */
+static void
+myfs_l2_feed(struct myfs_l2 *l2, daddr_t blk, const char *data)
+{
+    struct rm_priotracker tracker;
+    struct myfs_l2batch *b;
+    uint64_t key = blk + 1;
+    int found;
+
+    if (l2->failed)
+        return;
+    rm_rlock(&l2->lock, &tracker);
+    found = myfs_l2_find(l2, key) != NULL;
+    rm_runlock(&l2->lock, &tracker);
+    if (found)
+        return;
+
+    mtx_lock(&l2->stage_lock);
+    b = l2->stage;
+    if (b->n == MYFS_L2_BATCH) {
+        mtx_unlock(&l2->stage_lock);
+        atomic_add_64(&l2->drops, 1);
+        return;
+    }
+    b->keys[b->n] = key;
+    memcpy(b->data + b->n * MYFS_IMG_BSIZE, data, MYFS_IMG_BSIZE);
+    if (++b->n == MYFS_L2_BATCH)
+        taskqueue_enqueue(taskqueue_thread, &l2->write_task);
+    mtx_unlock(&l2->stage_lock);
+}
+
+static int
+myfs_l2_write_hdr(struct myfs_l2 *l2, uint32_t magic)
+{
+    struct myfs_l2_hdr *hdr = (struct myfs_l2_hdr *)l2->ibuf;
+
+    memset(l2->ibuf, 0, MYFS_IMG_BSIZE);
+    hdr->magic = htole32(magic);
+    hdr->version = htole32(MYFS_L2_VERSION);
+    hdr->nslots = htole64(l2->nslots);
+    hdr->hand = htole64(l2->hand);
+    hdr->img_ctime = htole64(l2->img_ctime);
+    hdr->img_nblocks = htole64(l2->img_nblocks);
+    hdr->img_gen = htole32(l2->img_gen);
+    return (g_write_data(l2->dev.cp, 0, l2->ibuf, MYFS_IMG_BSIZE));
+}
+
+/*
+ * Write index blocks [first, first + n) from the slot keys, which only
+ * change under wlock.
+ */
+static int
+myfs_l2_write_index(struct myfs_l2 *l2, ssize_t first, ssize_t n)
+{
+    uint64_t slot, end;
+
+    sx_assert(&l2->wlock, SA_XLOCKED);
+    memset(l2->ibuf, 0, n * MYFS_IMG_BSIZE);
+    slot = first * MYFS_L2_IPB;
+    end = MIN(slot + n * MYFS_L2_IPB, l2->nslots);
+    for (; slot < end; slot++) {
+        l2->ibuf[slot - first * MYFS_L2_IPB] =
+            htole64(l2->slots[slot].key);
+    }
+    bit_nclear(l2->idirty, first, first + n - 1);
+    return (g_write_data(l2->dev.cp, (1 + first) * MYFS_IMG_BSIZE, l2->ibuf,
+        n * MYFS_IMG_BSIZE));
+}
+
+static void
+myfs_l2_fail(struct myfs_l2 *l2, int error)
+{
+    printf("MYFS: cache device write error %d, cache disabled\n", error);
+    l2->failed = 1;
+    myfs_l2_reset(l2);
+}
+
+/* Write the staged batch into the slots at the hand. */
+static void
+myfs_l2_write(struct myfs_l2 *l2)
+{
+    struct myfs_l2batch *b;
+    struct myfs_l2slot *sp;
+    int error, i;
+
+    sx_assert(&l2->wlock, SA_XLOCKED);
+    mtx_lock(&l2->stage_lock);
+    b = l2->stage;
+    l2->stage = l2->spare;
+    l2->spare = b;
+    mtx_unlock(&l2->stage_lock);
+    if (b->n == 0 || l2->failed)
+        goto out;
+
+    /* Empty the slots, then make that durable before overwriting them. */
+    rm_wlock(&l2->lock);
+    for (i = 0; i < MYFS_L2_BATCH; i++) {
+        sp = &l2->slots[l2->hand + i];
+        if (sp->key != 0) {
+            LIST_REMOVE(sp, hash);
+            sp->key = 0;
+        }
+        sp->gen++;
+    }
+    rm_wunlock(&l2->lock);
+    if (l2->hdr_valid) {
+        error = myfs_l2_write_index(l2, l2->hand / MYFS_L2_IPB, 1);
+        if (error) {
+            myfs_l2_fail(l2, error);
+            goto out;
+        }
+    }
+
+    error = g_write_data(l2->dev.cp,
+        (l2->data0 + l2->hand) * MYFS_IMG_BSIZE, b->data,
+        b->n * MYFS_IMG_BSIZE);
+    if (error) {
+        myfs_l2_fail(l2, error);
+        goto out;
+    }
+
+    rm_wlock(&l2->lock);
+    for (i = 0; i < b->n; i++) {
+        if (myfs_l2_find(l2, b->keys[i]) != NULL)
+            continue;
+        sp = &l2->slots[l2->hand + i];
+        sp->key = b->keys[i];
+        LIST_INSERT_HEAD(MYFS_L2HASH(l2, sp->key), sp, hash);
+    }
+    rm_wunlock(&l2->lock);
+    bit_set(l2->idirty, l2->hand / MYFS_L2_IPB);
+    l2->hand = (l2->hand + MYFS_L2_BATCH) % l2->nslots;
+
+out:
+    b->n = 0;
+}
+
+/* Write back dirty index blocks, then the header that validates them. */
+static void
+myfs_l2_flush(struct myfs_l2 *l2)
+{
+    ssize_t nidx, first, n;
+    int error;
+
+    sx_assert(&l2->wlock, SA_XLOCKED);
+    if (l2->failed)
+        return;
+
+    nidx = howmany(l2->nslots, MYFS_L2_IPB);
+    for (;;) {
+        bit_ffs(l2->idirty, nidx, &first);
+        if (first == -1)
+            break;
+        for (n = 1; n < MYFS_L2_IOBLKS && first + n < nidx &&
+            bit_test(l2->idirty, first + n); n++)
+            ;
+        error = myfs_l2_write_index(l2, first, n);
+        if (error) {
+            myfs_l2_fail(l2, error);
+            return;
+        }
+    }
+
+    error = myfs_l2_write_hdr(l2, MYFS_L2_MAGIC);
+    if (error) {
+        myfs_l2_fail(l2, error);
+        return;
+    }
+    l2->hdr_valid = 1;
+}
+
+static void
+myfs_l2_write_task(void *arg, int pending __unused)
+{
+    struct myfs_l2 *l2 = arg;
+
+    sx_xlock(&l2->wlock);
+    myfs_l2_write(l2);
+    sx_xunlock(&l2->wlock);
+}
+
+static void
+myfs_l2_flush_task(void *arg, int pending __unused)
+{
+    struct myfs_l2 *l2 = arg;
+
+    sx_xlock(&l2->wlock);
+    myfs_l2_write(l2);
+    myfs_l2_flush(l2);
+    sx_xunlock(&l2->wlock);
+    if (!l2->dying)
+        taskqueue_enqueue_timeout(taskqueue_thread, &l2->flush_task,
+            MYFS_L2_FLUSH * hz);
+}
+
+/*
+ * Rebuild the hash from the index on the device if its header names this
+ * image.  Otherwise start empty: invalidate the header and leave it so
+ * until the first flush has rewritten the whole index.
+ */
+static void
+myfs_l2_load(struct myfs_l2 *l2)
+{
+    struct myfs_l2_hdr *hdr;
+    struct myfs_l2slot *sp;
+    uint64_t *keys, key, slot;
+    ssize_t nidx, i, j, n;
+    void *data;
+    int error;
+
+    nidx = howmany(l2->nslots, MYFS_L2_IPB);
+    data = g_read_data(l2->dev.cp, 0, MYFS_IMG_BSIZE, &error);
+    if (data == NULL)
+        goto fresh;
+    hdr = data;
+    if (le32toh(hdr->magic) != MYFS_L2_MAGIC ||
+        le32toh(hdr->version) != MYFS_L2_VERSION ||
+        le64toh(hdr->nslots) != l2->nslots ||
+        le64toh(hdr->img_ctime) != l2->img_ctime ||
+        le64toh(hdr->img_nblocks) != l2->img_nblocks ||
+        le32toh(hdr->img_gen) != l2->img_gen) {
+        g_free(data);
+        goto fresh;
+    }
+    l2->hand = rounddown(le64toh(hdr->hand) % l2->nslots, MYFS_L2_BATCH);
+    g_free(data);
+
+    for (i = 0; i < nidx; i += n) {
+        n = MIN(nidx - i, MYFS_L2_IOBLKS);
+        data = g_read_data(l2->dev.cp, (1 + i) * MYFS_IMG_BSIZE,
+            n * MYFS_IMG_BSIZE, &error);
+        if (data == NULL) {
+            myfs_l2_reset(l2);
+            goto fresh;
+        }
+        keys = data;
+        for (j = 0; j < n * (ssize_t)MYFS_L2_IPB; j++) {
+            slot = i * MYFS_L2_IPB + j;
+            key = le64toh(keys[j]);
+            if (slot >= l2->nslots)
+                break;
+            if (key == 0 || key > l2->img_nblocks ||
+                myfs_l2_find(l2, key) != NULL)
+                continue;
+            sp = &l2->slots[slot];
+            sp->key = key;
+            LIST_INSERT_HEAD(MYFS_L2HASH(l2, key), sp, hash);
+        }
+        g_free(data);
+    }
+    l2->hdr_valid = 1;
+    return;
+
+fresh:
+    l2->hand = 0;
+    bit_nset(l2->idirty, 0, nidx - 1);
+    error = myfs_l2_write_hdr(l2, 0);
+    if (error)
+        myfs_l2_fail(l2, error);
+}
+
+/*
+ * Attach the cache device named by the cachedev mount option.  Only sealed
+ * images have a data path to cache so far.
+ */
+static int
+myfs_l2_mount(struct mount *mp, struct myfs_mount *mmp)
+{
+    struct myfs_l2 *l2;
+    uint64_t nslots;
+    char *path;
+    int error;
+
+    path = vfs_getopts(mp->mnt_optnew, "cachedev", &error);
+    if (path == NULL)
+        return (0);
+    if ((mmp->mnt_flags & MYFS_MNT_SEALED) == 0)
+        return (EINVAL);
+
+    l2 = malloc(sizeof(*l2), M_TEMP, M_WAITOK | M_ZERO);
+    error = myfs_dev_open(path, 1, &l2->dev);
+    if (error) {
+        free(l2, M_TEMP);
+        return (error);
+    }
+
+    /* As many slots as fit beside their index, in whole batches. */
+    nslots = rounddown((l2->dev.nblocks - 1) * MYFS_L2_IPB /
+        (MYFS_L2_IPB + 1), MYFS_L2_BATCH);
+    while (nslots > 0 &&
+        1 + howmany(nslots, MYFS_L2_IPB) + nslots > l2->dev.nblocks)
+        nslots -= MYFS_L2_BATCH;
+    if (nslots == 0) {
+        myfs_dev_close(&l2->dev);
+        free(l2, M_TEMP);
+        return (EINVAL);
+    }
+    l2->nslots = nslots;
+    l2->data0 = 1 + howmany(nslots, MYFS_L2_IPB);
+    l2->img_ctime = mmp->img.ctime;
+    l2->img_nblocks = mmp->img.nblocks;
+    l2->img_gen = mmp->img.gen;
+
+    l2->slots = malloc(nslots * sizeof(*l2->slots), M_TEMP,
+        M_WAITOK | M_ZERO);
+    l2->hash = hashinit(nslots / 2, M_TEMP, &l2->hashmask);
+    l2->idirty = bit_alloc(howmany(nslots, MYFS_L2_IPB), M_TEMP, M_WAITOK);
+    l2->ibuf = malloc(MYFS_L2_IOBLKS * MYFS_IMG_BSIZE, M_TEMP, M_WAITOK);
+    l2->stage = malloc(sizeof(struct myfs_l2batch), M_TEMP,
+        M_WAITOK | M_ZERO);
+    l2->spare = malloc(sizeof(struct myfs_l2batch), M_TEMP,
+        M_WAITOK | M_ZERO);
+    l2->stage->data = malloc(MYFS_L2_BATCH * MYFS_IMG_BSIZE, M_TEMP,
+        M_WAITOK);
+    l2->spare->data = malloc(MYFS_L2_BATCH * MYFS_IMG_BSIZE, M_TEMP,
+        M_WAITOK);
+    rm_init(&l2->lock, "myfs l2");
+    sx_init(&l2->wlock, "myfs l2 writer");
+    mtx_init(&l2->stage_lock, "myfs l2 stage", NULL, MTX_DEF);
+    TASK_INIT(&l2->write_task, 0, myfs_l2_write_task, l2);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &l2->flush_task, 0,
+        myfs_l2_flush_task, l2);
+
+    myfs_l2_load(l2);
+    mmp->l2 = l2;
+    taskqueue_enqueue_timeout(taskqueue_thread, &l2->flush_task,
+        MYFS_L2_FLUSH * hz);
+
+    return (0);
+}
+
+/* Write out what is staged and the index, then detach the cache device. */
+static void
+myfs_l2_unmount(struct myfs_mount *mmp)
+{
+    struct myfs_l2 *l2 = mmp->l2;
+
+    if (l2 == NULL)
+        return;
+    l2->dying = 1;
+    while (taskqueue_cancel_timeout(taskqueue_thread, &l2->flush_task,
+        NULL) != 0)
+        taskqueue_drain_timeout(taskqueue_thread, &l2->flush_task);
+    taskqueue_drain(taskqueue_thread, &l2->write_task);
+
+    sx_xlock(&l2->wlock);
+    myfs_l2_write(l2);
+    myfs_l2_flush(l2);
+    sx_xunlock(&l2->wlock);
+    printf("MYFS: cache device: %ju hits, %ju misses, %ju dropped\n",
+        (uintmax_t)l2->hits, (uintmax_t)l2->misses, (uintmax_t)l2->drops);
+
+    myfs_l2_reset(l2);
+    hashdestroy(l2->hash, M_TEMP, l2->hashmask);
+    free(l2->slots, M_TEMP);
+    free(l2->idirty, M_TEMP);
+    free(l2->ibuf, M_TEMP);
+    free(l2->stage->data, M_TEMP);
+    free(l2->spare->data, M_TEMP);
+    free(l2->stage, M_TEMP);
+    free(l2->spare, M_TEMP);
+    mtx_destroy(&l2->stage_lock);
+    sx_destroy(&l2->wlock);
+    rm_destroy(&l2->lock);
+    myfs_dev_close(&l2->dev);
+    free(l2, M_TEMP);
+    mmp->l2 = NULL;
+}
+
+/* Access tracing */
+
+/* Append a record to this CPU's ring, dropping it if the ring is full. */
+static void
+myfs_trace_log(struct myfs_mount *mmp, int op, ino_t ino, off_t off,
+    off_t len)
+{
+    struct myfs_tring *tr;
+    struct myfs_trace_rec *r;
+    uint64_t head;
+
+    critical_enter();
+    tr = mmp->trace[curcpu];
+    head = tr->head;
+    if (head - atomic_load_acq_64(&tr->tail) >= mmp->trace_nrecs) {
+        tr->dropped++;
+        critical_exit();
+        return;
+    }
+    r = &tr->recs[head & (mmp->trace_nrecs - 1)];
+    r->time_ns = sbttons(sbinuptime());
+    r->ino = ino;
+    r->off = off;
+    r->len = MIN(len, UINT32_MAX);
+    r->op = op;
+    r->cpu = curcpu;
+    atomic_store_rel_64(&tr->head, head + 1);
+    critical_exit();
+}
+
+/*
+ * Note an access to np.  Only first touches are logged: the first access
+ * to a node in this trace generation, and reads past the furthest offset
+ * logged so far.  Racing readers may both log; that is harmless.
+ */
+static void
+myfs_trace(struct myfs_mount *mmp, int op, struct myfs_node *np, off_t off,
+    off_t len)
+{
+    u_int gen, ngen;
+    off_t end;
+
+    if (atomic_load_acq_int(&mmp->tracing) == 0)
+        return;
+
+    gen = atomic_load_int(&np->trace_gen);
+    ngen = atomic_load_int(&mmp->trace_gen);
+    if (gen != ngen && atomic_cmpset_int(&np->trace_gen, gen, ngen)) {
+        np->trace_hiwat = 0;
+        if (op == MYFS_TRACE_LOOKUP) {
+            myfs_trace_log(mmp, op, np->ino, 0, 0);
+            return;
+        }
+    }
+    if (op == MYFS_TRACE_LOOKUP)
+        return;
+
+    end = off + len;
+    if (end <= np->trace_hiwat)
+        return;
+    off = MAX(off, np->trace_hiwat);
+    np->trace_hiwat = end;
+    myfs_trace_log(mmp, op, np->ino, off, end - off);
+}
+
+static int
+myfs_trace_start(struct myfs_mount *mmp, u_int nrecs)
+{
+    int cpu;
+
+    if (nrecs == 0)
+        nrecs = MYFS_TRACE_DEFRECS;
+    if (nrecs > MYFS_TRACE_MAXRECS)
+        return (EINVAL);
+    nrecs = 1u << fls(nrecs - 1);
+
+    sx_xlock(&mmp->trace_lock);
+    if (mmp->tracing) {
+        sx_xunlock(&mmp->trace_lock);
+        return (EBUSY);
+    }
+
+    /*
+     * Rings are only freed at unmount, since a producer may still be
+     * inside one after tracing is switched off.  A different size needs a
+     * remount.
+     */
+    if (mmp->trace == NULL) {
+        mmp->trace = malloc(sizeof(struct myfs_tring *) * (mp_maxid + 1),
+            M_TEMP, M_WAITOK | M_ZERO);
+        CPU_FOREACH(cpu) {
+            mmp->trace[cpu] = malloc(sizeof(struct myfs_tring) +
+                nrecs * sizeof(struct myfs_trace_rec), M_TEMP,
+                M_WAITOK | M_ZERO);
+        }
+        mmp->trace_nrecs = nrecs;
+    }
+    CPU_FOREACH(cpu) {
+        atomic_store_64(&mmp->trace[cpu]->tail,
+            atomic_load_acq_64(&mmp->trace[cpu]->head));
+        mmp->trace[cpu]->dropped = 0;
+    }
+    atomic_add_int(&mmp->trace_gen, 1);
+    atomic_store_rel_int(&mmp->tracing, 1);
+    sx_xunlock(&mmp->trace_lock);
+
+    return (0);
+}
+
+static int
+myfs_ioc_tracectl(struct myfs_mount *mmp, struct thread *td,
+    struct myfs_trace_ctl *tc)
+{
+    int error;
+
+    error = priv_check(td, PRIV_VFS_MOUNT);
+    if (error)
+        return (error);
+
+    switch (tc->op) {
+    case MYFS_TRACE_START:
+        return (myfs_trace_start(mmp, tc->nrecs));
+    case MYFS_TRACE_STOP:
+        atomic_store_rel_int(&mmp->tracing, 0);
+        return (0);
+    default:
+        return (EINVAL);
+    }
+}
+
+/* Copy out and consume as many records as fit, CPU by CPU. */
+static int
+myfs_ioc_tracedrain(struct myfs_mount *mmp, struct thread *td,
+    struct myfs_trace_drain *dr)
+{
+    struct myfs_tring *tr;
+    uint64_t head, tail, n, idx, chunk;
+    uint32_t done;
+    int cpu, error;
+
+    error = priv_check(td, PRIV_VFS_MOUNT);
+    if (error)
+        return (error);
+
+    sx_xlock(&mmp->trace_lock);
+    done = 0;
+    dr->dropped = 0;
+    if (mmp->trace == NULL)
+        goto out;
+    CPU_FOREACH(cpu) {
+        tr = mmp->trace[cpu];
+        dr->dropped += tr->dropped;
+        tail = tr->tail;
+        head = atomic_load_acq_64(&tr->head);
+        n = MIN(head - tail, dr->nrecs - done);
+        while (n > 0) {
+            idx = tail & (mmp->trace_nrecs - 1);
+            chunk = MIN(n, mmp->trace_nrecs - idx);
+            error = copyout(&tr->recs[idx], dr->recs + done,
+                chunk * sizeof(struct myfs_trace_rec));
+            if (error)
+                goto out;
+            tail += chunk;
+            done += chunk;
+            n -= chunk;
+            atomic_store_rel_64(&tr->tail, tail);
+        }
+    }
+out:
+    sx_xunlock(&mmp->trace_lock);
+    dr->nrecs = done;
+
+    return (error);
+}
+
+static void
+myfs_trace_uninit(struct myfs_mount *mmp)
+{
+    int cpu;
+
+    if (mmp->trace != NULL) {
+        CPU_FOREACH(cpu)
+            free(mmp->trace[cpu], M_TEMP);
+        free(mmp->trace, M_TEMP);
+    }
+    sx_destroy(&mmp->trace_lock);
+}
+
+/* Shared metadata cache for read-only mounts */
+
+#define MYFS_METAHASH(rc, ino) \
+    (&(rc)->hash[(ino) & (MYFS_METAHASHSIZE - 1)])
+
+/*
+ * Attach to the cache for the sealed image mmp has open, creating it on
+ * first use.  The key is the device itself, so every path naming it shares
+ * one cache, plus the image identity, so an image rewritten in place while
+ * an older mount still holds the cache gets a fresh one.
+ */
+static struct myfs_rocache *
+myfs_rocache_get(struct myfs_mount *mmp)
+{
+    struct myfs_rocache *rc;
+    struct cdev *dev = mmp->devvp->v_rdev;
+    int i;
+
+    sx_xlock(&myfs_rocache_lock);
+    LIST_FOREACH(rc, &myfs_rocaches, link) {
+        if (rc->dev == dev && rc->img_ctime == mmp->img.ctime &&
+            rc->img_nblocks == mmp->img.nblocks &&
+            rc->img_gen == mmp->img.gen)
+            break;
+    }
+    if (rc == NULL) {
+        rc = malloc(sizeof(struct myfs_rocache), M_TEMP, M_WAITOK | M_ZERO);
+        rc->dev = dev;
+        rc->img_ctime = mmp->img.ctime;
+        rc->img_nblocks = mmp->img.nblocks;
+        rc->img_gen = mmp->img.gen;
+        rm_init(&rc->lock, "myfs rocache");
+        for (i = 0; i < MYFS_METAHASHSIZE; i++)
+            LIST_INIT(&rc->hash[i]);
+        LIST_INSERT_HEAD(&myfs_rocaches, rc, link);
+    }
+    rc->refs++;
+    sx_xunlock(&myfs_rocache_lock);
+
+    return (rc);
+}
+
+static void
+myfs_rocache_rele(struct myfs_rocache *rc)
+{
+    struct myfs_meta *m;
+    int i;
+
+    sx_xlock(&myfs_rocache_lock);
+    if (--rc->refs > 0) {
+        sx_xunlock(&myfs_rocache_lock);
+        return;
+    }
+    LIST_REMOVE(rc, link);
+    sx_xunlock(&myfs_rocache_lock);
+
+    for (i = 0; i < MYFS_METAHASHSIZE; i++) {
+        while ((m = LIST_FIRST(&rc->hash[i])) != NULL) {
+            LIST_REMOVE(m, link);
+            free(m, M_TEMP);
+        }
+    }
+    rm_destroy(&rc->lock);
+    free(rc, M_TEMP);
+}
+
+static int
+myfs_rocache_lookup(struct myfs_rocache *rc, ino_t ino, struct myfs_meta *out)
+{
+    struct rm_priotracker tracker;
+    struct myfs_meta *m;
+
+    rm_rlock(&rc->lock, &tracker);
+    LIST_FOREACH(m, MYFS_METAHASH(rc, ino), link) {
+        if (m->ino == ino) {
+            if (m->ref == 0)
+                atomic_store_int(&m->ref, 1);
+            *out = *m;
+            break;
+        }
+    }
+    rm_runlock(&rc->lock, &tracker);
+
+    return (m != NULL);
+}
+
+static void
+myfs_rocache_insert(struct myfs_rocache *rc, const struct myfs_meta *in)
+{
+    struct myfs_meta *m, *nm;
+
+    nm = malloc(sizeof(struct myfs_meta), M_TEMP, M_WAITOK);
+    *nm = *in;
+    nm->ref = 1;
+
+    rm_wlock(&rc->lock);
+    LIST_FOREACH(m, MYFS_METAHASH(rc, in->ino), link) {
+        if (m->ino == in->ino)
+            break;
+    }
+    if (m == NULL) {
+        LIST_INSERT_HEAD(MYFS_METAHASH(rc, in->ino), nm, link);
+        rc->count++;
+        nm = NULL;
+    }
+    rm_wunlock(&rc->lock);
+
+    if (nm != NULL)
+        free(nm, M_TEMP);
+}
+
+/*
+ * Drop pct percent of rc's entries, second-chance style: the hand sweeps
+ * the buckets, clearing the reference bit of entries used since its last
+ * visit and freeing the others.
+ */
+static void
+myfs_rocache_trim(struct myfs_rocache *rc, u_int pct)
+{
+    struct myfs_metahead dead;
+    struct myfs_meta *m, *tm;
+    u_int target, scanned;
+
+    LIST_INIT(&dead);
+    rm_wlock(&rc->lock);
+    target = (uint64_t)rc->count * pct / 100;
+    for (scanned = 0; target > 0 && scanned < 2 * MYFS_METAHASHSIZE;
+        scanned++) {
+        LIST_FOREACH_SAFE(m, &rc->hash[rc->hand], link, tm) {
+            if (m->ref) {
+                m->ref = 0;
+                continue;
+            }
+            LIST_REMOVE(m, link);
+            LIST_INSERT_HEAD(&dead, m, link);
+            rc->count--;
+            if (--target == 0)
+                break;
+        }
+        if (m == NULL)
+            rc->hand = (rc->hand + 1) & (MYFS_METAHASHSIZE - 1);
+    }
+    rm_wunlock(&rc->lock);
+
+    while ((m = LIST_FIRST(&dead)) != NULL) {
+        LIST_REMOVE(m, link);
+        free(m, M_TEMP);
+    }
+}
+
+/*
+ * Memory pressure.  On vm_lowmem the private caches give back
+ * vfs.myfs.lowmem_pct percent, coldest first: decoded inodes in the
+ * shared read-only caches, then the absent-name filters and crypto
+ * sessions of vnodes nobody references.  Everything dropped is rebuilt
+ * on demand.  The work runs from a task, off the pagedaemon's back.
+ */
+static u_int myfs_lowmem_pct = 25;
+SYSCTL_UINT(_vfs_myfs, OID_AUTO, lowmem_pct, CTLFLAG_RW, &myfs_lowmem_pct,
+    0, "Percent of myfs caches released on each low-memory event");
+
+static eventhandler_tag myfs_lowmem_tag;
+static struct task myfs_lowmem_task;
+
+/* Release the caches of every pct-th unreferenced vnode of mp. */
+static void
+myfs_lowmem_mount(struct mount *mp, u_int pct)
+{
+    struct myfs_node *np;
+    struct vnode *vp, *mvp;
+    u_int n = 0;
+
+    MNT_VNODE_FOREACH_ALL(vp, mp, mvp) {
+        np = (struct myfs_node *)vp->v_data;
+        if (np == NULL || vrefcnt(vp) > 0 ||
+            (np->bloom == NULL && np->crypt_keys == NULL)) {
+            VI_UNLOCK(vp);
+            continue;
+        }
+        n++;
+        if (n * pct / 100 == (n - 1) * pct / 100) {
+            VI_UNLOCK(vp);
+            continue;
+        }
+        if (vget(vp, LK_EXCLUSIVE | LK_NOWAIT | LK_INTERLOCK) != 0)
+            continue;
+        if (np->bloom != NULL) {
+            free(np->bloom, M_TEMP);
+            np->bloom = NULL;
+            np->bloom_misses = 0;
+            counter_u64_add(myfs_st_lowmem_freed, 1);
+        }
+        if (np->crypt_keys != NULL) {
+            myfs_ckeys_free(np->crypt_keys);
+            np->crypt_keys = NULL;
+            counter_u64_add(myfs_st_lowmem_freed, 1);
+        }
+        vput(vp);
+    }
+}
+
+static void
+myfs_lowmem_trim(void *arg __unused, int pending __unused)
+{
+    struct myfs_rocache *rc;
+    struct myfs_mount *mmp;
+    struct mount *mp, *nmp;
+    u_int pct;
+
+    pct = MIN(myfs_lowmem_pct, 100);
+    if (pct == 0)
+        return;
+
+    sx_slock(&myfs_rocache_lock);
+    LIST_FOREACH(rc, &myfs_rocaches, link)
+        myfs_rocache_trim(rc, pct);
+    sx_sunlock(&myfs_rocache_lock);
+
+    mtx_lock(&mountlist_mtx);
+    for (mp = TAILQ_FIRST(&mountlist); mp != NULL; mp = nmp) {
+        if (mp->mnt_op != &myfs_vfsops ||
+            vfs_busy(mp, MBF_NOWAIT | MBF_MNTLSTLOCK) != 0) {
+            nmp = TAILQ_NEXT(mp, mnt_list);
+            continue;
+        }
+        mmp = (struct myfs_mount *)mp->mnt_data;
+        if (mmp->mnt_flags & MYFS_MNT_SEALED)
+            myfs_lowmem_mount(mp, pct);
+        mtx_lock(&mountlist_mtx);
+        nmp = TAILQ_NEXT(mp, mnt_list);
+        vfs_unbusy(mp);
+    }
+    mtx_unlock(&mountlist_mtx);
+}
+
+static void
+myfs_lowmem(void *arg __unused, int flags __unused)
+{
+    taskqueue_enqueue(taskqueue_thread, &myfs_lowmem_task);
+}
+
+/*
+ * Read and decode an on-disk inode.  Sealed images are the only on-disk
+ * format so far; everything else lives in memory, see myfs_node_alloc(),
+ * and an inode that is not resident does not exist.
+ */
+static int
+myfs_read_dinode(struct myfs_mount *mmp, ino_t ino, struct myfs_meta *m)
+{
+    if ((mmp->mnt_flags & MYFS_MNT_SEALED) == 0)
+        return (ESTALE);
+    return (myfs_img_read_dinode(mmp, ino, m));
+}
+
+/* Fill np for ino, through the shared cache on read-only mounts. */
+static int
+myfs_load_inode(struct myfs_mount *mmp, ino_t ino, struct myfs_node *np)
+{
+    struct myfs_meta m;
+    int error;
+
+    if (mmp->rocache == NULL ||
+        !myfs_rocache_lookup(mmp->rocache, ino, &m)) {
+        error = myfs_read_dinode(mmp, ino, &m);
+        if (error)
+            return (error);
+        if (mmp->rocache != NULL)
+            myfs_rocache_insert(mmp->rocache, &m);
+    }
+
+    np->ino = ino;
+    np->gen = m.gen;
+    np->mode = m.mode;
+    np->nlink = m.nlink;
+    np->size = m.size;
+    np->uid = m.uid;
+    np->gid = m.gid;
+    np->projid = m.projid;
+    np->atime = m.atime;
+    np->mtime = m.mtime;
+    np->ctime = m.ctime;
+    np->daddr = m.daddr;
+    np->dflags = m.dflags;
+    np->crypt = m.crypt;
+
+    return (0);
+}
+
+/* Start the periodic tasks a writable mount needs. */
+static void
+myfs_rw_tasks_start(struct myfs_mount *mmp)
+{
+    taskqueue_enqueue_timeout(taskqueue_thread, &mmp->dq_fold_task, hz);
+    if (mmp->mnt_flags & MYFS_MNT_RSTATS)
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->rs_task, hz);
+    if (mmp->sets[MYFS_DEV_SLOW].ndevs != 0)
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->tier_task,
+            MAX(myfs_tier_interval, 1) * hz);
+    if (mmp->mnt_flags & MYFS_MNT_LOG)
+        taskqueue_enqueue_timeout(taskqueue_thread, &mmp->log_task, hz);
+}
+
+/*
+ * Switch an existing mount between read-write and read-only.  Vnodes keep
+ * the vector they were created with: myfs_img_vops for sealed images, which
+ * stay read-only, and myfs_vops for every node of an in-memory namespace,
+ * see myfs_node_alloc().  So nothing needs flushing either way.
+ */
+static int
+myfs_mount_update(struct mount *mp, struct myfs_mount *mmp)
+{
+    int error;
+
+    if (vfs_flagopt(mp->mnt_optnew, "ro", NULL, 0) &&
+        (mmp->mnt_flags & MYFS_MNT_RDONLY) == 0) {
+        error = VFS_SYNC(mp, MNT_WAIT);
+        if (error)
+            return (error);
+        error = myfs_tier_setrw(mmp, 0);
+        if (error)
+            return (error);
+        mmp->mnt_flags |= MYFS_MNT_RDONLY;
+        return (0);
+    }
+
+    if (!vfs_flagopt(mp->mnt_optnew, "ro", NULL, 0) &&
+        (mmp->mnt_flags & MYFS_MNT_RDONLY) != 0) {
+        if (mmp->mnt_flags & MYFS_MNT_SEALED)
+            return (EROFS);
+        error = myfs_tier_setrw(mmp, 1);
+        if (error)
+            return (error);
+        if (mmp->rocache != NULL) {
+            myfs_rocache_rele(mmp->rocache);
+            mmp->rocache = NULL;
+        }
+        mmp->vops = &myfs_vops;
+        mmp->mnt_flags &= ~MYFS_MNT_RDONLY;
+        myfs_rw_tasks_start(mmp);
+    }
+
+    return (0);
+}
+
+/* Mount function */
+static int
+myfs_mount(struct mount *mp)
+{
+    struct myfs_mount *mmp;
+    struct vnode *vp;
+    char *from;
+    int error = 0;
+
+    printf("MYFS: Mounting filesystem\n");
+
+    if (mp->mnt_flag & MNT_UPDATE)
+        return (myfs_mount_update(mp, (struct myfs_mount *)mp->mnt_data));
+
+    /* Allocate mount structure */
+    mmp = malloc(sizeof(struct myfs_mount), M_TEMP, M_WAITOK | M_ZERO);
+    if (!mmp)
+        return (ENOMEM);
+
+    mp->mnt_data = mmp;
+    mmp->mp = mp;
+
+    /* Initialize superblock */
+    mmp->sb.magic = MYFS_MAGIC;
+    mmp->sb.total_blocks = 0;  // Initialize with actual values
+    mmp->sb.free_blocks = 0;
+
+    /*
+     * Read-only mounts get the read-only vector and skip every periodic
+     * task; mounts of the same device share decoded metadata.  A device
+     * holding a sealed image switches to the sealed vector.
+     */
+
+    from = vfs_getopts(mp->mnt_optnew, "from", &error);
+    error = 0;
+    if (mp->mnt_flag & MNT_RDONLY) {
+        mmp->mnt_flags |= MYFS_MNT_RDONLY;
+        mmp->vops = &myfs_ro_vops;
+    } else
+        mmp->vops = &myfs_vops;
+
+    if (from != NULL) {
+        error = myfs_img_mount(mp, mmp, from);
+        if (error) {
+            free(mmp, M_TEMP);
+            mp->mnt_data = NULL;
+            return (error);
+        }
+        if (mmp->devvp != NULL && (mmp->mnt_flags & MYFS_MNT_RDONLY))
+            mmp->rocache = myfs_rocache_get(mmp);
+    }
+
+    error = myfs_tier_mount(mp, mmp);
+    if (error == 0)
+        error = myfs_l2_mount(mp, mmp);
+    if (error) {
+        myfs_tier_unmount(mmp);
+        if (mmp->rocache != NULL)
+            myfs_rocache_rele(mmp->rocache);
+        if (mmp->devvp != NULL)
+            myfs_img_unmount(mmp);
+        free(mmp, M_TEMP);
+        mp->mnt_data = NULL;
+        return (error);
+    }
+
+    mtx_init(&mmp->resv_lock, "myfs resv", NULL, MTX_DEF);
+    myfs_pcount_init(&mmp->resv, MYFS_RESV_BATCH);
+    mtx_init(&mmp->key_lock, "myfs keys", NULL, MTX_DEF);
+    LIST_INIT(&mmp->keys);
+    myfs_quota_init(mmp);
+
+    vfs_flagopt(mp->mnt_optnew, "rstats", &mmp->mnt_flags, MYFS_MNT_RSTATS);
+    myfs_rstat_init(mmp);
+    myfs_dir_init(mmp);
+
+    TASK_INIT(&mmp->wb_task, 0, myfs_wb_task, mmp);
+    sx_init(&mmp->freeze_lock, "myfs freeze");
+
+    sx_init(&mmp->trace_lock, "myfs trace");
+    vfs_flagopt(mp->mnt_optnew, "trace", &mmp->mnt_flags, MYFS_MNT_TRACE);
+    if (mmp->mnt_flags & MYFS_MNT_TRACE)
+        myfs_trace_start(mmp, 0);
+
+    if ((mmp->mnt_flags & MYFS_MNT_RDONLY) == 0)
+        myfs_rw_tasks_start(mmp);
+
+    /* Set filesystem statistics */
+    mp->mnt_stat.f_iosize = PAGE_SIZE;
+    if (mmp->devvp != NULL)
+        mp->mnt_iosize_max = mmp->devvp->v_rdev->si_iosize_max;
+    mp->mnt_stat.f_blocks = mmp->sb.total_blocks;
+    mp->mnt_stat.f_bfree = mmp->sb.free_blocks;
+    mp->mnt_stat.f_bavail = mmp->sb.free_blocks;
+    mp->mnt_stat.f_namemax = NAME_MAX;
+
+    /* Set VFS flags */
+    vfs_getnewfsid(mp);
+    MNT_ILOCK(mp);
+    mp->mnt_flag |= MNT_LOCAL;
+    mp->mnt_kern_flag |= MNTK_LOOKUP_SHARED | MNTK_EXTENDED_SHARED |
+        MNTK_SUSPENDABLE;
+    MNT_IUNLOCK(mp);
+
+    /* The root of a new in-memory namespace */
+    if ((mmp->mnt_flags & MYFS_MNT_SEALED) == 0) {
+        mmp->ino_next = MYFS_ROOTINO;
+        error = myfs_node_alloc(mp, NULL, NULL, VDIR, 0755, &vp);
+        if (error) {
+            myfs_unmount(mp, MNT_FORCE);
+            return (error);
+        }
+        vput(vp);
+    }
+
+    return (error);
+}
+
+/* Unmount function */
+static int
+myfs_unmount(struct mount *mp, int mntflags)
+{
+    struct myfs_mount *mmp = (struct myfs_mount *)mp->mnt_data;
+    struct myfs_mkey *mk;
+    int error, flags;
+
+    printf("MYFS: Unmounting filesystem\n");
+
+    if (mmp) {
+        /* A forced unmount must not be stranded by a forgotten freeze. */
+        sx_xlock(&mmp->freeze_lock);
+        if (mmp->frozen) {
+            if ((mntflags & MNT_FORCE) == 0) {
+                sx_xunlock(&mmp->freeze_lock);
+                return (EBUSY);
+            }
+            myfs_thaw_locked(mmp);
+        }
+        sx_xunlock(&mmp->freeze_lock);
+
+        flags = 0;
+        if (mntflags & MNT_FORCE)
+            flags |= FORCECLOSE;
+        myfs_tier_stop(mmp);
+        myfs_dir_stop(mmp, 1);
+        error = vflush(mp, 0, flags, curthread);
+        if (error) {
+            myfs_dir_stop(mmp, 0);
+            if (mmp->mnt_flags & MYFS_MNT_TIERED) {
+                mmp->tier_dying = 0;
+                if (mmp->sets[MYFS_DEV_SLOW].ndevs != 0)
+                    taskqueue_enqueue_timeout(taskqueue_thread,
+                        &mmp->tier_task, hz);
+                if (mmp->mnt_flags & MYFS_MNT_LOG)
+                    taskqueue_enqueue_timeout(taskqueue_thread,
+                        &mmp->log_task, hz);
+            }
+            return (error);
+        }
+        taskqueue_drain(taskqueue_thread, &mmp->wb_task);
+        myfs_l2_unmount(mmp);
+        sx_destroy(&mmp->freeze_lock);
+        myfs_trace_uninit(mmp);
+        myfs_rstat_uninit(mmp);
+        mtx_destroy(&mmp->dir_lock);
+        myfs_quota_uninit(mmp);
+        myfs_pcount_destroy(&mmp->resv);
+        mtx_destroy(&mmp->resv_lock);
+        while ((mk = LIST_FIRST(&mmp->keys)) != NULL) {
+            LIST_REMOVE(mk, link);
+            myfs_mkey_free(mk);
+        }
+        mtx_destroy(&mmp->key_lock);
+        if (mmp->rocache != NULL)
+            myfs_rocache_rele(mmp->rocache);
+        if (mmp->devvp != NULL)
+            myfs_img_unmount(mmp);
+        myfs_tier_unmount(mmp);
+        free(mmp, M_TEMP);
+        mp->mnt_data = NULL;
+    }
+
+    return (0);
+}
+
+/* Root vnode function */
+static int
+myfs_root(struct mount *mp, int flags, struct vnode **vpp)
+{
+    struct myfs_mount *mmp = (struct myfs_mount *)mp->mnt_data;
+
+    printf("MYFS: Getting root vnode\n");
+
+    if (mmp->mnt_flags & MYFS_MNT_SEALED)
+        return (myfs_vget(mp, mmp->img.root, flags, vpp));
+    return (myfs_vget(mp, MYFS_ROOTINO, flags, vpp));
+}
+
+/* Statfs function */
+static int
+myfs_statfs(struct mount *mp, struct statfs *sbp)
+{
+    struct myfs_mount *mmp = (struct myfs_mount *)mp->mnt_data;
+    u_int i;
+
+    printf("MYFS: Getting filesystem statistics\n");
+
+    /*
+     * Data devices report their own totals; reserved-but-unallocated
+     * blocks are free on disk, not available.
+     */
+    sbp->f_blocks = mmp->sb.total_blocks;
+    sbp->f_bfree = mmp->sb.free_blocks;
+    if (mmp->sb.ndevs != 0) {
+        sbp->f_blocks = sbp->f_bfree = 0;
+        mtx_lock(&mmp->resv_lock);
+        for (i = 0; i < mmp->sb.ndevs; i++) {
+            sbp->f_blocks += mmp->sb.devs[i].total_blocks;
+            sbp->f_bfree += mmp->sb.devs[i].free_blocks;
+        }
+        mtx_unlock(&mmp->resv_lock);
+    }
+    sbp->f_bavail = myfs_resv_avail(mmp, myfs_pcount_sum(&mmp->resv));
+    sbp->f_files = mmp->img.ninodes;  // Total inodes
+    sbp->f_ffree = 0;  // Free inodes
+    sbp->f_bsize = PAGE_SIZE;
+    sbp->f_iosize = PAGE_SIZE;
+    sbp->f_namemax = NAME_MAX;
+
+    return (0);
+}
+
+/* Vget function - get vnode by inode number */
+static int
+myfs_vget(struct mount *mp, ino_t ino, int flags, struct vnode **vpp)
+{
+    struct myfs_mount *mmp = (struct myfs_mount *)mp->mnt_data;
+    struct thread *td = curthread;
+    struct myfs_node *np;
+    struct vnode *vp;
+    int error;
+
+    printf("MYFS: Getting vnode for ino %ju\n", (uintmax_t)ino);
+
+    error = vfs_hash_get(mp, ino, flags, td, vpp, NULL, NULL);
+    if (error || *vpp != NULL)
+        return (error);
+
+    np = malloc(sizeof(struct myfs_node), M_TEMP, M_WAITOK | M_ZERO);
+    error = myfs_load_inode(mmp, ino, np);
+    if (error) {
+        free(np, M_TEMP);
+        return (error);
+    }
+    mtx_init(&np->ext_lock, "myfs extents", NULL, MTX_DEF);
+    RB_INIT(&np->extents);
+
+    error = getnewvnode(MYFS_NAME, mp, mmp->vops, &vp);
+    if (error) {
+        mtx_destroy(&np->ext_lock);
+        free(np, M_TEMP);
+        return (error);
+    }
+    vp->v_data = np;
+    np->vp = vp;
+    vp->v_type = IFTOVT(np->mode);
+    if ((mmp->mnt_flags & MYFS_MNT_SEALED) && ino == mmp->img.root)
+        vp->v_vflag |= VV_ROOT;
+    VN_LOCK_ASHARE(vp);
+
+    vn_lock(vp, LK_EXCLUSIVE | LK_RETRY);
+    error = insmntque(vp, mp);
+    if (error) {
+        /* insmntque() cleared v_data, so reclaim will not free np. */
+        mtx_destroy(&np->ext_lock);
+        free(np, M_TEMP);
+        *vpp = NULL;
+        return (error);
+    }
+
+    error = vfs_hash_insert(vp, ino, flags, td, vpp, NULL, NULL);
+    if (error || *vpp != NULL)
+        return (error);
+
+    *vpp = vp;
+    return (0);
+}
+
+/*
+ * Volumes without a sealed image keep their namespace in memory.  A node
+ * lives as long as it is linked: its vnode is held, which keeps vnlru
+ * away, and myfs_vget() finds it in the vnode hash.  Once unlinked and
+ * unused, myfs_inactive() frees it.
+ *
+ * Create a node of type and mode in directory dvp, or the root if dvp is
+ * NULL, and return its vnode locked.  Ownership, project and tier hints
+ * come from dvp, see myfs_node_init().  Every node is built on myfs_vops,
+ * the root of a read-only mount included; see myfs_mount_update().
+ */
+static int
+myfs_node_alloc(struct mount *mp, struct vnode *dvp, struct ucred *cred,
+    enum vtype type, mode_t mode, struct vnode **vpp)
+{
+    struct myfs_mount *mmp = (struct myfs_mount *)mp->mnt_data;
+    struct myfs_node *np, *dnp;
+    struct vnode *vp;
+    int error;
+
+    np = malloc(sizeof(struct myfs_node), M_TEMP, M_WAITOK | M_ZERO);
+    np->ino = atomic_fetchadd_64(&mmp->ino_next, 1);
+    np->gen = arc4random();
+    np->mode = VTTOIF(type) | (mode & ALLPERMS);
+    np->nlink = type == VDIR ? 2 : 1;
+    vfs_timestamp(&np->ctime);
+    np->atime = np->mtime = np->ctime;
+    if (dvp != NULL) {
+        dnp = (struct myfs_node *)dvp->v_data;
+        myfs_node_init(np, dnp, cred, type);
+        if ((np->mode & S_ISGID) && !groupmember(np->gid, cred) &&
+            priv_check_cred(cred, PRIV_VFS_SETGID) != 0)
+            np->mode &= ~S_ISGID;
+    } else
+        np->parent = np->ino;
+    myfs_quota_attach(mmp, np);
+    error = myfs_quota_alloc(np->dquot, 0, 1);
+    if (error) {
+        free(np, M_TEMP);
+        return (error);
+    }
+    mtx_init(&np->ext_lock, "myfs extents", NULL, MTX_DEF);
+    RB_INIT(&np->extents);
+    if (type == VDIR)
+        myfs_dir_alloc(np);
+
+    error = getnewvnode(MYFS_NAME, mp, &myfs_vops, &vp);
+    if (error)
+        goto fail;
+    vp->v_data = np;
+    np->vp = vp;
+    vp->v_type = type;
+    if (dvp == NULL)
+        vp->v_vflag |= VV_ROOT;
+    VN_LOCK_ASHARE(vp);
+
+    vn_lock(vp, LK_EXCLUSIVE | LK_RETRY);
+    error = insmntque(vp, mp);
+    if (error)
+        goto fail;
+    error = vfs_hash_insert(vp, np->ino, LK_EXCLUSIVE, curthread, vpp, NULL,
+        NULL);
+    if (error)
+        return (error);
+    KASSERT(*vpp == NULL, ("myfs: inode %ju reused", (uintmax_t)np->ino));
+
+    vhold(vp);
+    np->flags |= MYFS_NODE_HELD;
+    *vpp = vp;
+    return (0);
+
+fail:
+    /* insmntque() cleared v_data, so reclaim will not free np. */
+    myfs_quota_free(np->dquot, 0, 1);
+    if (np->dir != NULL)
+        myfs_dir_free(mmp, np->dir);
+    mtx_destroy(&np->ext_lock);
+    free(np, M_TEMP);
+    *vpp = NULL;
+    return (error);
+}
+
+/*
+ * Turn an NFS file handle back into a vnode.  The vnode hash answers for
+ * resident inodes and myfs_vget() reads the rest straight from the inode
+ * table, so no directory is ever searched.
+ */
+static int
+myfs_fhtovp(struct mount *mp, struct fid *fhp, int flags __unused,
+    struct vnode **vpp)
+{
+    struct myfs_fid mf;
+    struct myfs_node *np;
+    struct vnode *nvp;
+    int error;
+
+    if (fhp->fid_len != sizeof(mf)) {
+        *vpp = NULLVP;
+        return (EINVAL);
+    }
+    memcpy(&mf, fhp->fid_data, sizeof(mf));
+
+    error = myfs_vget(mp, mf.ino, LK_EXCLUSIVE, &nvp);
+    if (error) {
+        *vpp = NULLVP;
+        return (error);
+    }
+    np = (struct myfs_node *)nvp->v_data;
+    if (np->gen != mf.gen || np->nlink == 0) {
+        vput(nvp);
+        *vpp = NULLVP;
+        return (ESTALE);
+    }
+    if (nvp->v_type == VREG)
+        vnode_create_vobject(nvp, np->size, curthread);
+    *vpp = nvp;
+    return (0);
+}
+
+/* Vnode operations implementation */
+
+/*
+ * Lookup in a read-write directory, behind the name cache.  Missing names
+ * are cached too, unless they are about to be created.
+ */
+static int
+myfs_lookup(struct vop_cachedlookup_args *ap)
+{
+    struct vnode *dvp = ap->a_dvp;
+    struct vnode **vpp = ap->a_vpp;
+    struct componentname *cnp = ap->a_cnp;
+    struct myfs_mount *mmp = (struct myfs_mount *)dvp->v_mount->mnt_data;
+    struct myfs_node *dnp = (struct myfs_node *)dvp->v_data;
+    struct myfs_node *np;
+    ino_t ino;
+    int error, modify;
+
+    *vpp = NULL;
+    modify = (cnp->cn_flags & ISLASTCN) &&
+        (cnp->cn_nameiop == DELETE || cnp->cn_nameiop == RENAME);
+    if (modify && (dvp->v_mount->mnt_flag & MNT_RDONLY))
+        return (EROFS);
+
+    error = VOP_ACCESS(dvp, VEXEC, cnp->cn_cred, curthread);
+    if (error)
+        return (error);
+
+    if (cnp->cn_namelen == 1 && cnp->cn_nameptr[0] == '.') {
+        vref(dvp);
+        *vpp = dvp;
+        return (0);
+    }
+
+    if (cnp->cn_flags & ISDOTDOT)
+        return (vn_vget_ino(dvp, dnp->parent, cnp->cn_lkflags, vpp));
+
+    error = myfs_dir_lookup(mmp, dnp, cnp->cn_nameptr, cnp->cn_namelen,
+        &ino);
+    if (error == ENOENT) {
+        if ((cnp->cn_flags & ISLASTCN) &&
+            (cnp->cn_nameiop == CREATE || cnp->cn_nameiop == RENAME)) {
+            if (dvp->v_mount->mnt_flag & MNT_RDONLY)
+                return (EROFS);
+            error = VOP_ACCESS(dvp, VWRITE, cnp->cn_cred, curthread);
+            if (error)
+                return (error);
+            return (EJUSTRETURN);
+        }
+        if ((cnp->cn_flags & MAKEENTRY) && cnp->cn_nameiop != CREATE)
+            cache_enter(dvp, NULL, cnp);
+        return (ENOENT);
+    }
+    if (error)
+        return (error);
+
+    if (modify) {
+        error = VOP_ACCESS(dvp, VWRITE, cnp->cn_cred, curthread);
+        if (error)
+            return (error);
+    }
+    error = myfs_vget(dvp->v_mount, ino, cnp->cn_lkflags, vpp);
+    if (error)
+        return (error);
+
+    /* In a sticky directory only owners remove or rename. */
+    np = (struct myfs_node *)(*vpp)->v_data;
+    if (modify && (dnp->mode & S_ISTXT) &&
+        cnp->cn_cred->cr_uid != dnp->uid && cnp->cn_cred->cr_uid != np->uid &&
+        priv_check_cred(cnp->cn_cred, PRIV_VFS_ADMIN) != 0) {
+        vput(*vpp);
+        *vpp = NULL;
+        return (EPERM);
+    }
+    if (cnp->cn_flags & MAKEENTRY)
+        cache_enter(dvp, *vpp, cnp);
+
+    return (0);
+}
+
+/*
+ * namei() hands create and remove the directory locked exclusively, with
+ * the entry's vnode locked below it.  The index has range locks of its
+ * own, so the directory is downgraded for the index update, letting
+ * lookups, readdir and stat in it go on meanwhile, and taken back
+ * exclusive for its attributes.  An upgrade that would wait lets vp go
+ * first, so that the locks are taken again parent first.  Returns nonzero
+ * if the directory was reclaimed while it was shared.
+ */
+static void
+myfs_dir_share(struct vnode *dvp)
+{
+    VOP_LOCK(dvp, LK_DOWNGRADE);
+}
+
+static int
+myfs_dir_unshare(struct vnode *dvp, struct vnode *vp)
+{
+    if (VOP_LOCK(dvp, LK_TRYUPGRADE) != 0) {
+        VOP_UNLOCK(vp);
+        vn_lock(dvp, LK_UPGRADE | LK_RETRY);
+        vn_lock(vp, LK_EXCLUSIVE | LK_RETRY);
+    }
+    return (VN_IS_DOOMED(dvp));
+}
+
+/* Make a node as vap describes and link it into dvp under cnp's name. */
+static int
+myfs_mknode(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp,
+    struct vattr *vap)
+{
+    struct myfs_mount *mmp = (struct myfs_mount *)dvp->v_mount->mnt_data;
+    struct myfs_node *dnp = (struct myfs_node *)dvp->v_data;
+    struct myfs_node *np;
+    struct vnode *vp;
+    int error;
+
+    *vpp = NULL;
+    if (vap->va_type == VDIR && dnp->nlink >= LINK_MAX)
+        return (EMLINK);
+
+    myfs_dir_share(dvp);
+    error = myfs_node_alloc(dvp->v_mount, dvp, cnp->cn_cred, vap->va_type,
+        vap->va_mode, &vp);
+    if (error) {
+        vn_lock(dvp, LK_UPGRADE | LK_RETRY);
+        return (error);
+    }
+    np = (struct myfs_node *)vp->v_data;
+    error = myfs_dir_insert(mmp, dnp, cnp->cn_nameptr, cnp->cn_namelen,
+        np->ino, IFTODT(np->mode));
+    if (error) {
+        np->nlink = 0;
+        vput(vp);
+        vn_lock(dvp, LK_UPGRADE | LK_RETRY);
+        return (error);
+    }
+    if (cnp->cn_flags & MAKEENTRY)
+        cache_enter(dvp, vp, cnp);
+    *vpp = vp;
+    if (myfs_dir_unshare(dvp, vp))
+        return (0);
+
+    if (vap->va_type == VDIR)
+        dnp->nlink++;
+    myfs_rstat_add(mmp, dnp->ino, dnp->parent, 0, vap->va_type == VREG,
+        vap->va_type == VDIR);
+    vfs_timestamp(&dnp->mtime);
+    dnp->ctime = dnp->mtime;
+    return (0);
+}
+
+static int
+myfs_create(struct vop_create_args *ap)
+{
+    return (myfs_mknode(ap->a_dvp, ap->a_vpp, ap->a_cnp, ap->a_vap));
+}
+
+static int
+myfs_mknod(struct vop_mknod_args *ap)
+{
+    printf("MYFS: Mknod operation\n");
+    return (ENOSYS);
+}
+
+static int
+myfs_open(struct vop_open_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+
+    if (vp->v_type == VREG)
+        vnode_create_vobject(vp, np->size, ap->a_td);
+    return (0);
+}
+
+static int
+myfs_close(struct vop_close_args *ap)
+{
+    printf("MYFS: Close operation\n");
+    return (0);
+}
+
+static int
+myfs_access(struct vop_access_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+
+    if ((ap->a_accmode & VWRITE) &&
+        (vp->v_mount->mnt_flag & MNT_RDONLY) &&
+        (vp->v_type == VREG || vp->v_type == VDIR || vp->v_type == VLNK))
+        return (EROFS);
+    return (vaccess(vp->v_type, np->mode, np->uid, np->gid, ap->a_accmode,
+        ap->a_cred));
+}
+
+/* Directories report their entry slots as their size, see readdir. */
+static int
+myfs_getattr(struct vop_getattr_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct vattr *vap = ap->a_vap;
+
+    VATTR_NULL(vap);
+    vap->va_type = vp->v_type;
+    vap->va_mode = np->mode & ALLPERMS;
+    vap->va_nlink = np->nlink;
+    vap->va_uid = np->uid;
+    vap->va_gid = np->gid;
+    vap->va_fsid = vp->v_mount->mnt_stat.f_fsid.val[0];
+    vap->va_fileid = np->ino;
+    vap->va_size = np->size;
+    if (np->dir != NULL) {
+        sx_slock(&np->dir->blk_lock);
+        vap->va_size = (off_t)np->dir->nblks * MYFS_DIRBLK + 2;
+        sx_sunlock(&np->dir->blk_lock);
+    }
+    vap->va_blocksize = PAGE_SIZE;
+    vap->va_atime = np->atime;
+    vap->va_mtime = np->mtime;
+    vap->va_ctime = np->ctime;
+    vap->va_birthtime = np->ctime;
+    vap->va_gen = np->gen;
+    vap->va_flags = 0;
+    vap->va_rdev = NODEV;
+    vap->va_bytes = np->blocks * PAGE_SIZE;
+    vap->va_filerev = 0;
+
+    return (0);
+}
+
+/* Permission checks follow UFS; file flags are not supported. */
+static int
+myfs_setattr(struct vop_setattr_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct vattr *vap = ap->a_vap;
+    struct ucred *cred = ap->a_cred;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    uid_t ouid, uid;
+    gid_t ogid, gid;
+    int error;
+
+    if (vap->va_type != VNON || vap->va_nlink != VNOVAL ||
+        vap->va_fsid != VNOVAL || vap->va_fileid != VNOVAL ||
+        vap->va_blocksize != VNOVAL || vap->va_rdev != VNOVAL ||
+        (int)vap->va_bytes != VNOVAL || vap->va_gen != VNOVAL)
+        return (EINVAL);
+    if (vap->va_flags != VNOVAL)
+        return (EOPNOTSUPP);
+    if (vp->v_mount->mnt_flag & MNT_RDONLY)
+        return (EROFS);
+
+    if (vap->va_size != VNOVAL) {
+        if (vp->v_type == VDIR)
+            return (EISDIR);
+        if (vp->v_type == VREG && vap->va_size != np->size) {
+            error = myfs_resize(vp, vap->va_size);
+            if (error)
+                return (error);
+            vfs_timestamp(&np->mtime);
+            np->ctime = np->mtime;
+        }
+    }
+
+    if (vap->va_uid != (uid_t)VNOVAL || vap->va_gid != (gid_t)VNOVAL) {
+        uid = vap->va_uid == (uid_t)VNOVAL ? np->uid : vap->va_uid;
+        gid = vap->va_gid == (gid_t)VNOVAL ? np->gid : vap->va_gid;
+        if ((cred->cr_uid != np->uid || uid != np->uid ||
+            (gid != np->gid && !groupmember(gid, cred))) &&
+            (error = priv_check_cred(cred, PRIV_VFS_CHOWN)) != 0)
+            return (error);
+        ouid = np->uid;
+        ogid = np->gid;
+        error = myfs_quota_chown(mmp, np, uid, gid, np->projid);
+        if (error)
+            return (error);
+        if ((np->mode & (S_ISUID | S_ISGID)) &&
+            (uid != ouid || gid != ogid) &&
+            priv_check_cred(cred, PRIV_VFS_RETAINSUGID) != 0)
+            np->mode &= ~(S_ISUID | S_ISGID);
+        vfs_timestamp(&np->ctime);
+    }
+
+    if (vap->va_mode != (mode_t)VNOVAL) {
+        if (cred->cr_uid != np->uid &&
+            (error = priv_check_cred(cred, PRIV_VFS_ADMIN)) != 0)
+            return (error);
+        if (vp->v_type != VDIR && (vap->va_mode & S_ISTXT) &&
+            priv_check_cred(cred, PRIV_VFS_STICKYFILE) != 0)
+            return (EFTYPE);
+        if ((vap->va_mode & S_ISGID) && !groupmember(np->gid, cred) &&
+            (error = priv_check_cred(cred, PRIV_VFS_SETGID)) != 0)
+            return (error);
+        np->mode = (np->mode & S_IFMT) | (vap->va_mode & ALLPERMS);
+        vfs_timestamp(&np->ctime);
+    }
+
+    if (vap->va_atime.tv_sec != VNOVAL || vap->va_mtime.tv_sec != VNOVAL) {
+        error = vn_utimes_perm(vp, vap, cred, curthread);
+        if (error)
+            return (error);
+        if (vap->va_atime.tv_sec != VNOVAL)
+            np->atime = vap->va_atime;
+        if (vap->va_mtime.tv_sec != VNOVAL)
+            np->mtime = vap->va_mtime;
+        vfs_timestamp(&np->ctime);
+    }
+
+    return (0);
+}
+
+static int
+myfs_read(struct vop_read_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct uio *uio = ap->a_uio;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct buf *bp;
+    daddr_t lbn;
+    off_t n;
+    int error, on;
+
+    if (vp->v_type == VDIR)
+        return (EISDIR);
+    if (vp->v_type != VREG)
+        return (EOPNOTSUPP);
+    if (uio->uio_offset < 0)
+        return (EINVAL);
+    if (uio->uio_resid == 0)
+        return (0);
+
+    /* Heat is charged per read call, not per block. */
+    if (mmp->mnt_flags & MYFS_MNT_TIERED) {
+        lbn = uio->uio_offset / PAGE_SIZE;
+        myfs_tier_touch(mmp, np, lbn,
+            howmany(uio->uio_offset + uio->uio_resid, PAGE_SIZE) - lbn);
+    }
+
+    error = 0;
+    while (uio->uio_resid > 0 && uio->uio_offset < np->size) {
+        lbn = uio->uio_offset / PAGE_SIZE;
+        on = uio->uio_offset % PAGE_SIZE;
+        n = MIN(MIN(PAGE_SIZE - on, np->size - uio->uio_offset),
+            uio->uio_resid);
+        error = bread(vp, lbn, PAGE_SIZE, NOCRED, &bp);
+        if (error)
+            break;
+        error = uiomove((char *)bp->b_data + on, n, uio);
+        bqrelse(bp);
+        if (error)
+            break;
+    }
+
+    return (error);
+}
+
+/*
+ * Write through the buffer cache with delayed allocation: a block that
+ * needs space has it reserved before its buffer changes, so a full volume
+ * fails the write with ENOSPC here rather than the flush later.  Buffers
+ * go out as delayed writes unless IO_SYNC asks otherwise.  A buffer that
+ * fails to fill is thrown away, unless it was already dirty, and its
+ * block keeps what it mapped before.
+ */
+static int
+myfs_write(struct vop_write_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct uio *uio = ap->a_uio;
+    int ioflag = ap->a_ioflag;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct buf *bp;
+    daddr_t lbn;
+    off_t osize;
+    ssize_t n, resid;
+    int error, need, on;
+
+    if (vp->v_type == VDIR)
+        return (EISDIR);
+    if (vp->v_type != VREG)
+        return (EOPNOTSUPP);
+    if (ioflag & IO_APPEND)
+        uio->uio_offset = np->size;
+    if (uio->uio_offset < 0)
+        return (EINVAL);
+    if (uio->uio_resid == 0)
+        return (0);
+    error = vn_rlimit_fsize(vp, uio, uio->uio_td);
+    if (error)
+        return (error);
+
+    osize = np->size;
+    resid = uio->uio_resid;
+    while (uio->uio_resid > 0) {
+        lbn = uio->uio_offset / PAGE_SIZE;
+        on = uio->uio_offset % PAGE_SIZE;
+        n = MIN(PAGE_SIZE - on, uio->uio_resid);
+        if (on == 0 && n == PAGE_SIZE)
+            bp = getblk(vp, lbn, PAGE_SIZE, 0, 0, 0);
+        else if (uio->uio_offset - on >= np->size) {
+            bp = getblk(vp, lbn, PAGE_SIZE, 0, 0, 0);
+            vfs_bio_clrbuf(bp);
+        } else {
+            error = bread(vp, lbn, PAGE_SIZE, NOCRED, &bp);
+            if (error)
+                break;
+        }
+
+        need = myfs_data_needs(mmp, np, lbn);
+        error = need ? myfs_data_reserve(mmp, np, lbn) : 0;
+        if (error == 0) {
+            if (uio->uio_offset + n > np->size) {
+                np->size = uio->uio_offset + n;
+                vnode_pager_setsize(vp, np->size);
+            }
+            error = uiomove((char *)bp->b_data + on, n, uio);
+            if (error && need)
+                myfs_data_unreserve(mmp, np, lbn);
+        }
+        if (error) {
+            if (bp->b_flags & B_DELWRI)
+                bdwrite(bp);
+            else {
+                bp->b_flags |= B_INVAL | B_NOCACHE;
+                brelse(bp);
+            }
+            break;
+        }
+        if (need)
+            myfs_data_dirty(mmp, np, lbn);
+
+        if (ioflag & IO_SYNC) {
+            error = bwrite(bp);
+            if (error)
+                break;
+        } else
+            bdwrite(bp);
+    }
+
+    if (np->size > osize && np->nlink > 0)
+        myfs_rstat_add(mmp, np->parent, 0, np->size - osize, 0, 0);
+    if ((ioflag & IO_SYNC) == 0)
+        myfs_wb_check(mmp);
+    if (error && (ioflag & IO_UNIT)) {
+        if (np->size > osize)
+            (void)myfs_resize(vp, osize);
+        uio->uio_offset -= resid - uio->uio_resid;
+        uio->uio_resid = resid;
+    }
+    if (uio->uio_resid < resid) {
+        vfs_timestamp(&np->mtime);
+        np->ctime = np->mtime;
+        if ((np->mode & (S_ISUID | S_ISGID)) && ap->a_cred != NULL &&
+            priv_check_cred(ap->a_cred, PRIV_VFS_RETAINSUGID) != 0)
+            np->mode &= ~(S_ISUID | S_ISGID);
+    }
+
+    return (error);
+}
+
+static int
+myfs_ioctl(struct vop_ioctl_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+
+    printf("MYFS: Ioctl operation\n");
+
+    if (mmp->mnt_flags & MYFS_MNT_RDONLY) {
+        switch (ap->a_command) {
+        case MYFS_IOC_SETQUOTA:
+        case MYFS_IOC_SETPROJID:
+        case MYFS_IOC_FREEZE:
+        case MYFS_IOC_THAW:
+        case MYFS_IOC_SETTIER:
+            return (EROFS);
+        }
+    }
+
+    switch (ap->a_command) {
+    case MYFS_IOC_SETQUOTA:
+        return (myfs_ioc_setquota(mmp, ap->a_td,
+            (struct myfs_quota_args *)ap->a_data));
+    case MYFS_IOC_GETQUOTA:
+        return (myfs_ioc_getquota(mmp, ap->a_cred,
+            (struct myfs_quota_args *)ap->a_data));
+    case MYFS_IOC_SETPROJID:
+        return (myfs_ioc_setprojid(mmp, vp, ap->a_td,
+            (struct myfs_projid_args *)ap->a_data));
+    case MYFS_IOC_GETPROJUSAGE:
+        return (myfs_ioc_getprojusage(mmp, vp,
+            (struct myfs_projusage_args *)ap->a_data));
+    case MYFS_IOC_GETRSTAT:
+        return (myfs_ioc_getrstat(mmp, vp,
+            (struct myfs_rstat_args *)ap->a_data));
+    case MYFS_IOC_FREEZE:
+        return (myfs_freeze(mmp, ap->a_td));
+    case MYFS_IOC_THAW:
+        return (myfs_thaw(mmp, ap->a_td));
+    case MYFS_IOC_TRACECTL:
+        return (myfs_ioc_tracectl(mmp, ap->a_td,
+            (struct myfs_trace_ctl *)ap->a_data));
+    case MYFS_IOC_TRACEDRAIN:
+        return (myfs_ioc_tracedrain(mmp, ap->a_td,
+            (struct myfs_trace_drain *)ap->a_data));
+    case MYFS_IOC_SETTIER:
+        return (myfs_ioc_settier(mmp, vp, ap->a_cred,
+            (struct myfs_tier_args *)ap->a_data));
+    case MYFS_IOC_GETTIER:
+        return (myfs_ioc_gettier(mmp, vp,
+            (struct myfs_tier_args *)ap->a_data));
+    case MYFS_IOC_ADDKEY:
+        return (myfs_ioc_addkey(mmp, ap->a_td,
+            (struct myfs_key_args *)ap->a_data));
+    case MYFS_IOC_RMKEY:
+        return (myfs_ioc_rmkey(mmp, ap->a_td,
+            (struct myfs_key_args *)ap->a_data));
+    case MYFS_IOC_GETPOLICY:
+        return (myfs_ioc_getpolicy(vp,
+            (struct myfs_policy_args *)ap->a_data));
+    default:
+        return (ENOTTY);
+    }
+}
+
+static int
+myfs_poll(struct vop_poll_args *ap)
+{
+    return (vop_stdpoll(ap));
+}
+
+static int
+myfs_reclaim(struct vop_reclaim_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    struct myfs_node *node;
+
+    printf("MYFS: Reclaim vnode\n");
+
+    vfs_hash_remove(vp);
+    node = (struct myfs_node *)vp->v_data;
+    if (node) {
+        myfs_tier_reclaim((struct myfs_mount *)vp->v_mount->mnt_data, node);
+        if (node->crypt_keys != NULL)
+            myfs_ckeys_free(node->crypt_keys);
+        free(node->bloom, M_TEMP);
+        if (node->dir != NULL)
+            myfs_dir_free((struct myfs_mount *)vp->v_mount->mnt_data,
+                node->dir);
+        if (node->flags & MYFS_NODE_HELD)
+            vdrop(vp);
+        mtx_destroy(&node->ext_lock);
+        free(node, M_TEMP);
+        vp->v_data = NULL;
+    }
+
+    return (0);
+}
+
+static int
+myfs_readdir(struct vop_readdir_args *ap)
+{
+    struct myfs_node *np = (struct myfs_node *)ap->a_vp->v_data;
+
+    printf("MYFS: Readdir operation\n");
+    if (np->dir != NULL)
+        return (myfs_dir_readdir(ap));
+    return (ENOSYS);
+}
+
+static int
+myfs_readlink(struct vop_readlink_args *ap)
+{
+    printf("MYFS: Readlink operation\n");
+    return (ENOSYS);
 }
 
-/* Unmount function */
 static int
-myfs_unmount(struct mount *mp)
+myfs_symlink(struct vop_symlink_args *ap)
 {
-    struct myfs_mount *mmp = (struct myfs_mount *)mp->mnt_data;
+    printf("MYFS: Symlink operation\n");
+    return (ENOSYS);
+}
 
-    printf("MYFS: Unmounting filesystem\n");
+static int
+myfs_remove(struct vop_remove_args *ap)
+{
+    struct vnode *dvp = ap->a_dvp;
+    struct vnode *vp = ap->a_vp;
+    struct componentname *cnp = ap->a_cnp;
+    struct myfs_mount *mmp = (struct myfs_mount *)dvp->v_mount->mnt_data;
+    struct myfs_node *dnp = (struct myfs_node *)dvp->v_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    ino_t ino;
+    int error;
 
-    if (mmp) {
-        free(mmp, M_TEMP);
-        mp->mnt_data = NULL;
+    if (vp->v_type == VDIR)
+        return (EPERM);
+    myfs_dir_share(dvp);
+    error = myfs_dir_remove(mmp, dnp, cnp->cn_nameptr, cnp->cn_namelen,
+        &ino);
+    if (error) {
+        myfs_dir_unshare(dvp, vp);
+        return (error);
     }
+    KASSERT(ino == np->ino, ("myfs: %s maps to %ju, not %ju",
+        cnp->cn_nameptr, (uintmax_t)ino, (uintmax_t)np->ino));
+    cache_purge(vp);
+    np->nlink--;
+    vfs_timestamp(&np->ctime);
+    if (myfs_dir_unshare(dvp, vp))
+        return (0);
 
+    myfs_rstat_add(mmp, dnp->ino, dnp->parent, -np->size,
+        -(vp->v_type == VREG), 0);
+    dnp->mtime = dnp->ctime = np->ctime;
     return (0);
 }
 
-/* Root vnode function */
+/*
+ * Rename.  A directory only moves within its parent: moving it elsewhere
+ * would need a walk up from the target to check that it is not moved
+ * below itself, and EXDEV has mv(1) copy it instead.  fdvp and fvp come
+ * in unlocked and their locks are only tried, since tdvp is held; if one
+ * is busy, the caller looks both paths up again on ERELOOKUP.
+ */
 static int
-myfs_root(struct mount *mp, struct vnode **vpp)
+myfs_rename(struct vop_rename_args *ap)
 {
-    // Implement getting root directory vnode
-    printf("MYFS: Getting root vnode\n");
-    return (ENOSYS);
-}
+    struct vnode *fdvp = ap->a_fdvp;
+    struct vnode *fvp = ap->a_fvp;
+    struct vnode *tdvp = ap->a_tdvp;
+    struct vnode *tvp = ap->a_tvp;
+    struct componentname *fcnp = ap->a_fcnp;
+    struct componentname *tcnp = ap->a_tcnp;
+    struct myfs_mount *mmp = (struct myfs_mount *)tdvp->v_mount->mnt_data;
+    struct myfs_node *fdnp, *fnp, *tdnp, *tnp;
+    struct vnode *busy;
+    ino_t ino;
+    int error;
 
-/* Statfs function */
-static int
-myfs_statfs(struct mount *mp, struct statfs *sbp)
-{
-    struct myfs_mount *mmp = (struct myfs_mount *)mp->mnt_data;
+    if (fvp->v_mount != tdvp->v_mount ||
+        (tvp != NULL && fvp->v_mount != tvp->v_mount)) {
+        error = EXDEV;
+        goto out;
+    }
+    if (fvp == tvp) {
+        error = 0;
+        goto out;
+    }
+    if (fvp->v_type == VDIR && fdvp != tdvp) {
+        error = EXDEV;
+        goto out;
+    }
+    error = 0;
+    if (tvp != NULL) {
+        if (fvp->v_type == VDIR && tvp->v_type != VDIR)
+            error = ENOTDIR;
+        else if (fvp->v_type != VDIR && tvp->v_type == VDIR)
+            error = EISDIR;
+        else if (tvp->v_type == VDIR &&
+            ((struct myfs_node *)tvp->v_data)->dir->count != 0)
+            error = ENOTEMPTY;
+        if (error)
+            goto out;
+    }
 
-    printf("MYFS: Getting filesystem statistics\n");
+    busy = NULL;
+    if (fdvp != tdvp && vn_lock(fdvp, LK_EXCLUSIVE | LK_NOWAIT) != 0)
+        busy = fdvp;
+    else if (vn_lock(fvp, LK_EXCLUSIVE | LK_NOWAIT) != 0) {
+        if (fdvp != tdvp)
+            VOP_UNLOCK(fdvp);
+        busy = fvp;
+    }
+    if (busy != NULL) {
+        VOP_UNLOCK(tdvp);
+        if (tvp != NULL && tvp != tdvp)
+            VOP_UNLOCK(tvp);
+        if (vn_lock(busy, LK_EXCLUSIVE) == 0)
+            VOP_UNLOCK(busy);
+        vrele(fdvp);
+        vrele(fvp);
+        vrele(tdvp);
+        if (tvp != NULL)
+            vrele(tvp);
+        return (ERELOOKUP);
+    }
 
-    sbp->f_blocks = mmp->sb.total_blocks;
-    sbp->f_bfree = mmp->sb.free_blocks;
-    sbp->f_bavail = mmp->sb.free_blocks;
-    sbp->f_files = 0;  // Total inodes
-    sbp->f_ffree = 0;  // Free inodes
-    sbp->f_bsize = PAGE_SIZE;
-    sbp->f_iosize = PAGE_SIZE;
-    sbp->f_namemax = NAME_MAX;
+    fdnp = (struct myfs_node *)fdvp->v_data;
+    fnp = (struct myfs_node *)fvp->v_data;
+    tdnp = (struct myfs_node *)tdvp->v_data;
 
-    return (0);
+    /* The source may have gone while it was unlocked. */
+    error = myfs_dir_lookup(mmp, fdnp, fcnp->cn_nameptr, fcnp->cn_namelen,
+        &ino);
+    if (error == 0 && ino != fnp->ino)
+        error = ENOENT;
+    if (error)
+        goto unlock;
+
+    if (tvp != NULL) {
+        tnp = (struct myfs_node *)tvp->v_data;
+        error = myfs_dir_remove(mmp, tdnp, tcnp->cn_nameptr,
+            tcnp->cn_namelen, &ino);
+        if (error)
+            goto unlock;
+        if (tvp->v_type == VDIR) {
+            tdnp->nlink--;
+            tnp->nlink = 0;
+        } else
+            tnp->nlink--;
+        myfs_rstat_add(mmp, tdnp->ino, tdnp->parent,
+            tvp->v_type == VREG ? -tnp->size : 0, -(tvp->v_type == VREG),
+            -(tvp->v_type == VDIR));
+        vfs_timestamp(&tnp->ctime);
+    }
+    error = myfs_dir_insert(mmp, tdnp, tcnp->cn_nameptr, tcnp->cn_namelen,
+        fnp->ino, IFTODT(fnp->mode));
+    if (error)
+        goto unlock;
+    error = myfs_dir_remove(mmp, fdnp, fcnp->cn_nameptr, fcnp->cn_namelen,
+        &ino);
+    KASSERT(error == 0, ("myfs: rename source vanished"));
+    cache_vop_rename(fdvp, fvp, tdvp, tvp, fcnp, tcnp);
+    if (fdvp != tdvp && fvp->v_type == VREG) {
+        myfs_rstat_add(mmp, fdnp->ino, fdnp->parent, -fnp->size, -1, 0);
+        myfs_rstat_add(mmp, tdnp->ino, tdnp->parent, fnp->size, 1, 0);
+    }
+
+    fnp->parent = tdnp->ino;
+    vfs_timestamp(&fnp->ctime);
+    fdnp->mtime = fdnp->ctime = fnp->ctime;
+    tdnp->mtime = tdnp->ctime = fnp->ctime;
+
+unlock:
+    VOP_UNLOCK(fvp);
+    if (fdvp != tdvp)
+        VOP_UNLOCK(fdvp);
+out:
+    if (tdvp == tvp)
+        vrele(tdvp);
+    else
+        vput(tdvp);
+    if (tvp != NULL)
+        vput(tvp);
+    vrele(fdvp);
+    vrele(fvp);
+    return (error);
 }
 
-/* Vget function - get vnode by inode number */
 static int
-myfs_vget(struct mount *mp, ino_t ino, struct vnode **vpp)
+myfs_mkdir(struct vop_mkdir_args *ap)
 {
-    // Implement getting vnode by inode number
-    printf("MYFS: Getting vnode for ino %ju\n", (uintmax_t)ino);
-    return (ENOSYS);
+    return (myfs_mknode(ap->a_dvp, ap->a_vpp, ap->a_cnp, ap->a_vap));
 }
 
-/* Vnode operations implementation */
-
 static int
-myfs_lookup(struct vop_lookup_args *ap)
+myfs_rmdir(struct vop_rmdir_args *ap)
 {
-    printf("MYFS: Lookup operation\n");
-    return (ENOSYS);
+    struct vnode *dvp = ap->a_dvp;
+    struct vnode *vp = ap->a_vp;
+    struct componentname *cnp = ap->a_cnp;
+    struct myfs_mount *mmp = (struct myfs_mount *)dvp->v_mount->mnt_data;
+    struct myfs_node *dnp = (struct myfs_node *)dvp->v_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    ino_t ino;
+    int error;
+
+    if (np->dir->count != 0)
+        return (ENOTEMPTY);
+    error = myfs_dir_remove(mmp, dnp, cnp->cn_nameptr, cnp->cn_namelen,
+        &ino);
+    if (error)
+        return (error);
+
+    cache_vop_rmdir(dvp, vp);
+    dnp->nlink--;
+    np->nlink = 0;
+    myfs_rstat_add(mmp, dnp->ino, dnp->parent, 0, 0, -1);
+    vfs_timestamp(&dnp->mtime);
+    dnp->ctime = np->ctime = dnp->mtime;
+    return (0);
 }
 
+/* An unlinked node goes with its last reference, data and all. */
 static int
-myfs_create(struct vop_create_args *ap)
+myfs_inactive(struct vop_inactive_args *ap)
 {
-    printf("MYFS: Create operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+
+    printf("MYFS: Inactive operation\n");
+
+    if (np == NULL || np->nlink > 0)
+        return (0);
+    if (vp->v_type == VREG) {
+        vinvalbuf(vp, 0, 0, 0);
+        vnode_pager_setsize(vp, 0);
+        myfs_data_trunc(mmp, np, 0);
+        np->size = 0;
+    }
+    if (np->flags & MYFS_NODE_HELD)
+        myfs_quota_free(np->dquot, 0, 1);
+    if (np->flags & MYFS_NODE_HELD) {
+        np->flags &= ~MYFS_NODE_HELD;
+        vdrop(vp);
+    }
+    vrecycle(vp);
+    return (0);
 }
 
 static int
-myfs_mknod(struct vop_mknod_args *ap)
+myfs_truncate(struct vop_truncate_args *ap)
 {
-    printf("MYFS: Mknod operation\n");
+    printf("MYFS: Truncate operation\n");
     return (ENOSYS);
 }
 
+/* fsync function */
 static int
-myfs_open(struct vop_open_args *ap)
+myfs_fsync(struct vop_fsync_args *ap)
 {
-    printf("MYFS: Open operation\n");
-    return (0);
+    printf("MYFS: Fsync operation on vnode %p, waitfor: %d\n", ap->a_vp,
+        ap->a_waitfor);
+
+    /* Dirty buffers get their blocks placed as they go out. */
+    return (vop_stdfsync(ap));
 }
 
+/*
+ * File buffers are handed to the data device's bufobj, as UFS does with
+ * its device.  Reads of holes and of blocks only reserved come back
+ * zeroed; writes of reserved blocks place them first, see myfs_place().
+ * Placement changes the extent map, which writes are allowed to because
+ * every path that pushes a file's buffers holds its vnode lock
+ * exclusively.  A failed placement leaves the buffer dirty for the next
+ * flush.  On zoned volumes a block is placed and written in one go under
+ * the zone lock, see myfs_zone_strategy().
+ */
 static int
-myfs_close(struct vop_close_args *ap)
+myfs_strategy(struct vop_strategy_args *ap)
 {
-    printf("MYFS: Close operation\n");
+    struct vnode *vp = ap->a_vp;
+    struct buf *bp = ap->a_bp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    daddr_t pbn;
+    u_int dev;
+    int error;
+
+    if (bp->b_iocmd == BIO_READ) {
+        if (myfs_data_map(np, bp->b_lblkno, &dev, &pbn, NULL, NULL) != 0) {
+            vfs_bio_clrbuf(bp);
+            bufdone(bp);
+            return (0);
+        }
+    } else {
+        ASSERT_VOP_ELOCKED(vp, "myfs_strategy");
+        if (mmp->mnt_flags & MYFS_MNT_ZONED)
+            sx_xlock(&mmp->zone_lock);
+        error = myfs_place(mmp, np, bp->b_lblkno, &dev, &pbn);
+        if (error == 0 && myfs_zone_seq(&mmp->devs[dev], pbn)) {
+            bp->b_blkno = pbn * btodb(PAGE_SIZE);
+            myfs_zone_strategy(&mmp->devs[dev], bp, pbn);
+            sx_xunlock(&mmp->zone_lock);
+            return (0);
+        }
+        if (mmp->mnt_flags & MYFS_MNT_ZONED)
+            sx_xunlock(&mmp->zone_lock);
+        if (error) {
+            bp->b_error = error;
+            bp->b_ioflags |= BIO_ERROR;
+            bufdone(bp);
+            return (0);
+        }
+    }
+
+    bp->b_blkno = pbn * btodb(PAGE_SIZE);
+    bp->b_iooffset = dbtob(bp->b_blkno);
+    BO_STRATEGY(&mmp->devs[dev].devvp->v_bufobj, bp);
     return (0);
 }
 
+/* For the vnode pager: holes, and reserved blocks, read as zeroes. */
 static int
-myfs_access(struct vop_access_args *ap)
+myfs_bmap(struct vop_bmap_args *ap)
 {
-    printf("MYFS: Access operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    daddr_t pbn;
+    u_int dev;
+
+    if (myfs_data_map(np, ap->a_bn, &dev, &pbn, ap->a_runp,
+        ap->a_runb) != 0) {
+        if (ap->a_bop != NULL)
+            *ap->a_bop = &vp->v_bufobj;
+        if (ap->a_bnp != NULL)
+            *ap->a_bnp = -1;
+        if (ap->a_runp != NULL)
+            *ap->a_runp = 0;
+        if (ap->a_runb != NULL)
+            *ap->a_runb = 0;
+        return (0);
+    }
+
+    if (ap->a_bop != NULL)
+        *ap->a_bop = &mmp->devs[dev].devvp->v_bufobj;
+    if (ap->a_bnp != NULL)
+        *ap->a_bnp = pbn * btodb(PAGE_SIZE);
+    return (0);
 }
 
 static int
-myfs_getattr(struct vop_getattr_args *ap)
+myfs_vptofh(struct vop_vptofh_args *ap)
 {
-    printf("MYFS: Getattr operation\n");
-    return (ENOSYS);
+    struct myfs_node *np = (struct myfs_node *)ap->a_vp->v_data;
+    struct myfs_fid mf;
+
+    mf.ino = np->ino;
+    mf.gen = np->gen;
+    mf.pad = 0;
+    ap->a_fhp->fid_len = sizeof(mf);
+    memcpy(ap->a_fhp->fid_data, &mf, sizeof(mf));
+    return (0);
 }
 
-static int
-myfs_setattr(struct vop_setattr_args *ap)
+/* Sealed image vnode operations */
+
+/*
+ * Files are contiguous on the device, so reads go straight to the device's
+ * buffers with readahead over the next blocks of the same file.  Opening a
+ * file for read starts the first window, see myfs_img_prefetch().
+ */
+#define MYFS_IMG_RA 8   /* readahead blocks */
+
+static int myfs_img_prefetch_on = 1;
+SYSCTL_INT(_vfs_myfs, OID_AUTO, prefetch, CTLFLAG_RW, &myfs_img_prefetch_on,
+    0, "Start reading sealed files when they are opened for read");
+
+/*
+ * Queue asynchronous reads of the first blocks of np, so the first read
+ * finds them cached or in flight.  For a compressed file they hold the
+ * chunk offset table and the first chunks.  breada() skips cached
+ * blocks; mounts with a cache device leave misses to it.
+ */
+static void
+myfs_img_prefetch(struct myfs_mount *mmp, struct myfs_node *np)
 {
-    printf("MYFS: Setattr operation\n");
-    return (ENOSYS);
+    daddr_t rablks[MYFS_IMG_RA];
+    int rasizes[MYFS_IMG_RA];
+    int i, n;
+
+    if (!myfs_img_prefetch_on || mmp->l2 != NULL)
+        return;
+    n = MIN(MYFS_IMG_RA, howmany(np->size, MYFS_IMG_BSIZE));
+    n = MIN(n, mmp->img.nblocks - np->daddr);
+    for (i = 0; i < n; i++) {
+        rablks[i] = (np->daddr + i) * btodb(MYFS_IMG_BSIZE);
+        rasizes[i] = MYFS_IMG_BSIZE;
+    }
+    if (n > 0) {
+        breada(mmp->devvp, rablks, rasizes, n, NOCRED, 0, NULL);
+        counter_u64_add(myfs_st_prefetch, n);
+    }
 }
 
 static int
-myfs_read(struct vop_read_args *ap)
+myfs_img_open(struct vop_open_args *ap)
 {
-    printf("MYFS: Read operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct myfs_ckeys *ck;
+    int error;
+
+    /* Encrypted files cannot be opened without their key. */
+    if (vp->v_type == VREG && (np->dflags & MYFS_IMG_I_CRYPT)) {
+        error = myfs_crypt_session(mmp, np, &ck);
+        if (error)
+            return (error);
+    }
+    if (vp->v_type == VREG) {
+        vnode_create_vobject(vp, np->size, ap->a_td);
+        if (ap->a_mode & FREAD)
+            myfs_img_prefetch(mmp, np);
+    }
+    return (0);
 }
 
 static int
-myfs_write(struct vop_write_args *ap)
+myfs_img_access(struct vop_access_args *ap)
 {
-    printf("MYFS: Write operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+
+    if ((ap->a_accmode & VWRITE) &&
+        (vp->v_type == VREG || vp->v_type == VDIR || vp->v_type == VLNK))
+        return (EROFS);
+    return (vaccess(vp->v_type, np->mode, np->uid, np->gid, ap->a_accmode,
+        ap->a_cred));
 }
 
 static int
-myfs_ioctl(struct vop_ioctl_args *ap)
+myfs_img_getattr(struct vop_getattr_args *ap)
 {
-    printf("MYFS: Ioctl operation\n");
-    return (ENOTTY);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct vattr *vap = ap->a_vap;
+
+    VATTR_NULL(vap);
+    vap->va_type = vp->v_type;
+    vap->va_mode = np->mode & ALLPERMS;
+    vap->va_nlink = np->nlink;
+    vap->va_uid = np->uid;
+    vap->va_gid = np->gid;
+    vap->va_fsid = vp->v_mount->mnt_stat.f_fsid.val[0];
+    vap->va_fileid = np->ino;
+    vap->va_size = np->size;
+    vap->va_blocksize = MYFS_IMG_BSIZE;
+    vap->va_atime = np->atime;
+    vap->va_mtime = np->mtime;
+    vap->va_ctime = np->ctime;
+    vap->va_birthtime = np->ctime;
+    vap->va_gen = np->gen;
+    vap->va_flags = 0;
+    vap->va_rdev = NODEV;
+    vap->va_bytes = roundup(np->size, MYFS_IMG_BSIZE);
+    vap->va_filerev = 0;
+
+    return (0);
 }
 
 static int
-myfs_poll(struct vop_poll_args *ap)
+myfs_img_lookup(struct vop_cachedlookup_args *ap)
 {
-    printf("MYFS: Poll operation\n");
-    return (ENOSYS);
+    struct vnode *dvp = ap->a_dvp;
+    struct vnode **vpp = ap->a_vpp;
+    struct componentname *cnp = ap->a_cnp;
+    struct myfs_mount *mmp = (struct myfs_mount *)dvp->v_mount->mnt_data;
+    struct myfs_node *dnp = (struct myfs_node *)dvp->v_data;
+    struct myfs_img_dirhdr hdr;
+    struct myfs_ckeys *ck;
+    char ename[NAME_MAX];
+    size_t elen;
+    ino_t ino;
+    int error;
+
+    *vpp = NULL;
+    if ((cnp->cn_flags & ISLASTCN) &&
+        (cnp->cn_nameiop == DELETE || cnp->cn_nameiop == RENAME))
+        return (EROFS);
+
+    error = VOP_ACCESS(dvp, VEXEC, cnp->cn_cred, curthread);
+    if (error)
+        return (error);
+
+    if (cnp->cn_namelen == 1 && cnp->cn_nameptr[0] == '.') {
+        vref(dvp);
+        *vpp = dvp;
+        return (0);
+    }
+
+    if (cnp->cn_flags & ISDOTDOT) {
+        error = myfs_img_pread(mmp, dnp->daddr * MYFS_IMG_BSIZE, &hdr,
+            sizeof(hdr));
+        if (error)
+            return (error);
+        return (vn_vget_ino(dvp, le64toh(hdr.parent), cnp->cn_lkflags,
+            vpp));
+    }
+
+    /*
+     * Encrypted directories are sorted by encrypted name.  Sealed images
+     * never change, so in a case-insensitive directory every spelling a
+     * caller uses can be cached as its own entry, positive or negative.
+     */
+    if (dnp->dflags & MYFS_IMG_I_CRYPT) {
+        error = myfs_crypt_session(mmp, dnp, &ck);
+        if (error == 0)
+            error = myfs_crypt_name(ck, cnp->cn_nameptr, cnp->cn_namelen,
+                ename, &elen);
+        if (error == 0)
+            error = myfs_img_dirlookup(mmp, dnp, ename, elen, &ino);
+    } else if (dnp->dflags & MYFS_IMG_I_CASEFOLD)
+        error = myfs_img_foldlookup(mmp, dnp, cnp->cn_nameptr,
+            cnp->cn_namelen, &ino);
+    else
+        error = myfs_img_dirlookup(mmp, dnp, cnp->cn_nameptr,
+            cnp->cn_namelen, &ino);
+    if (error == ENOENT) {
+        if (cnp->cn_flags & MAKEENTRY)
+            cache_enter(dvp, NULL, cnp);
+        if ((cnp->cn_flags & ISLASTCN) && cnp->cn_nameiop == CREATE)
+            return (EROFS);
+        return (ENOENT);
+    }
+    if (error)
+        return (error);
+
+    error = myfs_vget(dvp->v_mount, ino, LK_EXCLUSIVE, vpp);
+    if (error)
+        return (error);
+    myfs_trace(mmp, MYFS_TRACE_LOOKUP, (struct myfs_node *)(*vpp)->v_data,
+        0, 0);
+    if (cnp->cn_flags & MAKEENTRY)
+        cache_enter(dvp, *vpp, cnp);
+
+    return (0);
 }
 
+/*
+ * Directory offsets are entry indices: 0 is ".", 1 is "..", and entry i of
+ * the sorted array is at i + 2.
+ */
 static int
-myfs_reclaim(struct vop_reclaim_args *ap)
+myfs_img_readdir(struct vop_readdir_args *ap)
 {
     struct vnode *vp = ap->a_vp;
-    struct myfs_node *node;
+    struct uio *uio = ap->a_uio;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct myfs_img_dirhdr hdr;
+    struct myfs_img_dirent de;
+    struct dirent d;
+    struct myfs_ckeys *ck;
+    size_t namlen;
+    off_t idx;
+    int error;
 
-    printf("MYFS: Reclaim vnode\n");
+    if (vp->v_type != VDIR)
+        return (ENOTDIR);
+    if (uio->uio_offset < 0)
+        return (EINVAL);
+    ck = NULL;
+    if (np->dflags & MYFS_IMG_I_CRYPT) {
+        error = myfs_crypt_session(mmp, np, &ck);
+        if (error)
+            return (error);
+    }
 
-    node = (struct myfs_node *)vp->v_data;
-    if (node) {
-        free(node, M_TEMP);
-        vp->v_data = NULL;
+    error = myfs_img_pread(mmp, np->daddr * MYFS_IMG_BSIZE, &hdr,
+        sizeof(hdr));
+    if (error)
+        return (error);
+    myfs_cookies_alloc(ap);
+
+    for (idx = uio->uio_offset; idx < le32toh(hdr.count) + 2; idx++) {
+        memset(&d, 0, sizeof(d));
+        if (idx == 0) {
+            d.d_fileno = np->ino;
+            d.d_type = DT_DIR;
+            d.d_namlen = 1;
+            d.d_name[0] = '.';
+        } else if (idx == 1) {
+            d.d_fileno = le64toh(hdr.parent);
+            d.d_type = DT_DIR;
+            d.d_namlen = 2;
+            d.d_name[0] = d.d_name[1] = '.';
+        } else {
+            error = myfs_img_dirent(mmp, np, idx - 2, &de, d.d_name);
+            if (error)
+                break;
+            d.d_fileno = le64toh(de.ino);
+            d.d_type = de.type;
+            d.d_namlen = le16toh(de.namelen);
+            if (ck != NULL) {
+                error = myfs_crypt_unpad(ck, d.d_name, d.d_namlen,
+                    &namlen);
+                if (error)
+                    break;
+                d.d_namlen = namlen;
+            }
+        }
+        d.d_reclen = GENERIC_DIRSIZ(&d);
+        d.d_off = idx + 1;
+        dirent_terminate(&d);
+        if (d.d_reclen > uio->uio_resid)
+            break;
+        error = uiomove(&d, d.d_reclen, uio);
+        if (error)
+            break;
+        myfs_cookies_add(ap, d.d_off);
+        uio->uio_offset = idx + 1;
     }
 
-    return (0);
+    myfs_cookies_done(ap, error);
+    if (ap->a_eofflag != NULL)
+        *ap->a_eofflag = (idx >= le32toh(hdr.count) + 2);
+    return (error);
 }
 
 static int
-myfs_readdir(struct vop_readdir_args *ap)
+myfs_img_read(struct vop_read_args *ap)
 {
-    printf("MYFS: Readdir operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct uio *uio = ap->a_uio;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    daddr_t rablks[MYFS_IMG_RA];
+    int rasizes[MYFS_IMG_RA];
+    struct buf *bp;
+    daddr_t lbn, nblocks, blkno;
+    struct myfs_ckeys *ck;
+    off_t boff;
+    ssize_t n;
+    char *zbuf, *l2buf, *cbuf;
+    int error, i, nra;
+
+    if (vp->v_type == VDIR)
+        return (EISDIR);
+    if (vp->v_type != VREG)
+        return (EOPNOTSUPP);
+    if (uio->uio_offset < 0)
+        return (EINVAL);
+
+    myfs_trace(mmp, MYFS_TRACE_READ, np, uio->uio_offset,
+        MIN(uio->uio_resid, MAX(np->size - uio->uio_offset, 0)));
+
+    nblocks = howmany(np->size, MYFS_IMG_BSIZE);
+    zbuf = NULL;
+    if (np->dflags & MYFS_IMG_I_ZLIB)
+        zbuf = malloc(MYFS_IMG_BSIZE, M_TEMP, M_WAITOK);
+    l2buf = NULL;
+    if (mmp->l2 != NULL && zbuf == NULL)
+        l2buf = malloc(MYFS_IMG_BSIZE, M_TEMP, M_WAITOK);
+    cbuf = NULL;
+    if (np->dflags & MYFS_IMG_I_CRYPT) {
+        error = myfs_crypt_session(mmp, np, &ck);
+        if (error)
+            goto out;
+        cbuf = malloc(MYFS_IMG_BSIZE, M_TEMP, M_WAITOK);
+    }
+
+    error = 0;
+    while (uio->uio_resid > 0 && uio->uio_offset < np->size) {
+        lbn = uio->uio_offset / MYFS_IMG_BSIZE;
+        boff = uio->uio_offset % MYFS_IMG_BSIZE;
+        n = MIN(MYFS_IMG_BSIZE - boff, np->size - uio->uio_offset);
+        n = MIN(n, uio->uio_resid);
+
+        if (zbuf != NULL) {
+            error = myfs_img_zblock(mmp, np, lbn, zbuf,
+                MIN(MYFS_IMG_BSIZE, np->size - lbn * MYFS_IMG_BSIZE));
+            if (error)
+                break;
+            error = uiomove(zbuf + boff, n, uio);
+            if (error)
+                break;
+            continue;
+        }
+
+        /* The cache device stands in for the primary on a cache miss. */
+        blkno = (np->daddr + lbn) * btodb(MYFS_IMG_BSIZE);
+        if (l2buf != NULL && incore(mmp->bo, blkno) == NULL &&
+            myfs_l2_read(mmp->l2, np->daddr + lbn, l2buf) == 0) {
+            if (cbuf != NULL) {
+                error = myfs_crypt_block(ck, l2buf, lbn);
+                if (error)
+                    break;
+            }
+            error = uiomove(l2buf + boff, n, uio);
+            if (error)
+                break;
+            continue;
+        }
+
+        nra = MIN(MYFS_IMG_RA, nblocks - lbn - 1);
+        for (i = 0; i < nra; i++) {
+            rablks[i] = (np->daddr + lbn + 1 + i) * btodb(MYFS_IMG_BSIZE);
+            rasizes[i] = MYFS_IMG_BSIZE;
+        }
+        error = breadn(mmp->devvp, blkno, MYFS_IMG_BSIZE, rablks, rasizes,
+            nra, NOCRED, &bp);
+        if (error)
+            break;
+        if (l2buf != NULL)
+            myfs_l2_feed(mmp->l2, np->daddr + lbn, bp->b_data);
+        if (cbuf != NULL) {
+            memcpy(cbuf, bp->b_data, MYFS_IMG_BSIZE);
+            brelse(bp);
+            error = myfs_crypt_block(ck, cbuf, lbn);
+            if (error == 0)
+                error = uiomove(cbuf + boff, n, uio);
+        } else {
+            error = uiomove((char *)bp->b_data + boff, n, uio);
+            brelse(bp);
+        }
+        if (error)
+            break;
+    }
+
+out:
+    if (cbuf != NULL)
+        free(cbuf, M_TEMP);
+    if (zbuf != NULL)
+        free(zbuf, M_TEMP);
+    if (l2buf != NULL)
+        free(l2buf, M_TEMP);
+    return (error);
 }
 
 static int
-myfs_readlink(struct vop_readlink_args *ap)
+myfs_img_readlink(struct vop_readlink_args *ap)
 {
-    printf("MYFS: Readlink operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    struct myfs_ckeys *ck;
+    size_t len;
+    char *target;
+    int error;
+
+    if (np->size > MAXPATHLEN)
+        return (EINTEGRITY);
+    ck = NULL;
+    if (np->dflags & MYFS_IMG_I_CRYPT) {
+        error = myfs_crypt_session(mmp, np, &ck);
+        if (error)
+            return (error);
+    }
+    target = malloc(np->size, M_TEMP, M_WAITOK);
+    len = np->size;
+    error = myfs_img_pread(mmp, np->daddr * MYFS_IMG_BSIZE, target, len);
+    if (error == 0 && ck != NULL)
+        error = myfs_crypt_unpad(ck, target, np->size, &len);
+    if (error == 0)
+        error = uiomove(target, len, ap->a_uio);
+    free(target, M_TEMP);
+
+    return (error);
 }
 
+/*
+ * Map uncompressed file blocks straight to the device so the pager and
+ * clustering see one contiguous run per file.  Compressed and encrypted
+ * files return EOPNOTSUPP, which makes the vnode pager fall back to
+ * VOP_READ.
+ */
 static int
-myfs_symlink(struct vop_symlink_args *ap)
+myfs_img_bmap(struct vop_bmap_args *ap)
 {
-    printf("MYFS: Symlink operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+    daddr_t nblocks;
+
+    if (np->dflags & (MYFS_IMG_I_ZLIB | MYFS_IMG_I_CRYPT))
+        return (EOPNOTSUPP);
+
+    nblocks = howmany(np->size, MYFS_IMG_BSIZE);
+    if (ap->a_bop != NULL)
+        *ap->a_bop = mmp->bo;
+    if (ap->a_bnp != NULL)
+        *ap->a_bnp = (np->daddr + ap->a_bn) * btodb(MYFS_IMG_BSIZE);
+    if (ap->a_runp != NULL)
+        *ap->a_runp = MAX(nblocks - ap->a_bn - 1, 0);
+    if (ap->a_runb != NULL)
+        *ap->a_runb = MIN(ap->a_bn, nblocks);
+
+    return (0);
 }
 
 static int
-myfs_remove(struct vop_remove_args *ap)
+myfs_img_getpages(struct vop_getpages_args *ap)
 {
-    printf("MYFS: Remove operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+
+    myfs_trace(mmp, MYFS_TRACE_GETPAGES, (struct myfs_node *)vp->v_data,
+        IDX_TO_OFF(ap->a_m[0]->pindex), (off_t)ap->a_count * PAGE_SIZE);
+    return (vop_stdgetpages(ap));
 }
 
-static int
-myfs_rename(struct vop_rename_args *ap)
+/*
+ * Release the clean device buffers caching bytes [start, end] of np.
+ * File data is read through the device's buffers, which the generic
+ * advice code never sees.  Compressed files are skipped: their offsets
+ * only map to device blocks through the chunk offset table.
+ */
+static void
+myfs_img_release(struct myfs_mount *mmp, struct myfs_node *np, off_t start,
+    off_t end)
 {
-    printf("MYFS: Rename operation\n");
-    return (ENOSYS);
+    struct bufobj *bo = mmp->bo;
+    daddr_t startn, endn;
+
+    if ((np->dflags & MYFS_IMG_I_ZLIB) || start >= np->size)
+        return;
+    end = MIN(end, np->size - 1);
+    startn = (np->daddr + start / MYFS_IMG_BSIZE) * btodb(MYFS_IMG_BSIZE);
+    endn = (np->daddr + end / MYFS_IMG_BSIZE + 1) * btodb(MYFS_IMG_BSIZE) - 1;
+    BO_RLOCK(bo);
+    (void)bnoreuselist(&bo->bo_clean, bo, startn, endn);
+    BO_RUNLOCK(bo);
 }
 
+/*
+ * POSIX_FADV_DONTNEED drops the range now, and if it covers the whole
+ * file, whatever gets cached after it too once the last user lets go;
+ * streaming readers advise once and then read everything.
+ */
 static int
-myfs_mkdir(struct vop_mkdir_args *ap)
+myfs_img_advise(struct vop_advise_args *ap)
 {
-    printf("MYFS: Mkdir operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp;
+    struct myfs_node *np;
+    int error;
+
+    error = vop_stdadvise(ap);
+    if (error || ap->a_advice != POSIX_FADV_DONTNEED || vp->v_type != VREG)
+        return (error);
+
+    vn_lock(vp, LK_SHARED | LK_RETRY);
+    if (VN_IS_DOOMED(vp)) {
+        VOP_UNLOCK(vp);
+        return (EBADF);
+    }
+    mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    np = (struct myfs_node *)vp->v_data;
+    myfs_img_release(mmp, np, ap->a_start, ap->a_end);
+    if (ap->a_start == 0 && ap->a_end >= np->size - 1)
+        atomic_set_int(&np->flags, MYFS_NODE_DONTNEED);
+    VOP_UNLOCK(vp);
+    return (0);
 }
 
 static int
-myfs_rmdir(struct vop_rmdir_args *ap)
+myfs_img_inactive(struct vop_inactive_args *ap)
 {
-    printf("MYFS: Rmdir operation\n");
-    return (ENOSYS);
+    struct vnode *vp = ap->a_vp;
+    struct myfs_mount *mmp = (struct myfs_mount *)vp->v_mount->mnt_data;
+    struct myfs_node *np = (struct myfs_node *)vp->v_data;
+
+    if (np->flags & MYFS_NODE_DONTNEED) {
+        atomic_clear_int(&np->flags, MYFS_NODE_DONTNEED);
+        myfs_img_release(mmp, np, 0, OFF_MAX);
+        vn_pages_remove(vp, 0, 0);
+    }
+    return (0);
 }
 
+/* Read-only vnode operations */
+
 static int
-myfs_inactive(struct vop_inactive_args *ap)
+myfs_vop_erofs(struct vop_generic_args *ap)
 {
-    printf("MYFS: Inactive operation\n");
-    return (0);
+    return (EROFS);
 }
 
+/* Nothing is ever dirty on a read-only mount. */
 static int
-myfs_truncate(struct vop_truncate_args *ap)
+myfs_ro_fsync(struct vop_fsync_args *ap)
 {
-    printf("MYFS: Truncate operation\n");
-    return (ENOSYS);
+    return (0);
 }
 
-/* fsync function */
 static int
-myfs_fsync(struct vop_fsync_args *ap)
+myfs_ro_inactive(struct vop_inactive_args *ap)
 {
-    struct vnode *vp = ap->a_vp;
-    int waitfor = ap->a_waitfor;
-    struct thread *td = ap->a_td;
-
-    printf("MYFS: Fsync operation on vnode %p, waitfor: %d\n", vp, waitfor);
-
-    /*
-     * waitfor can be:
-     * MNT_WAIT - sync all data and metadata
-     * MNT_NOWAIT - sync only what can be done without blocking
-     */
-
-    /* 
-     * For a real filesystem, you would:
-     * 1. Flush any cached data to persistent storage
-     * 2. Write metadata updates (timestamps, size changes, etc.)
-     * 3. Handle the waitfor parameter appropriately
-     */
-
-    /* Example implementation for a simple filesystem */
-    if (waitfor == MNT_WAIT) {
-        /* 
-         * Wait for all I/O to complete
-         * This might involve flushing buffers, waiting for disk writes, etc.
-         */
-        printf("MYFS: Waiting for all data to sync\n");
-    } else {
-        /* MNT_NOWAIT - start sync but don't wait for completion */
-        printf("MYFS: Starting async sync\n");
-    }
-
-    /* 
-     * Return 0 on success, or error code on failure
-     * Common errors: EIO (I/O error), EROFS (read-only filesystem)
-     */
     return (0);
 }
 
@@ -452,6 +8108,9 @@ myfs_modevent(module_t mod, int type, void *data)
             printf("MYFS: Failed to attach VFS ops: %d\n", error);
             break;
         }
+        TASK_INIT(&myfs_lowmem_task, 0, myfs_lowmem_trim, NULL);
+        myfs_lowmem_tag = EVENTHANDLER_REGISTER(vm_lowmem, myfs_lowmem,
+            NULL, EVENTHANDLER_PRI_FIRST);
         break;
 
     case MOD_UNLOAD:
@@ -459,7 +8118,10 @@ myfs_modevent(module_t mod, int type, void *data)
         error = vfs_detach(&myfs_vfsops);
         if (error) {
             printf("MYFS: Failed to detach VFS ops: %d\n", error);
+            break;
         }
+        EVENTHANDLER_DEREGISTER(vm_lowmem, myfs_lowmem_tag);
+        taskqueue_drain(taskqueue_thread, &myfs_lowmem_task);
         break;
 
     case MOD_SHUTDOWN:
@@ -483,3 +8145,5 @@ static moduledata_t myfs_mod = {
 
 DECLARE_MODULE(myfs, myfs_mod, SI_SUB_VFS, SI_ORDER_ANY);
 MODULE_VERSION(myfs, MYFS_VERSION);
+MODULE_DEPEND(myfs, zlib, 1, 1, 1);
+MODULE_DEPEND(myfs, crypto, 1, 1, 1);
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2024 Your Name
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Case folding for case-insensitive directories of sealed images, shared by
+ * the module and mkfs.myfs so both sides fold and hash names identically.
+ *
+ * This is Unicode simple case folding (CaseFolding.txt, status C and S)
+ * for the Latin, Greek, Cyrillic, Armenian and fullwidth letters, applied
+ * to UTF-8 names without normalization.  Folding never lengthens a name,
+ * and bytes that are not valid UTF-8 are kept as they are.
+ */
+
+#ifndef _MYFS_CASEFOLD_H_
+#define _MYFS_CASEFOLD_H_
+
+#include <sys/types.h>
+
+#include "myfs_image.h"
+
+static __inline uint32_t
+myfs_fold_cp(uint32_t c)
+{
+    if (c < 0x80)
+        return (c >= 'A' && c <= 'Z' ? c + 32 : c);
+    if (c == 0xB5)
+        return (0x3BC);
+    if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+        return (c + 32);
+    if (c >= 0x100 && c <= 0x17F) {
+        if (c == 0x130 || c == 0x131 || c == 0x138)
+            return (c);
+        if (c == 0x178)
+            return (0xFF);
+        if (c == 0x17F)
+            return ('s');
+        if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+            return ((c & 1) ? c + 1 : c);
+        return ((c & 1) ? c : c + 1);
+    }
+
+    /* Greek */
+    if (c == 0x386)
+        return (0x3AC);
+    if (c >= 0x388 && c <= 0x38A)
+        return (c + 37);
+    if (c == 0x38C)
+        return (0x3CC);
+    if (c == 0x38E || c == 0x38F)
+        return (c + 63);
+    if ((c >= 0x391 && c <= 0x3A1) || (c >= 0x3A3 && c <= 0x3AB))
+        return (c + 32);
+    if (c == 0x3C2)
+        return (0x3C3);
+
+    /* Cyrillic */
+    if (c >= 0x400 && c <= 0x40F)
+        return (c + 80);
+    if (c >= 0x410 && c <= 0x42F)
+        return (c + 32);
+    if ((c >= 0x460 && c <= 0x481) || (c >= 0x48A && c <= 0x4BF) ||
+        (c >= 0x4D0 && c <= 0x52F))
+        return ((c & 1) ? c : c + 1);
+    if (c == 0x4C0)
+        return (0x4CF);
+    if (c >= 0x4C1 && c <= 0x4CE)
+        return ((c & 1) ? c + 1 : c);
+
+    /* Armenian */
+    if (c >= 0x531 && c <= 0x556)
+        return (c + 48);
+
+    /* Latin Extended Additional, letterlike symbols, fullwidth */
+    if ((c >= 0x1E00 && c <= 0x1E95) || (c >= 0x1EA0 && c <= 0x1EFF))
+        return ((c & 1) ? c : c + 1);
+    if (c == 0x1E9E)
+        return (0xDF);
+    if (c == 0x2126)
+        return (0x3C9);
+    if (c == 0x212A)
+        return ('k');
+    if (c == 0x212B)
+        return (0xE5);
+    if (c >= 0xFF21 && c <= 0xFF3A)
+        return (c + 32);
+    return (c);
+}
+
+/* Fold len bytes of name into out, which may be name.  Returns the length. */
+static __inline size_t
+myfs_fold(const char *name, size_t len, char *out)
+{
+    const unsigned char *s = (const unsigned char *)name;
+    unsigned char *d = (unsigned char *)out;
+    uint32_t c;
+    size_t i, n;
+
+    for (i = 0; i < len; i += n) {
+        c = s[i];
+        n = 1;
+        if (c >= 0xC2 && c <= 0xDF && i + 1 < len &&
+            (s[i + 1] & 0xC0) == 0x80) {
+            c = (c & 0x1F) << 6 | (s[i + 1] & 0x3F);
+            n = 2;
+        } else if (c >= 0xE0 && c <= 0xEF && i + 2 < len &&
+            (s[i + 1] & 0xC0) == 0x80 && (s[i + 2] & 0xC0) == 0x80) {
+            c = (c & 0x0F) << 12 | (s[i + 1] & 0x3F) << 6 |
+                (s[i + 2] & 0x3F);
+            n = 3;
+            if (c < 0x800) {    /* overlong */
+                c = s[i];
+                n = 1;
+            }
+        }
+        if (n == 1 && c >= 0x80) {
+            *d++ = c;
+            continue;
+        }
+
+        c = myfs_fold_cp(c);
+        if (c < 0x80) {
+            *d++ = c;
+        } else if (c < 0x800) {
+            *d++ = 0xC0 | c >> 6;
+            *d++ = 0x80 | (c & 0x3F);
+        } else {
+            *d++ = 0xE0 | c >> 12;
+            *d++ = 0x80 | (c >> 6 & 0x3F);
+            *d++ = 0x80 | (c & 0x3F);
+        }
+    }
+    return (d - (unsigned char *)out);
+}
+
+#define MYFS_SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define MYFS_SIP_ROUND(v0, v1, v2, v3) do {                            \
+    (v0) += (v1); (v1) = MYFS_SIP_ROTL(v1, 13); (v1) ^= (v0);           \
+    (v0) = MYFS_SIP_ROTL(v0, 32);                                       \
+    (v2) += (v3); (v3) = MYFS_SIP_ROTL(v3, 16); (v3) ^= (v2);           \
+    (v0) += (v3); (v3) = MYFS_SIP_ROTL(v3, 21); (v3) ^= (v0);           \
+    (v2) += (v1); (v1) = MYFS_SIP_ROTL(v1, 17); (v1) ^= (v2);           \
+    (v2) = MYFS_SIP_ROTL(v2, 32);                                       \
+} while (0)
+
+static __inline uint64_t
+myfs_sip_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        v = v << 8 | p[i];
+    return (v);
+}
+
+/* SipHash-1-3 of len bytes under a MYFS_IMG_HASHKEY_SIZE-byte key. */
+static __inline uint64_t
+myfs_siphash13(const uint8_t *key, const void *src, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    uint64_t k0, k1, v0, v1, v2, v3, m, b;
+    int i;
+
+    k0 = myfs_sip_le64(key);
+    k1 = myfs_sip_le64(key + 8);
+    v0 = k0 ^ 0x736f6d6570736575ULL;
+    v1 = k1 ^ 0x646f72616e646f6dULL;
+    v2 = k0 ^ 0x6c7967656e657261ULL;
+    v3 = k1 ^ 0x7465646279746573ULL;
+    b = (uint64_t)len << 56;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        m = myfs_sip_le64(p);
+        v3 ^= m;
+        MYFS_SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for (i = (int)len - 1; i >= 0; i--)
+        b |= (uint64_t)p[i] << (8 * i);
+    v3 ^= b;
+    MYFS_SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    MYFS_SIP_ROUND(v0, v1, v2, v3);
+    MYFS_SIP_ROUND(v0, v1, v2, v3);
+    MYFS_SIP_ROUND(v0, v1, v2, v3);
+    return (v0 ^ v1 ^ v2 ^ v3);
+}
+
+/*
+ * Hash of a folded name for the directory's hash index: SipHash-1-3 under
+ * the image's key, so names cannot be picked to collide without it, or
+ * FNV-1a on images built before there was a key (key NULL).
+ */
+static __inline uint32_t
+myfs_fold_hash(const uint8_t *key, const char *folded, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)folded;
+    uint32_t h = 0x811c9dc5;
+
+    if (key != NULL)
+        return ((uint32_t)myfs_siphash13(key, folded, len));
+    while (len-- > 0)
+        h = (h ^ *p++) * 0x01000193;
+    return (h);
+}
+
+#endif /* _MYFS_CASEFOLD_H_ */
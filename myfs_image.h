@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2024 Your Name
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * On-disk layout of sealed myfs images.
+ *
+ * A sealed image is immutable and built offline.  Everything is laid out
+ * for reading the fewest blocks, sequentially:
+ *
+ *   block 0            superblock
+ *   block itable...    inode table, dense array of myfs_img_inode,
+ *                      inode number n at index n - 1
+ *   block crypt...     encryption contexts, MYFS_IMG_F_CRYPT only
+ *   remaining blocks   file, directory and symlink data, each object
+ *                      contiguous, objects in the builder's access order
+ *
+ * Directory data is a myfs_img_dirhdr, an array of myfs_img_dirent sorted
+ * by name (bytewise, shorter name first on a tie) and then the names, so
+ * lookups are a binary search.  Directories and symlinks are never
+ * compressed.
+ *
+ * Case-insensitive directories, flagged MYFS_IMG_I_CASEFOLD, have a
+ * myfs_img_dirhash per entry between the entries and the names, sorted by
+ * the hash of the entry's folded name (see myfs_casefold.h), then by the
+ * folded name.  The hash is SipHash-1-3 under the superblock's hash_key
+ * on images flagged MYFS_IMG_F_HASHKEY, and FNV-1a otherwise.  No two
+ * entries fold to the same name.  Subdirectories built under one are
+ * case-insensitive too.
+ *
+ * Inode numbers are never reused within an image, so every inode of an
+ * image shares one generation, gen, drawn at random when it is built.  File
+ * handles pair it with the inode number; they go stale when the device is
+ * rewritten with another image.  Images built before gen existed have 0.
+ *
+ * Images flagged MYFS_IMG_F_DUP keep two copies of their metadata: the
+ * superblock, inode table, contexts, directories and symlinks come first,
+ * in [0, nmeta), and the same blocks are repeated at mirror, after the file
+ * data.  A second superblock sits at block MYFS_IMG_SB_COPY, ahead of the
+ * inode table.  The checksum table at csum, itself inside the metadata,
+ * holds the CRC-32C of every metadata block; the superblocks and the
+ * table are covered by sb_crc and csum_crc instead.
+ *
+ * Images flagged MYFS_IMG_F_CRYPT have encrypted subtrees.  Every inode
+ * flagged MYFS_IMG_I_CRYPT has an entry in the context table at crypt,
+ * right after the inode table: the identifier of its master key and a
+ * random nonce.  The per-file key is unsalted HKDF-SHA512 of the master
+ * key with info "myfs", MYFS_IMG_HKDF_FILEKEY and the nonce; the key
+ * identifier is the first MYFS_IMG_KEYID_SIZE bytes of the same with
+ * MYFS_IMG_HKDF_KEYID and no nonce.  With that key and AES-256-XTS, each
+ * block of a file is one data unit, tweak = logical block number, the
+ * tail of the last block included.
+ *
+ * Names use a second key from the same expansion with
+ * MYFS_IMG_HKDF_NAMEKEY: its first MYFS_IMG_NAMEKEY_SIZE bytes are an
+ * AES-256-CBC key, and the next MYFS_IMG_CRYPT_PAD the IV.  The entry
+ * names of a directory are NUL-padded to a multiple of MYFS_IMG_CRYPT_PAD
+ * and encrypted with them, and the entries are sorted by the encrypted
+ * names; a symlink target is padded and encrypted the same way.
+ *
+ * Lookups encrypt the name asked for and search for it, so all names of
+ * a directory share one IV.  Nonces differ, so nothing links names across
+ * directories; within one, though, names whose first n 16-byte blocks
+ * agree also agree on their first n ciphertext blocks, which gives away a
+ * shared prefix at that granularity.  Later blocks, unlike with a fixed
+ * XTS tweak, depend on everything before them.
+ *
+ * Encrypted files are never compressed.
+ *
+ * A file flagged MYFS_IMG_I_ZLIB starts with nblocks + 1 little-endian
+ * uint32_t offsets, followed by one zlib stream per logical block.  Chunk i
+ * spans [off[i], off[i + 1]) relative to the end of the offset table; a
+ * chunk as long as its logical block is stored raw.
+ *
+ * All fields are little-endian.
+ */
+
+#ifndef _MYFS_IMAGE_H_
+#define _MYFS_IMAGE_H_
+
+#include <sys/types.h>
+
+#define MYFS_IMG_MAGIC 0x4D59534C   /* "MYSL" */
+#define MYFS_IMG_VERSION 1
+#define MYFS_IMG_BSIZE 4096
+#define MYFS_IMG_ROOTINO 1
+#define MYFS_IMG_SB_COPY 16         /* second superblock, DUP images */
+
+/* Superblock flags */
+#define MYFS_IMG_F_ZLIB 0x0001      /* some files are compressed */
+#define MYFS_IMG_F_DUP 0x0002       /* metadata is mirrored */
+#define MYFS_IMG_F_CRYPT 0x0004     /* some inodes are encrypted */
+#define MYFS_IMG_F_HASHKEY 0x0008   /* dirhash is keyed, see hash_key */
+
+#define MYFS_IMG_HASHKEY_SIZE 16
+
+struct myfs_img_sb {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t bsize;
+    uint32_t flags;         /* MYFS_IMG_F_* */
+    uint64_t nblocks;       /* image size */
+    uint64_t ninodes;
+    uint64_t itable;        /* first inode table block */
+    uint64_t root;          /* root directory inode */
+    uint64_t ctime;         /* build time */
+
+    /* MYFS_IMG_F_DUP images only */
+    uint64_t nmeta;         /* metadata blocks */
+    uint64_t mirror;        /* first block of the metadata copy */
+    uint64_t csum;          /* first block of the checksum table */
+    uint32_t csum_crc;      /* CRC-32C of the nmeta table entries */
+    uint32_t sb_crc;        /* CRC-32C of this struct, sb_crc zeroed */
+
+    /* MYFS_IMG_F_CRYPT images only */
+    uint64_t crypt;         /* first block of the context table */
+    uint64_t ncrypt;        /* context table entries */
+
+    /* MYFS_IMG_F_HASHKEY images only */
+    uint8_t hash_key[MYFS_IMG_HASHKEY_SIZE];    /* random, per image */
+
+    uint32_t gen;           /* inode generation, random per image */
+    uint32_t reserved;
+};
+
+/* Inode flags */
+#define MYFS_IMG_I_ZLIB 0x0001      /* data is per-block zlib */
+#define MYFS_IMG_I_CRYPT 0x0002     /* data or names are encrypted */
+#define MYFS_IMG_I_CASEFOLD 0x0004  /* case-insensitive directory */
+
+struct myfs_img_inode {
+    uint16_t mode;
+    uint16_t flags;         /* MYFS_IMG_I_* */
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size;          /* logical size */
+    uint64_t daddr;         /* first data block */
+    uint64_t mtime;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint64_t ctime;
+    uint64_t crypt;         /* MYFS_IMG_I_CRYPT: context table index */
+};
+
+struct myfs_img_dirhdr {
+    uint32_t count;         /* entries, excluding . and .. */
+    uint32_t reserved;
+    uint64_t parent;        /* inode of .. */
+};
+
+struct myfs_img_dirent {
+    uint64_t ino;
+    uint32_t name_off;      /* from the start of the directory data */
+    uint16_t namelen;
+    uint8_t type;           /* DT_* */
+    uint8_t reserved;
+};
+
+struct myfs_img_dirhash {
+    uint32_t hash;          /* of the folded name, see above */
+    uint32_t idx;           /* entry index */
+};
+
+/* Encryption contexts */
+#define MYFS_IMG_CRYPT_V1 1
+#define MYFS_IMG_CRYPT_AES_256_XTS 1    /* contents */
+#define MYFS_IMG_CRYPT_AES_256_CBC 2    /* names */
+#define MYFS_IMG_KEY_SIZE 64        /* master and per-file keys */
+#define MYFS_IMG_KEYID_SIZE 16
+#define MYFS_IMG_NONCE_SIZE 16
+#define MYFS_IMG_CRYPT_PAD 16
+#define MYFS_IMG_CRYPT_NAMEMAX 240  /* longest name in an encrypted dir */
+#define MYFS_IMG_HKDF_KEYID 1
+#define MYFS_IMG_HKDF_FILEKEY 2
+#define MYFS_IMG_HKDF_NAMEKEY 3
+#define MYFS_IMG_NAMEKEY_SIZE 32
+
+struct myfs_img_crypt {
+    uint8_t version;        /* MYFS_IMG_CRYPT_V1 */
+    uint8_t contents_mode;  /* MYFS_IMG_CRYPT_* */
+    uint8_t names_mode;
+    uint8_t flags;
+    uint32_t reserved;
+    uint8_t key_id[MYFS_IMG_KEYID_SIZE];
+    uint8_t nonce[MYFS_IMG_NONCE_SIZE];
+};
+
+#endif /* _MYFS_IMAGE_H_ */
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2024 Your Name
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * ioctl interface shared between the myfs module and userland tools.
+ */
+
+#ifndef _MYFS_IOCTL_H_
+#define _MYFS_IOCTL_H_
+
+#include <sys/types.h>
+#include <sys/ioccom.h>
+
+/* Quota types */
+#define MYFS_QTYPE_USR 0
+#define MYFS_QTYPE_GRP 1
+#define MYFS_QTYPE_PRJ 2
+#define MYFS_MAXQTYPES 3
+
+/*
+ * Quota limits and usage for one id.  A limit of 0 means unlimited.
+ * Usage is exact at the time of the call.
+ */
+struct myfs_quota_args {
+    uint32_t type;          /* MYFS_QTYPE_* */
+    uint32_t id;
+    uint64_t blk_limit;     /* blocks */
+    uint64_t ino_limit;     /* inodes */
+    uint64_t blk_used;      /* out */
+    uint64_t ino_used;      /* out */
+};
+
+#define MYFS_IOC_SETQUOTA _IOW('M', 1, struct myfs_quota_args)
+#define MYFS_IOC_GETQUOTA _IOWR('M', 2, struct myfs_quota_args)
+
+/*
+ * Project tagging for directory trees.  With MYFS_PROJ_INHERIT set, files
+ * and directories created under the directory take its project id, and new
+ * subdirectories inherit the flag.  Existing children are not retagged.
+ */
+#define MYFS_PROJ_INHERIT 0x0001
+
+struct myfs_projid_args {
+    uint32_t projid;
+    uint32_t flags;         /* MYFS_PROJ_* */
+};
+
+/* Usage of the project a file or directory belongs to. */
+struct myfs_projusage_args {
+    uint32_t projid;        /* out */
+    uint32_t flags;         /* out, MYFS_PROJ_* */
+    uint64_t blk_used;      /* out */
+    uint64_t ino_used;      /* out */
+    uint64_t blk_limit;     /* out */
+    uint64_t ino_limit;     /* out */
+};
+
+#define MYFS_IOC_SETPROJID _IOW('M', 3, struct myfs_projid_args)
+#define MYFS_IOC_GETPROJUSAGE _IOR('M', 4, struct myfs_projusage_args)
+
+/*
+ * Recursive statistics of a directory (mount option "rstats"): bytes,
+ * regular files and subdirectories in the whole subtree below it.
+ */
+struct myfs_rstat_args {
+    uint64_t rbytes;
+    uint64_t rfiles;
+    uint64_t rsubdirs;
+};
+
+#define MYFS_IOC_GETRSTAT _IOR('M', 5, struct myfs_rstat_args)
+
+/*
+ * Freeze the volume for a block-level snapshot: wait for in-flight writers,
+ * flush everything and block new modifications until MYFS_IOC_THAW.
+ */
+#define MYFS_IOC_FREEZE _IO('M', 6)
+#define MYFS_IOC_THAW _IO('M', 7)
+
+/*
+ * Access tracing.  While enabled, each CPU logs the first lookup of every
+ * inode and every read that goes past the furthest offset read so far,
+ * for feeding layout tools such as mkfs.myfs -t.  Records from different
+ * CPUs are ordered by time_ns.
+ */
+#define MYFS_TRACE_LOOKUP 1
+#define MYFS_TRACE_READ 2
+#define MYFS_TRACE_GETPAGES 3
+
+struct myfs_trace_rec {
+    uint64_t time_ns;       /* since boot */
+    uint64_t ino;
+    uint64_t off;
+    uint32_t len;
+    uint16_t op;            /* MYFS_TRACE_* */
+    uint16_t cpu;
+};
+
+#define MYFS_TRACE_START 1
+#define MYFS_TRACE_STOP 2
+
+struct myfs_trace_ctl {
+    uint32_t op;            /* MYFS_TRACE_START or MYFS_TRACE_STOP */
+    uint32_t nrecs;         /* per-CPU buffer size on start, 0 = default */
+};
+
+struct myfs_trace_drain {
+    struct myfs_trace_rec *recs;
+    uint32_t nrecs;         /* in: room in recs, out: records returned */
+    uint32_t reserved;
+    uint64_t dropped;       /* out: records lost to full buffers */
+};
+
+#define MYFS_IOC_TRACECTL _IOW('M', 8, struct myfs_trace_ctl)
+#define MYFS_IOC_TRACEDRAIN _IOWR('M', 9, struct myfs_trace_drain)
+
+/*
+ * Tier placement hints for volumes mounted with fastdev and slowdev.
+ * MYFS_TIER_AUTO leaves placement to size and access heat; the others pin
+ * a file's data to one tier.  New files inherit their directory's hint.
+ * MYFS_IOC_GETTIER also works on volumes with datadev, and reports where
+ * a file's blocks are by device, in the order the mount options list them.
+ */
+#define MYFS_TIER_AUTO 0
+#define MYFS_TIER_FAST 1
+#define MYFS_TIER_SLOW 2
+
+#define MYFS_TIER_MAXDEVS 16    /* data devices per volume */
+
+struct myfs_tier_args {
+    uint32_t hint;          /* MYFS_TIER_* */
+    uint32_t ndevs;         /* out: data devices */
+    uint64_t fast_blocks;   /* out: blocks on the fast device */
+    uint64_t slow_blocks;   /* out: blocks on the slow device */
+    uint64_t dev_blocks[MYFS_TIER_MAXDEVS]; /* out: blocks per device */
+};
+
+#define MYFS_IOC_SETTIER _IOW('M', 10, struct myfs_tier_args)
+#define MYFS_IOC_GETTIER _IOWR('M', 11, struct myfs_tier_args)
+
+/*
+ * Keys for encrypted directories of sealed images (mkfs.myfs -e).  A master
+ * key is added to a mount once and unlocks every file whose policy names
+ * its identifier; removing it drops the per-file keys and any plaintext
+ * cached from them.  Without the key, encrypted files cannot be opened
+ * and encrypted directories cannot be listed or searched.
+ */
+#define MYFS_KEY_SIZE 64
+#define MYFS_KEY_IDSIZE 16
+
+struct myfs_key_args {
+    uint8_t key[MYFS_KEY_SIZE];     /* MYFS_IOC_ADDKEY only */
+    uint8_t id[MYFS_KEY_IDSIZE];    /* out on add, in on remove */
+};
+
+/* Encryption policy of a file or directory, see myfs_image.h. */
+struct myfs_policy_args {
+    uint8_t version;
+    uint8_t contents_mode;
+    uint8_t names_mode;
+    uint8_t flags;
+    uint32_t reserved;
+    uint8_t key_id[MYFS_KEY_IDSIZE];
+};
+
+#define MYFS_IOC_ADDKEY _IOWR('M', 12, struct myfs_key_args)
+#define MYFS_IOC_RMKEY _IOW('M', 13, struct myfs_key_args)
+#define MYFS_IOC_GETPOLICY _IOR('M', 14, struct myfs_policy_args)
+
+#endif /* _MYFS_IOCTL_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2024 Your Name
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * myfs_addkey: give a mounted myfs the master key in a file, read the way
+ * mkfs.myfs -k reads it, and print the key identifier in hex, as
+ * mkfs.myfs prints it.  Used by sealed_test.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "myfs_ioctl.h"
+
+int
+main(int argc, char **argv)
+{
+    struct myfs_key_args ka;
+    ssize_t n;
+    int fd, kfd;
+    u_int i;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: myfs_addkey mountpoint keyfile\n");
+        return (EX_USAGE);
+    }
+
+    memset(&ka, 0, sizeof(ka));
+    kfd = open(argv[2], O_RDONLY);
+    if (kfd < 0)
+        err(EX_NOINPUT, "%s", argv[2]);
+    n = read(kfd, ka.key, sizeof(ka.key));
+    if (n < 0)
+        err(EX_IOERR, "%s", argv[2]);
+    if (n != (ssize_t)sizeof(ka.key))
+        errx(EX_DATAERR, "%s: need %zu bytes", argv[2], sizeof(ka.key));
+    close(kfd);
+
+    fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        err(EX_NOINPUT, "%s", argv[1]);
+    if (ioctl(fd, MYFS_IOC_ADDKEY, &ka) != 0)
+        err(EX_OSERR, "MYFS_IOC_ADDKEY");
+    explicit_bzero(ka.key, sizeof(ka.key));
+    close(fd);
+
+    for (i = 0; i < sizeof(ka.id); i++)
+        printf("%02x", ka.id[i]);
+    printf("\n");
+    return (0);
+}
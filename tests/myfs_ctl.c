@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2024 Your Name
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * myfs_ctl: drive the myfs ioctls from tests, one per subcommand, and
+ * print what they return as space-separated numbers.  fhread and dontneed
+ * reach the file handle and advice paths, which have no other command.
+ * Used by rw_test and sealed_test.
+ */
+
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "myfs_ioctl.h"
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: myfs_ctl setquota path user|group|project id blocks inodes\n"
+        "       myfs_ctl getquota path user|group|project id\n"
+        "       myfs_ctl setprojid dir projid [inherit]\n"
+        "       myfs_ctl projusage path\n"
+        "       myfs_ctl rstat dir\n"
+        "       myfs_ctl freeze|thaw path\n"
+        "       myfs_ctl settier path auto|fast|slow\n"
+        "       myfs_ctl gettier|getdevs path\n"
+        "       myfs_ctl fhread file\n"
+        "       myfs_ctl dontneed file [offset length]\n");
+    exit(EX_USAGE);
+}
+
+static uint32_t
+qtype(const char *s)
+{
+    if (strcmp(s, "user") == 0)
+        return (MYFS_QTYPE_USR);
+    if (strcmp(s, "group") == 0)
+        return (MYFS_QTYPE_GRP);
+    if (strcmp(s, "project") == 0)
+        return (MYFS_QTYPE_PRJ);
+    usage();
+    return (0);
+}
+
+static const char *hints[] = { "auto", "fast", "slow" };
+
+static uint32_t
+hint(const char *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < nitems(hints); i++) {
+        if (strcmp(s, hints[i]) == 0)
+            return (i);
+    }
+    usage();
+    return (0);
+}
+
+static uint64_t
+num(const char *s)
+{
+    char *end;
+    uint64_t v;
+
+    v = strtoull(s, &end, 0);
+    if (*s == '\0' || *end != '\0')
+        errx(EX_USAGE, "%s: not a number", s);
+    return (v);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct myfs_quota_args qa;
+    struct myfs_projid_args pa;
+    struct myfs_projusage_args pu;
+    struct myfs_rstat_args ra;
+    struct myfs_tier_args ta;
+    fhandle_t fh;
+    char buf[65536];
+    const char *cmd;
+    ssize_t n;
+    u_int i;
+    int error, fd, fhfd;
+
+    if (argc < 3)
+        usage();
+    cmd = argv[1];
+    fd = open(argv[2], O_RDONLY);
+    if (fd < 0)
+        err(EX_NOINPUT, "%s", argv[2]);
+
+    if (strcmp(cmd, "setquota") == 0 && argc == 7) {
+        memset(&qa, 0, sizeof(qa));
+        qa.type = qtype(argv[3]);
+        qa.id = num(argv[4]);
+        qa.blk_limit = num(argv[5]);
+        qa.ino_limit = num(argv[6]);
+        if (ioctl(fd, MYFS_IOC_SETQUOTA, &qa) != 0)
+            err(EX_OSERR, "MYFS_IOC_SETQUOTA");
+    } else if (strcmp(cmd, "getquota") == 0 && argc == 5) {
+        memset(&qa, 0, sizeof(qa));
+        qa.type = qtype(argv[3]);
+        qa.id = num(argv[4]);
+        if (ioctl(fd, MYFS_IOC_GETQUOTA, &qa) != 0)
+            err(EX_OSERR, "MYFS_IOC_GETQUOTA");
+        printf("%ju %ju\n", (uintmax_t)qa.blk_used, (uintmax_t)qa.ino_used);
+    } else if (strcmp(cmd, "setprojid") == 0 && (argc == 4 || argc == 5)) {
+        memset(&pa, 0, sizeof(pa));
+        pa.projid = num(argv[3]);
+        if (argc == 5) {
+            if (strcmp(argv[4], "inherit") != 0)
+                usage();
+            pa.flags = MYFS_PROJ_INHERIT;
+        }
+        if (ioctl(fd, MYFS_IOC_SETPROJID, &pa) != 0)
+            err(EX_OSERR, "MYFS_IOC_SETPROJID");
+    } else if (strcmp(cmd, "projusage") == 0 && argc == 3) {
+        if (ioctl(fd, MYFS_IOC_GETPROJUSAGE, &pu) != 0)
+            err(EX_OSERR, "MYFS_IOC_GETPROJUSAGE");
+        printf("%u %ju %ju\n", pu.projid, (uintmax_t)pu.blk_used,
+            (uintmax_t)pu.ino_used);
+    } else if (strcmp(cmd, "rstat") == 0 && argc == 3) {
+        if (ioctl(fd, MYFS_IOC_GETRSTAT, &ra) != 0)
+            err(EX_OSERR, "MYFS_IOC_GETRSTAT");
+        printf("%ju %ju %ju\n", (uintmax_t)ra.rbytes,
+            (uintmax_t)ra.rfiles, (uintmax_t)ra.rsubdirs);
+    } else if (strcmp(cmd, "freeze") == 0 && argc == 3) {
+        if (ioctl(fd, MYFS_IOC_FREEZE) != 0)
+            err(EX_OSERR, "MYFS_IOC_FREEZE");
+    } else if (strcmp(cmd, "thaw") == 0 && argc == 3) {
+        if (ioctl(fd, MYFS_IOC_THAW) != 0)
+            err(EX_OSERR, "MYFS_IOC_THAW");
+    } else if (strcmp(cmd, "settier") == 0 && argc == 4) {
+        memset(&ta, 0, sizeof(ta));
+        ta.hint = hint(argv[3]);
+        if (ioctl(fd, MYFS_IOC_SETTIER, &ta) != 0)
+            err(EX_OSERR, "MYFS_IOC_SETTIER");
+    } else if (strcmp(cmd, "gettier") == 0 && argc == 3) {
+        memset(&ta, 0, sizeof(ta));
+        if (ioctl(fd, MYFS_IOC_GETTIER, &ta) != 0)
+            err(EX_OSERR, "MYFS_IOC_GETTIER");
+        printf("%s %ju %ju\n", ta.hint < nitems(hints) ?
+            hints[ta.hint] : "?", (uintmax_t)ta.fast_blocks,
+            (uintmax_t)ta.slow_blocks);
+    } else if (strcmp(cmd, "getdevs") == 0 && argc == 3) {
+        memset(&ta, 0, sizeof(ta));
+        if (ioctl(fd, MYFS_IOC_GETTIER, &ta) != 0)
+            err(EX_OSERR, "MYFS_IOC_GETTIER");
+        for (i = 0; i < ta.ndevs && i < nitems(ta.dev_blocks); i++)
+            printf("%s%ju", i == 0 ? "" : " ",
+                (uintmax_t)ta.dev_blocks[i]);
+        printf("\n");
+    } else if (strcmp(cmd, "fhread") == 0 && argc == 3) {
+        /* Copy the file to stdout through its file handle. */
+        if (getfh(argv[2], &fh) != 0)
+            err(EX_OSERR, "getfh");
+        fhfd = fhopen(&fh, O_RDONLY);
+        if (fhfd < 0)
+            err(EX_OSERR, "fhopen");
+        while ((n = read(fhfd, buf, sizeof(buf))) > 0) {
+            if (write(STDOUT_FILENO, buf, n) != n)
+                err(EX_IOERR, "write");
+        }
+        if (n < 0)
+            err(EX_IOERR, "read");
+        close(fhfd);
+    } else if (strcmp(cmd, "dontneed") == 0 && (argc == 3 || argc == 5)) {
+        error = posix_fadvise(fd, argc == 5 ? num(argv[3]) : 0,
+            argc == 5 ? num(argv[4]) : 0, POSIX_FADV_DONTNEED);
+        if (error != 0)
+            errc(EX_OSERR, error, "posix_fadvise");
+    } else
+        usage();
+
+    close(fd);
+    return (0);
+}
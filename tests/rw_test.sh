@@ -0,0 +1,483 @@
+#
+# Read-write volumes: mount one over a blank data device and check that
+# files and directories can be made, written, renamed and removed, that
+# emptied directories shrink back, that a
+# full volume fails writes with ENOSPC until space is freed, that a frozen
+# volume holds writers until thawed, how striped and tiered volumes place
+# data, that
+# log-structured ones survive overwrites, also on emulated zoned drives,
+# and what the ioctls report, through myfs_ctl.
+#
+# Needs myfs.ko loaded.
+#
+
+MNT=mnt
+
+common_head()
+{
+    atf_set "require.user" "root"
+    atf_set "require.kmods" "myfs"
+}
+
+# A blank md(4) device of the given size; prints its path.
+md_new()
+{
+    md=$(mdconfig -a -t swap -s "$1") || atf_fail "mdconfig failed"
+    echo "$md" >> md.units
+    echo /dev/$md
+}
+
+mount_myfs()
+{
+    atf_check mkdir -p $MNT
+    atf_check mount -t myfs "$@" myfs $MNT
+}
+
+# Mount a new volume on a blank device of the given size, with any
+# further mount options given.
+attach()
+{
+    dev=$(md_new "$1")
+    shift
+    mount_myfs -o datadev=$dev "$@"
+}
+
+detach()
+{
+    umount -f $MNT 2>/dev/null
+    if [ -f md.units ]; then
+        for md in $(cat md.units); do
+            mdconfig -d -u $md
+        done
+    fi
+}
+
+atf_test_case namespace cleanup
+namespace_head()
+{
+    atf_set "descr" "Files and directories can be made, written, renamed" \
+        "and removed"
+    common_head
+}
+namespace_body()
+{
+    attach 64m
+    jot 100000 > want
+
+    atf_check mkdir -p $MNT/a/b
+    echo hello > $MNT/a/b/f || atf_fail "write failed"
+    atf_check -o inline:"hello\n" cat $MNT/a/b/f
+    atf_check cp want $MNT/a/text
+    atf_check cmp want $MNT/a/text
+    atf_check -e ignore dd if=want of=$MNT/a/sync bs=4k conv=fsync
+    atf_check cmp want $MNT/a/sync
+    atf_check -o inline:"b\nsync\ntext\n" ls $MNT/a
+
+    atf_check mv $MNT/a/text $MNT/a/b/moved
+    atf_check cmp want $MNT/a/b/moved
+    atf_check mv $MNT/a/sync $MNT/a/b/f
+    atf_check cmp want $MNT/a/b/f
+    atf_check truncate -s 10 $MNT/a/b/moved
+    atf_check -o inline:"1\n2\n3\n4\n5\n" cat $MNT/a/b/moved
+
+    atf_check -s not-exit:0 -e ignore rmdir $MNT/a/b
+    atf_check rm $MNT/a/b/f $MNT/a/b/moved
+    atf_check rmdir $MNT/a/b $MNT/a
+    atf_check -o empty ls $MNT
+}
+namespace_cleanup()
+{
+    detach
+}
+
+# A directory's size is its slots in use, up to the last, plus two.
+dir_size()
+{
+    stat -f %z $MNT/d
+}
+
+atf_test_case dirshrink cleanup
+dirshrink_head()
+{
+    atf_set "descr" "Directories give back emptied blocks at once and" \
+        "pack sparse ones in the background, keeping their entries"
+    common_head
+}
+dirshrink_body()
+{
+    attach 64m
+    atf_check mkdir $MNT/d
+    (cd $MNT/d && jot -w f%d 6400 | xargs touch) || atf_fail "create failed"
+    atf_check -o inline:"6402\n" dir_size
+    (cd $MNT/d && jot -w f%d 6400 | xargs rm) || atf_fail "remove failed"
+    atf_check -o inline:"2\n" dir_size
+    atf_check -o empty ls $MNT/d
+
+    # Keep one entry in ten: no block empties, so only packing helps.
+    (cd $MNT/d && jot -w f%d 6400 | xargs touch) || atf_fail "create failed"
+    jot 6400 | awk '$1 % 10 { print "f" $1 }' > gone
+    jot 640 10 6400 10 | sed 's/^/f/' | sort > kept
+    (cd $MNT/d && xargs rm) < gone || atf_fail "remove failed"
+    atf_check -o inline:"6402\n" dir_size
+    for i in $(jot 10); do
+        [ $(dir_size) -eq 642 ] && break
+        sleep 1
+    done
+    atf_check -o inline:"642\n" dir_size
+    ls $MNT/d | sort > got
+    atf_check cmp kept got
+    atf_check test -e $MNT/d/f6400
+    atf_check test ! -e $MNT/d/f6399
+}
+dirshrink_cleanup()
+{
+    detach
+}
+
+atf_test_case dirconcur cleanup
+dirconcur_head()
+{
+    atf_set "descr" "Parallel creates and removes in one directory, with" \
+        "readers listing it, lose and duplicate no entries"
+    common_head
+}
+dirconcur_body()
+{
+    attach 64m
+    atf_check mkdir $MNT/d
+    jot -w f%d 6400 | sort > all
+    (while [ ! -f stop ]; do ls $MNT/d > /dev/null; done) &
+    (cd $MNT/d && xargs -P 16 -n 50 touch) < all || atf_fail "create failed"
+    atf_check -o inline:"6402\n" dir_size
+    ls $MNT/d | sort > got
+    atf_check cmp all got
+
+    awk 'NR % 2' all > gone
+    awk 'NR % 2 == 0' all > kept
+    (cd $MNT/d && xargs -P 16 -n 50 rm) < gone || atf_fail "remove failed"
+    touch stop
+    wait
+    ls $MNT/d | sort > got
+    atf_check cmp kept got
+}
+dirconcur_cleanup()
+{
+    touch stop
+    detach
+}
+
+atf_test_case enospc cleanup
+enospc_head()
+{
+    atf_set "descr" "Writes to a full volume fail with ENOSPC, and" \
+        "succeed again once space is freed"
+    common_head
+}
+enospc_body()
+{
+    attach 8m
+    atf_check -s not-exit:0 -e match:"No space left on device" \
+        dd if=/dev/zero of=$MNT/fill bs=64k
+    size=$(stat -f %z $MNT/fill)
+    [ "$size" -gt 6000000 ] || atf_fail "volume full at $size bytes"
+
+    atf_check rm $MNT/fill
+    atf_check -e ignore dd if=/dev/zero of=$MNT/fill bs=64k count=64
+    atf_check -o inline:"4194304\n" stat -f %z $MNT/fill
+}
+enospc_cleanup()
+{
+    detach
+}
+
+ctl()
+{
+    $(atf_get_srcdir)/myfs_ctl "$@"
+}
+
+atf_test_case quota cleanup
+quota_head()
+{
+    atf_set "descr" "Files are charged their inode and every block they" \
+        "fill, a write past the limit fails with EDQUOT, and a project" \
+        "change moves what was charged"
+    common_head
+}
+quota_body()
+{
+    attach 64m
+    atf_check -o inline:"0 1\n" ctl getquota $MNT user 0
+
+    atf_check ctl setquota $MNT user 0 20 0
+    atf_check -s not-exit:0 -e match:"Disc quota exceeded" \
+        dd if=/dev/zero of=$MNT/f bs=4k count=30
+    atf_check -o inline:"20 2\n" ctl getquota $MNT user 0
+    atf_check truncate -s 40k $MNT/f
+    atf_check -o inline:"10 2\n" ctl getquota $MNT user 0
+    atf_check truncate -s 1m $MNT/f
+    atf_check -o inline:"10 2\n" ctl getquota $MNT user 0
+    atf_check rm $MNT/f
+    atf_check -o inline:"0 1\n" ctl getquota $MNT user 0
+
+    atf_check mkdir $MNT/d
+    atf_check -o inline:"0 0 2\n" ctl projusage $MNT
+    atf_check ctl setprojid $MNT/d 7
+    atf_check -o inline:"7 0 1\n" ctl projusage $MNT/d
+    atf_check -o inline:"0 0 1\n" ctl projusage $MNT
+}
+quota_cleanup()
+{
+    detach
+}
+
+atf_test_case inherit cleanup
+inherit_head()
+{
+    atf_set "descr" "New nodes take the group of their directory, and the" \
+        "project of one tagged to pass it on"
+    common_head
+}
+inherit_body()
+{
+    attach 64m
+    atf_check mkdir $MNT/d $MNT/plain
+    atf_check chgrp 5 $MNT/d
+    atf_check ctl setprojid $MNT/d 7 inherit
+    atf_check ctl setprojid $MNT/plain 8
+
+    atf_check mkdir $MNT/d/sub
+    atf_check touch $MNT/d/sub/f $MNT/plain/f
+    atf_check -o inline:"5\n" stat -f %g $MNT/d/sub/f
+    atf_check -o inline:"7 0 3\n" ctl projusage $MNT/d/sub/f
+    atf_check -o inline:"0 0 2\n" ctl projusage $MNT/plain/f
+    atf_check -o inline:"8 0 1\n" ctl projusage $MNT/plain
+}
+inherit_cleanup()
+{
+    detach
+}
+
+atf_test_case rstats cleanup
+rstats_head()
+{
+    atf_set "descr" "Recursive statistics follow creates, writes," \
+        "truncation, renames and removals"
+    common_head
+}
+rstats_body()
+{
+    attach 64m -o rstats
+    atf_check mkdir -p $MNT/a/b
+    atf_check -e ignore dd if=/dev/zero of=$MNT/a/b/f bs=10000 count=1
+    atf_check -e ignore dd if=/dev/zero of=$MNT/a/g bs=5000 count=1
+    atf_check -o inline:"15000 2 1\n" ctl rstat $MNT/a
+    atf_check -o inline:"15000 2 2\n" ctl rstat $MNT
+
+    atf_check mv $MNT/a/b/f $MNT/a/f
+    atf_check -o inline:"0 0 0\n" ctl rstat $MNT/a/b
+    atf_check -o inline:"15000 2 1\n" ctl rstat $MNT/a
+    atf_check mv $MNT/a/f $MNT/a/g
+    atf_check -o inline:"10000 1 1\n" ctl rstat $MNT/a
+    atf_check truncate -s 100 $MNT/a/g
+    atf_check rmdir $MNT/a/b
+    atf_check -o inline:"100 1 0\n" ctl rstat $MNT/a
+    atf_check -o inline:"100 1 1\n" ctl rstat $MNT
+    atf_check rm $MNT/a/g
+    atf_check -o inline:"0 0 1\n" ctl rstat $MNT
+}
+rstats_cleanup()
+{
+    detach
+}
+
+atf_test_case freeze cleanup
+freeze_head()
+{
+    atf_set "descr" "A frozen volume holds writers until it is thawed"
+    common_head
+}
+freeze_body()
+{
+    attach 64m
+    echo old > $MNT/f
+    atf_check ctl freeze $MNT
+    atf_check -s not-exit:0 -e match:"Device busy" ctl freeze $MNT
+
+    (echo new > $MNT/f; echo new > $MNT/g) &
+    writer=$!
+    sleep 1
+    kill -0 $writer || atf_fail "write went through a frozen volume"
+    atf_check -o inline:"old\n" cat $MNT/f
+    atf_check test ! -e $MNT/g
+
+    atf_check ctl thaw $MNT
+    wait $writer || atf_fail "write failed after thaw"
+    atf_check -o inline:"new\n" cat $MNT/f
+    atf_check -o inline:"new\n" cat $MNT/g
+    atf_check -s not-exit:0 -e match:"Invalid argument" ctl thaw $MNT
+}
+freeze_cleanup()
+{
+    ctl thaw $MNT 2>/dev/null
+    detach
+}
+
+atf_test_case stripe cleanup
+stripe_head()
+{
+    atf_set "descr" "A volume over several devices adds up their space and" \
+        "stripes each file across them a MiB at a time"
+    common_head
+}
+stripe_body()
+{
+    a=$(md_new 32m)
+    b=$(md_new 32m)
+    mount_myfs -o datadev=$a:$b
+    # Each device gives up its label block.
+    df -k $MNT | awk 'NR == 2 { print $2 }' > df.out
+    atf_check -o inline:"65528\n" cat df.out
+
+    atf_check -e ignore dd if=/dev/random of=data bs=1m count=8
+    atf_check -e ignore dd if=data of=$MNT/f bs=1m conv=fsync
+    atf_check -e ignore dd if=data of=$MNT/g bs=1m count=3 conv=fsync
+    atf_check -o inline:"1024 1024\n" ctl getdevs $MNT/f
+    ctl getdevs $MNT/g > g.devs
+    read na nb < g.devs
+    [ $((na + nb)) -eq 768 -a $na -ne 0 -a $nb -ne 0 ] || \
+        atf_fail "g has $na and $nb blocks"
+    atf_check cmp data $MNT/f
+    atf_check -o save:g.want head -c 3145728 data
+    atf_check cmp g.want $MNT/g
+}
+stripe_cleanup()
+{
+    detach
+}
+
+atf_test_case tiers cleanup
+tiers_head()
+{
+    atf_set "descr" "Small files go to the fast tier, pinned files to" \
+        "theirs, and large ones spill to the slow tier when the fast one" \
+        "fills"
+    common_head
+}
+tiers_body()
+{
+    fast=$(md_new 16m)
+    slow=$(md_new 64m)
+    mount_myfs -o fastdev=$fast -o slowdev=$slow
+    atf_check mkdir $MNT/cold
+    atf_check ctl settier $MNT/cold slow
+
+    atf_check -e ignore dd if=/dev/zero of=$MNT/small bs=4k count=4 \
+        conv=fsync
+    atf_check -e ignore dd if=/dev/zero of=$MNT/cold/f bs=4k count=64 \
+        conv=fsync
+    atf_check -o inline:"auto 4 0\n" ctl gettier $MNT/small
+    atf_check -o inline:"slow 0 64\n" ctl gettier $MNT/cold/f
+
+    atf_check -e ignore dd if=/dev/zero of=$MNT/big bs=1m count=24 \
+        conv=fsync
+    ctl gettier $MNT/big > big.tiers
+    read hint nfast nslow < big.tiers
+    [ "$nfast" -gt 0 -a "$nslow" -gt 0 ] || \
+        atf_fail "big has $nfast fast and $nslow slow blocks"
+    [ $((nfast + nslow)) -eq 6144 ] || atf_fail "big is not all placed"
+
+    # Pinning moves data already written, on the next migrator pass.
+    atf_check ctl settier $MNT/small slow
+    sleep 2
+    atf_check -o inline:"slow 0 4\n" ctl gettier $MNT/small
+}
+tiers_cleanup()
+{
+    detach
+}
+
+stat_get()
+{
+    sysctl -n vfs.myfs.stats.$1
+}
+
+# Write 8MB of random data to $MNT/f, then rewrite every other block of
+# it and then the rest from fresh data, and check what reads back.  Each
+# pass leaves the segments before it half live.
+overwrite()
+{
+    atf_check -e ignore dd if=/dev/random of=data bs=1m count=8
+    atf_check -e ignore dd if=data of=$MNT/f bs=1m conv=fsync
+    atf_check -e ignore dd if=/dev/random of=data bs=1m count=8
+    for first in 0 1; do
+        for i in $(jot 1024 $first 2047 2); do
+            dd if=data of=$MNT/f bs=4k skip=$i seek=$i count=1 \
+                conv=notrunc 2>/dev/null || atf_fail "write $i failed"
+        done
+        atf_check fsync $MNT/f
+    done
+    atf_check cmp data $MNT/f
+}
+
+atf_test_case logwrite cleanup
+logwrite_head()
+{
+    atf_set "descr" "Overwrites on a log-structured volume keep their" \
+        "data while the cleaner reclaims the segments they leave half dead"
+    common_head
+}
+logwrite_body()
+{
+    attach 16m -o logwrite
+    cleaned=$(stat_get log_cleaned)
+    overwrite
+    [ $(stat_get log_cleaned) -gt $cleaned ] || atf_fail "nothing was cleaned"
+
+    atf_check rm $MNT/f
+    atf_check -e ignore dd if=data of=$MNT/g bs=1m conv=fsync
+    atf_check cmp data $MNT/g
+}
+logwrite_cleanup()
+{
+    detach
+}
+
+atf_test_case zoned cleanup
+zoned_head()
+{
+    atf_set "descr" "On emulated zoned drives every write lands at its" \
+        "zone's write pointer, and cleaned zones are reset for reuse"
+    atf_set "is.exclusive" "true"
+    common_head
+}
+zoned_body()
+{
+    # 2 MiB zones: 11 for data, of which 2 are the cleaner's reserve.
+    attach 24m -o zonesim=2
+    wperr=$(stat_get zone_wperr)
+    resets=$(stat_get zone_resets)
+    overwrite
+    [ $(stat_get zone_resets) -gt $resets ] || atf_fail "no zone was reset"
+    [ $(stat_get zone_wperr) -eq $wperr ] || \
+        atf_fail "writes off the write pointer"
+}
+zoned_cleanup()
+{
+    detach
+}
+
+atf_init_test_cases()
+{
+    atf_add_test_case namespace
+    atf_add_test_case dirshrink
+    atf_add_test_case dirconcur
+    atf_add_test_case enospc
+    atf_add_test_case quota
+    atf_add_test_case inherit
+    atf_add_test_case rstats
+    atf_add_test_case freeze
+    atf_add_test_case stripe
+    atf_add_test_case tiers
+    atf_add_test_case logwrite
+    atf_add_test_case zoned
+}
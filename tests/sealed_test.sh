@@ -0,0 +1,473 @@
+#
+# Round trips of sealed images: build one from a tree with mkfs.myfs,
+# attach it to an md(4) device, mount it and check that lookup, readdir
+# and read give back the tree.  Then the read-side machinery: access
+# tracing, the cache device, file handles, absent-name filters, prefetch
+# on open, low-memory trimming and POSIX_FADV_DONTNEED, observed through
+# the vfs.myfs.stats counters.
+#
+# Needs myfs.ko loaded, and mkfs.myfs and myfstrace in PATH or named by
+# the mkfs_myfs and myfstrace configuration variables:
+#
+#     kyua -v test_suites.FreeBSD.mkfs_myfs=/path/to/mkfs.myfs test
+#
+
+MNT=mnt
+
+common_head()
+{
+    atf_set "require.user" "root"
+    atf_set "require.kmods" "myfs"
+}
+
+# The source tree: empty, small, block-sized and multi-block files, a
+# compressible one, nested and empty directories, a symlink and a hard link.
+make_tree()
+{
+    atf_check mkdir -p src/dir/sub src/empty
+    atf_check touch src/zero
+    echo hello > src/small
+    atf_check -e ignore dd if=/dev/random of=src/block bs=4096 count=1
+    atf_check -e ignore dd if=/dev/random of=src/dir/big bs=4096 count=300
+    jot 100000 > src/dir/sub/text
+    atf_check ln -s dir/sub/text src/link
+    atf_check ln src/dir/sub/text src/dir/text.hard
+}
+
+mkfs()
+{
+    atf_check -o save:mkfs.out $(atf_config_get mkfs_myfs mkfs.myfs) \
+        "$@" --from-dir src img
+}
+
+# Mount the image read-only, with any further mount options given.
+attach()
+{
+    md=$(mdconfig -a -t vnode -f img) || atf_fail "mdconfig failed"
+    echo "$md" > md.unit
+    atf_check mkdir -p $MNT
+    atf_check mount -t myfs -o ro "$@" /dev/$md $MNT
+}
+
+detach()
+{
+    umount -f $MNT 2>/dev/null
+    if [ -f md.unit ]; then
+        mdconfig -d -u $(cat md.unit)
+        rm md.unit
+    fi
+    if [ -f cache.unit ]; then
+        mdconfig -d -u $(cat cache.unit)
+        rm cache.unit
+    fi
+}
+
+# A blank device for the cachedev mount option; prints its name.
+cache_dev()
+{
+    cache=$(mdconfig -a -t swap -s 16m) || atf_fail "mdconfig failed"
+    echo "$cache" > cache.unit
+    echo /dev/$cache
+}
+
+myfstrace()
+{
+    $(atf_config_get myfstrace myfstrace) "$@"
+}
+
+ctl()
+{
+    $(atf_get_srcdir)/myfs_ctl "$@"
+}
+
+stat_get()
+{
+    sysctl -n vfs.myfs.stats.$1
+}
+
+# A directory large enough for an absent-name filter.
+make_many()
+{
+    atf_check mkdir src/many
+    for i in $(jot 200); do
+        touch src/many/f$i
+    done
+}
+
+# Look up count names that are not in the many directory.
+absent()
+{
+    for i in $(jot $2); do
+        test -e $MNT/many/$1$i && atf_fail "$1$i found"
+    done
+}
+
+# Names through readdir, then every file's contents through lookup and read.
+check_tree()
+{
+    (cd src && find . | sort) > want
+    (cd $MNT && find . | sort) > got
+    atf_check cmp want got
+    atf_check diff -r src $MNT
+    atf_check -o inline:"dir/sub/text\n" readlink $MNT/link
+    atf_check test $MNT/dir/sub/text -ef $MNT/dir/text.hard
+}
+
+atf_test_case plain cleanup
+plain_head()
+{
+    atf_set "descr" "An image reads back as the tree it was built from"
+    common_head
+}
+plain_body()
+{
+    make_tree
+    mkfs
+    attach
+    check_tree
+    atf_check -s not-exit:0 -e ignore mount -u -o rw $MNT
+    atf_check -s not-exit:0 -e ignore touch $MNT/new
+}
+plain_cleanup()
+{
+    detach
+}
+
+atf_test_case zlib cleanup
+zlib_head()
+{
+    atf_set "descr" "A compressed image (-z) reads back as its tree"
+    common_head
+}
+zlib_body()
+{
+    make_tree
+    mkfs -z
+    attach
+    check_tree
+}
+zlib_cleanup()
+{
+    detach
+}
+
+atf_test_case dup cleanup
+dup_head()
+{
+    atf_set "descr" "An image with duplicated metadata (-D) reads back" \
+        "as its tree"
+    common_head
+}
+dup_body()
+{
+    make_tree
+    mkfs -D -z
+    attach
+    check_tree
+}
+dup_cleanup()
+{
+    detach
+}
+
+atf_test_case crypt cleanup
+crypt_head()
+{
+    atf_set "descr" "An encrypted directory (-e) reads back only once" \
+        "its master key is added"
+    common_head
+}
+crypt_body()
+{
+    make_tree
+    atf_check -e ignore dd if=/dev/random of=key bs=64 count=1
+    mkfs -e dir -k key
+    attach
+    atf_check -o match:"^hello$" cat $MNT/small
+    atf_check -s not-exit:0 -e ignore cat $MNT/dir/sub/text
+
+    id=$(sed -n 's/.*encrypted inodes, key //p' mkfs.out)
+    atf_check -o inline:"$id\n" $(atf_get_srcdir)/myfs_addkey $MNT key
+    check_tree
+}
+crypt_cleanup()
+{
+    detach
+}
+
+atf_test_case casefold cleanup
+casefold_head()
+{
+    atf_set "descr" "A case-insensitive directory (-i) finds names in" \
+        "any case and lists them as created"
+    common_head
+}
+casefold_body()
+{
+    make_tree
+    echo readme > src/dir/ReadMe.TXT
+    mkfs -i dir
+    attach
+    check_tree
+    atf_check -o inline:"readme\n" cat $MNT/dir/README.txt
+    atf_check cmp src/dir/big $MNT/dir/BIG
+    atf_check cmp src/dir/sub/text $MNT/dir/SUB/TEXT
+    atf_check -s not-exit:0 -e ignore cat $MNT/SMALL
+}
+casefold_cleanup()
+{
+    detach
+}
+
+atf_test_case trace cleanup
+trace_head()
+{
+    atf_set "descr" "A drained access trace lists paths in first-touch" \
+        "order, and an image laid out from it reads back as its tree"
+    common_head
+}
+trace_body()
+{
+    make_tree
+    mkfs -m map
+    attach
+    atf_check myfstrace start $MNT
+    atf_check -o ignore cat $MNT/dir/sub/text $MNT/small
+    atf_check myfstrace stop $MNT
+    atf_check -o save:trace myfstrace -m map drain $MNT
+    atf_check -o inline:"/dir\n/dir/sub\n/dir/sub/text\n/small\n" cat trace
+
+    detach
+    mkfs -t trace
+    attach
+    check_tree
+}
+trace_cleanup()
+{
+    detach
+}
+
+atf_test_case cachedev cleanup
+cachedev_head()
+{
+    atf_set "descr" "Blocks read through a cache device are read from it" \
+        "after a remount"
+    atf_set "is.exclusive" "true"
+    common_head
+}
+cachedev_body()
+{
+    make_tree
+    mkfs
+    cache=$(cache_dev)
+    attach -o cachedev=$cache
+    atf_check -o file:src/dir/big cat $MNT/dir/big
+    atf_check umount $MNT
+    atf_check mount -t myfs -o ro -o cachedev=$cache /dev/$(cat md.unit) $MNT
+
+    hits=$(stat_get l2_hits)
+    atf_check -o file:src/dir/big cat $MNT/dir/big
+    [ $(stat_get l2_hits) -gt $hits ] || atf_fail "no cache device hits"
+    check_tree
+}
+cachedev_cleanup()
+{
+    detach
+}
+
+atf_test_case fhandle cleanup
+fhandle_head()
+{
+    atf_set "descr" "Files open and read through their file handles"
+    common_head
+}
+fhandle_body()
+{
+    make_tree
+    mkfs -z
+    attach
+    atf_check -o file:src/dir/sub/text ctl fhread $MNT/dir/sub/text
+    atf_check -o file:src/dir/sub/text ctl fhread $MNT/dir/text.hard
+    atf_check -o file:src/dir/big ctl fhread $MNT/dir/big
+    atf_check -o empty ctl fhread $MNT/zero
+}
+fhandle_cleanup()
+{
+    detach
+}
+
+atf_test_case bloom cleanup
+bloom_head()
+{
+    atf_set "descr" "A large directory that keeps failing lookups gets" \
+        "an absent-name filter, which still finds every entry"
+    atf_set "is.exclusive" "true"
+    common_head
+}
+bloom_body()
+{
+    make_tree
+    make_many
+    mkfs
+    attach
+    builds=$(stat_get bloom_builds)
+    rejects=$(stat_get bloom_rejects)
+    absent nope 20
+    [ $(stat_get bloom_builds) -eq $((builds + 1)) ] || \
+        atf_fail "no filter built"
+    [ $(stat_get bloom_rejects) -ge $((rejects + 10)) ] || \
+        atf_fail "filter rejected too few names"
+    for i in 1 2 100 199 200; do
+        atf_check test -e $MNT/many/f$i
+    done
+    check_tree
+}
+bloom_cleanup()
+{
+    detach
+}
+
+atf_test_case prefetch cleanup
+prefetch_head()
+{
+    atf_set "descr" "Opening a file for read queues its first blocks" \
+        "unless vfs.myfs.prefetch is off"
+    atf_set "is.exclusive" "true"
+    common_head
+}
+prefetch_body()
+{
+    make_tree
+    mkfs
+    attach
+    sysctl -n vfs.myfs.prefetch > prefetch.saved
+
+    atf_check -o ignore sysctl vfs.myfs.prefetch=0
+    n=$(stat_get prefetch)
+    atf_check -o file:src/block cat $MNT/block
+    [ $(stat_get prefetch) -eq $n ] || atf_fail "prefetched while disabled"
+
+    atf_check -o ignore sysctl vfs.myfs.prefetch=1
+    atf_check -o file:src/dir/big cat $MNT/dir/big
+    [ $(stat_get prefetch) -eq $((n + 8)) ] || \
+        atf_fail "open did not queue the first window"
+}
+prefetch_cleanup()
+{
+    if [ -f prefetch.saved ]; then
+        sysctl vfs.myfs.prefetch=$(cat prefetch.saved) >/dev/null
+    fi
+    detach
+}
+
+atf_test_case lowmem cleanup
+lowmem_head()
+{
+    atf_set "descr" "A low-memory event releases absent-name filters," \
+        "which are built again on demand"
+    atf_set "is.exclusive" "true"
+    common_head
+}
+lowmem_body()
+{
+    make_tree
+    make_many
+    mkfs
+    attach
+    sysctl -n vfs.myfs.lowmem_pct > lowmem_pct.saved
+    absent a 8
+
+    freed=$(stat_get lowmem_freed)
+    builds=$(stat_get bloom_builds)
+    atf_check -o ignore sysctl vfs.myfs.lowmem_pct=100
+    atf_check -o ignore sysctl debug.vm_lowmem=1
+    sleep 1
+    [ $(stat_get lowmem_freed) -gt $freed ] || atf_fail "nothing released"
+
+    absent b 8
+    [ $(stat_get bloom_builds) -eq $((builds + 1)) ] || \
+        atf_fail "filter not rebuilt"
+    check_tree
+}
+lowmem_cleanup()
+{
+    if [ -f lowmem_pct.saved ]; then
+        sysctl vfs.myfs.lowmem_pct=$(cat lowmem_pct.saved) >/dev/null
+    fi
+    detach
+}
+
+atf_test_case dontneed cleanup
+dontneed_head()
+{
+    atf_set "descr" "POSIX_FADV_DONTNEED drops a file's cached blocks," \
+        "so the next read goes back to the cache device"
+    atf_set "is.exclusive" "true"
+    common_head
+}
+dontneed_body()
+{
+    make_tree
+    mkfs
+    attach -o cachedev=$(cache_dev)
+    atf_check -o file:src/dir/big cat $MNT/dir/big
+    # Let the staged batches reach the cache device.
+    sleep 6
+
+    hits=$(stat_get l2_hits)
+    atf_check -o file:src/dir/big cat $MNT/dir/big
+    [ $(stat_get l2_hits) -eq $hits ] || atf_fail "blocks were not cached"
+    atf_check ctl dontneed $MNT/dir/big
+    atf_check -o file:src/dir/big cat $MNT/dir/big
+    [ $(stat_get l2_hits) -gt $hits ] || atf_fail "blocks were kept"
+}
+dontneed_cleanup()
+{
+    detach
+}
+
+atf_test_case dontneed_range cleanup
+dontneed_range_head()
+{
+    atf_set "descr" "POSIX_FADV_DONTNEED on part of a file drops just the" \
+        "blocks it covers"
+    atf_set "is.exclusive" "true"
+    common_head
+}
+dontneed_range_body()
+{
+    make_tree
+    mkfs
+    attach -o cachedev=$(cache_dev)
+    atf_check -o file:src/dir/big cat $MNT/dir/big
+    # Let the staged batches reach the cache device.
+    sleep 6
+
+    # Blocks 10 to 19, the last one ending at the range's last byte.
+    hits=$(stat_get l2_hits)
+    atf_check ctl dontneed $MNT/dir/big 40960 40960
+    atf_check -o file:src/dir/big cat $MNT/dir/big
+    [ $(stat_get l2_hits) -eq $((hits + 10)) ] || \
+        atf_fail "$(($(stat_get l2_hits) - hits)) blocks dropped, not 10"
+}
+dontneed_range_cleanup()
+{
+    detach
+}
+
+atf_init_test_cases()
+{
+    atf_add_test_case plain
+    atf_add_test_case zlib
+    atf_add_test_case dup
+    atf_add_test_case crypt
+    atf_add_test_case casefold
+    atf_add_test_case trace
+    atf_add_test_case cachedev
+    atf_add_test_case fhandle
+    atf_add_test_case bloom
+    atf_add_test_case prefetch
+    atf_add_test_case lowmem
+    atf_add_test_case dontneed
+    atf_add_test_case dontneed_range
+}
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2024 Your Name
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * hashbench: compare the name hashes a sealed image can index a
+ * case-insensitive directory with.
+ *
+ * Images carry a per-volume key in the superblock and hash folded names
+ * with SipHash-1-3 under it; images without one fall back to FNV-1a.  For
+ * each name set this reports the cost per hash, the longest run of equal
+ * 32-bit hashes (the entries myfs_img_foldlookup() must compare by name
+ * after its binary search) and the worst bucket of a 2^BITS chained table.
+ *
+ * The realistic set mimics camera rolls, build trees and mail spools.  The
+ * adversarial set is a Joux multicollision on FNV-1a: from one state a
+ * birthday search finds two 8-byte blocks that reach the same next state,
+ * and chaining -k such pairs yields 2^k names that all hash alike without
+ * the key, the attack an untrusted tenant can mount on an unkeyed index.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "myfs_casefold.h"
+
+#define BITS        12      /* bucket table size */
+#define BLK         8       /* multicollision block length */
+#define ROUNDS      200     /* timing passes over each set */
+
+static volatile uint32_t sink;   /* keeps the timed loop alive */
+static const char alnum[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+
+struct nameset {
+    const char *label;
+    char **names;
+    size_t *lens;
+    size_t count;
+};
+
+static void
+nameset_add(struct nameset *ns, const char *name)
+{
+    if ((ns->count & (ns->count - 1)) == 0) {
+        size_t n = ns->count == 0 ? 1 : ns->count * 2;
+
+        if ((ns->names = realloc(ns->names, n * sizeof(char *))) == NULL ||
+            (ns->lens = realloc(ns->lens, n * sizeof(size_t))) == NULL)
+            err(1, "realloc");
+    }
+    if ((ns->names[ns->count] = strdup(name)) == NULL)
+        err(1, "strdup");
+    ns->lens[ns->count++] = strlen(name);
+}
+
+static void
+realistic(struct nameset *ns, size_t count)
+{
+    static const char *ext[] = { "c", "h", "o", "txt", "md", "json" };
+    char name[256];
+    size_t i;
+
+    ns->label = "realistic";
+    for (i = 0; ns->count < count; i++) {
+        switch (i % 5) {
+        case 0:
+            snprintf(name, sizeof(name), "img_%04zu.jpg", i / 5);
+            break;
+        case 1:
+            snprintf(name, sizeof(name), "file%zu.%s", i / 5,
+                ext[(i / 5) % 6]);
+            break;
+        case 2:
+            snprintf(name, sizeof(name), "%08lx.o", (unsigned long)
+                (i * 2654435761u));
+            break;
+        case 3:
+            snprintf(name, sizeof(name), "%zu.m%zu.host.example:2,s",
+                1700000000 + i * 37, i % 4096);
+            break;
+        default:
+            snprintf(name, sizeof(name), "report-2024-%02zu-%02zu (%zu).pdf",
+                1 + i % 12, 1 + i % 28, i / 5);
+            break;
+        }
+        nameset_add(ns, name);
+    }
+}
+
+static uint32_t
+fnv_step(uint32_t h, const char *blk)
+{
+    int i;
+
+    for (i = 0; i < BLK; i++)
+        h = (h ^ (unsigned char)blk[i]) * 0x01000193;
+    return (h);
+}
+
+static void
+random_block(char *blk)
+{
+    int i;
+
+    for (i = 0; i < BLK; i++)
+        blk[i] = alnum[arc4random_uniform(sizeof(alnum) - 1)];
+}
+
+/*
+ * Find two distinct blocks taking FNV-1a from state h to one common state.
+ * Only lowercase letters and digits are used so folding leaves them alone.
+ */
+static uint32_t
+collide(uint32_t h, char *a, char *b)
+{
+    const size_t size = 1 << 20;
+    uint32_t *state;
+    char *blk;
+    size_t slot, tries;
+
+    if ((state = calloc(size, sizeof(*state))) == NULL ||
+        (blk = calloc(size, BLK)) == NULL)
+        err(1, "calloc");
+    for (tries = 0;; tries++) {
+        char cand[BLK];
+        uint32_t s;
+
+        /* Start over rather than let the table fill up. */
+        if (tries == size / 2) {
+            memset(blk, 0, size * BLK);
+            tries = 0;
+        }
+        random_block(cand);
+        s = fnv_step(h, cand);
+        for (slot = s & (size - 1); blk[slot * BLK] != 0;
+            slot = (slot + 1) & (size - 1)) {
+            if (state[slot] == s &&
+                memcmp(&blk[slot * BLK], cand, BLK) != 0) {
+                memcpy(a, &blk[slot * BLK], BLK);
+                memcpy(b, cand, BLK);
+                free(state);
+                free(blk);
+                return (s);
+            }
+        }
+        state[slot] = s;
+        memcpy(&blk[slot * BLK], cand, BLK);
+    }
+}
+
+static void
+adversarial(struct nameset *ns, int k)
+{
+    char pair[32][2][BLK];
+    char name[256];
+    uint32_t h = 0x811c9dc5;
+    size_t i;
+    int j;
+
+    ns->label = "adversarial";
+    for (j = 0; j < k; j++)
+        h = collide(h, pair[j][0], pair[j][1]);
+    for (i = 0; i < ((size_t)1 << k); i++) {
+        for (j = 0; j < k; j++)
+            memcpy(&name[j * BLK], pair[j][(i >> j) & 1], BLK);
+        name[k * BLK] = '\0';
+        nameset_add(ns, name);
+    }
+}
+
+static int
+hash_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x < y ? -1 : x > y);
+}
+
+static void
+measure(const struct nameset *ns, const uint8_t *key, const char *hname)
+{
+    struct timespec t0, t1;
+    uint32_t *hash, *load;
+    size_t i, run, maxrun, maxload, probes;
+    int r;
+    double ns_per;
+
+    if ((hash = calloc(ns->count, sizeof(*hash))) == NULL ||
+        (load = calloc((size_t)1 << BITS, sizeof(*load))) == NULL)
+        err(1, "calloc");
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (r = 0; r < ROUNDS; r++)
+        for (i = 0; i < ns->count; i++)
+            sink += myfs_fold_hash(key, ns->names[i], ns->lens[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns_per = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+        ((double)ROUNDS * ns->count);
+
+    for (i = 0; i < ns->count; i++) {
+        hash[i] = myfs_fold_hash(key, ns->names[i], ns->lens[i]);
+        load[hash[i] & ((1 << BITS) - 1)]++;
+    }
+    for (i = 0, maxload = 0; i < ((size_t)1 << BITS); i++)
+        if (load[i] > maxload)
+            maxload = load[i];
+
+    /*
+     * A lookup compares every entry in its hash's run; averaged over all
+     * names that is the sum of squared run lengths over the count.
+     */
+    qsort(hash, ns->count, sizeof(*hash), hash_cmp);
+    for (i = 0, maxrun = 0, probes = 0; i < ns->count; i += run) {
+        for (run = 1; i + run < ns->count && hash[i + run] == hash[i];
+            run++)
+            continue;
+        if (run > maxrun)
+            maxrun = run;
+        probes += run * run;
+    }
+
+    printf("%-12s %-10s %7zu %8.1f %10.2f %8zu %10zu\n", ns->label,
+        hname, ns->count, ns_per, (double)probes / ns->count, maxrun,
+        maxload);
+    free(hash);
+    free(load);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: hashbench [-k pairs] [-n names]\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct nameset real = { 0 }, hostile = { 0 };
+    uint8_t key[MYFS_IMG_HASHKEY_SIZE];
+    size_t count = 4096;
+    int ch, k = 12;
+
+    while ((ch = getopt(argc, argv, "k:n:")) != -1) {
+        switch (ch) {
+        case 'k':
+            k = atoi(optarg);
+            if (k < 1 || k > 20)
+                errx(1, "pairs must be 1 to 20");
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            if (count == 0)
+                errx(1, "bad name count");
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    arc4random_buf(key, sizeof(key));
+    realistic(&real, count);
+    adversarial(&hostile, k);
+
+    printf("%-12s %-10s %7s %8s %10s %8s %10s\n", "set", "hash", "names",
+        "ns/hash", "cmp/lookup", "longest", "max/2^" __XSTRING(BITS));
+    measure(&real, NULL, "fnv1a");
+    measure(&real, key, "siphash13");
+    measure(&hostile, NULL, "fnv1a");
+    measure(&hostile, key, "siphash13");
+    return (0);
+}
@@ -0,0 +1,1341 @@
+/*
+ * Copyright (c) 2024 Your Name
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * mkfs.myfs: build a sealed myfs image (see myfs_image.h) from a directory
+ * tree.
+ *
+ * Objects are numbered and laid out in one order: an optional access trace
+ * first, each traced path preceded by its not yet placed ancestors, then
+ * everything else in depth-first name order.  A cold start that follows
+ * the trace then reads the inode table and one forward sweep of data.
+ *
+ * Worker threads read, compress and encode objects ahead of a single writer
+ * that appends them to the image in order; the window between the writer
+ * and the workers bounds memory use.
+ *
+ * With -D, directories and symlinks are written up front by the main
+ * thread, so that all metadata is contiguous and can be mirrored and
+ * checksummed once the rest of the image is out.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <endian.h>
+#define __unused __attribute__((__unused__))
+#else
+#include <sys/endian.h>
+#endif
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "myfs_image.h"
+#include "myfs_casefold.h"
+
+#define BSIZE MYFS_IMG_BSIZE
+
+/* Uncompressed files larger than this are copied by the writer itself. */
+#define STREAM_MIN (1024 * 1024)
+
+/* Compressed output larger than this spills to a temporary file. */
+#define SPILL_MIN (16 * 1024 * 1024)
+
+struct node {
+    char *path;             /* relative to the source root, "" for root */
+    const char *name;       /* last component of path */
+    struct stat st;
+    int parent;             /* -1 for the root */
+    int link_of;            /* hard link: primary node, else -1 */
+    int *children;          /* directories, in name order */
+    int nchildren;
+    int cap;
+    uint64_t ino;           /* image inode, 0 until placed */
+    uint64_t size;          /* bytes of data, set by the writer */
+    uint32_t nlink;
+    uint16_t iflags;        /* MYFS_IMG_I_* */
+    uint64_t daddr;
+    int encrypt;            /* under an -e directory */
+    uint64_t crypt;         /* context table index */
+    unsigned char *key;     /* per-file key, if encrypted */
+    unsigned char *nkey;    /* and names key and IV */
+};
+
+/* Encoded data for one object, produced by a worker. */
+struct job {
+    int done;
+    int error;              /* errno, reported by the writer */
+    int stream;             /* writer copies from the source file */
+    unsigned char *buf;     /* data, or compressed chunks */
+    size_t len;
+    size_t cap;
+    FILE *spill;            /* compressed chunks, if too big for buf */
+    uint32_t *table;        /* compressed files: chunk offsets */
+    size_t ntable;
+    int meta;               /* -D: already written with the metadata */
+};
+
+static struct node *nodes;
+static int nnodes, capnodes;
+static int *order;          /* primary nodes in placement order */
+static int norder;
+static struct job *jobs;
+
+static const char *srcdir;
+static int srcfd;
+static int compress_data;
+static int dup_meta;
+static unsigned char *master_prk;  /* -k: HKDF-Extract of the master key */
+static unsigned char key_id[MYFS_IMG_KEYID_SIZE];
+static struct myfs_img_crypt *ctxs; /* context table */
+static uint64_t nctxs;
+static uint8_t hash_key[MYFS_IMG_HASHKEY_SIZE];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static int next_job, written, window;
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: mkfs.myfs [-Dz] [-e dir -k keyfile] [-i dir] "
+        "[-j jobs] [-m map]\n"
+        "                 [-t trace] --from-dir dir image\n");
+    exit(EX_USAGE);
+}
+
+static void *
+xmalloc(size_t size)
+{
+    void *p;
+
+    p = malloc(size);
+    if (p == NULL && size != 0)
+        err(EX_OSERR, "malloc");
+    return (p);
+}
+
+static void *
+xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL && size != 0)
+        err(EX_OSERR, "realloc");
+    return (p);
+}
+
+/* Path lookup for trace entries and hard links */
+
+struct hent {
+    const char *key;
+    dev_t dev;
+    ino_t ino;
+    int idx;
+};
+
+static struct hent *phash, *ihash;
+static size_t hsize;
+
+static uint64_t
+hash_str(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*s != '\0')
+        h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+    return (h);
+}
+
+static void
+hash_init(size_t n)
+{
+    for (hsize = 64; hsize < n * 2; hsize <<= 1)
+        ;
+    phash = calloc(hsize, sizeof(*phash));
+    ihash = calloc(hsize, sizeof(*ihash));
+    if (phash == NULL || ihash == NULL)
+        err(EX_OSERR, "calloc");
+}
+
+static void
+path_insert(const char *key, int idx)
+{
+    size_t i;
+
+    for (i = hash_str(key) & (hsize - 1); phash[i].key != NULL;
+        i = (i + 1) & (hsize - 1))
+        ;
+    phash[i].key = key;
+    phash[i].idx = idx;
+}
+
+static int
+path_find(const char *key)
+{
+    size_t i;
+
+    for (i = hash_str(key) & (hsize - 1); phash[i].key != NULL;
+        i = (i + 1) & (hsize - 1)) {
+        if (strcmp(phash[i].key, key) == 0)
+            return (phash[i].idx);
+    }
+    return (-1);
+}
+
+/* Return the first node seen with (dev, ino), recording idx if new. */
+static int
+link_find(dev_t dev, ino_t ino, int idx)
+{
+    size_t i;
+
+    for (i = (ino * 0x9e3779b97f4a7c15ULL) & (hsize - 1);
+        ihash[i].key != NULL; i = (i + 1) & (hsize - 1)) {
+        if (ihash[i].dev == dev && ihash[i].ino == ino)
+            return (ihash[i].idx);
+    }
+    ihash[i].key = "";
+    ihash[i].dev = dev;
+    ihash[i].ino = ino;
+    ihash[i].idx = idx;
+    return (idx);
+}
+
+/* Tree walk */
+
+static int
+name_cmp(const void *a, const void *b)
+{
+    const char *x = *(const char * const *)a;
+    const char *y = *(const char * const *)b;
+    size_t lx = strlen(x), ly = strlen(y);
+    int cmp;
+
+    /* The kernel's order: bytewise, shorter name first on a tie. */
+    cmp = memcmp(x, y, lx < ly ? lx : ly);
+    if (cmp == 0)
+        cmp = (lx > ly) - (lx < ly);
+    return (cmp);
+}
+
+static int
+node_new(const char *path, int parent)
+{
+    struct node *np;
+
+    if (nnodes == capnodes) {
+        capnodes = capnodes ? capnodes * 2 : 1024;
+        nodes = xrealloc(nodes, capnodes * sizeof(*nodes));
+    }
+    np = &nodes[nnodes];
+    memset(np, 0, sizeof(*np));
+    np->path = strdup(path);
+    if (np->path == NULL)
+        err(EX_OSERR, "strdup");
+    np->name = strrchr(np->path, '/');
+    np->name = np->name != NULL ? np->name + 1 : np->path;
+    np->parent = parent;
+    np->link_of = -1;
+    if (fstatat(srcfd, *path != '\0' ? path : ".", &np->st,
+        AT_SYMLINK_NOFOLLOW) == -1)
+        err(EX_NOINPUT, "%s/%s", srcdir, path);
+
+    return (nnodes++);
+}
+
+static void
+child_add(int dir, int child)
+{
+    struct node *dp = &nodes[dir];
+
+    if (dp->nchildren == dp->cap) {
+        dp->cap = dp->cap ? dp->cap * 2 : 16;
+        dp->children = xrealloc(dp->children, dp->cap * sizeof(int));
+    }
+    dp->children[dp->nchildren++] = child;
+}
+
+static void
+walk(int dir)
+{
+    char **names, path[PATH_MAX];
+    struct dirent *de;
+    DIR *d;
+    int fd, i, idx, n, cap;
+
+    fd = openat(srcfd, *nodes[dir].path != '\0' ? nodes[dir].path : ".",
+        O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || (d = fdopendir(fd)) == NULL)
+        err(EX_NOINPUT, "%s/%s", srcdir, nodes[dir].path);
+
+    names = NULL;
+    n = cap = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            names = xrealloc(names, cap * sizeof(char *));
+        }
+        names[n] = strdup(de->d_name);
+        if (names[n++] == NULL)
+            err(EX_OSERR, "strdup");
+    }
+    closedir(d);
+    qsort(names, n, sizeof(char *), name_cmp);
+
+    for (i = 0; i < n; i++) {
+        if (snprintf(path, sizeof(path), "%s%s%s", nodes[dir].path,
+            *nodes[dir].path != '\0' ? "/" : "", names[i]) >=
+            (int)sizeof(path))
+            errx(EX_DATAERR, "%s/%s: path too long", srcdir, names[i]);
+        idx = node_new(path, dir);
+        child_add(dir, idx);
+        if (S_ISDIR(nodes[idx].st.st_mode))
+            walk(idx);
+        free(names[i]);
+    }
+    free(names);
+}
+
+/* Placement */
+
+static void
+place(int idx)
+{
+    struct node *np;
+
+    if (nodes[idx].link_of != -1)
+        idx = nodes[idx].link_of;
+    np = &nodes[idx];
+    if (np->ino != 0)
+        return;
+    if (np->parent != -1)
+        place(np->parent);
+    np->ino = norder + 1;
+    order[norder++] = idx;
+}
+
+static void
+read_trace(const char *trace)
+{
+    char *line, *p;
+    size_t cap;
+    ssize_t len;
+    FILE *f;
+    int idx;
+
+    f = fopen(trace, "r");
+    if (f == NULL)
+        err(EX_NOINPUT, "%s", trace);
+
+    line = NULL;
+    cap = 0;
+    while ((len = getline(&line, &cap, f)) != -1) {
+        /* One path per line; anything after a tab is ignored. */
+        p = line + strcspn(line, "\t\r\n");
+        *p = '\0';
+        p = line;
+        if (*p == '#' || *p == '\0')
+            continue;
+        while (*p == '/' || (p[0] == '.' && p[1] == '/'))
+            p += (*p == '/') ? 1 : 2;
+        idx = path_find(p);
+        if (idx != -1)
+            place(idx);
+    }
+    free(line);
+    fclose(f);
+}
+
+/*
+ * Write "ino<TAB>path" for every placed object, so that myfstrace can turn
+ * the inode numbers it records on a mounted image back into paths.
+ */
+static void
+write_map(const char *map)
+{
+    FILE *f;
+    int k;
+
+    f = fopen(map, "w");
+    if (f == NULL)
+        err(EX_CANTCREAT, "%s", map);
+    for (k = 0; k < norder; k++) {
+        fprintf(f, "%ju\t/%s\n", (uintmax_t)nodes[order[k]].ino,
+            nodes[order[k]].path);
+    }
+    if (fclose(f) != 0)
+        err(EX_IOERR, "%s", map);
+}
+
+/* Encryption, see myfs_image.h */
+
+#define PRK_SIZE 64             /* SHA-512 */
+
+/* The first block of HKDF-Expand for info "myfs", what and nonce. */
+static void
+hkdf_expand(uint8_t what, const unsigned char *nonce, unsigned char *out)
+{
+    unsigned char info[4 + 1 + MYFS_IMG_NONCE_SIZE + 1];
+    unsigned int outlen;
+    size_t len;
+
+    memcpy(info, "myfs", 4);
+    len = 4;
+    info[len++] = what;
+    if (nonce != NULL) {
+        memcpy(info + len, nonce, MYFS_IMG_NONCE_SIZE);
+        len += MYFS_IMG_NONCE_SIZE;
+    }
+    info[len++] = 1;
+    if (HMAC(EVP_sha512(), master_prk, PRK_SIZE, info, len, out,
+        &outlen) == NULL)
+        errx(EX_SOFTWARE, "HMAC-SHA512 failed");
+}
+
+/* -k: the master key is the file's MYFS_IMG_KEY_SIZE raw bytes. */
+static void
+read_key(const char *path)
+{
+    unsigned char key[MYFS_IMG_KEY_SIZE + 1], salt[PRK_SIZE], okm[PRK_SIZE];
+    unsigned int outlen;
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        err(EX_NOINPUT, "%s", path);
+    n = read(fd, key, sizeof(key));
+    if (n == -1)
+        err(EX_IOERR, "%s", path);
+    close(fd);
+    if (n != MYFS_IMG_KEY_SIZE)
+        errx(EX_DATAERR, "%s: the key must be %d bytes", path,
+            MYFS_IMG_KEY_SIZE);
+
+    master_prk = xmalloc(PRK_SIZE);
+    memset(salt, 0, sizeof(salt));
+    if (HMAC(EVP_sha512(), salt, sizeof(salt), key, MYFS_IMG_KEY_SIZE,
+        master_prk, &outlen) == NULL)
+        errx(EX_SOFTWARE, "HMAC-SHA512 failed");
+    explicit_bzero(key, sizeof(key));
+    hkdf_expand(MYFS_IMG_HKDF_KEYID, NULL, okm);
+    memcpy(key_id, okm, sizeof(key_id));
+}
+
+/* AES-256-XTS over len bytes in place, a multiple of 16, as one unit. */
+static void
+xts_encrypt(const unsigned char *key, uint64_t tweak, unsigned char *buf,
+    size_t len)
+{
+    unsigned char iv[16];
+    EVP_CIPHER_CTX *ctx;
+    int outl;
+
+    memset(iv, 0, sizeof(iv));
+    tweak = htole64(tweak);
+    memcpy(iv, &tweak, sizeof(tweak));
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL ||
+        EVP_EncryptInit_ex(ctx, EVP_aes_256_xts(), NULL, key, iv) != 1 ||
+        EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)len) != 1)
+        errx(EX_SOFTWARE, "AES-256-XTS failed");
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+/* Encrypt whole blocks of file data, starting at logical block lbn. */
+static void
+encrypt_blocks(const unsigned char *key, uint64_t lbn, unsigned char *buf,
+    size_t len)
+{
+    size_t off;
+
+    for (off = 0; off < len; off += BSIZE)
+        xts_encrypt(key, lbn++, buf + off, BSIZE);
+}
+
+/*
+ * Pad a name or symlink target in place and encrypt it with AES-256-CBC
+ * under nkey, the names key followed by the IV; returns its size.
+ */
+static size_t
+encrypt_name(const unsigned char *nkey, unsigned char *buf, size_t len)
+{
+    EVP_CIPHER_CTX *ctx;
+    size_t plen;
+    int outl;
+
+    plen = len == 0 ? MYFS_IMG_CRYPT_PAD :
+        (len + MYFS_IMG_CRYPT_PAD - 1) / MYFS_IMG_CRYPT_PAD *
+        MYFS_IMG_CRYPT_PAD;
+    memset(buf + len, 0, plen - len);
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL ||
+        EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, nkey,
+        nkey + MYFS_IMG_NAMEKEY_SIZE) != 1 ||
+        EVP_CIPHER_CTX_set_padding(ctx, 0) != 1 ||
+        EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)plen) != 1)
+        errx(EX_SOFTWARE, "AES-256-CBC failed");
+    EVP_CIPHER_CTX_free(ctx);
+    return (plen);
+}
+
+/* A directory named on the command line. */
+static int
+find_dir(const char *p)
+{
+    int idx;
+
+    while (*p == '/' || (p[0] == '.' && p[1] == '/'))
+        p += (*p == '/') ? 1 : 2;
+    idx = path_find(p);
+    if (idx == -1 || !S_ISDIR(nodes[idx].st.st_mode))
+        errx(EX_DATAERR, "%s/%s: not a directory", srcdir, p);
+    return (idx);
+}
+
+/*
+ * -e: mark each named directory and everything below it, then give each
+ * encrypted inode a context and a key.  Nodes come in walk order, so
+ * parents are marked before their children.
+ */
+static void
+mark_encrypted(char **dirs, int ndirs)
+{
+    int i;
+
+    for (i = 0; i < ndirs; i++)
+        nodes[find_dir(dirs[i])].encrypt = 1;
+    for (i = 1; i < nnodes; i++) {
+        if (nodes[nodes[i].parent].encrypt)
+            nodes[i].encrypt = 1;
+    }
+    for (i = 0; i < nnodes; i++) {
+        if (nodes[i].link_of != -1 &&
+            nodes[i].encrypt != nodes[nodes[i].link_of].encrypt)
+            errx(EX_DATAERR, "%s/%s: hard link crosses an encryption "
+                "boundary", srcdir, nodes[i].path);
+    }
+}
+
+/* -i: case-insensitive directories, and every directory below them. */
+static void
+mark_casefold(char **dirs, int ndirs)
+{
+    int i;
+
+    for (i = 0; i < ndirs; i++)
+        nodes[find_dir(dirs[i])].iflags |= MYFS_IMG_I_CASEFOLD;
+    for (i = 0; i < nnodes; i++) {
+        if (i > 0 && S_ISDIR(nodes[i].st.st_mode) &&
+            (nodes[nodes[i].parent].iflags & MYFS_IMG_I_CASEFOLD))
+            nodes[i].iflags |= MYFS_IMG_I_CASEFOLD;
+        if ((nodes[i].iflags & MYFS_IMG_I_CASEFOLD) && nodes[i].encrypt)
+            errx(EX_USAGE, "%s/%s: encrypted directories cannot be "
+                "case-insensitive", srcdir, nodes[i].path);
+    }
+}
+
+static void
+setup_crypt(void)
+{
+    struct myfs_img_crypt *ctx;
+    struct node *np;
+    int k;
+
+    ctxs = calloc(norder, sizeof(*ctxs));
+    if (ctxs == NULL)
+        err(EX_OSERR, "calloc");
+    for (k = 0; k < norder; k++) {
+        np = &nodes[order[k]];
+        if (!np->encrypt || (!S_ISREG(np->st.st_mode) &&
+            !S_ISDIR(np->st.st_mode) && !S_ISLNK(np->st.st_mode)))
+            continue;
+        ctx = &ctxs[nctxs];
+        ctx->version = MYFS_IMG_CRYPT_V1;
+        ctx->contents_mode = MYFS_IMG_CRYPT_AES_256_XTS;
+        ctx->names_mode = MYFS_IMG_CRYPT_AES_256_CBC;
+        memcpy(ctx->key_id, key_id, sizeof(ctx->key_id));
+        if (RAND_bytes(ctx->nonce, sizeof(ctx->nonce)) != 1)
+            errx(EX_SOFTWARE, "RAND_bytes failed");
+        np->key = xmalloc(MYFS_IMG_KEY_SIZE);
+        hkdf_expand(MYFS_IMG_HKDF_FILEKEY, ctx->nonce, np->key);
+        np->nkey = xmalloc(PRK_SIZE);
+        hkdf_expand(MYFS_IMG_HKDF_NAMEKEY, ctx->nonce, np->nkey);
+        np->crypt = nctxs++;
+        np->iflags |= MYFS_IMG_I_CRYPT;
+    }
+}
+
+/* Encoding, run by workers */
+
+static void
+job_append(struct job *jp, const void *data, size_t len)
+{
+    if (jp->spill != NULL) {
+        if (fwrite(data, 1, len, jp->spill) != len)
+            jp->error = errno;
+        jp->len += len;
+        return;
+    }
+    if (jp->len + len > jp->cap) {
+        jp->cap = jp->cap ? jp->cap * 2 : 64 * 1024;
+        if (jp->cap < jp->len + len)
+            jp->cap = jp->len + len;
+        jp->buf = xrealloc(jp->buf, jp->cap);
+    }
+    memcpy(jp->buf + jp->len, data, len);
+    jp->len += len;
+}
+
+/* A child of an encrypted directory, by encrypted name. */
+struct dent {
+    unsigned char name[MYFS_IMG_CRYPT_NAMEMAX];
+    size_t len;
+    int child;
+};
+
+static int
+dent_cmp(const void *a, const void *b)
+{
+    const struct dent *x = a, *y = b;
+    int cmp;
+
+    cmp = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    if (cmp == 0)
+        cmp = (x->len > y->len) - (x->len < y->len);
+    return (cmp);
+}
+
+/* An entry of a case-insensitive directory, by folded name. */
+struct fent {
+    uint32_t hash;
+    uint32_t idx;
+    size_t len;
+    char name[NAME_MAX];
+};
+
+static int
+fent_cmp(const void *a, const void *b)
+{
+    const struct fent *x = a, *y = b;
+    int cmp;
+
+    if (x->hash != y->hash)
+        return (x->hash < y->hash ? -1 : 1);
+    cmp = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    if (cmp == 0)
+        cmp = (x->len > y->len) - (x->len < y->len);
+    return (cmp);
+}
+
+/* The hash index of a case-insensitive directory. */
+static void
+encode_dirhash(struct node *np, struct myfs_img_dirhash *dh)
+{
+    struct fent *fe;
+    const char *name;
+    int i;
+
+    fe = xmalloc(np->nchildren * sizeof(*fe));
+    for (i = 0; i < np->nchildren; i++) {
+        name = nodes[np->children[i]].name;
+        fe[i].len = myfs_fold(name, strlen(name), fe[i].name);
+        fe[i].hash = myfs_fold_hash(hash_key, fe[i].name, fe[i].len);
+        fe[i].idx = i;
+    }
+    qsort(fe, np->nchildren, sizeof(*fe), fent_cmp);
+    for (i = 0; i < np->nchildren; i++) {
+        if (i > 0 && fent_cmp(&fe[i - 1], &fe[i]) == 0)
+            errx(EX_DATAERR, "%s/%s: %s and %s differ only in case",
+                srcdir, np->path, nodes[np->children[fe[i - 1].idx]].name,
+                nodes[np->children[fe[i].idx]].name);
+        dh[i].hash = htole32(fe[i].hash);
+        dh[i].idx = htole32(fe[i].idx);
+    }
+    free(fe);
+}
+
+static void
+encode_dir(struct node *np, struct job *jp)
+{
+    struct myfs_img_dirhdr *hdr;
+    struct myfs_img_dirent *de;
+    struct dent *ents;
+    struct node *cp;
+    size_t namelen, off;
+    int i;
+
+    /* Encrypted directories are searched by encrypted name. */
+    ents = NULL;
+    if (np->key != NULL) {
+        ents = xmalloc(np->nchildren * sizeof(*ents));
+        for (i = 0; i < np->nchildren; i++) {
+            cp = &nodes[np->children[i]];
+            namelen = strlen(cp->name);
+            if (namelen > MYFS_IMG_CRYPT_NAMEMAX) {
+                jp->error = ENAMETOOLONG;
+                free(ents);
+                return;
+            }
+            memcpy(ents[i].name, cp->name, namelen);
+            ents[i].len = encrypt_name(np->nkey, ents[i].name, namelen);
+            ents[i].child = np->children[i];
+        }
+        qsort(ents, np->nchildren, sizeof(*ents), dent_cmp);
+    }
+
+    off = sizeof(*hdr) + np->nchildren * sizeof(*de);
+    if (np->iflags & MYFS_IMG_I_CASEFOLD)
+        off += np->nchildren * sizeof(struct myfs_img_dirhash);
+    for (i = 0; i < np->nchildren; i++)
+        off += ents != NULL ? ents[i].len :
+            strlen(nodes[np->children[i]].name);
+    jp->buf = calloc(1, off);
+    if (jp->buf == NULL)
+        err(EX_OSERR, "calloc");
+    jp->len = off;
+
+    hdr = (struct myfs_img_dirhdr *)jp->buf;
+    hdr->count = htole32(np->nchildren);
+    hdr->parent = htole64(np->parent != -1 ? nodes[np->parent].ino : np->ino);
+
+    de = (struct myfs_img_dirent *)(hdr + 1);
+    off = sizeof(*hdr) + np->nchildren * sizeof(*de);
+    if (np->iflags & MYFS_IMG_I_CASEFOLD) {
+        encode_dirhash(np, (struct myfs_img_dirhash *)(jp->buf + off));
+        off += np->nchildren * sizeof(struct myfs_img_dirhash);
+    }
+    for (i = 0; i < np->nchildren; i++, de++) {
+        cp = &nodes[ents != NULL ? ents[i].child : np->children[i]];
+        namelen = ents != NULL ? ents[i].len : strlen(cp->name);
+        de->ino = htole64(cp->link_of != -1 ? nodes[cp->link_of].ino :
+            cp->ino);
+        de->name_off = htole32(off);
+        de->namelen = htole16(namelen);
+        de->type = IFTODT(cp->st.st_mode);
+        memcpy(jp->buf + off, ents != NULL ? ents[i].name :
+            (const unsigned char *)cp->name, namelen);
+        off += namelen;
+    }
+    free(ents);
+}
+
+static void
+encode_symlink(struct node *np, struct job *jp)
+{
+    ssize_t len;
+
+    jp->buf = xmalloc(PATH_MAX + MYFS_IMG_CRYPT_PAD);
+    len = readlinkat(srcfd, np->path, (char *)jp->buf, PATH_MAX);
+    if (len == -1) {
+        jp->error = errno;
+        return;
+    }
+    jp->len = len;
+    if (np->key != NULL)
+        jp->len = encrypt_name(np->nkey, jp->buf, len);
+}
+
+static int
+read_full(int fd, unsigned char *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pread(fd, buf, len, off);
+        if (n == -1)
+            return (errno);
+        if (n == 0)
+            return (EIO);       /* file shrank under us */
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return (0);
+}
+
+static void
+encode_file(struct node *np, struct job *jp)
+{
+    unsigned char in[BSIZE], *out;
+    uLongf clen;
+    size_t nblocks, i, blen, total;
+    off_t size = np->st.st_size;
+    int fd;
+
+    /* Encrypted files are stored whole blocks at a time, uncompressed. */
+    if (size == 0)
+        return;
+    if ((!compress_data || np->key != NULL) && size > STREAM_MIN) {
+        jp->stream = 1;
+        return;
+    }
+
+    fd = openat(srcfd, np->path, O_RDONLY);
+    if (fd == -1) {
+        jp->error = errno;
+        return;
+    }
+
+    if (!compress_data || np->key != NULL) {
+        jp->len = size;
+        if (np->key != NULL)
+            jp->len = (size + BSIZE - 1) / BSIZE * BSIZE;
+        jp->buf = xmalloc(jp->len);
+        jp->error = read_full(fd, jp->buf, size, 0);
+        close(fd);
+        if (np->key != NULL && jp->error == 0) {
+            memset(jp->buf + size, 0, jp->len - size);
+            encrypt_blocks(np->key, 0, jp->buf, jp->len);
+        }
+        return;
+    }
+
+    nblocks = (size + BSIZE - 1) / BSIZE;
+    jp->ntable = nblocks + 1;
+    jp->table = xmalloc(jp->ntable * sizeof(uint32_t));
+    if (size > SPILL_MIN && (jp->spill = tmpfile()) == NULL) {
+        jp->error = errno;
+        close(fd);
+        return;
+    }
+    out = xmalloc(compressBound(BSIZE));
+
+    total = 0;
+    for (i = 0; i < nblocks && jp->error == 0; i++) {
+        blen = (i == nblocks - 1) ? size - i * BSIZE : BSIZE;
+        jp->error = read_full(fd, in, blen, i * BSIZE);
+        if (jp->error)
+            break;
+        jp->table[i] = htole32(total);
+        clen = compressBound(BSIZE);
+        if (compress2(out, &clen, in, blen, Z_BEST_COMPRESSION) == Z_OK &&
+            clen < blen) {
+            job_append(jp, out, clen);
+            total += clen;
+        } else {
+            job_append(jp, in, blen);
+            total += blen;
+        }
+        if (total > UINT32_MAX)
+            jp->error = EFBIG;
+    }
+    jp->table[nblocks] = htole32(total);
+    free(out);
+    close(fd);
+
+    /*
+     * Every chunk is at most its block's size, so no saving means every
+     * chunk was stored raw: drop the table and keep the data as is.
+     */
+    if (jp->error == 0 && total == (size_t)size) {
+        free(jp->table);
+        jp->table = NULL;
+        jp->ntable = 0;
+        return;
+    }
+    np->iflags |= MYFS_IMG_I_ZLIB;
+}
+
+static void *
+worker(void *arg __unused)
+{
+    struct node *np;
+    struct job *jp;
+    int k;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (next_job < norder && next_job >= written + window)
+            pthread_cond_wait(&cv, &lock);
+        if (next_job >= norder) {
+            pthread_mutex_unlock(&lock);
+            return (NULL);
+        }
+        k = next_job++;
+        pthread_mutex_unlock(&lock);
+
+        np = &nodes[order[k]];
+        jp = &jobs[k];
+        if (jp->meta)
+            ;
+        else if (S_ISDIR(np->st.st_mode))
+            encode_dir(np, jp);
+        else if (S_ISLNK(np->st.st_mode))
+            encode_symlink(np, jp);
+        else if (S_ISREG(np->st.st_mode))
+            encode_file(np, jp);
+
+        pthread_mutex_lock(&lock);
+        jp->done = 1;
+        pthread_cond_broadcast(&cv);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/* Writing, run by the main thread */
+
+static void
+pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, off);
+        if (n == -1)
+            err(EX_IOERR, "write");
+        buf = (const char *)buf + n;
+        len -= n;
+        off += n;
+    }
+}
+
+/*
+ * Copy len bytes from fd (or from f, if fd is -1) to the image, encrypted
+ * a block at a time if key is set.
+ */
+static void
+copy_out(int ifd, FILE *f, int ofd, off_t off, size_t len, const char *what,
+    const unsigned char *key)
+{
+    static unsigned char buf[1024 * 1024];
+    uint64_t lbn;
+    size_t n, got, wlen;
+    ssize_t r;
+
+    lbn = 0;
+    while (len > 0) {
+        n = len < sizeof(buf) ? len : sizeof(buf);
+        for (got = 0; got < n; got += r) {
+            if (f != NULL)
+                r = fread(buf + got, 1, n - got, f);
+            else
+                r = read(ifd, buf + got, n - got);
+            if (r <= 0)
+                errx(EX_IOERR, "%s: short read", what);
+        }
+        wlen = n;
+        if (key != NULL) {
+            wlen = (n + BSIZE - 1) / BSIZE * BSIZE;
+            memset(buf + n, 0, wlen - n);
+            encrypt_blocks(key, lbn, buf, wlen);
+            lbn += wlen / BSIZE;
+        }
+        pwrite_full(ofd, buf, wlen, off);
+        off += n;
+        len -= n;
+    }
+}
+
+static uint64_t
+write_job(int ofd, struct node *np, struct job *jp, uint64_t blk)
+{
+    off_t off = (off_t)blk * BSIZE;
+    size_t len, jp_len;
+    int fd;
+
+    if (jp->error) {
+        errno = jp->error;
+        err(EX_IOERR, "%s/%s", srcdir, np->path);
+    }
+
+    len = jp_len = jp->len;
+    if (jp->table != NULL) {
+        pwrite_full(ofd, jp->table, jp->ntable * sizeof(uint32_t), off);
+        off += jp->ntable * sizeof(uint32_t);
+        len += jp->ntable * sizeof(uint32_t);
+    }
+    if (jp->stream) {
+        fd = openat(srcfd, np->path, O_RDONLY);
+        if (fd == -1)
+            err(EX_NOINPUT, "%s/%s", srcdir, np->path);
+        copy_out(fd, NULL, ofd, off, np->st.st_size, np->path, np->key);
+        close(fd);
+        len = np->st.st_size;
+    } else if (jp->spill != NULL) {
+        rewind(jp->spill);
+        copy_out(-1, jp->spill, ofd, off, jp->len, np->path, NULL);
+        fclose(jp->spill);
+    } else if (jp->len > 0) {
+        pwrite_full(ofd, jp->buf, jp->len, off);
+    }
+    free(jp->buf);
+    free(jp->table);
+    memset(jp, 0, sizeof(*jp));
+
+    np->size = S_ISREG(np->st.st_mode) ? (uint64_t)np->st.st_size : jp_len;
+    if (len == 0)
+        return (blk);
+    np->daddr = blk;
+    return (blk + (len + BSIZE - 1) / BSIZE);
+}
+
+static void
+write_inodes(int ofd, uint64_t itable)
+{
+    struct myfs_img_inode *it, *di;
+    struct node *np;
+    size_t len;
+    int k;
+
+    len = (size_t)norder * sizeof(*it);
+    it = calloc(1, len);
+    if (it == NULL)
+        err(EX_OSERR, "calloc");
+    for (k = 0; k < norder; k++) {
+        np = &nodes[order[k]];
+        di = &it[np->ino - 1];
+        di->mode = htole16(np->st.st_mode);
+        di->flags = htole16(np->iflags);
+        di->nlink = htole32(np->nlink);
+        di->uid = htole32(np->st.st_uid);
+        di->gid = htole32(np->st.st_gid);
+        di->size = htole64(np->size);
+        di->daddr = htole64(np->daddr);
+        di->mtime = htole64(np->st.st_mtim.tv_sec);
+        di->mtime_nsec = htole32(np->st.st_mtim.tv_nsec);
+        di->ctime = htole64(np->st.st_ctim.tv_sec);
+        di->ctime_nsec = htole32(np->st.st_ctim.tv_nsec);
+        di->crypt = htole64(np->crypt);
+    }
+    pwrite_full(ofd, it, len, (off_t)itable * BSIZE);
+    free(it);
+}
+
+/* CRC-32C (Castagnoli), as the kernel's calculate_crc32c() with ~0 seeds. */
+static uint32_t
+crc32c(const void *buf, size_t len)
+{
+    static uint32_t table[256];
+    const unsigned char *p = buf;
+    uint32_t crc;
+    int i, j;
+
+    if (table[1] == 0) {
+        for (i = 0; i < 256; i++) {
+            crc = i;
+            for (j = 0; j < 8; j++)
+                crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+            table[i] = crc;
+        }
+    }
+    crc = ~0U;
+    while (len-- > 0)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return (~crc);
+}
+
+/*
+ * -D: checksum metadata blocks [0, nmeta) as written, store the table at
+ * sb->csum, write both superblocks and copy the metadata to sb->mirror.
+ */
+static void
+write_dup(int ofd, struct myfs_img_sb *sb)
+{
+    unsigned char buf[BSIZE];
+    uint64_t nmeta, csum, ncsum, b;
+    uint32_t *table;
+    ssize_t n;
+
+    nmeta = le64toh(sb->nmeta);
+    csum = le64toh(sb->csum);
+    ncsum = nmeta - csum;
+    table = calloc(ncsum, BSIZE);
+    if (table == NULL)
+        err(EX_OSERR, "calloc");
+    for (b = 1; b < csum; b++) {
+        if (b == MYFS_IMG_SB_COPY)
+            continue;
+        n = pread(ofd, buf, BSIZE, (off_t)b * BSIZE);
+        if (n == -1)
+            err(EX_IOERR, "read");
+        memset(buf + n, 0, BSIZE - n);
+        table[b] = htole32(crc32c(buf, BSIZE));
+    }
+    sb->csum_crc = htole32(crc32c(table, nmeta * sizeof(uint32_t)));
+    pwrite_full(ofd, table, ncsum * BSIZE, (off_t)csum * BSIZE);
+    free(table);
+
+    sb->sb_crc = 0;
+    sb->sb_crc = htole32(crc32c(sb, sizeof(*sb)));
+    memset(buf, 0, BSIZE);
+    memcpy(buf, sb, sizeof(*sb));
+    pwrite_full(ofd, buf, BSIZE, 0);
+    pwrite_full(ofd, buf, BSIZE, (off_t)MYFS_IMG_SB_COPY * BSIZE);
+
+    for (b = 0; b < nmeta; b++) {
+        n = pread(ofd, buf, BSIZE, (off_t)b * BSIZE);
+        if (n == -1)
+            err(EX_IOERR, "read");
+        memset(buf + n, 0, BSIZE - n);
+        pwrite_full(ofd, buf, BSIZE,
+            (off_t)(le64toh(sb->mirror) + b) * BSIZE);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        { "from-dir", required_argument, NULL, 'd' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "map", required_argument, NULL, 'm' },
+        { "trace", required_argument, NULL, 't' },
+        { "compress", no_argument, NULL, 'z' },
+        { "dup", no_argument, NULL, 'D' },
+        { "encrypt", required_argument, NULL, 'e' },
+        { "key", required_argument, NULL, 'k' },
+        { "casefold", required_argument, NULL, 'i' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct myfs_img_sb sb;
+    pthread_t *tids;
+    const char *map = NULL, *trace = NULL, *keyfile = NULL;
+    char **edirs = NULL, **idirs = NULL;
+    struct stat ost;
+    struct node *np;
+    uint64_t itable, blk, csum, nmeta, crypt;
+    uint32_t gen;
+    long njobs;
+    int ch, i, k, ofd, primary, nedirs = 0, nidirs = 0;
+
+    njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((ch = getopt_long(argc, argv, "Dd:e:i:j:k:m:t:z", longopts,
+        NULL)) != -1) {
+        switch (ch) {
+        case 'D':
+            dup_meta = 1;
+            break;
+        case 'd':
+            srcdir = optarg;
+            break;
+        case 'e':
+            edirs = xrealloc(edirs, (nedirs + 1) * sizeof(char *));
+            edirs[nedirs++] = optarg;
+            break;
+        case 'i':
+            idirs = xrealloc(idirs, (nidirs + 1) * sizeof(char *));
+            idirs[nidirs++] = optarg;
+            break;
+        case 'k':
+            keyfile = optarg;
+            break;
+        case 'j':
+            njobs = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            map = optarg;
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'z':
+            compress_data = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1 || srcdir == NULL || (nedirs != 0) != (keyfile != NULL))
+        usage();
+    if (njobs < 1)
+        njobs = 1;
+
+    srcfd = open(srcdir, O_RDONLY | O_DIRECTORY);
+    if (srcfd == -1)
+        err(EX_NOINPUT, "%s", srcdir);
+    if (keyfile != NULL)
+        read_key(keyfile);
+    if (RAND_bytes(hash_key, sizeof(hash_key)) != 1)
+        errx(EX_SOFTWARE, "RAND_bytes failed");
+
+    /* Walk the tree and resolve hard links. */
+    node_new("", -1);
+    if (!S_ISDIR(nodes[0].st.st_mode))
+        errx(EX_DATAERR, "%s: not a directory", srcdir);
+    walk(0);
+    hash_init(nnodes);
+    for (i = 0; i < nnodes; i++) {
+        path_insert(nodes[i].path, i);
+        if (S_ISDIR(nodes[i].st.st_mode) || nodes[i].st.st_nlink < 2)
+            continue;
+        primary = link_find(nodes[i].st.st_dev, nodes[i].st.st_ino, i);
+        if (primary != i)
+            nodes[i].link_of = primary;
+    }
+    for (i = 0; i < nnodes; i++) {
+        if (S_ISDIR(nodes[i].st.st_mode))
+            nodes[i].nlink += 2;
+        if (i == 0)
+            continue;
+        if (S_ISDIR(nodes[i].st.st_mode))
+            nodes[nodes[i].parent].nlink++;
+        else
+            nodes[nodes[i].link_of != -1 ? nodes[i].link_of : i].nlink++;
+    }
+    if (nedirs != 0)
+        mark_encrypted(edirs, nedirs);
+    if (nidirs != 0)
+        mark_casefold(idirs, nidirs);
+
+    /* Number and order: root, the trace, then everything else. */
+    order = xmalloc(nnodes * sizeof(int));
+    place(0);
+    if (trace != NULL)
+        read_trace(trace);
+    for (i = 0; i < nnodes; i++)
+        place(i);
+    if (map != NULL)
+        write_map(map);
+    if (nedirs != 0)
+        setup_crypt();
+
+    ofd = open(argv[0], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (ofd == -1)
+        err(EX_CANTCREAT, "%s", argv[0]);
+
+    jobs = calloc(norder, sizeof(*jobs));
+    if (jobs == NULL)
+        err(EX_OSERR, "calloc");
+    itable = dup_meta ? MYFS_IMG_SB_COPY + 1 : 1;
+    blk = itable + ((uint64_t)norder * sizeof(struct myfs_img_inode) +
+        BSIZE - 1) / BSIZE;
+    crypt = blk;
+    blk += (nctxs * sizeof(struct myfs_img_crypt) + BSIZE - 1) / BSIZE;
+
+    /* -D: directories and symlinks, then the checksum table. */
+    csum = nmeta = 0;
+    if (dup_meta) {
+        for (k = 0; k < norder; k++) {
+            np = &nodes[order[k]];
+            if (!S_ISDIR(np->st.st_mode) && !S_ISLNK(np->st.st_mode))
+                continue;
+            if (S_ISDIR(np->st.st_mode))
+                encode_dir(np, &jobs[k]);
+            else
+                encode_symlink(np, &jobs[k]);
+            blk = write_job(ofd, np, &jobs[k], blk);
+            jobs[k].meta = 1;
+        }
+        csum = blk;
+        for (nmeta = csum + 1; csum + (nmeta * sizeof(uint32_t) +
+            BSIZE - 1) / BSIZE > nmeta; nmeta++)
+            ;
+        blk = nmeta;
+    }
+
+    /* Encode in parallel, append in order. */
+    tids = xmalloc(njobs * sizeof(pthread_t));
+    window = njobs * 4 + 64;
+    for (i = 0; i < njobs; i++) {
+        if (pthread_create(&tids[i], NULL, worker, NULL) != 0)
+            errx(EX_OSERR, "pthread_create");
+    }
+
+    for (k = 0; k < norder; k++) {
+        pthread_mutex_lock(&lock);
+        while (!jobs[k].done)
+            pthread_cond_wait(&cv, &lock);
+        pthread_mutex_unlock(&lock);
+
+        if (!jobs[k].meta)
+            blk = write_job(ofd, &nodes[order[k]], &jobs[k], blk);
+
+        pthread_mutex_lock(&lock);
+        written = k + 1;
+        pthread_cond_broadcast(&cv);
+        pthread_mutex_unlock(&lock);
+    }
+    for (i = 0; i < njobs; i++)
+        pthread_join(tids[i], NULL);
+
+    write_inodes(ofd, itable);
+    if (nctxs != 0)
+        pwrite_full(ofd, ctxs, nctxs * sizeof(*ctxs), (off_t)crypt * BSIZE);
+
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = htole32(MYFS_IMG_MAGIC);
+    sb.version = htole32(MYFS_IMG_VERSION);
+    sb.bsize = htole32(BSIZE);
+    sb.flags = htole32((compress_data ? MYFS_IMG_F_ZLIB : 0) |
+        (dup_meta ? MYFS_IMG_F_DUP : 0) |
+        (nctxs != 0 ? MYFS_IMG_F_CRYPT : 0) | MYFS_IMG_F_HASHKEY);
+    memcpy(sb.hash_key, hash_key, sizeof(sb.hash_key));
+    if (RAND_bytes((unsigned char *)&gen, sizeof(gen)) != 1)
+        errx(EX_SOFTWARE, "RAND_bytes failed");
+    sb.gen = htole32(gen);
+    if (nctxs != 0) {
+        sb.crypt = htole64(crypt);
+        sb.ncrypt = htole64(nctxs);
+    }
+    if (dup_meta) {
+        sb.nmeta = htole64(nmeta);
+        sb.mirror = htole64(blk);
+        sb.csum = htole64(csum);
+        blk += nmeta;
+    }
+    sb.nblocks = htole64(blk);
+    sb.ninodes = htole64(norder);
+    sb.itable = htole64(itable);
+    sb.root = htole64(MYFS_IMG_ROOTINO);
+    sb.ctime = htole64(time(NULL));
+    if (dup_meta)
+        write_dup(ofd, &sb);
+    else
+        pwrite_full(ofd, &sb, sizeof(sb), 0);
+
+    if (fstat(ofd, &ost) == 0 && S_ISREG(ost.st_mode) &&
+        ftruncate(ofd, (off_t)blk * BSIZE) == -1)
+        err(EX_IOERR, "%s", argv[0]);
+    if (fsync(ofd) == -1 || close(ofd) == -1)
+        err(EX_IOERR, "%s", argv[0]);
+
+    printf("%s: %d inodes, %ju blocks\n", argv[0], norder, (uintmax_t)blk);
+    if (nctxs != 0) {
+        printf("%s: %ju encrypted inodes, key ", argv[0], (uintmax_t)nctxs);
+        for (i = 0; i < MYFS_IMG_KEYID_SIZE; i++)
+            printf("%02x", key_id[i]);
+        printf("\n");
+    }
+    return (0);
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2024 Your Name
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * myfstrace: start, stop and drain access tracing on a myfs mount.
+ *
+ * "drain" collects the per-CPU buffers, merges them by time and prints one
+ * record per line.  With -m and the map written by mkfs.myfs -m it prints
+ * instead each traced path once, in first-touch order, which is the trace
+ * format mkfs.myfs -t reads back to lay out the next image.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "myfs_ioctl.h"
+
+#define DRAIN_CHUNK 65536
+
+struct mapent {
+    uint64_t ino;
+    char *path;
+    int seen;
+};
+
+static struct myfs_trace_rec *recs;
+static size_t nrecs, caprecs;
+static struct mapent *map;
+static size_t nmap;
+
+static const char *opnames[] = { "?", "lookup", "read", "getpages" };
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: myfstrace [-s nrecs] start path\n"
+        "       myfstrace stop path\n"
+        "       myfstrace [-m map] drain path\n");
+    exit(EX_USAGE);
+}
+
+static int
+rec_cmp(const void *a, const void *b)
+{
+    const struct myfs_trace_rec *ra = a, *rb = b;
+
+    if (ra->time_ns != rb->time_ns)
+        return (ra->time_ns < rb->time_ns ? -1 : 1);
+    return (ra->cpu - rb->cpu);
+}
+
+static int
+map_cmp(const void *a, const void *b)
+{
+    const struct mapent *ma = a, *mb = b;
+
+    if (ma->ino != mb->ino)
+        return (ma->ino < mb->ino ? -1 : 1);
+    return (0);
+}
+
+static void
+read_map(const char *file)
+{
+    char *line, *p;
+    size_t cap, capmap;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(file, "r");
+    if (f == NULL)
+        err(EX_NOINPUT, "%s", file);
+    line = NULL;
+    cap = capmap = 0;
+    while ((len = getline(&line, &cap, f)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        p = strchr(line, '\t');
+        if (p == NULL)
+            continue;
+        *p++ = '\0';
+        if (nmap == capmap) {
+            capmap = capmap ? capmap * 2 : 1024;
+            map = realloc(map, capmap * sizeof(*map));
+            if (map == NULL)
+                err(EX_OSERR, "realloc");
+        }
+        map[nmap].ino = strtoull(line, NULL, 10);
+        map[nmap].seen = 0;
+        if ((map[nmap].path = strdup(p)) == NULL)
+            err(EX_OSERR, "strdup");
+        nmap++;
+    }
+    free(line);
+    fclose(f);
+    qsort(map, nmap, sizeof(*map), map_cmp);
+}
+
+static void
+drain(int fd)
+{
+    struct myfs_trace_drain dr;
+    uint64_t dropped;
+
+    dropped = 0;
+    for (;;) {
+        if (caprecs - nrecs < DRAIN_CHUNK) {
+            caprecs = caprecs ? caprecs * 2 : DRAIN_CHUNK;
+            recs = realloc(recs, caprecs * sizeof(*recs));
+            if (recs == NULL)
+                err(EX_OSERR, "realloc");
+        }
+        memset(&dr, 0, sizeof(dr));
+        dr.recs = recs + nrecs;
+        dr.nrecs = caprecs - nrecs;
+        if (ioctl(fd, MYFS_IOC_TRACEDRAIN, &dr) == -1)
+            err(EX_IOERR, "MYFS_IOC_TRACEDRAIN");
+        dropped = dr.dropped;
+        if (dr.nrecs == 0)
+            break;
+        nrecs += dr.nrecs;
+    }
+    if (dropped != 0)
+        warnx("%ju records dropped", (uintmax_t)dropped);
+    qsort(recs, nrecs, sizeof(*recs), rec_cmp);
+}
+
+static void
+print_recs(void)
+{
+    struct myfs_trace_rec *r;
+    size_t i;
+
+    for (i = 0; i < nrecs; i++) {
+        r = &recs[i];
+        printf("%ju.%09ju\t%u\t%s\t%ju\t%ju\t%u\n",
+            (uintmax_t)(r->time_ns / 1000000000),
+            (uintmax_t)(r->time_ns % 1000000000), r->cpu,
+            opnames[r->op < 4 ? r->op : 0], (uintmax_t)r->ino,
+            (uintmax_t)r->off, r->len);
+    }
+}
+
+static void
+print_paths(void)
+{
+    struct mapent key, *mp;
+    size_t i;
+
+    for (i = 0; i < nrecs; i++) {
+        key.ino = recs[i].ino;
+        mp = bsearch(&key, map, nmap, sizeof(*map), map_cmp);
+        if (mp == NULL || mp->seen)
+            continue;
+        mp->seen = 1;
+        printf("%s\n", mp->path);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct myfs_trace_ctl ctl;
+    const char *mapfile = NULL;
+    unsigned long size = 0;
+    int ch, fd;
+
+    while ((ch = getopt(argc, argv, "m:s:")) != -1) {
+        switch (ch) {
+        case 'm':
+            mapfile = optarg;
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 2)
+        usage();
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+        err(EX_NOINPUT, "%s", argv[1]);
+
+    memset(&ctl, 0, sizeof(ctl));
+    if (strcmp(argv[0], "start") == 0) {
+        ctl.op = MYFS_TRACE_START;
+        ctl.nrecs = size;
+        if (ioctl(fd, MYFS_IOC_TRACECTL, &ctl) == -1)
+            err(EX_IOERR, "MYFS_IOC_TRACECTL");
+    } else if (strcmp(argv[0], "stop") == 0) {
+        ctl.op = MYFS_TRACE_STOP;
+        if (ioctl(fd, MYFS_IOC_TRACECTL, &ctl) == -1)
+            err(EX_IOERR, "MYFS_IOC_TRACECTL");
+    } else if (strcmp(argv[0], "drain") == 0) {
+        if (mapfile != NULL)
+            read_map(mapfile);
+        drain(fd);
+        if (mapfile != NULL)
+            print_paths();
+        else
+            print_recs();
+    } else
+        usage();
+
+    close(fd);
+    return (0);
+}